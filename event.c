@@ -0,0 +1,237 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#ifdef __linux__
+# include <sys/epoll.h>
+#else
+# include <poll.h>
+#endif
+#include "compat_util.h"
+#include "event.h"
+
+#define EVENT_BATCH 64
+
+struct event_slot {
+	event_cb cb; /* NULL if the fd is not watched */
+	void *data;
+	unsigned events;
+	/*
+	 * Bumped on every event_add(), so events reported for an fd which
+	 * was closed and reused during the same batch are dropped.
+	 */
+	uint32_t gen;
+};
+
+struct event_loop {
+	struct event_slot *slots; /* indexed by fd */
+	size_t alloc;
+	int nr;
+#ifdef __linux__
+	int epfd;
+#else
+	struct pollfd *pfds;
+	uint32_t *gens; /* gen of each pfds entry */
+	size_t pfds_alloc;
+#endif
+};
+
+#ifdef __linux__
+static unsigned to_epoll(unsigned events)
+{
+	return (events & EVENT_READ ? EPOLLIN : 0) |
+	       (events & EVENT_WRITE ? EPOLLOUT : 0);
+}
+#endif
+
+struct event_loop *event_loop_alloc(void)
+{
+	struct event_loop *loop = calloc(1, sizeof(*loop));
+
+	if (loop == NULL)
+		return NULL;
+#ifdef __linux__
+	loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (loop->epfd < 0) {
+		free(loop);
+		return NULL;
+	}
+#endif
+	return loop;
+}
+
+void event_loop_free(struct event_loop *loop)
+{
+	if (loop == NULL)
+		return;
+#ifdef __linux__
+	close(loop->epfd);
+#else
+	free(loop->pfds);
+	free(loop->gens);
+#endif
+	free(loop->slots);
+	free(loop);
+}
+
+int event_add(struct event_loop *loop, int fd, unsigned events, event_cb cb,
+	      void *data)
+{
+	size_t old = loop->alloc;
+
+	if (fd < 0) {
+		errno = EBADF;
+		return -1;
+	}
+	if ((size_t)fd >= loop->alloc) {
+		ALLOC_GROW(loop->slots, (size_t)fd + 1, loop->alloc);
+		if (loop->slots == NULL)
+			return -1;
+		memset(loop->slots + old, 0,
+		       sizeof(*loop->slots) * (loop->alloc - old));
+	}
+	if (loop->slots[fd].cb) {
+		errno = EEXIST;
+		return -1;
+	}
+	loop->slots[fd].gen++;
+#ifdef __linux__
+	{
+		struct epoll_event ev = { .events = to_epoll(events) };
+
+		ev.data.u64 = (uint64_t)loop->slots[fd].gen << 32 | (uint32_t)fd;
+		if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, fd, &ev) < 0)
+			return -1;
+	}
+#endif
+	loop->slots[fd].cb = cb;
+	loop->slots[fd].data = data;
+	loop->slots[fd].events = events;
+	loop->nr++;
+	return 0;
+}
+
+int event_mod(struct event_loop *loop, int fd, unsigned events)
+{
+	if (fd < 0 || (size_t)fd >= loop->alloc || !loop->slots[fd].cb) {
+		errno = ENOENT;
+		return -1;
+	}
+	if (loop->slots[fd].events == events)
+		return 0;
+#ifdef __linux__
+	{
+		struct epoll_event ev = { .events = to_epoll(events) };
+
+		ev.data.u64 = (uint64_t)loop->slots[fd].gen << 32 | (uint32_t)fd;
+		if (epoll_ctl(loop->epfd, EPOLL_CTL_MOD, fd, &ev) < 0)
+			return -1;
+	}
+#endif
+	loop->slots[fd].events = events;
+	return 0;
+}
+
+void event_del(struct event_loop *loop, int fd)
+{
+	if (fd < 0 || (size_t)fd >= loop->alloc || !loop->slots[fd].cb)
+		return;
+#ifdef __linux__
+	epoll_ctl(loop->epfd, EPOLL_CTL_DEL, fd, NULL);
+#endif
+	loop->slots[fd].cb = NULL;
+	loop->slots[fd].data = NULL;
+	loop->slots[fd].events = 0;
+	loop->nr--;
+}
+
+int event_loop_nr(struct event_loop *loop)
+{
+	return loop->nr;
+}
+
+static void dispatch(struct event_loop *loop, int fd, uint32_t gen,
+		     unsigned events)
+{
+	struct event_slot *slot;
+
+	/* an earlier callback in this batch may have deleted the fd */
+	if ((size_t)fd >= loop->alloc || !loop->slots[fd].cb ||
+	    loop->slots[fd].gen != gen)
+		return;
+	slot = &loop->slots[fd];
+	slot->cb(loop, fd, events, slot->data);
+}
+
+#ifdef __linux__
+int event_loop_run_once(struct event_loop *loop, int timeout_ms)
+{
+	struct epoll_event evs[EVENT_BATCH];
+	int n;
+
+	n = epoll_wait(loop->epfd, evs, EVENT_BATCH, timeout_ms);
+	if (n < 0)
+		return errno == EINTR ? 0 : -1;
+	for (int i = 0; i < n; i++) {
+		unsigned events = 0;
+
+		if (evs[i].events & (EPOLLIN | EPOLLHUP))
+			events |= EVENT_READ;
+		if (evs[i].events & EPOLLOUT)
+			events |= EVENT_WRITE;
+		if (evs[i].events & EPOLLERR)
+			events |= EVENT_ERROR | EVENT_READ;
+		dispatch(loop, (int)(uint32_t)evs[i].data.u64,
+			 (uint32_t)(evs[i].data.u64 >> 32), events);
+	}
+	return n;
+}
+#else
+int event_loop_run_once(struct event_loop *loop, int timeout_ms)
+{
+	nfds_t nfds = 0;
+	int n;
+
+	if ((size_t)loop->nr > loop->pfds_alloc) {
+		loop->pfds_alloc = alloc_nr(loop->nr);
+		REALLOC_ARRAY(loop->pfds, loop->pfds_alloc);
+		REALLOC_ARRAY(loop->gens, loop->pfds_alloc);
+		if (loop->pfds == NULL || loop->gens == NULL)
+			return -1;
+	}
+	for (size_t fd = 0; fd < loop->alloc; fd++) {
+		struct event_slot *slot = &loop->slots[fd];
+
+		if (!slot->cb)
+			continue;
+		loop->pfds[nfds].fd = fd;
+		loop->pfds[nfds].events =
+			(slot->events & EVENT_READ ? POLLIN : 0) |
+			(slot->events & EVENT_WRITE ? POLLOUT : 0);
+		loop->pfds[nfds].revents = 0;
+		loop->gens[nfds] = slot->gen;
+		nfds++;
+	}
+
+	n = poll(loop->pfds, nfds, timeout_ms);
+	if (n < 0)
+		return errno == EINTR ? 0 : -1;
+	for (nfds_t i = 0; i < nfds; i++) {
+		short re = loop->pfds[i].revents;
+		unsigned events = 0;
+
+		if (!re)
+			continue;
+		if (re & (POLLIN | POLLHUP))
+			events |= EVENT_READ;
+		if (re & POLLOUT)
+			events |= EVENT_WRITE;
+		if (re & (POLLERR | POLLNVAL))
+			events |= EVENT_ERROR | EVENT_READ;
+		dispatch(loop, loop->pfds[i].fd, loop->gens[i], events);
+	}
+	return n;
+}
+#endif
@@ -0,0 +1,32 @@
+#ifndef EVENT_H
+#define EVENT_H
+
+/*
+ * A minimal fd event loop. It uses epoll on Linux and falls back to
+ * poll() elsewhere. Events are level triggered, and callbacks may add or
+ * delete any fd, including their own.
+ */
+#define EVENT_READ  0x1
+#define EVENT_WRITE 0x2
+#define EVENT_ERROR 0x4 /* only reported, never requested */
+
+struct event_loop;
+
+typedef void (*event_cb)(struct event_loop *loop, int fd, unsigned events,
+			 void *data);
+
+struct event_loop *event_loop_alloc(void);
+void event_loop_free(struct event_loop *loop);
+int event_add(struct event_loop *loop, int fd, unsigned events, event_cb cb,
+	      void *data);
+int event_mod(struct event_loop *loop, int fd, unsigned events);
+void event_del(struct event_loop *loop, int fd);
+/* number of fds being watched */
+int event_loop_nr(struct event_loop *loop);
+/*
+ * Wait up to timeout_ms (-1 for ever) and run callbacks for ready fds.
+ * Return the number of fds handled, or -1 on error.
+ */
+int event_loop_run_once(struct event_loop *loop, int timeout_ms);
+
+#endif
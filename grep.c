@@ -0,0 +1,241 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "error_raw.h"
+#include "strbuf.h"
+#include "vt.h"
+#include "history.h"
+#include "grep.h"
+
+struct grep {
+	char *text;
+	size_t len;
+	unsigned context;
+
+	/* The output searched, read a block at a time */
+	uint64_t next; /* position of the next block */
+	uint64_t end; /* of the output when the search started */
+	struct strbuf raw;
+	struct vt_strip strip;
+
+	/*
+	 * The plain text, from the lines kept for context on: the lines
+	 * before pos are searched, the ones after it are not, and the
+	 * last one may still be missing its end.
+	 */
+	struct strbuf plain;
+	size_t pos;
+	uint64_t pos_line; /* number of the line at pos */
+	uint64_t next_print; /* lines before it are printed or skipped */
+	uint64_t after_end; /* lines before it are context of a match */
+	int printed; /* anything, so groups need a "--" */
+	int cut;
+
+	struct strbuf *out;
+	size_t total; /* handed to flush */
+	int (*flush)(struct strbuf *out, void *data);
+	void *data;
+};
+
+/* Offset of the end of the line at pos, its newline or end */
+static size_t line_end(const struct grep *g, size_t pos, size_t end)
+{
+	const char *nl = memchr(g->plain.buf + pos, '\n', end - pos);
+
+	return nl ? (size_t)(nl - g->plain.buf) : end;
+}
+
+/* Offset of the start of the line before the one at pos */
+static size_t line_before(const struct grep *g, size_t pos)
+{
+	const char *nl = memrchr(g->plain.buf, '\n', pos - 1);
+
+	return nl ? (size_t)(nl - g->plain.buf) + 1 : 0;
+}
+
+static uint64_t count_lines(const char *p, const char *end)
+{
+	uint64_t nr = 0;
+
+	while ((p = memchr(p, '\n', end - p))) {
+		p++;
+		nr++;
+	}
+	return nr;
+}
+
+/* Print line nr, return 1 to stop, -1 if flush failed */
+static int grep_emit(struct grep *g, uint64_t nr, size_t start, size_t end,
+		     char sep)
+{
+	struct strbuf *out = g->out;
+
+	if (g->total + out->len >= GREP_MAX_OUTPUT) {
+		g->cut = 1;
+		return 1;
+	}
+	if (g->context && g->printed && nr > g->next_print)
+		strbuf_addstr(out, "--\n");
+	strbuf_addf(out, "%llu%c", (unsigned long long)nr, sep);
+	strbuf_add(out, g->plain.buf + start, end - start);
+	strbuf_addch(out, '\n');
+	g->printed = 1;
+	g->next_print = nr + 1;
+	if (out->len < GREP_FLUSH)
+		return 0;
+	g->total += out->len;
+	if (g->flush(out, g->data) < 0)
+		return -1;
+	strbuf_reset(out);
+	return 0;
+}
+
+/*
+ * Search the plain text from pos to end, which ends a line, and print
+ * the matches with their context. Then drop what no later match needs.
+ */
+static int grep_region(struct grep *g, size_t end)
+{
+	const char *buf = g->plain.buf, *hit, *nl;
+	size_t at, start, le;
+	uint64_t nr;
+	int ret;
+
+	while (g->pos < end) {
+		hit = memmem(buf + g->pos, end - g->pos, g->text, g->len);
+		at = hit ? (size_t)(hit - buf) : end;
+		/* The context after the last match */
+		while (g->pos < at && g->pos_line < g->after_end) {
+			le = line_end(g, g->pos, end);
+			if (hit && le >= at)
+				break;
+			ret = grep_emit(g, g->pos_line, g->pos, le, '-');
+			if (ret)
+				return ret;
+			g->pos = le + (le < end);
+			g->pos_line++;
+		}
+		if (hit == NULL) {
+			g->pos_line += count_lines(buf + g->pos, buf + end);
+			g->pos = end;
+			break;
+		}
+
+		nl = memrchr(buf + g->pos, '\n', at - g->pos);
+		start = nl ? (size_t)(nl - buf) + 1 : g->pos;
+		g->pos_line += count_lines(buf + g->pos, buf + start);
+		g->pos = start;
+		/* The context before it, which may be in the lines kept */
+		for (nr = g->pos_line; start > 0 && nr > g->next_print &&
+				       g->pos_line - nr < g->context;
+		     nr--)
+			start = line_before(g, start);
+		for (; start < g->pos; nr++) {
+			le = line_end(g, start, end);
+			ret = grep_emit(g, nr, start, le, '-');
+			if (ret)
+				return ret;
+			start = le + 1;
+		}
+		le = line_end(g, g->pos, end);
+		ret = grep_emit(g, g->pos_line, g->pos, le, ':');
+		if (ret)
+			return ret;
+		g->pos = le + (le < end);
+		g->pos_line++;
+		g->after_end = g->pos_line + g->context;
+	}
+
+	/* Keep the lines a match in the next block may need as context */
+	start = g->pos;
+	for (nr = g->pos_line; start > 0 && g->pos_line - nr < g->context; nr--)
+		start = line_before(g, start);
+	strbuf_remove(&g->plain, 0, start);
+	g->pos -= start;
+	return 0;
+}
+
+struct grep *grep_start(struct history *h, const char *text, size_t len,
+			unsigned context, struct strbuf *out,
+			int (*flush)(struct strbuf *out, void *data),
+			void *data)
+{
+	struct grep *g = calloc(1, sizeof(*g));
+
+	if (g == NULL || (g->text = malloc(len)) == NULL)
+		ferror_raw_die("Error allocating memory for search");
+	memcpy(g->text, text, len);
+	g->len = len;
+	g->context = context;
+	g->out = out;
+	g->flush = flush;
+	g->data = data;
+	strbuf_init(&g->raw, 0);
+	strbuf_init(&g->plain, 0);
+	g->next = history_start(h);
+	g->end = history_end(h);
+	g->pos_line = history_first_line(h);
+	return g;
+}
+
+int grep_step(struct grep *g, struct history *h, size_t blocks)
+{
+	const char *nl;
+	int ret = 0;
+
+	/*
+	 * The blocks we were at were dropped meanwhile, carry on with the
+	 * oldest line kept
+	 */
+	if (g->next < history_start(h)) {
+		strbuf_reset(&g->plain);
+		memset(&g->strip, 0, sizeof(g->strip));
+		g->pos = 0;
+		g->next = history_start(h);
+		g->pos_line = history_first_line(h);
+	}
+	/* A block at a time, blocks start at multiples of HISTORY_BLOCK */
+	while (ret == 0 && blocks-- > 0 && g->next < g->end) {
+		uint64_t next = g->next - g->next % HISTORY_BLOCK +
+				HISTORY_BLOCK;
+
+		if (next > g->end)
+			next = g->end;
+		strbuf_reset(&g->raw);
+		history_read(h, g->next, next, &g->raw);
+		g->next = next;
+		vt_strip(&g->strip, g->raw.buf, g->raw.len, &g->plain);
+		nl = g->plain.len > g->pos ?
+			     memrchr(g->plain.buf + g->pos, '\n',
+				     g->plain.len - g->pos) :
+			     NULL;
+		if (nl)
+			ret = grep_region(g, nl - g->plain.buf + 1);
+	}
+	if (ret == 0 && g->next < g->end)
+		return 0;
+	/* The line being written */
+	if (ret == 0 && g->pos < g->plain.len)
+		ret = grep_region(g, g->plain.len);
+	if (ret < 0)
+		return -1;
+	if (g->out->len > 0 && g->flush(g->out, g->data) < 0)
+		return -1;
+	strbuf_reset(g->out);
+	return 1;
+}
+
+int grep_cut(const struct grep *g)
+{
+	return g->cut;
+}
+
+void grep_free(struct grep *g)
+{
+	if (g == NULL)
+		return;
+	strbuf_release(&g->raw);
+	strbuf_release(&g->plain);
+	free(g->text);
+	free(g);
+}
@@ -0,0 +1,52 @@
+#ifndef GREP_H
+#define GREP_H
+
+#include <stddef.h>
+
+struct history;
+struct strbuf;
+
+/*
+ * Search the plain text of the output a window keeps for a fixed
+ * string, line by line like `grep -n -C context`. Lines are numbered as
+ * in history.h, so copy mode can jump to them.
+ *
+ * Each block is decompressed and stripped of escape sequences once,
+ * and memmem() skips over the text between matches, so lines are only
+ * split up around a match.
+ */
+/* Results are handed over in pieces of about this size */
+#define GREP_FLUSH (64 * 1024)
+/* and cut after this much for one window */
+#define GREP_MAX_OUTPUT (4 * 1024 * 1024)
+#define GREP_MAX_CONTEXT 100
+
+/*
+ * Look for text in the output h keeps, adding the lines containing it
+ * to out as "N:line", with up to context lines around them as "N-line"
+ * and, if there are any, "--" between groups which aren't next to each
+ * other. flush is called with out, whole lines only, once it holds
+ * GREP_FLUSH bytes.
+ *
+ * The search goes a few blocks at a time, so the window can do other
+ * things in between. Output written meanwhile isn't searched, and if
+ * the blocks being searched are dropped it carries on from the oldest
+ * line still kept.
+ */
+struct grep;
+
+struct grep *grep_start(struct history *h, const char *text, size_t len,
+			unsigned context, struct strbuf *out,
+			int (*flush)(struct strbuf *out, void *data),
+			void *data);
+/*
+ * Search up to blocks more blocks of h. Return 1 once the search is
+ * over and out flushed, 0 if there is more to search, -1 if flush
+ * failed.
+ */
+int grep_step(struct grep *g, struct history *h, size_t blocks);
+/* Whether the results were cut at GREP_MAX_OUTPUT */
+int grep_cut(const struct grep *g);
+void grep_free(struct grep *g);
+
+#endif
@@ -0,0 +1,295 @@
+#include <stdlib.h>
+#include <string.h>
+#include "compat_util.h"
+#include "error_raw.h"
+#include "strbuf.h"
+#include "lz.h"
+#include "history.h"
+
+/* The open block starts this small and doubles, so idle windows are cheap */
+#define HISTORY_MIN_ALLOC 4096
+/* Compressing has to save this much of a block, or it's kept as it is */
+#define HISTORY_MIN_SAVING (HISTORY_BLOCK / 8)
+
+void history_init(struct history *h, size_t limit)
+{
+	memset(h, 0, sizeof(*h));
+	h->limit = limit;
+}
+
+void history_release(struct history *h)
+{
+	for (size_t i = 0; i < h->nr; i++)
+		free(h->blocks[i].data);
+	free(h->blocks);
+	free(h->open);
+	free(h->cache);
+	history_init(h, h->limit);
+}
+
+uint64_t history_start(const struct history *h)
+{
+	return h->nr ? h->blocks[0].start : h->end - h->open_len;
+}
+
+static void drop_oldest(struct history *h)
+{
+	struct history_block *b = &h->blocks[0];
+
+	h->mem -= b->stored;
+	if (b->stored < b->len) {
+		h->packed_len -= b->len;
+		h->packed_stored -= b->stored;
+	}
+	free(b->data);
+	h->nr--;
+	memmove(h->blocks, h->blocks + 1, h->nr * sizeof(*h->blocks));
+}
+
+/* Drop the oldest blocks until we are under the limit again */
+static void enforce_limit(struct history *h)
+{
+	while (h->mem > h->limit && h->nr > 0)
+		drop_oldest(h);
+}
+
+/* The open block is full, compress it away */
+static void seal_block(struct history *h)
+{
+	struct history_block b;
+	size_t cap = HISTORY_BLOCK - HISTORY_MIN_SAVING;
+	char *packed, *shrunk;
+
+	b.start = h->end - h->open_len;
+	b.len = h->open_len;
+	b.first_line = h->open_line;
+	packed = malloc(cap);
+	b.stored = packed ? lz_compress(h->open, h->open_len, packed, cap) : 0;
+	if (b.stored) {
+		/* The open block is reused for the next one */
+		shrunk = realloc(packed, b.stored);
+		b.data = shrunk ? shrunk : packed;
+		h->packed_len += b.len;
+		h->packed_stored += b.stored;
+	} else {
+		free(packed);
+		b.data = h->open;
+		b.stored = b.len;
+		h->mem -= h->open_alloc;
+		h->open = NULL;
+		h->open_alloc = 0;
+	}
+	h->mem += b.stored;
+	h->open_len = 0;
+	h->open_line = h->lines;
+
+	ALLOC_GROW(h->blocks, h->nr + 1, h->alloc);
+	if (h->blocks == NULL)
+		ferror_raw_die("Error allocating memory for scrollback");
+	h->blocks[h->nr++] = b;
+	enforce_limit(h);
+}
+
+static void grow_open(struct history *h, size_t len)
+{
+	size_t alloc = h->open_alloc ? h->open_alloc : HISTORY_MIN_ALLOC;
+
+	if (len <= h->open_alloc)
+		return;
+	while (alloc < len)
+		alloc *= 2;
+	h->open = realloc(h->open, alloc);
+	if (h->open == NULL)
+		ferror_raw_die("Error allocating memory for scrollback");
+	h->mem += alloc - h->open_alloc;
+	h->open_alloc = alloc;
+	enforce_limit(h);
+}
+
+/* Keep the line count up to date with buf, written at the end */
+static void count_lines(struct history *h, const char *buf, size_t len)
+{
+	const char *p = buf, *end = buf + len;
+
+	while ((p = memchr(p, '\n', end - p))) {
+		p++;
+		h->lines++;
+		h->line_pos = h->end + (p - buf);
+	}
+}
+
+void history_write(struct history *h, const char *buf, size_t len)
+{
+	while (len > 0) {
+		size_t n = HISTORY_BLOCK - h->open_len;
+
+		if (n > len)
+			n = len;
+		grow_open(h, h->open_len + n);
+		memcpy(h->open + h->open_len, buf, n);
+		count_lines(h, buf, n);
+		h->open_len += n;
+		h->end += n;
+		buf += n;
+		len -= n;
+		if (h->open_len == HISTORY_BLOCK)
+			seal_block(h);
+	}
+}
+
+/*
+ * Return the output of the block holding position pos, decompressed if
+ * need be, with its start and length. NULL if pos isn't kept.
+ */
+static const char *block_at(struct history *h, uint64_t pos, uint64_t *start,
+			    size_t *len)
+{
+	const struct history_block *b;
+	size_t lo = 0, hi = h->nr;
+
+	if (pos >= h->end || pos < history_start(h))
+		return NULL;
+	if (pos >= h->end - h->open_len) {
+		*start = h->end - h->open_len;
+		*len = h->open_len;
+		return h->open;
+	}
+	/* The last block starting at or before pos */
+	while (hi - lo > 1) {
+		size_t mid = lo + (hi - lo) / 2;
+
+		if (h->blocks[mid].start <= pos)
+			lo = mid;
+		else
+			hi = mid;
+	}
+	b = &h->blocks[lo];
+	*start = b->start;
+	*len = b->len;
+	if (b->stored == b->len)
+		return b->data;
+	if (h->cache && h->cache_start == b->start)
+		return h->cache;
+	if (h->cache == NULL)
+		h->cache = malloc(HISTORY_BLOCK);
+	if (h->cache == NULL)
+		ferror_raw_die("Error allocating memory for scrollback");
+	if (lz_decompress(b->data, b->stored, h->cache, HISTORY_BLOCK) !=
+	    (ssize_t)b->len) {
+		ferror_raw("Corrupt scrollback block at %llu",
+			   (unsigned long long)b->start);
+		free(h->cache);
+		h->cache = NULL;
+		return NULL;
+	}
+	h->cache_start = b->start;
+	return h->cache;
+}
+
+/* Readers are done, don't keep a block around for them */
+static void drop_cache(struct history *h)
+{
+	free(h->cache);
+	h->cache = NULL;
+}
+
+void history_read(struct history *h, uint64_t from, uint64_t to,
+		  struct strbuf *out)
+{
+	const char *data;
+	uint64_t start;
+	size_t len;
+
+	if (from < history_start(h))
+		from = history_start(h);
+	while (from < to && (data = block_at(h, from, &start, &len))) {
+		size_t n = start + len - from;
+
+		if (n > to - from)
+			n = to - from;
+		strbuf_add(out, data + (from - start), n);
+		from += n;
+	}
+	drop_cache(h);
+}
+
+uint64_t history_first_line(const struct history *h)
+{
+	return h->nr ? h->blocks[0].first_line : h->open_line;
+}
+
+uint64_t history_last_line(const struct history *h)
+{
+	if (h->line_pos == h->end && h->lines > history_first_line(h))
+		return h->lines - 1;
+	return h->lines;
+}
+
+uint64_t history_line_pos(struct history *h, uint64_t nr)
+{
+	uint64_t first = history_start(h), pos, line, start;
+	const char *data, *p;
+	size_t len, lo = 0, hi = h->nr;
+
+	if (nr <= history_first_line(h))
+		return first;
+	if (nr >= h->lines)
+		return h->line_pos > first ? h->line_pos : first;
+	/* The block holding the newline which ends line nr - 1 */
+	if (nr > h->open_line) {
+		pos = h->end - h->open_len;
+		line = h->open_line;
+	} else {
+		while (hi - lo > 1) {
+			size_t mid = lo + (hi - lo) / 2;
+
+			if (h->blocks[mid].first_line < nr)
+				lo = mid;
+			else
+				hi = mid;
+		}
+		pos = h->blocks[lo].start;
+		line = h->blocks[lo].first_line;
+	}
+	data = block_at(h, pos, &start, &len);
+	for (p = data; p && (p = memchr(p, '\n', data + len - p)); p++) {
+		if (++line == nr) {
+			pos = start + (p - data) + 1;
+			drop_cache(h);
+			return pos;
+		}
+	}
+	/* Only a corrupt block has fewer newlines than it should */
+	drop_cache(h);
+	return first;
+}
+
+uint64_t history_last_lines(struct history *h, size_t nr)
+{
+	uint64_t last = history_last_line(h);
+
+	if (nr == 0)
+		return h->end;
+	return history_line_pos(h, last >= nr ? last - nr + 1 : 0);
+}
+
+void history_stats(const struct history *h, struct strbuf *out)
+{
+	uint64_t kept = h->end - history_start(h);
+	size_t packed = 0;
+
+	for (size_t i = 0; i < h->nr; i++)
+		packed += h->blocks[i].stored < h->blocks[i].len;
+	strbuf_addf(out, "scrollback: %llu of %llu bytes of output kept\n",
+		    (unsigned long long)kept, (unsigned long long)h->end);
+	strbuf_addf(out, "lines: %llu to %llu\n",
+		    (unsigned long long)history_first_line(h),
+		    (unsigned long long)history_last_line(h));
+	strbuf_addf(out, "blocks: %zu full, %zu of them compressed, %zu bytes open\n",
+		    h->nr, packed, h->open_len);
+	strbuf_addf(out, "memory: %zu of %zu bytes\n", h->mem, h->limit);
+	if (h->packed_stored)
+		strbuf_addf(out, "compression: %.2fx, %.2fx with the rest\n",
+			    (double)h->packed_len / h->packed_stored,
+			    h->mem ? (double)kept / h->mem : 0.0);
+}
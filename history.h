@@ -0,0 +1,85 @@
+#ifndef HISTORY_H
+#define HISTORY_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct strbuf;
+
+/*
+ * The scrollback of a window, its raw output kept in blocks of
+ * HISTORY_BLOCK bytes. The newest block is filled as it is, each full
+ * one is compressed with lz_compress(), and the oldest are dropped once
+ * the blocks take more memory than the limit. Readers only decompress
+ * the blocks they touch.
+ *
+ * Positions are offsets into all the output the window ever printed,
+ * so they stay put as old blocks go. Lines are numbered the same way,
+ * line n starting after the nth newline, and each block knows the
+ * number of its first line, so finding a line only takes a search over
+ * the blocks and a scan of one of them.
+ */
+#define HISTORY_BLOCK (64 * 1024)
+
+struct history_block {
+	uint64_t start; /* position of the first byte */
+	uint32_t len; /* bytes of output */
+	uint32_t stored; /* bytes of data, len if it isn't compressed */
+	uint64_t first_line; /* number of the line start is in */
+	char *data;
+};
+
+struct history {
+	struct history_block *blocks; /* the full ones, oldest first */
+	size_t nr, alloc;
+	char *open; /* the block being filled */
+	size_t open_len, open_alloc;
+	uint64_t open_line; /* number of the line the open block starts in */
+	uint64_t end; /* position after the last byte */
+	uint64_t lines; /* newlines in all the output */
+	uint64_t line_pos; /* position after the last one */
+	size_t limit; /* memory the blocks may take */
+	size_t mem; /* memory they take */
+	uint64_t packed_len; /* output in compressed blocks */
+	size_t packed_stored; /* and their size */
+
+	/* A block decompressed for the reader, while it reads */
+	char *cache;
+	uint64_t cache_start;
+};
+
+void history_init(struct history *h, size_t limit);
+void history_release(struct history *h);
+void history_write(struct history *h, const char *buf, size_t len);
+
+/* Position of the oldest byte still kept */
+uint64_t history_start(const struct history *h);
+static inline uint64_t history_end(const struct history *h)
+{
+	return h->end;
+}
+
+/* Add the output between the positions from and to, as far as kept */
+void history_read(struct history *h, uint64_t from, uint64_t to,
+		  struct strbuf *out);
+/*
+ * Numbers of the oldest line still kept, which may be missing its
+ * start, and of the last line, a newline at the very end ending it.
+ */
+uint64_t history_first_line(const struct history *h);
+uint64_t history_last_line(const struct history *h);
+/*
+ * Position of the start of line nr, history_start() for lines before
+ * the first one and the start of the line being written for those
+ * after it.
+ */
+uint64_t history_line_pos(struct history *h, uint64_t nr);
+/*
+ * Position of the start of the last nr lines, or history_start() if
+ * there are fewer.
+ */
+uint64_t history_last_lines(struct history *h, size_t nr);
+/* Describe what is kept and what it costs, for people */
+void history_stats(const struct history *h, struct strbuf *out);
+
+#endif
@@ -0,0 +1,341 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "compat_util.h"
+#include "error_raw.h"
+#include "strbuf.h"
+#include "wrapper.h"
+#include "vt.h"
+#include "log.h"
+
+/* A batch buffer grown past this is given back once written */
+#define LOG_KEEP_ALLOC (64 * 1024)
+
+struct log_config {
+	char *dir;
+	int plain;
+	uint64_t rotate_size; /* bytes, 0 for no limit */
+	uint64_t rotate_time; /* seconds, 0 for no limit */
+};
+
+struct window_log {
+	struct log_config cfg;
+	char *name; /* of the socket, which names the files */
+
+	/* Shared with the window, under log_lock */
+	struct strbuf pending;
+	size_t dropped; /* bytes which didn't fit in pending */
+	int closing;
+
+	/* The writer's own */
+	struct strbuf batch; /* swapped with pending */
+	struct strbuf plain;
+	struct vt_strip strip;
+	int fd;
+	uint64_t size; /* of the file */
+	time_t opened;
+	unsigned seq; /* files opened in the same second before */
+};
+
+static pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t log_wake = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t log_idle = PTHREAD_COND_INITIALIZER;
+static struct window_log **logs;
+static size_t nr_logs, alloc_logs;
+static int log_work; /* some log has something for the writer */
+static int writer_started;
+
+static int parse_setting(struct log_config *cfg, char *line)
+{
+	static const uint64_t sizes[] = { 1024, 1024 * 1024,
+					  1024 * 1024 * 1024 };
+	static const uint64_t times[] = { 1, 60, 60 * 60, 24 * 60 * 60 };
+	const char *home = getenv("HOME");
+	char *key, *val, *end;
+
+	key = line + strspn(line, " \t");
+	if (*key == '\0' || *key == '#')
+		return 0;
+	val = key + strcspn(key, " \t");
+	if (*val)
+		*val++ = '\0';
+	val += strspn(val, " \t");
+	end = val + strlen(val);
+	while (end > val && (end[-1] == ' ' || end[-1] == '\t'))
+		*--end = '\0';
+
+	if (!strcmp(key, "plain")) {
+		cfg->plain = 1;
+		return *val ? -1 : 0;
+	}
+	if (*val == '\0')
+		return -1;
+	if (!strcmp(key, "dir")) {
+		struct strbuf dir = STRBUF_INIT;
+
+		if (!strncmp(val, "~/", 2) && home)
+			strbuf_addf(&dir, "%s%s", home, val + 1);
+		else
+			strbuf_addstr(&dir, val);
+		free(cfg->dir);
+		cfg->dir = dir.buf;
+		return 0;
+	}
+	if (!strcmp(key, "rotate-size"))
+		return parse_scaled(val, "KMG", sizes, &cfg->rotate_size);
+	if (!strcmp(key, "rotate-time"))
+		return parse_scaled(val, "smhd", times, &cfg->rotate_time);
+	return -1;
+}
+
+/* Start the next file of the log, return -1 on failure */
+static int log_open_file(struct window_log *log, time_t now)
+{
+	struct strbuf path = STRBUF_INIT;
+	struct stat st;
+	struct tm tm;
+	char stamp[32];
+
+	localtime_r(&now, &tm);
+	strftime(stamp, sizeof(stamp), "%Y%m%d-%H%M%S", &tm);
+	log->seq = log->opened == now ? log->seq + 1 : 0;
+	strbuf_addf(&path, "%s/%s.%s", log->cfg.dir, log->name, stamp);
+	if (log->seq)
+		strbuf_addf(&path, "-%u", log->seq);
+	strbuf_addstr(&path, ".log");
+	log->fd = open(path.buf, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC,
+		       0600);
+	if (log->fd < 0)
+		ferror_raw("Error opening log %s: %s", path.buf,
+			   strerror(errno));
+	strbuf_release(&path);
+	if (log->fd < 0)
+		return -1;
+	log->size = fstat(log->fd, &st) == 0 ? (uint64_t)st.st_size : 0;
+	log->opened = now;
+	return 0;
+}
+
+/* Move on to the next file if len more bytes are too much */
+static void log_rotate(struct window_log *log, size_t len)
+{
+	const struct log_config *cfg = &log->cfg;
+	time_t now = time(NULL);
+
+	if (log->fd >= 0 &&
+	    !(cfg->rotate_size && log->size > 0 &&
+	      log->size + len > cfg->rotate_size) &&
+	    !(cfg->rotate_time &&
+	      (uint64_t)(now - log->opened) >= cfg->rotate_time))
+		return;
+	if (log->fd >= 0)
+		close(log->fd);
+	log_open_file(log, now);
+}
+
+/* Write the batch taken from the window, outside the lock */
+static void log_flush(struct window_log *log, size_t dropped)
+{
+	struct strbuf *out = &log->batch;
+
+	if (log->cfg.plain) {
+		strbuf_reset(&log->plain);
+		vt_strip(&log->strip, log->batch.buf, log->batch.len,
+			 &log->plain);
+		out = &log->plain;
+	}
+	if (dropped)
+		strbuf_addf(out, "\n[myscreen: %zu bytes not logged]\n",
+			    dropped);
+	if (out->len > 0) {
+		log_rotate(log, out->len);
+		if (log->fd >= 0 &&
+		    write_in_full(log->fd, out->buf, out->len) < 0)
+			perror_raw("Error writing log");
+		log->size += out->len;
+	}
+	if (log->batch.alloc > LOG_KEEP_ALLOC)
+		strbuf_release(&log->batch);
+	strbuf_reset(&log->batch);
+	if (log->plain.alloc > LOG_KEEP_ALLOC)
+		strbuf_release(&log->plain);
+}
+
+static void log_free(struct window_log *log)
+{
+	if (log->fd >= 0)
+		close(log->fd);
+	strbuf_release(&log->pending);
+	strbuf_release(&log->batch);
+	strbuf_release(&log->plain);
+	free(log->cfg.dir);
+	free(log->name);
+	free(log);
+}
+
+/*
+ * Take turns with the windows: swap each log's pending buffer for the
+ * empty batch under the lock, then write the batch without it.
+ */
+static void *log_writer(void *arg)
+{
+	struct timespec batch = { 0, LOG_BATCH_MS * 1000000L };
+
+	(void)arg;
+	pthread_mutex_lock(&log_lock);
+	for (;;) {
+		while (!log_work) {
+			pthread_cond_broadcast(&log_idle);
+			pthread_cond_wait(&log_wake, &log_lock);
+		}
+		pthread_mutex_unlock(&log_lock);
+		nanosleep(&batch, NULL);
+		pthread_mutex_lock(&log_lock);
+
+		log_work = 0;
+		for (size_t i = 0; i < nr_logs;) {
+			struct window_log *log = logs[i];
+			struct strbuf tmp = log->pending;
+			size_t dropped = log->dropped;
+			int closing = log->closing;
+
+			log->pending = log->batch;
+			log->batch = tmp;
+			log->dropped = 0;
+			pthread_mutex_unlock(&log_lock);
+			log_flush(log, dropped);
+			pthread_mutex_lock(&log_lock);
+			/* Nobody writes to a closing log any more */
+			if (closing) {
+				logs[i] = logs[--nr_logs];
+				log_free(log);
+			} else {
+				i++;
+			}
+		}
+	}
+	return NULL;
+}
+
+/* Call with log_lock held */
+static int start_writer(void)
+{
+	pthread_attr_t attr;
+	pthread_t thread;
+
+	if (writer_started)
+		return 0;
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	errno = pthread_create(&thread, &attr, log_writer, NULL);
+	pthread_attr_destroy(&attr);
+	if (errno) {
+		perror_raw("Error starting log writer");
+		return -1;
+	}
+	writer_started = 1;
+	return 0;
+}
+
+struct window_log *window_log_open(const char *file, const char *socket_path)
+{
+	struct log_config cfg = { 0 };
+	struct window_log *log;
+	const char *name;
+	char *line = NULL;
+	size_t alloc = 0;
+	ssize_t len;
+	int lineno = 0;
+	FILE *fp;
+
+	fp = fopen(file, "r");
+	if (fp == NULL) {
+		if (errno != ENOENT)
+			perror_raw("Error reading logging settings");
+		return NULL;
+	}
+	while ((len = getline(&line, &alloc, fp)) > 0) {
+		lineno++;
+		if (line[len - 1] == '\n')
+			line[len - 1] = '\0';
+		if (parse_setting(&cfg, line) < 0)
+			ferror_raw("%s:%d: bad logging setting, skipped", file,
+				   lineno);
+	}
+	free(line);
+	fclose(fp);
+	if (cfg.dir == NULL)
+		return NULL;
+	if (mkdir(cfg.dir, 0700) < 0 && errno != EEXIST) {
+		ferror_raw("Error creating log directory %s: %s", cfg.dir,
+			   strerror(errno));
+		free(cfg.dir);
+		return NULL;
+	}
+
+	log = calloc(1, sizeof(*log));
+	if (log == NULL)
+		ferror_raw_die("Error allocating memory for log");
+	log->cfg = cfg;
+	name = strrchr(socket_path, '/');
+	log->name = strdup(name ? name + 1 : socket_path);
+	if (log->name == NULL)
+		ferror_raw_die("Error allocating memory for log");
+	if (log_open_file(log, time(NULL)) < 0) {
+		log_free(log);
+		return NULL;
+	}
+
+	pthread_mutex_lock(&log_lock);
+	if (start_writer() < 0) {
+		pthread_mutex_unlock(&log_lock);
+		log_free(log);
+		return NULL;
+	}
+	ALLOC_GROW(logs, nr_logs + 1, alloc_logs);
+	if (logs == NULL)
+		ferror_raw_die("Error allocating memory for logs");
+	logs[nr_logs++] = log;
+	pthread_mutex_unlock(&log_lock);
+	return log;
+}
+
+void window_log_write(struct window_log *log, const char *buf, size_t len)
+{
+	pthread_mutex_lock(&log_lock);
+	if (log->pending.len + len > LOG_PENDING_MAX)
+		log->dropped += len;
+	else
+		strbuf_add(&log->pending, buf, len);
+	if (!log_work) {
+		log_work = 1;
+		pthread_cond_signal(&log_wake);
+	}
+	pthread_mutex_unlock(&log_lock);
+}
+
+void window_log_close(struct window_log *log)
+{
+	if (log == NULL)
+		return;
+	pthread_mutex_lock(&log_lock);
+	log->closing = 1;
+	log_work = 1;
+	pthread_cond_signal(&log_wake);
+	pthread_mutex_unlock(&log_lock);
+}
+
+void window_log_sync(void)
+{
+	pthread_mutex_lock(&log_lock);
+	while (nr_logs > 0)
+		pthread_cond_wait(&log_idle, &log_lock);
+	pthread_mutex_unlock(&log_lock);
+}
@@ -0,0 +1,43 @@
+#ifndef LOG_H
+#define LOG_H
+
+#include <stddef.h>
+
+/*
+ * Session logs, the output of every window saved to disk. Logging is
+ * set up in ~/.myscreen.logging, read when a window starts:
+ *
+ *   dir PATH                 log to PATH/<socket>.<start time>.log
+ *   plain                    without escape sequences, for grep
+ *   rotate-size SIZE[K|M|G]  start a new file past that size
+ *   rotate-time SECS[m|h|d]  or once the file is that old
+ *
+ * Blank lines and lines starting with '#' are skipped.
+ *
+ * The window task only copies its output into a buffer. A writer
+ * thread, one per process, takes what all the windows gathered, strips
+ * it and writes it, so slow disks never hold up a window. If the writer
+ * falls more than LOG_PENDING_MAX behind on a window, output is dropped
+ * and the log says how much. A logged window refuses -D clients, whose
+ * output goes around the window task.
+ */
+#define LOGGING_FILE	".myscreen.logging"
+#define LOG_PENDING_MAX (4 * 1024 * 1024)
+/* The writer waits this long after being woken, to write in batches */
+#define LOG_BATCH_MS	20
+
+struct window_log;
+
+/*
+ * Start logging the window listening on socket_path as file says.
+ * Return NULL if it says nothing, or logging fails.
+ */
+struct window_log *window_log_open(const char *file, const char *socket_path);
+/* Queue output for the writer */
+void window_log_write(struct window_log *log, const char *buf, size_t len);
+/* The writer writes what is left, then closes the log */
+void window_log_close(struct window_log *log);
+/* Wait until the writer has written and closed everything */
+void window_log_sync(void);
+
+#endif
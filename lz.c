@@ -0,0 +1,164 @@
+#include <string.h>
+#include <stdint.h>
+#include "lz.h"
+
+#define LZ_HASH_BITS  12
+#define LZ_MAX_OFFSET 65535
+/* Matches end this far before the end, the last literals cover it */
+#define LZ_LAST_LITERALS 5
+/* and don't start in the last bytes, where they hardly pay */
+#define LZ_MATCH_LIMIT 12
+/* After this many misses in a row skip faster over incompressible data */
+#define LZ_SKIP_TRIGGER 6
+
+static uint32_t lz_hash(const unsigned char *p)
+{
+	uint32_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+/* The bytes after a nibble of 15, return NULL if they don't fit */
+static unsigned char *put_length(unsigned char *op, const unsigned char *end,
+				 size_t len)
+{
+	for (; len >= 255; len -= 255) {
+		if (op >= end)
+			return NULL;
+		*op++ = 255;
+	}
+	if (op >= end)
+		return NULL;
+	*op++ = len;
+	return op;
+}
+
+/* Add a sequence, return NULL if dst is full */
+static unsigned char *put_sequence(unsigned char *op, const unsigned char *end,
+				   const unsigned char *lits, size_t nr_lits,
+				   size_t offset, size_t match)
+{
+	unsigned char *token = op++;
+
+	if (op > end)
+		return NULL;
+	*token = (nr_lits >= 15 ? 15 : nr_lits) << 4;
+	if (nr_lits >= 15 && !(op = put_length(op, end, nr_lits - 15)))
+		return NULL;
+	if ((size_t)(end - op) < nr_lits)
+		return NULL;
+	memcpy(op, lits, nr_lits);
+	op += nr_lits;
+	if (offset == 0)
+		return op;
+
+	if (end - op < 2)
+		return NULL;
+	*op++ = offset & 0xff;
+	*op++ = offset >> 8;
+	match -= LZ_MIN_MATCH;
+	*token |= match >= 15 ? 15 : match;
+	if (match >= 15)
+		op = put_length(op, end, match - 15);
+	return op;
+}
+
+size_t lz_compress(const char *src, size_t len, char *dst, size_t cap)
+{
+	uint32_t table[1 << LZ_HASH_BITS];
+	const unsigned char *base = (const unsigned char *)src;
+	const unsigned char *ip = base, *anchor = base;
+	const unsigned char *end = base + len;
+	unsigned char *op = (unsigned char *)dst;
+	const unsigned char *oend = op + cap;
+	unsigned misses = 0;
+
+	memset(table, 0, sizeof(table));
+	while (len > LZ_MATCH_LIMIT && ip < end - LZ_MATCH_LIMIT) {
+		uint32_t h = lz_hash(ip);
+		const unsigned char *ref = base + table[h];
+		const unsigned char *mend;
+
+		table[h] = ip - base;
+		if (ref >= ip || ip - ref > LZ_MAX_OFFSET ||
+		    memcmp(ref, ip, LZ_MIN_MATCH)) {
+			ip += 1 + (misses++ >> LZ_SKIP_TRIGGER);
+			continue;
+		}
+		misses = 0;
+		mend = ip + LZ_MIN_MATCH;
+		ref += LZ_MIN_MATCH;
+		while (mend < end - LZ_LAST_LITERALS && *mend == *ref) {
+			mend++;
+			ref++;
+		}
+		/* Both moved along the match, so they are still as far apart */
+		op = put_sequence(op, oend, anchor, ip - anchor, mend - ref,
+				  mend - ip);
+		if (op == NULL)
+			return 0;
+		ip = anchor = mend;
+	}
+	op = put_sequence(op, oend, anchor, end - anchor, 0, 0);
+	return op ? op - (unsigned char *)dst : 0;
+}
+
+ssize_t lz_decompress(const char *src, size_t len, char *dst, size_t cap)
+{
+	const unsigned char *ip = (const unsigned char *)src;
+	const unsigned char *iend = ip + len;
+	unsigned char *op = (unsigned char *)dst;
+	unsigned char *oend = op + cap;
+
+	while (ip < iend) {
+		unsigned token = *ip++;
+		size_t nr_lits = token >> 4, match = token & 15, offset;
+		unsigned char b;
+
+		if (nr_lits == 15) {
+			do {
+				if (ip >= iend)
+					return -1;
+				b = *ip++;
+				nr_lits += b;
+			} while (b == 255);
+		}
+		if ((size_t)(iend - ip) < nr_lits ||
+		    (size_t)(oend - op) < nr_lits)
+			return -1;
+		memcpy(op, ip, nr_lits);
+		op += nr_lits;
+		ip += nr_lits;
+		/* The last sequence has no match */
+		if (ip == iend)
+			break;
+
+		if (iend - ip < 2)
+			return -1;
+		offset = ip[0] | ip[1] << 8;
+		ip += 2;
+		if (offset == 0 || offset > (size_t)(op - (unsigned char *)dst))
+			return -1;
+		if (match == 15) {
+			do {
+				if (ip >= iend)
+					return -1;
+				b = *ip++;
+				match += b;
+			} while (b == 255);
+		}
+		match += LZ_MIN_MATCH;
+		if ((size_t)(oend - op) < match)
+			return -1;
+		/* The match may overlap what it copies, byte by byte then */
+		if (offset >= match) {
+			memcpy(op, op - offset, match);
+			op += match;
+		} else {
+			for (; match > 0; match--, op++)
+				*op = op[-offset];
+		}
+	}
+	return op - (unsigned char *)dst;
+}
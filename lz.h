@@ -0,0 +1,29 @@
+#ifndef LZ_H
+#define LZ_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+/*
+ * A small LZ77 codec in the manner of LZ4, for scrollback. Terminal
+ * output repeats itself a lot, the same escape sequences, prompts and
+ * log prefixes, so matches alone squeeze it well and both ways stay
+ * fast.
+ *
+ * The data is a series of sequences, each a token byte, literals and
+ * a match: the token holds the number of literals in its high nibble
+ * and the match length minus LZ_MIN_MATCH in its low one, 15 meaning
+ * more follow in bytes up to 255. The match is a 2 byte little endian
+ * offset back into the output. The last sequence has literals only.
+ */
+#define LZ_MIN_MATCH 4
+
+/*
+ * Compress src into dst, return the compressed size, or 0 if it would
+ * take more than cap bytes.
+ */
+size_t lz_compress(const char *src, size_t len, char *dst, size_t cap);
+/* Return the size of the data decompressed into dst, -1 if corrupt */
+ssize_t lz_decompress(const char *src, size_t len, char *dst, size_t cap);
+
+#endif
@@ -5,38 +5,105 @@
 #include <unistd.h>
 #include <signal.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <fnmatch.h>
 #include <sys/types.h>
 #include <sys/select.h>
 #include "socket.h"
 #include "tty.h"
 #include "window.h"
+#include "registry.h"
 #include "error_raw.h"
+#include "proto.h"
+#include "wrapper.h"
+#include "server.h"
+#include "shm.h"
+#include "compat_util.h"
+#include "strbuf.h"
+#include "trigger.h"
+#include "grep.h"
 
-/* Default screen store is .myscreen in $HOME directory */
-#define DEFAULT_SCREEN_STORE ".myscreen"
+/* How long --broadcast waits for the windows to take the input */
+#define BROADCAST_TIMEOUT_MS 5000
+/* How long --grep waits for the windows to search */
+#define GREP_TIMEOUT_MS 10000
+/* How long --dump waits for the windows to answer */
+#define DUMP_TIMEOUT_MS 5000
+
+/* Default screen store is .myscreen.db in $HOME directory */
+#define DEFAULT_SCREEN_STORE ".myscreen.db"
+/* The text registry of older versions, imported once */
+#define OLD_SCREEN_STORE ".myscreen"
 
 #define CTRL_A 1
 
 static char screen_store[256];
+static char old_screen_store[256];
 
 static int window_ch = 0;
 
 static struct termios origin_termios;
 static int raw_mode = 0;
+/* ask for the pty master instead of relaying through the window task */
+static int direct_attach = 0;
+/* watch the window without typing into it or resizing it */
+static int read_only = 0;
+/* the window task turned us away, the window itself is fine */
+static int refused = 0;
+/* when we fall behind, ask to be disconnected instead of resynced */
+static int disconnect_slow = 0;
+/* ask for screen updates instead of every byte of output */
+static int state_sync = 0;
+/* start the window without a terminal and don't attach to it */
+static int detached = 0;
+/* the size of a detached window, COLSxROWS */
+static const char *detached_size = NULL;
 
 static void usage()
 {
 	/* Here we are not in the *raw* mode */
 	fprintf(stderr, "myscreen: simple window manager\n");
 	fprintf(stderr, "myscreen -l|--list\n");
-	fprintf(stderr, "myscreen -a|--attach winspec\n");
-	fprintf(stderr, "myscreen [cmd [arg0...]]\n");
+	fprintf(stderr, "myscreen --gc\n");
+	fprintf(stderr, "myscreen --import file\n");
+	fprintf(stderr, "myscreen --export\n");
+	fprintf(stderr, "myscreen [options] -a|--attach winspec\n");
+	fprintf(stderr, "myscreen [options] [cmd [arg0...]]\n");
+	fprintf(stderr, "myscreen -d|--detach [-s COLSxROWS] [cmd [arg0...]]\n");
+	fprintf(stderr, "myscreen [-s COLSxROWS] --batch manifest\n");
+	fprintf(stderr, "myscreen --broadcast text|- [winspec...]\n");
+	fprintf(stderr, "myscreen --control winspec [command]\n");
+	fprintf(stderr, "myscreen --grep [-C lines] text [winspec...]\n");
+	fprintf(stderr, "myscreen --dump [-n lines] [-e] [winspec...]\n");
+	fprintf(stderr, "myscreen --server [-j workers] [-p pool]\n");
+	fprintf(stderr, "myscreen --server-stats\n");
+	fprintf(stderr, "options:\n");
+	fprintf(stderr, "  -D|--direct     take the pty master\n");
+	fprintf(stderr, "  -r|--read-only  watch only, with -a\n");
+	fprintf(stderr, "  --on-overflow resync|disconnect\n");
+	fprintf(stderr, "                  what to do if we fall behind\n");
+	fprintf(stderr, "  --sync          skip to the current screen\n");
 	exit(EXIT_FAILURE);
 }
 
-enum { LIST, ATTACH, START } mode;
+enum {
+	LIST,
+	ATTACH,
+	START,
+	BATCH,
+	BROADCAST,
+	CONTROL,
+	GREP,
+	DUMP,
+	SERVER,
+	SERVER_STATS,
+	IMPORT,
+	EXPORT,
+	GC
+} mode;
 
-enum { DETACH = 'd', KILL = 'k' } control_char;
+enum { DETACH = 'd', KILL = 'k', COPY = '[', PASTE = ']' } control_char;
 
 /* return 0 if we want to retain this window task, -1 if we want to
  * we want to discard this window */
@@ -44,6 +111,22 @@ static int do_interact_window(struct window *win);
 
 static void sigwinch_handler(int sig);
 
+static unsigned char *windows_alive(const struct registry *reg);
+static void print_alert(const char *socket);
+static int collect_garbage(struct registry *reg);
+static int start_batch(struct registry *reg, const char *file,
+		       struct winsize *ws);
+static int find_window(const struct registry *reg, const char *spec,
+		       struct registry_entry *e);
+static int broadcast(const struct registry *reg, const char *text,
+		     char **specs, int nr_specs);
+static int control_window(const struct registry_entry *e, char **cmd,
+			  int nr_cmd);
+static int grep_windows(const struct registry *reg, const char *text,
+			unsigned context, char **specs, int nr_specs);
+static int dump_windows(const struct registry *reg, uint32_t lines,
+			unsigned flags, char **specs, int nr_specs);
+
 static void reset_tty_sig(int sig)
 {
 	(void)sig;
@@ -68,9 +151,12 @@ int main(int argc, char **argv)
 	char *arg;
 	int home_len;
 	int task_ret;
-	struct window_vec *windows;
+	struct registry *reg;
+	struct registry_entry entry;
 	struct window *win;
 	struct winsize ws;
+	int nr_workers = 1;
+	int nr_pool = 0;
 
 	mode = START;
 	argc--;
@@ -91,8 +177,164 @@ int main(int argc, char **argv)
 			mode = ATTACH;
 			break;
 		}
+		if (!strcmp(arg, "-D") || !strcmp(arg, "--direct")) {
+			argc--;
+			argv++;
+			direct_attach = 1;
+			continue;
+		}
+		if (!strcmp(arg, "-r") || !strcmp(arg, "--read-only")) {
+			argc--;
+			argv++;
+			read_only = 1;
+			continue;
+		}
+		if (!strcmp(arg, "-d") || !strcmp(arg, "--detach")) {
+			argc--;
+			argv++;
+			detached = 1;
+			continue;
+		}
+		if ((!strcmp(arg, "-s") || !strcmp(arg, "--size")) &&
+		    argc > 1) {
+			detached_size = argv[1];
+			argc -= 2;
+			argv += 2;
+			continue;
+		}
+		if (!strcmp(arg, "--sync")) {
+			argc--;
+			argv++;
+			state_sync = 1;
+			continue;
+		}
+		if (!strcmp(arg, "--on-overflow") && argc > 1) {
+			if (!strcmp(argv[1], "disconnect"))
+				disconnect_slow = 1;
+			else if (strcmp(argv[1], "resync"))
+				usage();
+			argc -= 2;
+			argv += 2;
+			continue;
+		}
+		if (!strcmp(arg, "--gc")) {
+			argc--;
+			argv++;
+			mode = GC;
+			break;
+		}
+		if (!strcmp(arg, "--batch")) {
+			argc--;
+			argv++;
+			mode = BATCH;
+			break;
+		}
+		if (!strcmp(arg, "--broadcast")) {
+			argc--;
+			argv++;
+			mode = BROADCAST;
+			break;
+		}
+		if (!strcmp(arg, "--control")) {
+			argc--;
+			argv++;
+			mode = CONTROL;
+			break;
+		}
+		if (!strcmp(arg, "--grep")) {
+			argc--;
+			argv++;
+			mode = GREP;
+			break;
+		}
+		if (!strcmp(arg, "--dump")) {
+			argc--;
+			argv++;
+			mode = DUMP;
+			break;
+		}
+		if (!strcmp(arg, "--import")) {
+			argc--;
+			argv++;
+			mode = IMPORT;
+			break;
+		}
+		if (!strcmp(arg, "--export")) {
+			argc--;
+			argv++;
+			mode = EXPORT;
+			break;
+		}
+		if (!strcmp(arg, "--server-stats")) {
+			argc--;
+			argv++;
+			mode = SERVER_STATS;
+			break;
+		}
+		if (!strcmp(arg, "--server")) {
+			argc--;
+			argv++;
+			mode = SERVER;
+			break;
+		}
 		usage();
 	}
+	/* A viewer can't take the pty, and only attaches */
+	if (read_only && (direct_attach || mode != ATTACH))
+		usage();
+	/* Nothing to sync when we hold the pty */
+	if (state_sync && direct_attach)
+		usage();
+	/* Windows started detached have nobody to attach */
+	if (detached && mode != START)
+		usage();
+	if (mode == BATCH)
+		detached = 1;
+	if (detached && (direct_attach || state_sync || disconnect_slow))
+		usage();
+	if (detached_size && !detached)
+		usage();
+	if (detached && !detached_size)
+		detached_size = "80x24";
+	if (detached && tty_parse_winsize(detached_size, &ws) < 0) {
+		fprintf(stderr, "Error: bad window size '%s'\n", detached_size);
+		exit(EXIT_FAILURE);
+	}
+
+	if (mode == SERVER) {
+		char *endptr;
+		long n;
+
+		for (; argc >= 2; argc -= 2, argv += 2) {
+			n = strtol(argv[1], &endptr, 10);
+			if (*endptr || argv[1][0] == '\0')
+				usage();
+			if (!strcmp(argv[0], "-j") && n >= 1 &&
+			    n <= SERVER_MAX_WORKERS)
+				nr_workers = n;
+			else if (!strcmp(argv[0], "-p") && n >= 0 &&
+				 n <= SERVER_MAX_POOL)
+				nr_pool = n;
+			else
+				usage();
+		}
+		if (argc != 0)
+			usage();
+		server_xrun(nr_workers, nr_pool);
+	}
+	if (mode == SERVER_STATS) {
+		struct strbuf stats = STRBUF_INIT;
+
+		if (argc != 0)
+			usage();
+		if (server_stats(&stats) < 0) {
+			fprintf(stderr, "No myscreen server is running\n");
+			exit(EXIT_FAILURE);
+		}
+		fwrite(stats.buf, 1, stats.len, stdout);
+		strbuf_release(&stats);
+		return 0;
+	}
 
 	home = getenv("HOME");
 	if (!home) {
@@ -108,190 +350,2009 @@ int main(int argc, char **argv)
 		home[home_len - 1] = '\0';
 
 	if (snprintf(screen_store, 256, "%s/%s", home, DEFAULT_SCREEN_STORE) >=
-	    256) {
+		    256 ||
+	    snprintf(old_screen_store, 256, "%s/%s", home, OLD_SCREEN_STORE) >=
+		    256) {
 		fprintf(stderr, "Error: screen store path too long\n");
 		exit(EXIT_FAILURE);
 	}
 	signal(SIGWINCH, sigwinch_handler);
 	signal(SIGABRT, reset_tty_sig);
-	signal(SIGKILL, reset_tty_sig);
 	signal(SIGINT, reset_tty_sig);
 	signal(SIGTERM, reset_tty_sig);
 	atexit(reset_tty);
 
-	windows = window_vec_xalloc();
-	window_vec_load(windows, screen_store);
-	if (mode == START) {
-		char window_name[32] = { 0 };
+	reg = registry_xopen(screen_store);
+	/* Carry the windows of older versions over, once */
+	if (reg->is_new && access(old_screen_store, F_OK) == 0 &&
+	    registry_import(reg, old_screen_store) == 0)
+		fprintf(stderr, "Imported windows from %s\n", old_screen_store);
+	if (mode == START && detached) {
+		struct termios termios;
 
+		tty_default_termios(&termios);
+		win = window_xstart("myscreen", &termios, &ws, argv);
+		if (registry_add_numbered(reg, win, "myscreen") < 0) {
+			ferror_raw("Window %s is not registered", win->name);
+			exit(EXIT_FAILURE);
+		}
+		/* For scripts to attach to or kill it later */
+		printf("%s %d\n", win->name, (int)win->pid);
+		window_free(win);
+	} else if (mode == START) {
+		if (!isatty(STDIN_FILENO)) {
+			fprintf(stderr,
+				"Error: not a terminal, use -d to start detached\n");
+			exit(EXIT_FAILURE);
+		}
 		tty_set_raw(STDIN_FILENO, &origin_termios);
 		raw_mode = 1;
 		tty_get_winsize(STDIN_FILENO, &ws);
-		snprintf(window_name, 32, "myscreen.%u",
-			 (unsigned int)windows->nr);
-		win = window_xstart(window_name, &origin_termios, &ws, argv);
+		/*
+		 * The name is settled under the registry lock, so windows
+		 * started side by side don't take the same one.
+		 */
+		win = window_xstart("myscreen", &origin_termios, &ws, argv);
+		if (registry_add_numbered(reg, win, "myscreen") < 0)
+			ferror_raw("Window %s is not registered", win->name);
 
 		task_ret = do_interact_window(win);
-		if (task_ret == 0)
-			window_vec_add(windows, win);
-		else
-			/* Failed or killed */
-			window_free(win);
+		if (task_ret < 0)
+			registry_remove(reg, win->name);
+		window_free(win);
+	} else if (mode == BATCH) {
+		if (argc != 1)
+			usage();
+		if (start_batch(reg, *argv, &ws) < 0)
+			exit(EXIT_FAILURE);
+	} else if (mode == BROADCAST) {
+		if (argc < 1)
+			usage();
+		if (broadcast(reg, argv[0], argv + 1, argc - 1) < 0)
+			exit(EXIT_FAILURE);
+	} else if (mode == CONTROL) {
+		if (argc < 1)
+			usage();
+		if (find_window(reg, argv[0], &entry) < 0) {
+			fprintf(stderr, "Error: window '%s' not found\n",
+				argv[0]);
+			exit(EXIT_FAILURE);
+		}
+		if (control_window(&entry, argv + 1, argc - 1) < 0)
+			exit(EXIT_FAILURE);
+	} else if (mode == GREP) {
+		unsigned long context = 0;
+		char *end;
+
+		if (argc > 2 && !strcmp(argv[0], "-C")) {
+			context = strtoul(argv[1], &end, 10);
+			if (*end || argv[1][0] == '\0')
+				usage();
+			argc -= 2;
+			argv += 2;
+		}
+		if (argc < 1)
+			usage();
+		if (grep_windows(reg, argv[0], context, argv + 1, argc - 1))
+			exit(EXIT_FAILURE);
+	} else if (mode == DUMP) {
+		unsigned long lines = 0;
+		unsigned flags = 0;
+		char *end;
+
+		for (; argc > 0 && argv[0][0] == '-'; argc--, argv++) {
+			if (!strcmp(argv[0], "-e")) {
+				flags |= PROTO_SCREEN_ATTRS;
+			} else if (!strcmp(argv[0], "-n") && argc > 1) {
+				lines = strtoul(argv[1], &end, 10);
+				if (*end || argv[1][0] == '\0' || lines == 0 ||
+				    lines > INT32_MAX)
+					usage();
+				argc--;
+				argv++;
+			} else {
+				usage();
+			}
+		}
+		if (dump_windows(reg, lines, flags, argv, argc) < 0)
+			exit(EXIT_FAILURE);
 	} else if (mode == LIST) {
+		unsigned char *alive;
+		size_t nr_dead = 0;
+
 		if (argc != 0)
 			usage();
-		if (windows->nr == 0)
+		if (registry_nr(reg) == 0)
 			printf("No windows found.\n");
-		else {
-			for (size_t i = 0; i < windows->nr; i++) {
-				struct window *win = windows->windows[i];
-				assert(win);
-				printf("--------------------------------\n");
-				printf("[%zu]\n", i);
-				printf("  Name: %s\n", win->name);
-				printf("  TTY: %s\n", win->device);
-				printf("  Socket: %s\n", win->socket);
-			}
+		alive = windows_alive(reg);
+		for (size_t i = 0; registry_get(reg, i, &entry) == 0; i++) {
+			printf("--------------------------------\n");
+			printf("[%zu]\n", i);
+			printf("  Name: %s\n", entry.name);
+			printf("  TTY: %s\n", entry.device);
+			printf("  Socket: %s\n", entry.socket);
+			printf("  PID: %d%s\n", (int)entry.pid,
+			       alive[i] ? "" : " (dead)");
+			if (alive[i])
+				print_alert(entry.socket);
+			nr_dead += !alive[i];
 		}
-		window_vec_free(windows);
-		return 0;
+		if (nr_dead)
+			printf("%zu dead, myscreen --gc removes them\n",
+			       nr_dead);
+		free(alive);
+	} else if (mode == GC) {
+		if (argc != 0)
+			usage();
+		if (collect_garbage(reg) < 0)
+			exit(EXIT_FAILURE);
+	} else if (mode == IMPORT) {
+		if (argc != 1)
+			usage();
+		if (registry_import(reg, *argv) < 0)
+			exit(EXIT_FAILURE);
+	} else if (mode == EXPORT) {
+		if (argc != 0)
+			usage();
+		if (registry_export(reg, stdout) < 0)
+			exit(EXIT_FAILURE);
 	} else { /* mode == ATTACH */
-		size_t win_idx;
-		char *endptr;
-
 		assert(mode == ATTACH);
 		if (argc != 1)
 			usage();
 
-		win_idx = strtoul(*argv, &endptr, 10);
-		if (!*endptr && *argv)
-			win = window_vec_get(windows, win_idx);
-		else
-			win = window_vec_find(windows, *argv);
-		if (!win) {
+		if (find_window(reg, *argv, &entry) < 0) {
 			fprintf(stderr, "Error: window '%s' not found\n",
 				*argv);
-			window_vec_free(windows);
 			exit(EXIT_FAILURE);
 		}
+		win = window_xnew(entry.name, entry.device, entry.socket,
+				  entry.pid);
 
 		tty_set_raw(STDIN_FILENO, &origin_termios);
 		raw_mode = 1;
 		tty_get_winsize(STDIN_FILENO, &ws);
 		task_ret = do_interact_window(win);
-		if (task_ret == 0)
-			window_vec_add(windows, win);
-		else {
+		if (task_ret < 0) {
 			/* Failed or killed */
-			window_vec_remove(windows, win);
+			registry_remove(reg, win->name);
 		}
+		window_free(win);
 	}
-	window_vec_save(windows, screen_store);
-	window_vec_free(windows);
+	registry_close(reg);
 
 	reset_tty();
+	return 0;
 }
 
-#define FAIL(p)               \
-	do {                  \
-		(p);          \
-		ret = -1;     \
-		goto cleanup; \
-	} while (0)
+/* Print what a trigger flagged the window for, if anything */
+static void print_alert(const char *socket)
+{
+	struct strbuf path = STRBUF_INIT;
+	char alert[256];
+	ssize_t n = -1;
+	int fd;
 
-static int do_interact_window(struct window *win)
+	strbuf_addf(&path, "%s%s", socket, TRIGGER_FLAG_SUFFIX);
+	fd = open(path.buf, O_RDONLY | O_CLOEXEC);
+	if (fd >= 0) {
+		n = read_in_full(fd, alert, sizeof(alert) - 1);
+		close(fd);
+	}
+	strbuf_release(&path);
+	if (n <= 0)
+		return;
+	alert[n] = '\0';
+	printf("  Alert: %.*s\n", (int)strcspn(alert, "\n"), alert);
+}
+
+/* Return whether each window in the registry is alive, by index */
+static unsigned char *windows_alive(const struct registry *reg)
 {
-	int sock_fd, nfds;
-	char sock_buf[256];
-	fd_set read_set;
-	int ret;
+	struct registry_entry e;
+	unsigned char *alive;
+	pid_t *pids;
+	size_t nr = registry_nr(reg);
 
-	sock_fd = socket_client_start(win->socket);
-	if (sock_fd < 0) {
-		ferror_raw("Error connecting to socket %s", win->socket);
+	ALLOC_ARRAY(pids, nr + 1);
+	ALLOC_ARRAY(alive, nr + 1);
+	if (pids == NULL || alive == NULL)
+		ferror_raw_die("Error allocating memory for window states");
+	for (size_t i = 0; i < nr; i++)
+		pids[i] = registry_get(reg, i, &e) == 0 ? e.pid : 0;
+	window_pids_alive(pids, nr, alive);
+	free(pids);
+	return alive;
+}
+
+static int cmp_str(const void *a, const void *b)
+{
+	return strcmp(*(const char *const *)a, *(const char *const *)b);
+}
+
+struct socket_sweep {
+	const char **used; /* sorted sockets of registered windows */
+	size_t nr_used;
+	int removed;
+};
+
+static int sweep_socket(const char *path, void *data)
+{
+	struct socket_sweep *sweep = data;
+
+	if (bsearch(&path, sweep->used, sweep->nr_used,
+		    sizeof(*sweep->used), cmp_str))
+		return 0;
+	/* Windows being started aren't registered yet, but listen */
+	if (socket_is_stale(path) && unlink(path) == 0) {
+		struct strbuf flag = STRBUF_INIT;
+
+		strbuf_addf(&flag, "%s%s", path, TRIGGER_FLAG_SUFFIX);
+		unlink(flag.buf);
+		strbuf_release(&flag);
+		printf("Removed socket %s\n", path);
+		sweep->removed++;
+	}
+	return 0;
+}
+
+/*
+ * Remove the windows whose task is gone from the registry, then the
+ * sockets nobody listens on which no window is registered with.
+ */
+static int collect_garbage(struct registry *reg)
+{
+	struct socket_sweep sweep = { 0 };
+	struct registry_entry e, *dead;
+	unsigned char *alive;
+	size_t nr = registry_nr(reg), nr_dead = 0;
+	int pruned = 0;
+
+	alive = windows_alive(reg);
+	ALLOC_ARRAY(dead, nr + 1);
+	if (dead == NULL)
+		ferror_raw_die("Error allocating memory for dead windows");
+	for (size_t i = 0; i < nr; i++) {
+		if (alive[i] || registry_get(reg, i, &e) < 0)
+			continue;
+		/* Pruning reloads the registry under them */
+		dead[nr_dead].name = strdup(e.name);
+		dead[nr_dead].device = "";
+		dead[nr_dead].socket = "";
+		dead[nr_dead].pid = e.pid;
+		if (dead[nr_dead].name == NULL)
+			ferror_raw_die("Error allocating memory for windows");
+		printf("Removing window %s: pid %d is gone\n", e.name,
+		       (int)e.pid);
+		nr_dead++;
+	}
+	free(alive);
+	if (nr_dead > 0)
+		pruned = registry_prune(reg, dead, nr_dead);
+	for (size_t i = 0; i < nr_dead; i++)
+		free((char *)dead[i].name);
+	free(dead);
+	if (pruned < 0)
 		return -1;
+
+	nr = registry_nr(reg);
+	ALLOC_ARRAY(sweep.used, nr + 1);
+	if (sweep.used == NULL)
+		ferror_raw_die("Error allocating memory for sockets");
+	for (size_t i = 0; i < nr; i++)
+		if (registry_get(reg, i, &e) == 0)
+			sweep.used[sweep.nr_used++] = e.socket;
+	qsort(sweep.used, sweep.nr_used, sizeof(*sweep.used), cmp_str);
+	if (socket_for_each(sweep_socket, &sweep) < 0)
+		perror_raw("Error looking for sockets");
+	free(sweep.used);
+	printf("Removed %d windows and %d sockets\n", pruned,
+	       sweep.removed);
+	return 0;
+}
+
+/* Look a window up by index or name, return its index or -1 */
+static int find_window(const struct registry *reg, const char *spec,
+		       struct registry_entry *e)
+{
+	char *end;
+	size_t idx = strtoul(spec, &end, 10);
+
+	if (*spec && !*end)
+		return registry_get(reg, idx, e) == 0 ? (int)idx : -1;
+	return registry_find(reg, spec, e);
+}
+
+/*
+ * Return the indexes of the windows which any of specs, an index, a
+ * name or a shell pattern of names, picks, or of every live window if
+ * there are no specs. Their number goes in *nr. Return NULL if a spec
+ * picks nothing.
+ */
+static size_t *select_windows(const struct registry *reg, char **specs,
+			      int nr_specs, size_t *nr)
+{
+	struct registry_entry e;
+	unsigned char *picked;
+	size_t *idx, nr_windows = registry_nr(reg);
+	int found, ret = 0;
+
+	if (nr_specs == 0) {
+		picked = windows_alive(reg);
+	} else {
+		CALLOC_ARRAY(picked, nr_windows + 1);
+		if (picked == NULL)
+			ferror_raw_die("Error allocating memory for windows");
 	}
-	nfds = sock_fd > STDIN_FILENO ? sock_fd + 1 : STDIN_FILENO + 1;
-	for (;;) {
-		char c;
+	for (int i = 0; i < nr_specs; i++) {
+		found = find_window(reg, specs[i], &e);
+		if (found >= 0) {
+			picked[found] = 1;
+			continue;
+		}
+		for (size_t j = 0; registry_get(reg, j, &e) == 0; j++) {
+			if (fnmatch(specs[i], e.name, 0))
+				continue;
+			picked[j] = 1;
+			found = j;
+		}
+		if (found < 0) {
+			fprintf(stderr, "Error: window '%s' not found\n",
+				specs[i]);
+			ret = -1;
+		}
+	}
+	ALLOC_ARRAY(idx, nr_windows + 1);
+	if (idx == NULL)
+		ferror_raw_die("Error allocating memory for windows");
+	*nr = 0;
+	for (size_t i = 0; i < nr_windows; i++)
+		if (picked[i])
+			idx[(*nr)++] = i;
+	free(picked);
+	if (ret < 0) {
+		free(idx);
+		return NULL;
+	}
+	return idx;
+}
 
-		if (window_ch) {
-			struct winsize ws;
-			char winch_buf[5] = { [0] = 'w' };
-			uint16_t *p = (uint16_t *)(winch_buf + 1);
+static int hex_digit(int c)
+{
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F')
+		return c - 'A' + 10;
+	return -1;
+}
 
-			tty_get_winsize(STDIN_FILENO, &ws);
-			window_ch = 0;
-			p[0] = ws.ws_row;
-			p[1] = ws.ws_col;
-			if (write(sock_fd, winch_buf, 5) != 5)
-				FAIL(perror_raw(
-					"Error sending window change to socket"));
+/*
+ * Expand the escapes \a, \b, \e, \n, \r, \t, \\ and \xHH in text, so
+ * it can carry Enter and other control keys.
+ */
+static int unescape_input(const char *text, struct strbuf *out)
+{
+	static const char from[] = "abenrt\\", to[] = "\a\b\033\n\r\t\\";
+	const char *p;
+	int hi, lo;
+
+	for (; *text; text++) {
+		if (*text != '\\') {
+			strbuf_addch(out, *text);
+			continue;
+		}
+		text++;
+		if (*text == 'x' && (hi = hex_digit(text[1])) >= 0 &&
+		    (lo = hex_digit(text[2])) >= 0) {
+			strbuf_addch(out, hi << 4 | lo);
+			text += 2;
+			continue;
+		}
+		p = *text ? strchr(from, *text) : NULL;
+		if (p == NULL) {
+			fprintf(stderr, "Error: unknown escape '\\%c'\n",
+				*text ? *text : ' ');
+			return -1;
 		}
+		strbuf_addch(out, to[p - from]);
+	}
+	return 0;
+}
 
-		FD_ZERO(&read_set);
-		FD_SET(STDIN_FILENO, &read_set);
-		FD_SET(sock_fd, &read_set);
-		if (select(nfds, &read_set, NULL, NULL, NULL) < 0) {
-			if (errno == EINTR)
-				continue; /* Interrupted by signal, retry select
-					   */
-			FAIL(perror_raw(
-				"Error in select from STDIN and socket"));
+/*
+ * Type text, or stdin if it is "-", into the windows specs pick, all at
+ * once, and say which ones got it.
+ */
+static int broadcast(const struct registry *reg, const char *text,
+		     char **specs, int nr_specs)
+{
+	struct strbuf input = STRBUF_INIT;
+	struct registry_entry e;
+	struct window_send *sends;
+	char buf[4096];
+	size_t *idx, nr, delivered;
+	uint64_t start;
+	ssize_t n;
+
+	if (!strcmp(text, "-")) {
+		while ((n = read_in_full(STDIN_FILENO, buf, sizeof(buf))) > 0)
+			strbuf_add(&input, buf, n);
+		if (n < 0) {
+			perror_raw("Error reading input to send");
+			return -1;
 		}
+	} else if (unescape_input(text, &input) < 0) {
+		return -1;
+	}
+	idx = select_windows(reg, specs, nr_specs, &nr);
+	if (idx == NULL)
+		return -1;
+	if (nr == 0)
+		printf("No windows found.\n");
 
-		if (FD_ISSET(sock_fd, &read_set)) {
-			ssize_t n = read(sock_fd, sock_buf, sizeof(sock_buf));
-			if (n < 0)
-				FAIL(perror_raw("Error reading from socket"));
-			else if (n == 0)
-				FAIL(ferror_raw("Socket closed"));
-			if (write(STDOUT_FILENO, sock_buf, n) != n)
-				FAIL(perror_raw("Error writing to STDOUT"));
-		} else if (FD_ISSET(STDIN_FILENO, &read_set)) {
-			if (read(STDIN_FILENO, &c, 1) != 1)
-				FAIL(perror_raw(
-					"Error reading char from STDIN"));
-			if (c != CTRL_A) {
-				char char_buf[2] = { 'c', c };
-				if (write(sock_fd, char_buf, 2) != 2)
-					FAIL(perror_raw(
-						"Error sending char to socket"));
-				continue;
-			}
+	CALLOC_ARRAY(sends, nr + 1);
+	if (sends == NULL)
+		ferror_raw_die("Error allocating memory for windows");
+	for (size_t i = 0; i < nr; i++)
+		if (registry_get(reg, idx[i], &e) == 0)
+			sends[i].socket = e.socket;
+	start = getnanotime();
+	delivered = window_send_many(sends, nr, input.buf, input.len,
+				     BROADCAST_TIMEOUT_MS);
+	for (size_t i = 0; i < nr; i++) {
+		registry_get(reg, idx[i], &e);
+		if (sends[i].delivered)
+			printf("%s: sent, %.3f ms\n", e.name,
+			       sends[i].ns / 1e6);
+		else
+			printf("%s: failed, %s\n", e.name, sends[i].error);
+	}
+	printf("Sent %zu bytes to %zu of %zu windows in %.3f ms\n", input.len,
+	       delivered, nr, (getnanotime() - start) / 1e6);
+	free(sends);
+	free(idx);
+	strbuf_release(&input);
+	return delivered == nr ? 0 : -1;
+}
 
-			/*
-			 * c is CTRL-A, if the next char is 'd' or 'k', we
-			 * detach or kill the window. Otherwise we ignore the
-			 * next character.
-			 *
-			 * NEEDSWORK: we should use select here to wait for the
-			 * next character, but for now we just read it directly
-			 * from stdin.
-			 */
-			if (read(STDIN_FILENO, &c, 1) != 1)
-				FAIL(perror_raw(
-					"Error reading char from STDIN after CTRL-A"));
-			switch (c) {
-			case DETACH:
-				ret = 0;
-                ferror_raw("Detach from window %s: pid %d",
-                           win->name, win->pid);
-				goto cleanup;
-			case KILL:
-				kill(win->pid, SIGKILL);
-				ret = -1;
-                ferror_raw("Kill window %s: pid %d",
-                           win->name, win->pid);
-				goto cleanup;
-			default:
-				/* ignore unknown char */
-				break;
+/*
+ * Print the lines of output kept by the windows specs pick which
+ * contain text, every window task searching its own at once. Return 1
+ * if nothing matched, -1 if a window couldn't be searched.
+ */
+static int grep_windows(const struct registry *reg, const char *text,
+			unsigned context, char **specs, int nr_specs)
+{
+	struct registry_entry e;
+	struct window_grep *greps;
+	size_t *idx, nr, done, matches = 0;
+	uint64_t start;
+
+	if (*text == '\0' || strchr(text, '\n') || context > GREP_MAX_CONTEXT) {
+		fprintf(stderr, "Error: the text has to be one line, with at most %d lines of context\n",
+			GREP_MAX_CONTEXT);
+		return -1;
+	}
+	idx = select_windows(reg, specs, nr_specs, &nr);
+	if (idx == NULL)
+		return -1;
+
+	CALLOC_ARRAY(greps, nr + 1);
+	if (greps == NULL)
+		ferror_raw_die("Error allocating memory for windows");
+	for (size_t i = 0; i < nr; i++) {
+		if (registry_get(reg, idx[i], &e) < 0)
+			continue;
+		greps[i].name = e.name;
+		greps[i].socket = e.socket;
+	}
+	start = getnanotime();
+	done = window_grep_many(greps, nr, text, context, GREP_TIMEOUT_MS);
+	for (size_t i = 0; i < nr; i++) {
+		if (!greps[i].done)
+			fprintf(stderr, "%s: not searched, %s\n",
+				greps[i].name, greps[i].error);
+		else if (greps[i].cut)
+			fprintf(stderr, "%s: too many lines found, the rest are not shown\n",
+				greps[i].name);
+		matches += greps[i].matches;
+	}
+	fprintf(stderr, "Searched %zu of %zu windows in %.3f ms, %zu lines matched\n",
+		done, nr, (getnanotime() - start) / 1e6, matches);
+	free(greps);
+	free(idx);
+	if (done < nr)
+		return -1;
+	return matches ? 0 : 1;
+}
+
+/*
+ * Print what the windows specs pick show, or their last lines of
+ * output, one after the other under a header if there are several.
+ * The windows are asked all at once and are neither attached to nor
+ * resized. Return -1 if a window didn't answer.
+ */
+static int dump_windows(const struct registry *reg, uint32_t lines,
+			unsigned flags, char **specs, int nr_specs)
+{
+	struct registry_entry e;
+	struct window_dump *dumps;
+	size_t *idx, nr, done, shown = 0;
+
+	idx = select_windows(reg, specs, nr_specs, &nr);
+	if (idx == NULL)
+		return -1;
+
+	CALLOC_ARRAY(dumps, nr + 1);
+	if (dumps == NULL)
+		ferror_raw_die("Error allocating memory for windows");
+	for (size_t i = 0; i < nr; i++) {
+		if (registry_get(reg, idx[i], &e) < 0)
+			continue;
+		dumps[i].name = e.name;
+		dumps[i].socket = e.socket;
+	}
+	done = window_dump_many(dumps, nr, lines, flags, DUMP_TIMEOUT_MS);
+	for (size_t i = 0; i < nr; i++) {
+		if (dumps[i].text == NULL) {
+			fprintf(stderr, "%s: not dumped, %s\n", dumps[i].name,
+				dumps[i].error);
+			continue;
+		}
+		if (nr > 1)
+			printf("%s==> %s <==\n", shown++ ? "\n" : "",
+			       dumps[i].name);
+		fwrite(dumps[i].text, 1, dumps[i].len, stdout);
+		if (dumps[i].len && dumps[i].text[dumps[i].len - 1] != '\n')
+			putchar('\n');
+		free(dumps[i].text);
+	}
+	fflush(stdout);
+	free(dumps);
+	free(idx);
+	return done == nr ? 0 : -1;
+}
+
+/* Say hello as a control client, return the socket or -1 */
+static int control_connect(const struct registry_entry *e,
+			   struct proto_reader *reader)
+{
+	struct proto_frame frame;
+	struct proto_hello hello = { .flags = PROTO_HELLO_CONTROL };
+	int fd;
+
+	fd = socket_client_try(e->socket);
+	if (fd < 0) {
+		ferror_raw("Error connecting to window %s: %s", e->name,
+			   strerror(errno));
+		return -1;
+	}
+	if (proto_send_hello(fd, &hello) < 0 ||
+	    proto_recv(fd, reader, &frame) < 0) {
+		perror_raw("Error in protocol handshake");
+		close(fd);
+		return -1;
+	}
+	if (proto_parse_hello(&frame, &hello) < 0 ||
+	    hello.version != PROTO_VERSION ||
+	    !(hello.flags & PROTO_HELLO_CONTROL)) {
+		ferror_raw("Window %s does not support control mode", e->name);
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/*
+ * Wait up to timeout_ms, -1 for ever, for the answer of the given type.
+ * Return 1 if it didn't come in time.
+ */
+static int control_answer(int fd, struct proto_reader *reader, int type,
+			  int timeout_ms, struct proto_frame *frame)
+{
+	struct pollfd pfd = { .fd = fd, .events = POLLIN };
+	ssize_t n;
+	int ret;
+
+	while ((ret = proto_reader_next(reader, frame)) == 0) {
+		if (timeout_ms >= 0 && poll(&pfd, 1, timeout_ms) == 0)
+			return 1;
+		n = proto_reader_fill(reader, fd);
+		if (n <= 0) {
+			printf("error connection closed\n");
+			return -1;
+		}
+	}
+	if (ret < 0 || frame->type != type) {
+		if (ret > 0 && frame->type == PROTO_ERROR)
+			printf("error %.*s\n", (int)frame->len, frame->payload);
+		else
+			printf("error unexpected answer\n");
+		return -1;
+	}
+	return 0;
+}
+
+/* Print text as "ok N" and its N lines */
+static void control_print(const char *text, size_t len)
+{
+	size_t nr = 0;
+	int open_line = len > 0 && text[len - 1] != '\n';
+
+	for (size_t i = 0; i < len; i++)
+		nr += text[i] == '\n';
+	printf("ok %zu\n", nr + open_line);
+	if (len)
+		fwrite(text, 1, len, stdout);
+	if (open_line)
+		putchar('\n');
+}
+
+/*
+ * Run one control command, cmd with its argument arg, and print the
+ * answer. Return 1 if the command failed, -1 if the window is gone.
+ */
+static int control_command(int fd, struct proto_reader *reader,
+			   const char *cmd, const char *arg)
+{
+	struct strbuf req = STRBUF_INIT;
+	struct proto_frame frame;
+	char num[4], *end;
+	unsigned long n = 0;
+	int ret = 0;
+
+	if (!strcmp(cmd, "lines") || !strcmp(cmd, "wait")) {
+		n = strtoul(arg, &end, 10);
+		if (end == arg || n > INT32_MAX ||
+		    (*end && *end != ' ')) {
+			printf("error %s takes a number\n", cmd);
+			return 1;
+		}
+		arg = *end ? end + 1 : end;
+	}
+	proto_put_u32(num, n);
+	if (!strcmp(cmd, "send")) {
+		if (unescape_input(arg, &req) < 0) {
+			printf("error bad escape\n");
+			ret = 1;
+		} else if (proto_send(fd, PROTO_DATA, req.buf, req.len) < 0) {
+			printf("error %s\n", strerror(errno));
+			ret = -1;
+		} else {
+			control_print(NULL, 0);
+		}
+	} else if (!strcmp(cmd, "screen") || !strcmp(cmd, "lines")) {
+		if (!strcmp(cmd, "lines") && n == 0) {
+			printf("error lines takes a number\n");
+			ret = 1;
+		} else if (proto_send(fd, PROTO_SCREEN, num, 4) < 0 ||
+			   control_answer(fd, reader, PROTO_SCREEN, -1,
+					  &frame) < 0) {
+			ret = -1;
+		} else {
+			control_print(frame.payload, frame.len);
+		}
+	} else if (!strcmp(cmd, "stats")) {
+		if (proto_send(fd, PROTO_STATS, NULL, 0) < 0 ||
+		    control_answer(fd, reader, PROTO_STATS, -1, &frame) < 0)
+			ret = -1;
+		else
+			control_print(frame.payload, frame.len);
+	} else if (!strcmp(cmd, "wait")) {
+		int limit = n == 0 ? -1 :
+			    n > INT32_MAX - 1000 ? INT32_MAX : (int)n + 1000;
+
+		strbuf_add(&req, num, 4);
+		strbuf_addstr(&req, arg);
+		/* The window task times out, we only make sure */
+		if (proto_send(fd, PROTO_WAIT, req.buf, req.len) < 0 ||
+		    (ret = control_answer(fd, reader, PROTO_WAIT, limit,
+					  &frame)) < 0)
+			ret = -1;
+		else if (ret > 0 || (frame.len > 0 && frame.payload[0] == 't'))
+			printf("timeout\n");
+		else if (frame.len > 0 && frame.payload[0] == 'm')
+			control_print(frame.payload + 1, frame.len - 1);
+		else
+			printf("error %.*s\n", (int)frame.len - 1,
+			       frame.payload + 1);
+		if (ret == 0 && (frame.len == 0 || frame.payload[0] != 'm'))
+			ret = 1;
+	} else {
+		printf("error unknown command %s\n", cmd);
+		ret = 1;
+	}
+	strbuf_release(&req);
+	fflush(stdout);
+	return ret;
+}
+
+/*
+ * Drive a window from a script: run the command given, or every line
+ * of stdin as one. Commands are
+ *
+ *   send TEXT        type TEXT, with the escapes of --broadcast
+ *   screen           the text on the screen
+ *   lines N          the last N lines of output
+ *   wait MS REGEX    wait up to MS ms, 0 for ever, for the output since
+ *                    the last match to match REGEX
+ *   stats            what the window keeps, and the memory it takes
+ *
+ * and are answered by "ok N" followed by N lines of text, "timeout" or
+ * "error MESSAGE".
+ */
+static int control_window(const struct registry_entry *e, char **cmd,
+			  int nr_cmd)
+{
+	struct proto_reader reader;
+	struct strbuf line = STRBUF_INIT;
+	char *buf = NULL, *p, *word;
+	size_t alloc = 0;
+	ssize_t len;
+	int fd, ret = 0;
+
+	proto_reader_init(&reader);
+	fd = control_connect(e, &reader);
+	if (fd < 0) {
+		proto_reader_release(&reader);
+		return -1;
+	}
+	if (nr_cmd > 0) {
+		for (int i = 1; i < nr_cmd; i++) {
+			if (i > 1)
+				strbuf_addch(&line, ' ');
+			strbuf_addstr(&line, cmd[i]);
+		}
+		ret = control_command(fd, &reader, cmd[0],
+				      line.len ? line.buf : "") ? -1 : 0;
+		goto cleanup;
+	}
+	while ((len = getline(&buf, &alloc, stdin)) > 0) {
+		if (buf[len - 1] == '\n')
+			buf[len - 1] = '\0';
+		p = buf;
+		word = strsep(&p, " ");
+		if (*word == '\0')
+			continue;
+		if (control_command(fd, &reader, word, p ? p : "") < 0) {
+			ret = -1;
+			break;
+		}
+	}
+
+cleanup:
+	free(buf);
+	strbuf_release(&line);
+	proto_reader_release(&reader);
+	close(fd);
+	return ret;
+}
+
+/* Return the next blank separated word of *p, NULL at the end */
+static char *next_word(char **p)
+{
+	char *word;
+
+	while ((word = strsep(p, " \t\n")) != NULL)
+		if (*word != '\0')
+			return word;
+	return NULL;
+}
+
+struct manifest {
+	struct window_request *reqs;
+	size_t nr, alloc;
+	char **lines; /* the strings of reqs[i] are in lines[i] */
+	size_t alloc_lines;
+};
+
+static void manifest_release(struct manifest *m)
+{
+	for (size_t i = 0; i < m->nr; i++) {
+		free(m->reqs[i].argv);
+		free(m->lines[i]);
+	}
+	free(m->reqs);
+	free(m->lines);
+}
+
+/*
+ * Read the windows to start from file, "-" for stdin. Each line is the
+ * name of a window and the command to run in it, split at blanks, none
+ * for a shell. Blank lines and lines starting with '#' are skipped.
+ */
+static int read_manifest(const char *file, struct manifest *m)
+{
+	struct window_request *req;
+	char *line = NULL, *p, *name, *word;
+	size_t alloc = 0, nr_argv, alloc_argv;
+	FILE *fp;
+
+	fp = strcmp(file, "-") ? fopen(file, "r") : stdin;
+	if (fp == NULL) {
+		perror_raw("Error opening manifest");
+		return -1;
+	}
+	while (getline(&line, &alloc, fp) > 0) {
+		p = line;
+		name = next_word(&p);
+		if (name == NULL || *name == '#')
+			continue;
+		ALLOC_GROW(m->reqs, m->nr + 1, m->alloc);
+		ALLOC_GROW(m->lines, m->nr + 1, m->alloc_lines);
+		if (m->reqs == NULL || m->lines == NULL)
+			ferror_raw_die("Error allocating memory for manifest");
+		req = &m->reqs[m->nr];
+		req->name = name;
+		req->argv = NULL;
+		nr_argv = alloc_argv = 0;
+		while ((word = next_word(&p)) != NULL) {
+			ALLOC_GROW(req->argv, nr_argv + 2, alloc_argv);
+			if (req->argv == NULL)
+				ferror_raw_die("Error allocating memory for manifest");
+			req->argv[nr_argv++] = word;
+			req->argv[nr_argv] = NULL;
+		}
+		/* The line belongs to the window now */
+		m->lines[m->nr++] = line;
+		line = NULL;
+		alloc = 0;
+	}
+	free(line);
+	if (fp != stdin)
+		fclose(fp);
+	return 0;
+}
+
+/*
+ * Start every window in the manifest at once, then register them with a
+ * single update. Windows already registered are left alone.
+ */
+static int start_batch(struct registry *reg, const char *file,
+		       struct winsize *ws)
+{
+	struct manifest m = { 0 };
+	struct registry_entry e;
+	struct termios termios;
+	struct window **wins;
+	const char **names;
+	size_t nr = 0, nr_started = 0, nr_failed;
+	uint64_t start;
+	int ret = 0;
+
+	if (read_manifest(file, &m) < 0)
+		return -1;
+	ALLOC_ARRAY(names, m.nr + 1);
+	if (names == NULL)
+		ferror_raw_die("Error allocating memory for manifest");
+	for (size_t i = 0; i < m.nr; i++)
+		names[i] = m.reqs[i].name;
+	qsort(names, m.nr, sizeof(*names), cmp_str);
+	for (size_t i = 1; i < m.nr; i++) {
+		if (strcmp(names[i - 1], names[i]))
+			continue;
+		fprintf(stderr, "Error: window %s is in %s twice\n",
+			names[i], file);
+		ret = -1;
+	}
+	free(names);
+	if (ret < 0)
+		goto cleanup;
+
+	/* Only the windows to start stay in m.reqs[0..nr) */
+	for (size_t i = 0; i < m.nr; i++) {
+		struct window_request req = m.reqs[i];
+		char *line = m.lines[i];
+
+		if (registry_find(reg, req.name, &e) >= 0) {
+			printf("%s: exists, skipped\n", req.name);
+			free(req.argv);
+			free(line);
+			continue;
+		}
+		m.reqs[nr] = req;
+		m.lines[nr++] = line;
+	}
+	m.nr = nr;
+
+	tty_default_termios(&termios);
+	start = getnanotime();
+	window_start_many(m.reqs, m.nr, &termios, ws);
+	ALLOC_ARRAY(wins, m.nr + 1);
+	if (wins == NULL)
+		ferror_raw_die("Error allocating memory for windows");
+	for (size_t i = 0; i < m.nr; i++) {
+		struct window_request *req = &m.reqs[i];
+
+		if (req->win == NULL) {
+			printf("%s: failed\n", req->name);
+			continue;
+		}
+		printf("%s: pid %d, %.3f ms\n", req->name, (int)req->win->pid,
+		       req->ns / 1e6);
+		wins[nr_started++] = req->win;
+	}
+	nr_failed = m.nr - nr_started;
+	printf("Started %zu of %zu windows in %.3f ms\n", nr_started, m.nr,
+	       (getnanotime() - start) / 1e6);
+	if (nr_started > 0 && registry_add_many(reg, wins, nr_started) < 0) {
+		ferror_raw("Windows started by %s are not registered", file);
+		ret = -1;
+	}
+	for (size_t i = 0; i < nr_started; i++)
+		window_free(wins[i]);
+	free(wins);
+	if (nr_failed > 0)
+		ret = -1;
+
+cleanup:
+	manifest_release(&m);
+	return ret;
+}
+
+#define FAIL(p)               \
+	do {                  \
+		(p);          \
+		ret = -1;     \
+		goto cleanup; \
+	} while (0)
+
+/*
+ * Wait for a frame of the given type passing nr fds, copying the repaint
+ * which comes first to STDOUT.
+ */
+static int window_wait_fds(int sock_fd, struct proto_reader *reader,
+			   int type, int *fds, int nr)
+{
+	struct proto_frame frame;
+
+	for (;;) {
+		if (proto_recv(sock_fd, reader, &frame) < 0) {
+			perror_raw("Error waiting for window task");
+			return -1;
+		}
+		if (frame.type == type)
+			break;
+		if (frame.type == PROTO_ERROR) {
+			ferror_raw("Disconnected by window task: %.*s",
+				   (int)frame.len, frame.payload);
+			refused = 1;
+			return -1;
+		}
+		if (frame.type == PROTO_DATA &&
+		    write_in_full(STDOUT_FILENO, frame.payload, frame.len) <
+			    0) {
+			perror_raw("Error writing to STDOUT");
+			return -1;
+		}
+	}
+	if (proto_reader_take_fds(reader, fds, nr) < 0) {
+		ferror_raw("Window task passed unexpected file descriptors");
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Wait for the pty master asked for with PROTO_HELLO_DIRECT. The master
+ * is made blocking, the window task makes it non-blocking again once we
+ * are done.
+ */
+static int window_take_master(int sock_fd, struct proto_reader *reader)
+{
+	int master_fd;
+
+	if (window_wait_fds(sock_fd, reader, PROTO_MASTER, &master_fd, 1) < 0)
+		return -1;
+	if (fcntl(master_fd, F_SETFL, fcntl(master_fd, F_GETFL) & ~O_NONBLOCK) <
+	    0) {
+		perror_raw("Error making pty master blocking");
+		close(master_fd);
+		return -1;
+	}
+	return master_fd;
+}
+
+/* Map the shared memory channel the window task agreed to in HELLO */
+static int window_take_shm(int sock_fd, struct proto_reader *reader,
+			   struct shm_channel *shm)
+{
+	int fds[SHM_NR_FDS];
+
+	if (window_wait_fds(sock_fd, reader, PROTO_SHM, fds, SHM_NR_FDS) < 0)
+		return -1;
+	return shm_channel_attach(shm, fds);
+}
+
+/*
+ * Copy window output from the shared memory ring to STDOUT until it is
+ * empty, and tell the window task we are going to sleep.
+ */
+static int shm_write_output(struct shm_channel *shm)
+{
+	struct iovec iov[2];
+	const char *p1, *p2;
+	size_t len1, len2;
+
+	for (;;) {
+		shm_ring_peek(&shm->out, &p1, &len1, &p2, &len2);
+		if (len1 == 0) {
+			if (!shm_ring_sleep(&shm->out))
+				return 0;
+			continue;
+		}
+		iov[0].iov_base = (void *)p1;
+		iov[0].iov_len = len1;
+		iov[1].iov_base = (void *)p2;
+		iov[1].iov_len = len2;
+		if (writev_in_full(STDOUT_FILENO, iov, 2) < 0) {
+			perror_raw("Error writing to STDOUT");
+			return -1;
+		}
+		shm_ring_consume(&shm->out, len1 + len2);
+		shm_ring_notify_space(&shm->out, shm->task_efd);
+	}
+}
+
+/* Put input in the shared memory ring, waiting for room if it's full */
+static int shm_send_input(struct shm_channel *shm, const char *buf,
+			  size_t len)
+{
+	struct pollfd pfd = { .fd = shm->client_efd, .events = POLLIN };
+
+	for (;;) {
+		size_t n = shm_ring_write(&shm->in, buf, len);
+
+		shm_ring_notify_data(&shm->in, shm->task_efd);
+		buf += n;
+		len -= n;
+		if (len == 0)
+			return 0;
+		if (shm_ring_wait_space(&shm->in, 1))
+			continue;
+		while (poll(&pfd, 1, -1) < 0)
+			if (errno != EINTR)
+				return -1;
+		/* Output wakeups eaten here are caught before select() */
+		shm_wakeup_clear(shm->client_efd);
+	}
+}
+
+/*
+ * Connect to the window task and agree on the protocol version. The
+ * HELLO flags the window task answered with are put in *flags.
+ */
+static int window_connect(struct window *win, struct proto_reader *reader,
+			  unsigned *flags)
+{
+	struct proto_frame frame;
+	struct proto_hello hello = { .flags = PROTO_HELLO_WINSIZE };
+	int sock_fd;
+
+	sock_fd = socket_client_start(win->socket);
+	if (sock_fd < 0) {
+		ferror_raw("Error connecting to socket %s", win->socket);
+		return -1;
+	}
+	/* The window is redrawn for our size right away */
+	tty_get_winsize(STDIN_FILENO, &hello.ws);
+	/* Direct attach needs no transport, else offer shared memory */
+	if (direct_attach)
+		hello.flags |= PROTO_HELLO_DIRECT;
+	else
+		hello.flags |= state_sync ? PROTO_HELLO_SYNC : PROTO_HELLO_SHM;
+	if (read_only)
+		hello.flags |= PROTO_HELLO_READONLY;
+	if (disconnect_slow)
+		hello.flags |= PROTO_HELLO_DISCONNECT;
+	if (proto_send_hello(sock_fd, &hello) < 0 ||
+	    proto_recv(sock_fd, reader, &frame) < 0) {
+		perror_raw("Error in protocol handshake");
+		close(sock_fd);
+		return -1;
+	}
+	if (proto_parse_hello(&frame, &hello) < 0 ||
+	    hello.version != PROTO_VERSION) {
+		ferror_raw("Window %s speaks protocol version %d, expected %d",
+			   win->name, hello.version, PROTO_VERSION);
+		close(sock_fd);
+		return -1;
+	}
+	*flags = hello.flags;
+	return sock_fd;
+}
+
+/*
+ * Send input to the program, straight to the pty when we hold it, else
+ * over shared memory if the window task agreed to it.
+ */
+static int send_input(int sock_fd, int master_fd, struct shm_channel *shm,
+		      const char *buf, size_t len)
+{
+	if (master_fd >= 0)
+		return write_in_full(master_fd, buf, len) < 0 ? -1 : 0;
+	if (shm)
+		return shm_send_input(shm, buf, len);
+	return proto_send(sock_fd, PROTO_DATA, buf, len);
+}
+
+#define OUTPUT_IOV 64
+
+/*
+ * Copy the output in every whole frame buffered in reader to STDOUT,
+ * gathering up to OUTPUT_IOV frames into each write. Screen updates are
+ * acknowledged once they are written.
+ */
+static int write_window_output(int sock_fd, struct proto_reader *reader)
+{
+	struct proto_frame frame;
+	struct iovec iov[OUTPUT_IOV];
+	char ack[4];
+	int nr = 0, acked = 1;
+	int ret;
+
+	do {
+		ret = proto_reader_next(reader, &frame);
+		if (ret > 0 && frame.type == PROTO_ERROR) {
+			ferror_raw("Disconnected by window task: %.*s",
+				   (int)frame.len, frame.payload);
+			refused = 1;
+			return -1;
+		}
+		if (ret > 0 && frame.type == PROTO_SYNC && frame.len >= 4) {
+			memcpy(ack, frame.payload, 4);
+			acked = 0;
+			frame.payload += 4;
+			frame.len -= 4;
+			frame.type = PROTO_DATA;
+		}
+		if (ret > 0 && frame.type == PROTO_DATA) {
+			iov[nr].iov_base = (void *)frame.payload;
+			iov[nr].iov_len = frame.len;
+			nr++;
+		}
+		if ((ret <= 0 || nr == OUTPUT_IOV) && nr > 0) {
+			if (writev_in_full(STDOUT_FILENO, iov, nr) < 0) {
+				perror_raw("Error writing to STDOUT");
+				return -1;
+			}
+			nr = 0;
+		}
+	} while (ret > 0);
+	if (ret < 0) {
+		ferror_raw("Malformed frame from socket");
+		return -1;
+	}
+	if (!acked && proto_send(sock_fd, PROTO_ACK, ack, sizeof(ack)) < 0) {
+		perror_raw("Error acknowledging screen update");
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Copy mode, CTRL-a [: page through the output the window keeps and
+ * copy some of it, for CTRL-a ] and the terminal's clipboard. Only the
+ * page on the screen is fetched, with PROTO_PAGE. Meanwhile window
+ * output isn't shown: over the socket it is read and dropped, screen
+ * updates of --sync are acknowledged unseen, and with shared memory it
+ * stays in the ring, which the window task stops feeding once it is
+ * full. When we leave, PROTO_REDRAW has the window repaint the screen,
+ * after whatever was left in the ring.
+ */
+
+/* Keys after the bytes, for the escape sequences we know */
+enum {
+	KEY_UP = 0x100,
+	KEY_DOWN,
+	KEY_LEFT,
+	KEY_RIGHT,
+	KEY_HOME,
+	KEY_END,
+	KEY_PGUP,
+	KEY_PGDN,
+};
+
+#define KEY_CTRL(c) ((c) & 0x1f)
+#define KEY_ESC	    0x1b
+
+/* Lines of plain text from the window's history, see PROTO_PAGE */
+struct copy_page {
+	uint64_t first, last; /* lines the window keeps */
+	uint64_t top; /* line the text starts at */
+	struct strbuf text; /* tabs expanded */
+	size_t *lines; /* where each line starts in text */
+	size_t nr, alloc;
+};
+
+struct copy_mode {
+	int sock_fd;
+	struct proto_reader *reader;
+	struct winsize ws;
+	struct copy_page page; /* on the screen */
+	uint64_t top; /* line we want at the top */
+	uint64_t line; /* of the cursor */
+	size_t col; /* characters into the line */
+	int marked;
+	uint64_t mark_line;
+	size_t mark_col;
+	uint64_t count; /* typed before a command, 0 for none */
+};
+
+/* The text copied last, typed into the window with CTRL-a ] */
+static struct strbuf copy_buffer = STRBUF_INIT;
+
+static void copy_page_release(struct copy_page *page)
+{
+	strbuf_release(&page->text);
+	free(page->lines);
+	memset(page, 0, sizeof(*page));
+}
+
+static void copy_page_add_line(struct copy_page *page)
+{
+	ALLOC_GROW(page->lines, page->nr + 1, page->alloc);
+	if (page->lines == NULL)
+		ferror_raw_die("Error allocating memory for copy mode");
+	page->lines[page->nr++] = page->text.len;
+}
+
+static void copy_page_set(struct copy_page *page, const char *p, size_t len)
+{
+	size_t col = 0;
+
+	page->first = proto_get_u64(p);
+	page->last = proto_get_u64(p + 8);
+	page->top = proto_get_u64(p + 16);
+	strbuf_reset(&page->text);
+	page->nr = 0;
+	copy_page_add_line(page);
+	for (size_t i = 24; i < len; i++) {
+		unsigned char c = p[i];
+
+		/* So that characters are columns, wide ones aside */
+		if (c == '\t') {
+			do
+				strbuf_addch(&page->text, ' ');
+			while (++col % 8);
+			continue;
+		}
+		strbuf_addch(&page->text, c);
+		if (c != '\n') {
+			col += (c & 0xc0) != 0x80;
+		} else if (i + 1 < len) {
+			copy_page_add_line(page);
+			col = 0;
+		}
+	}
+}
+
+/* Text of a line on the page, without its newline */
+static const char *copy_page_line(const struct copy_page *page,
+				  uint64_t line, size_t *len)
+{
+	size_t i, end;
+
+	if (line < page->top || line - page->top >= page->nr) {
+		*len = 0;
+		return "";
+	}
+	i = line - page->top;
+	end = i + 1 < page->nr ? page->lines[i + 1] - 1 : page->text.len;
+	if (end > page->lines[i] && page->text.buf[end - 1] == '\n')
+		end--;
+	*len = end - page->lines[i];
+	return page->text.buf + page->lines[i];
+}
+
+static size_t utf8_chars(const char *s, size_t len)
+{
+	size_t nr = 0;
+
+	for (size_t i = 0; i < len; i++)
+		nr += (s[i] & 0xc0) != 0x80;
+	return nr;
+}
+
+/* Bytes taken by the first nr characters of s */
+static size_t utf8_offset(const char *s, size_t len, size_t nr)
+{
+	size_t i = 0;
+
+	for (; i < len; i++)
+		if ((s[i] & 0xc0) != 0x80 && nr-- == 0)
+			break;
+	return i;
+}
+
+/*
+ * Handle the frames buffered while in copy mode. Output is dropped and
+ * screen updates are acknowledged all the same, so the window doesn't
+ * wait for us. Return 1 if a PAGE was put in page, -1 on error.
+ */
+static int copy_drain(struct copy_mode *cm, struct copy_page *page)
+{
+	struct proto_frame frame;
+	int ret, got = 0;
+
+	while ((ret = proto_reader_next(cm->reader, &frame)) > 0) {
+		switch (frame.type) {
+		case PROTO_ERROR:
+			ferror_raw("Disconnected by window task: %.*s",
+				   (int)frame.len, frame.payload);
+			refused = 1;
+			return -1;
+		case PROTO_SYNC:
+			if (frame.len >= 4 &&
+			    proto_send(cm->sock_fd, PROTO_ACK, frame.payload,
+				       4) < 0) {
+				perror_raw("Error acknowledging screen update");
+				return -1;
+			}
+			break;
+		case PROTO_PAGE:
+			if (frame.len < 24) {
+				ret = -1;
+				break;
+			}
+			if (page) {
+				copy_page_set(page, frame.payload, frame.len);
+				got = 1;
+			}
+			break;
+		}
+	}
+	if (ret < 0) {
+		ferror_raw("Malformed frame from socket");
+		return -1;
+	}
+	return got;
+}
+
+/* Ask for count lines from line on, and wait for them */
+static int copy_fetch(struct copy_mode *cm, uint64_t line, uint32_t count,
+		      struct copy_page *page)
+{
+	char req[12];
+	ssize_t n;
+	int got;
+
+	proto_put_u64(req, line);
+	proto_put_u32(req + 8, count);
+	if (proto_send(cm->sock_fd, PROTO_PAGE, req, sizeof(req)) < 0) {
+		perror_raw("Error asking for scrollback");
+		return -1;
+	}
+	while (!(got = copy_drain(cm, page))) {
+		n = proto_reader_fill(cm->reader, cm->sock_fd);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			perror_raw("Error reading from socket");
+		else if (n == 0)
+			ferror_raw("Socket closed");
+		if (n <= 0)
+			return -1;
+	}
+	return got < 0 ? -1 : 0;
+}
+
+/* Rows of text, the last one is for the status line */
+static int copy_rows(const struct copy_mode *cm)
+{
+	return cm->ws.ws_row > 1 ? cm->ws.ws_row - 1 : 1;
+}
+
+/* Characters of line which are selected, from <= i < to */
+static void copy_selected(const struct copy_mode *cm, uint64_t line,
+			  size_t *from, size_t *to)
+{
+	uint64_t a = cm->mark_line, b = cm->line;
+	size_t a_col = cm->mark_col, b_col = cm->col;
+
+	*from = *to = 0;
+	if (!cm->marked)
+		return;
+	if (a > b || (a == b && a_col > b_col)) {
+		a = cm->line;
+		b = cm->mark_line;
+		a_col = cm->col;
+		b_col = cm->mark_col;
+	}
+	if (line < a || line > b)
+		return;
+	*from = line == a ? a_col : 0;
+	*to = line == b ? b_col + 1 : SIZE_MAX;
+}
+
+static void copy_draw_line(const struct copy_mode *cm, uint64_t line,
+			   struct strbuf *sb)
+{
+	size_t len, from, to, nr = 0;
+	const char *text = copy_page_line(&cm->page, line, &len);
+
+	copy_selected(cm, line, &from, &to);
+	for (size_t i = 0; i < len; i++) {
+		if ((text[i] & 0xc0) != 0x80) {
+			if (nr == cm->ws.ws_col)
+				break;
+			if (nr == from && from < to)
+				strbuf_addstr(sb, "\033[7m");
+			if (nr == to)
+				strbuf_addstr(sb, "\033[m");
+			nr++;
+		}
+		strbuf_addch(sb, text[i]);
+	}
+	strbuf_addstr(sb, "\033[m");
+}
+
+static int copy_draw(const struct copy_mode *cm)
+{
+	const struct copy_page *page = &cm->page;
+	struct strbuf sb = STRBUF_INIT, status = STRBUF_INIT;
+	int rows = copy_rows(cm), ret = 0;
+	size_t len;
+	const char *text = copy_page_line(page, cm->line, &len);
+	size_t col = utf8_chars(text, utf8_offset(text, len, cm->col));
+
+	strbuf_addstr(&sb, "\033[?25l\033[m");
+	for (int r = 0; r < rows; r++) {
+		strbuf_addf(&sb, "\033[%d;1H\033[K", r + 1);
+		copy_draw_line(cm, page->top + r, &sb);
+	}
+	strbuf_addf(&status, "Copy mode: line %llu of %llu-%llu%s",
+		    (unsigned long long)cm->line,
+		    (unsigned long long)page->first,
+		    (unsigned long long)page->last,
+		    cm->marked ? ", marked; enter copies" :
+				 "; space marks, q quits");
+	strbuf_addf(&sb, "\033[%d;1H\033[K\033[7m%.*s\033[m", rows + 1,
+		    (int)(status.len < cm->ws.ws_col ? status.len : cm->ws.ws_col),
+		    status.buf);
+	if (cm->ws.ws_col > 0 && col >= cm->ws.ws_col)
+		col = cm->ws.ws_col - 1;
+	strbuf_addf(&sb, "\033[%d;%zuH\033[?25h",
+		    (int)(cm->line - page->top) + 1, col + 1);
+	if (write_in_full(STDOUT_FILENO, sb.buf, sb.len) < 0) {
+		perror_raw("Error writing to STDOUT");
+		ret = -1;
+	}
+	strbuf_release(&status);
+	strbuf_release(&sb);
+	return ret;
+}
+
+/*
+ * Fetch the page with the cursor on it, scrolled as little as possible
+ * from the top we want, and draw it.
+ */
+static int copy_show(struct copy_mode *cm)
+{
+	struct copy_page *page = &cm->page;
+	uint64_t rows = copy_rows(cm);
+	size_t len;
+	const char *text;
+
+	if (cm->line < cm->top)
+		cm->top = cm->line;
+	else if (cm->line - cm->top >= rows)
+		cm->top = cm->line - rows + 1;
+	if (copy_fetch(cm, cm->top, rows, page) < 0)
+		return -1;
+	/* Pages past the ends are moved back in, bring the cursor along */
+	cm->top = page->top;
+	if (cm->line < page->top)
+		cm->line = page->top;
+	if (cm->line - page->top >= page->nr)
+		cm->line = page->top + page->nr - 1;
+	text = copy_page_line(page, cm->line, &len);
+	len = utf8_chars(text, len);
+	if (cm->col >= len)
+		cm->col = len ? len - 1 : 0;
+	/* The window dropped the start of the selection */
+	if (cm->marked && cm->mark_line < page->first) {
+		cm->mark_line = page->first;
+		cm->mark_col = 0;
+	}
+	return copy_draw(cm);
+}
+
+static void add_base64(struct strbuf *sb, const char *buf, size_t len)
+{
+	static const char digits[] =
+		"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+	const unsigned char *p = (const unsigned char *)buf;
+
+	for (; len > 0; p += 3, len -= len < 3 ? len : 3) {
+		uint32_t v = p[0] << 16 | (len > 1 ? p[1] << 8 : 0) |
+			     (len > 2 ? p[2] : 0);
+
+		strbuf_addch(sb, digits[v >> 18]);
+		strbuf_addch(sb, digits[v >> 12 & 63]);
+		strbuf_addch(sb, len > 1 ? digits[v >> 6 & 63] : '=');
+		strbuf_addch(sb, len > 2 ? digits[v & 63] : '=');
+	}
+}
+
+/*
+ * Copy the text from the mark to the cursor, both included, into
+ * copy_buffer, and into the terminal's clipboard with OSC 52 where
+ * the terminal allows it.
+ */
+static int copy_selection(struct copy_mode *cm)
+{
+	struct copy_page sel = { 0 };
+	struct strbuf osc = STRBUF_INIT;
+	uint64_t from = cm->mark_line, to = cm->line;
+	size_t from_col = cm->mark_col, to_col = cm->col;
+	int ret = 0;
+
+	if (from > to || (from == to && from_col > to_col)) {
+		from = cm->line;
+		to = cm->mark_line;
+		from_col = cm->col;
+		to_col = cm->mark_col;
+	}
+	if (copy_fetch(cm, from, to - from < UINT32_MAX ? to - from + 1 :
+							 UINT32_MAX,
+		       &sel) < 0)
+		return -1;
+	strbuf_reset(&copy_buffer);
+	for (uint64_t line = sel.top; line - sel.top < sel.nr; line++) {
+		size_t len, start = 0, end;
+		const char *text = copy_page_line(&sel, line, &len);
+
+		if (line == from)
+			start = utf8_offset(text, len, from_col);
+		end = line == to ? utf8_offset(text, len, to_col + 1) : len;
+		if (end > start)
+			strbuf_add(&copy_buffer, text + start, end - start);
+		if (line == to)
+			break;
+		strbuf_addch(&copy_buffer, '\n');
+	}
+	copy_page_release(&sel);
+
+	strbuf_addstr(&osc, "\033]52;c;");
+	add_base64(&osc, copy_buffer.buf, copy_buffer.len);
+	strbuf_addch(&osc, '\a');
+	if (write_in_full(STDOUT_FILENO, osc.buf, osc.len) < 0) {
+		perror_raw("Error writing to STDOUT");
+		ret = -1;
+	}
+	strbuf_release(&osc);
+	return ret;
+}
+
+/* Read the key at the start of buf, return the bytes it took */
+static size_t copy_parse_key(const char *buf, size_t len, int *key)
+{
+	static const int tilde_keys[] = { 0,	    KEY_HOME, 0,	0,
+					  KEY_END,  KEY_PGUP, KEY_PGDN, KEY_HOME,
+					  KEY_END };
+	size_t i = 2;
+	int nr;
+
+	*key = (unsigned char)buf[0];
+	if (buf[0] != KEY_ESC || len < 3 || (buf[1] != '[' && buf[1] != 'O'))
+		return 1;
+	/* CSI or SS3, parameters, then the final byte */
+	while (i < len && ((buf[i] >= '0' && buf[i] <= '9') || buf[i] == ';'))
+		i++;
+	if (i == len) {
+		*key = 0;
+		return len;
+	}
+	switch (buf[i]) {
+	case 'A':
+		*key = KEY_UP;
+		break;
+	case 'B':
+		*key = KEY_DOWN;
+		break;
+	case 'C':
+		*key = KEY_RIGHT;
+		break;
+	case 'D':
+		*key = KEY_LEFT;
+		break;
+	case 'H':
+		*key = KEY_HOME;
+		break;
+	case 'F':
+		*key = KEY_END;
+		break;
+	case '~':
+		/* vt220 style, the number says which */
+		nr = atoi(buf + 2);
+		if (nr < (int)(sizeof(tilde_keys) / sizeof(tilde_keys[0])))
+			*key = tilde_keys[nr];
+		else
+			*key = 0;
+		break;
+	default:
+		*key = 0;
+		break;
+	}
+	return i + 1;
+}
+
+/* Counts go no further, so a page times a count can't overflow */
+#define COPY_MAX_COUNT 999999999999ULL
+
+/* Lines up from line, stopping at 0 */
+static uint64_t lines_up(uint64_t line, uint64_t n)
+{
+	return line > n ? line - n : 0;
+}
+
+/* Handle a key, return 1 to leave copy mode, -1 on error */
+static int copy_key(struct copy_mode *cm, int key)
+{
+	uint64_t count = cm->count, n = count ? count : 1;
+	uint64_t page = copy_rows(cm);
+
+	/* A count, unless it's a 0 on its own */
+	if (key >= '0' && key <= '9' && (count || key != '0')) {
+		if (count * 10 + key - '0' <= COPY_MAX_COUNT)
+			cm->count = count * 10 + key - '0';
+		return 0;
+	}
+	cm->count = 0;
+	switch (key) {
+	case 'j':
+	case KEY_DOWN:
+	case KEY_CTRL('n'):
+		cm->line = cm->line + n < cm->line ? UINT64_MAX : cm->line + n;
+		break;
+	case 'k':
+	case KEY_UP:
+	case KEY_CTRL('p'):
+		cm->line = lines_up(cm->line, n);
+		break;
+	case 'h':
+	case KEY_LEFT:
+		cm->col = cm->col > n ? cm->col - n : 0;
+		break;
+	case 'l':
+	case KEY_RIGHT:
+		cm->col += n < SIZE_MAX - cm->col ? n : 0;
+		break;
+	case '0':
+	case KEY_HOME:
+		cm->col = 0;
+		break;
+	case '$':
+	case KEY_END:
+		cm->col = SIZE_MAX;
+		break;
+	case 'f':
+	case KEY_PGDN:
+	case KEY_CTRL('f'):
+		cm->top += cm->top < UINT64_MAX - page * n ?
+				   page * n : UINT64_MAX - cm->top;
+		cm->line += cm->line < UINT64_MAX - page * n ?
+				    page * n : UINT64_MAX - cm->line;
+		break;
+	case 'b':
+	case KEY_PGUP:
+	case KEY_CTRL('b'):
+		cm->top = lines_up(cm->top, page * n);
+		cm->line = lines_up(cm->line, page * n);
+		break;
+	case 'g':
+		/* The top of the history, or line count */
+		cm->line = cm->top = count;
+		break;
+	case 'G':
+		/* The bottom, or line count in the middle of the screen */
+		cm->line = count ? count : UINT64_MAX;
+		cm->top = lines_up(cm->line, page / 2);
+		break;
+	case ' ':
+	case 'v':
+		if (cm->marked && key == ' ')
+			return copy_selection(cm) < 0 ? -1 : 1;
+		cm->marked = !cm->marked;
+		cm->mark_line = cm->line;
+		cm->mark_col = cm->col;
+		break;
+	case '\r':
+	case 'y':
+		if (!cm->marked)
+			return 0;
+		return copy_selection(cm) < 0 ? -1 : 1;
+	case 'q':
+	case KEY_ESC:
+	case KEY_CTRL('c'):
+		return 1;
+	case KEY_CTRL('l'):
+		break;
+	default:
+		return 0;
+	}
+	return copy_show(cm) < 0 ? -1 : 0;
+}
+
+static int copy_mode(int sock_fd, struct proto_reader *reader)
+{
+	struct copy_mode cm = {
+		.sock_fd = sock_fd,
+		.reader = reader,
+		.top = UINT64_MAX,
+		.line = UINT64_MAX,
+	};
+	char buf[256];
+	fd_set read_set;
+	ssize_t n;
+	int ret = 0, key;
+
+	/* Start at the bottom, where the screen is */
+	tty_get_winsize(STDIN_FILENO, &cm.ws);
+	if (copy_show(&cm) < 0)
+		ret = -1;
+	while (ret == 0) {
+		if (window_ch) {
+			tty_get_winsize(STDIN_FILENO, &cm.ws);
+			window_ch = 0;
+			if (proto_send_winch(sock_fd, &cm.ws) < 0) {
+				perror_raw("Error sending window change to socket");
+				ret = -1;
+				break;
+			}
+			ret = copy_show(&cm);
+			continue;
+		}
+		FD_ZERO(&read_set);
+		FD_SET(STDIN_FILENO, &read_set);
+		FD_SET(sock_fd, &read_set);
+		if (select((sock_fd > STDIN_FILENO ? sock_fd : STDIN_FILENO) +
+				   1,
+			   &read_set, NULL, NULL, NULL) < 0) {
+			if (errno == EINTR)
+				continue;
+			perror_raw("Error in select from STDIN and socket");
+			ret = -1;
+			break;
+		}
+		if (FD_ISSET(sock_fd, &read_set)) {
+			n = proto_reader_fill(reader, sock_fd);
+			if (n < 0 && errno == EINTR)
+				continue;
+			if (n < 0)
+				perror_raw("Error reading from socket");
+			else if (n == 0)
+				ferror_raw("Socket closed");
+			if (n <= 0 || copy_drain(&cm, NULL) < 0) {
+				ret = -1;
+				break;
+			}
+		}
+		if (!FD_ISSET(STDIN_FILENO, &read_set))
+			continue;
+		n = read(STDIN_FILENO, buf, sizeof(buf));
+		if (n <= 0) {
+			perror_raw("Error reading from STDIN");
+			ret = -1;
+			break;
+		}
+		for (ssize_t i = 0; i < n && ret == 0;) {
+			i += copy_parse_key(buf + i, n - i, &key);
+			ret = copy_key(&cm, key);
+		}
+	}
+	copy_page_release(&cm.page);
+	if (ret < 0)
+		return -1;
+	if (proto_send(sock_fd, PROTO_REDRAW, NULL, 0) < 0) {
+		perror_raw("Error asking for a repaint");
+		return -1;
+	}
+	return 0;
+}
+
+static int do_interact_window(struct window *win)
+{
+	int sock_fd, nfds, master_fd = -1;
+	char in_buf[4096];
+	fd_set read_set;
+	struct proto_reader reader;
+	struct shm_channel shm_channel, *shm = NULL;
+	unsigned flags;
+	int ret;
+
+	proto_reader_init(&reader);
+	sock_fd = window_connect(win, &reader, &flags);
+	if (sock_fd < 0) {
+		proto_reader_release(&reader);
+		return -1;
+	}
+	if (direct_attach) {
+		master_fd = window_take_master(sock_fd, &reader);
+		if (master_fd < 0) {
+			ret = -1;
+			goto cleanup;
+		}
+	} else if (flags & PROTO_HELLO_SHM) {
+		if (window_take_shm(sock_fd, &reader, &shm_channel) < 0) {
+			ret = -1;
+			goto cleanup;
+		}
+		shm = &shm_channel;
+	}
+	nfds = sock_fd > STDIN_FILENO ? sock_fd + 1 : STDIN_FILENO + 1;
+	if (master_fd >= nfds)
+		nfds = master_fd + 1;
+	if (shm && shm->client_efd >= nfds)
+		nfds = shm->client_efd + 1;
+	/* The repaint may have arrived together with the HELLO */
+	if (write_window_output(sock_fd, &reader) < 0) {
+		ret = -1;
+		goto cleanup;
+	}
+	for (;;) {
+		if (window_ch) {
+			struct winsize ws;
+
+			tty_get_winsize(STDIN_FILENO, &ws);
+			window_ch = 0;
+			if (proto_send_winch(sock_fd, &ws) < 0)
+				FAIL(perror_raw(
+					"Error sending window change to socket"));
+		}
+
+		/* Catch up before we sleep, the window task wakes us after */
+		if (shm && shm_write_output(shm) < 0) {
+			ret = -1;
+			goto cleanup;
+		}
+
+		FD_ZERO(&read_set);
+		FD_SET(STDIN_FILENO, &read_set);
+		FD_SET(sock_fd, &read_set);
+		if (master_fd >= 0)
+			FD_SET(master_fd, &read_set);
+		if (shm)
+			FD_SET(shm->client_efd, &read_set);
+		if (select(nfds, &read_set, NULL, NULL, NULL) < 0) {
+			if (errno == EINTR)
+				continue; /* Interrupted by signal, retry select
+					   */
+			FAIL(perror_raw(
+				"Error in select from STDIN and socket"));
+		}
+
+		/* The output is copied at the top of the loop */
+		if (shm && FD_ISSET(shm->client_efd, &read_set))
+			shm_wakeup_clear(shm->client_efd);
+
+		if (master_fd >= 0 && FD_ISSET(master_fd, &read_set)) {
+			char out_buf[65536];
+			ssize_t n = read(master_fd, out_buf, sizeof(out_buf));
+
+			/* Linux reports EIO once the program is gone */
+			if (n == 0 || (n < 0 && errno != EINTR))
+				FAIL(ferror_raw("PTY closed"));
+			if (n > 0 &&
+			    write_in_full(STDOUT_FILENO, out_buf, n) < 0)
+				FAIL(perror_raw("Error writing to STDOUT"));
+		} else if (FD_ISSET(sock_fd, &read_set)) {
+			ssize_t n = proto_reader_fill(&reader, sock_fd);
+			if (n < 0)
+				FAIL(perror_raw("Error reading from socket"));
+			else if (n == 0) {
+				/* Show the last words of the program */
+				if (shm)
+					shm_write_output(shm);
+				FAIL(ferror_raw("Socket closed"));
+			}
+			if (write_window_output(sock_fd, &reader) < 0) {
+				ret = -1;
+				goto cleanup;
+			}
+		} else if (FD_ISSET(STDIN_FILENO, &read_set)) {
+			char *start, *end, *p;
+			ssize_t n;
+			char c;
+
+			n = read(STDIN_FILENO, in_buf, sizeof(in_buf));
+			if (n <= 0)
+				FAIL(perror_raw("Error reading from STDIN"));
+
+			/*
+			 * Everything up to a CTRL-A goes to the window as
+			 * a single frame, unless we only watch.
+			 */
+			start = in_buf;
+			end = in_buf + n;
+			while (start < end) {
+				p = memchr(start, CTRL_A, end - start);
+				if (!read_only && (p ? p : end) > start &&
+				    send_input(sock_fd, master_fd, shm, start,
+					       (p ? p : end) - start) < 0)
+					FAIL(perror_raw(
+						"Error sending input to window"));
+				if (!p)
+					break;
+
+				/*
+				 * c is CTRL-A, if the next char is 'd' or
+				 * 'k', we detach or kill the window, '['
+				 * enters copy mode and ']' types what it
+				 * copied. Otherwise we ignore the next
+				 * character.
+				 *
+				 * NEEDSWORK: we should use select here to
+				 * wait for the next character, but for now
+				 * we just read it directly from stdin.
+				 */
+				if (p + 1 < end) {
+					c = p[1];
+					start = p + 2;
+				} else {
+					if (read(STDIN_FILENO, &c, 1) != 1)
+						FAIL(perror_raw(
+							"Error reading char from STDIN after CTRL-A"));
+					start = end;
+				}
+				switch (c) {
+				case DETACH:
+					ret = 0;
+					ferror_raw("Detach from window %s: pid %d",
+						   win->name, win->pid);
+					goto cleanup;
+				case KILL:
+					/* Viewers don't get to end the window */
+					if (read_only)
+						break;
+					kill(win->pid, SIGKILL);
+					ret = -1;
+					ferror_raw("Kill window %s: pid %d",
+						   win->name, win->pid);
+					goto cleanup;
+				case COPY:
+					/*
+					 * The output we hold the pty for
+					 * never reaches the history.
+					 */
+					if (master_fd >= 0) {
+						write_in_full(STDOUT_FILENO,
+							      "\a", 1);
+						break;
+					}
+					if (copy_mode(sock_fd, &reader) < 0) {
+						ret = -1;
+						goto cleanup;
+					}
+					break;
+				case PASTE:
+					if (!read_only && copy_buffer.len &&
+					    send_input(sock_fd, master_fd, shm,
+						       copy_buffer.buf,
+						       copy_buffer.len) < 0)
+						FAIL(perror_raw(
+							"Error sending input to window"));
+					break;
+				default:
+					/* ignore unknown char */
+					break;
+				}
 			}
 		}
 	}
 
 cleanup:
+	if (refused)
+		ret = 0;
+	/* Closing the socket gives the pty master back to the window task */
+	if (master_fd >= 0)
+		close(master_fd);
+	if (shm)
+		shm_channel_release(shm);
+	proto_reader_release(&reader);
 	close(sock_fd);
 	return ret;
 }
@@ -0,0 +1,283 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include "compat_util.h"
+#include "proto.h"
+#include "strbuf.h"
+#include "wrapper.h"
+
+#define PROTO_READ_CHUNK 65536
+
+void proto_reader_init(struct proto_reader *r)
+{
+	r->buf = NULL;
+	r->start = 0;
+	r->len = 0;
+	r->alloc = 0;
+	r->nr_fds = 0;
+}
+
+void proto_reader_release(struct proto_reader *r)
+{
+	free(r->buf);
+	for (int i = 0; i < r->nr_fds; i++)
+		close(r->fds[i]);
+	proto_reader_init(r);
+}
+
+int proto_reader_take_fds(struct proto_reader *r, int *fds, int nr)
+{
+	int taken = r->nr_fds;
+
+	if (taken != nr) {
+		errno = EPROTO;
+		return -1;
+	}
+	memcpy(fds, r->fds, nr * sizeof(int));
+	r->nr_fds = 0;
+	return 0;
+}
+
+/* Keep fds passed with SCM_RIGHTS, close those we have no room for */
+static void reader_collect_fds(struct proto_reader *r, struct msghdr *msg)
+{
+	struct cmsghdr *cmsg;
+
+	for (cmsg = CMSG_FIRSTHDR(msg); cmsg; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+		int *fds = (int *)CMSG_DATA(cmsg);
+		size_t nr;
+
+		if (cmsg->cmsg_level != SOL_SOCKET ||
+		    cmsg->cmsg_type != SCM_RIGHTS)
+			continue;
+		nr = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		for (size_t i = 0; i < nr; i++) {
+			if (r->nr_fds < PROTO_MAX_FDS)
+				r->fds[r->nr_fds++] = fds[i];
+			else
+				close(fds[i]);
+		}
+	}
+}
+
+ssize_t proto_reader_fill(struct proto_reader *r, int fd)
+{
+	union {
+		char buf[CMSG_SPACE(PROTO_MAX_FDS * sizeof(int))];
+		struct cmsghdr align;
+	} cmsg_buf;
+	struct msghdr msg;
+	struct iovec iov;
+	ssize_t n;
+
+	/* Move the partial frame to the front before reading more */
+	if (r->start > 0) {
+		memmove(r->buf, r->buf + r->start, r->len - r->start);
+		r->len -= r->start;
+		r->start = 0;
+	}
+	ALLOC_GROW(r->buf, r->len + PROTO_READ_CHUNK, r->alloc);
+	if (r->buf == NULL)
+		return -1;
+
+	iov.iov_base = r->buf + r->len;
+	iov.iov_len = r->alloc - r->len;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cmsg_buf.buf;
+	msg.msg_controllen = sizeof(cmsg_buf.buf);
+	do {
+		n = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+	} while (n < 0 && errno == EINTR);
+	if (n > 0)
+		r->len += n;
+	if (n >= 0)
+		reader_collect_fds(r, &msg);
+	return n;
+}
+
+int proto_reader_next(struct proto_reader *r, struct proto_frame *f)
+{
+	const char *p = r->buf + r->start;
+	size_t avail = r->len - r->start;
+	uint32_t len;
+
+	if (avail < PROTO_HDR_LEN)
+		return 0;
+	len = proto_get_u32(p + 1);
+	if (len > PROTO_MAX_PAYLOAD) {
+		errno = EPROTO;
+		return -1;
+	}
+	if (avail < PROTO_HDR_LEN + (size_t)len)
+		return 0;
+
+	f->type = (unsigned char)p[0];
+	f->len = len;
+	f->payload = p + PROTO_HDR_LEN;
+	r->start += PROTO_HDR_LEN + len;
+	return 1;
+}
+
+int proto_recv(int fd, struct proto_reader *r, struct proto_frame *f)
+{
+	for (;;) {
+		ssize_t n;
+		int ret = proto_reader_next(r, f);
+
+		if (ret != 0)
+			return ret > 0 ? 0 : -1;
+		n = proto_reader_fill(r, fd);
+		if (n < 0)
+			return -1;
+		if (n == 0) {
+			errno = ECONNRESET;
+			return -1;
+		}
+	}
+}
+
+int proto_send(int fd, int type, const void *payload, size_t len)
+{
+	char hdr[PROTO_HDR_LEN];
+	struct iovec iov[2];
+
+	if (len > PROTO_MAX_PAYLOAD) {
+		errno = EMSGSIZE;
+		return -1;
+	}
+	proto_put_hdr(hdr, type, len);
+	iov[0].iov_base = hdr;
+	iov[0].iov_len = PROTO_HDR_LEN;
+	iov[1].iov_base = (void *)payload;
+	iov[1].iov_len = len;
+
+	/* Header and payload go out with one syscall in the common case */
+	return writev_in_full(fd, iov, 2);
+}
+
+int proto_send_fds(int fd, int type, const void *payload, size_t len,
+		   const int *fds, int nr)
+{
+	union {
+		char buf[CMSG_SPACE(PROTO_MAX_FDS * sizeof(int))];
+		struct cmsghdr align;
+	} cmsg_buf;
+	struct cmsghdr *cmsg;
+	struct msghdr msg;
+	char hdr[PROTO_HDR_LEN];
+	struct iovec iov[2];
+	ssize_t n;
+
+	if (len > PROTO_MAX_PAYLOAD || nr < 1 || nr > PROTO_MAX_FDS) {
+		errno = EINVAL;
+		return -1;
+	}
+	proto_put_hdr(hdr, type, len);
+	iov[0].iov_base = hdr;
+	iov[0].iov_len = PROTO_HDR_LEN;
+	iov[1].iov_base = (void *)payload;
+	iov[1].iov_len = len;
+
+	memset(&msg, 0, sizeof(msg));
+	memset(&cmsg_buf, 0, sizeof(cmsg_buf));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = 2;
+	msg.msg_control = cmsg_buf.buf;
+	msg.msg_controllen = CMSG_SPACE(nr * sizeof(int));
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(nr * sizeof(int));
+	memcpy(CMSG_DATA(cmsg), fds, nr * sizeof(int));
+
+	do {
+		n = sendmsg(fd, &msg, 0);
+	} while (n < 0 && errno == EINTR);
+	if (n < 0)
+		return -1;
+	/* The fds went with the first byte, the rest is a plain write */
+	for (int i = 0; i < 2; i++) {
+		size_t skip = (size_t)n < iov[i].iov_len ? (size_t)n :
+							  iov[i].iov_len;
+
+		iov[i].iov_base = (char *)iov[i].iov_base + skip;
+		iov[i].iov_len -= skip;
+		n -= skip;
+	}
+	return writev_in_full(fd, iov, 2);
+}
+
+void proto_add_frame(struct strbuf *sb, int type, const void *payload,
+		     size_t len)
+{
+	char hdr[PROTO_HDR_LEN];
+
+	proto_put_hdr(hdr, type, len);
+	strbuf_add(sb, hdr, sizeof(hdr));
+	strbuf_add(sb, payload, len);
+}
+
+#define HELLO_LEN 8
+
+static void hello_payload(char *buf, const struct proto_hello *hello)
+{
+	proto_put_u16(buf, PROTO_VERSION);
+	proto_put_u16(buf + 2, hello->flags);
+	proto_put_u16(buf + 4, hello->ws.ws_row);
+	proto_put_u16(buf + 6, hello->ws.ws_col);
+}
+
+int proto_send_hello(int fd, const struct proto_hello *hello)
+{
+	char buf[HELLO_LEN];
+
+	hello_payload(buf, hello);
+	return proto_send(fd, PROTO_HELLO, buf, sizeof(buf));
+}
+
+void proto_add_hello(struct strbuf *sb, const struct proto_hello *hello)
+{
+	char buf[HELLO_LEN];
+
+	hello_payload(buf, hello);
+	proto_add_frame(sb, PROTO_HELLO, buf, sizeof(buf));
+}
+
+int proto_parse_hello(const struct proto_frame *f, struct proto_hello *hello)
+{
+	memset(hello, 0, sizeof(*hello));
+	if (f->type != PROTO_HELLO || f->len < 2)
+		return -1;
+	hello->version = proto_get_u16(f->payload);
+	if (f->len >= 8) {
+		hello->flags = proto_get_u16(f->payload + 2);
+		hello->ws.ws_row = proto_get_u16(f->payload + 4);
+		hello->ws.ws_col = proto_get_u16(f->payload + 6);
+	}
+	return 0;
+}
+
+int proto_send_winch(int fd, const struct winsize *ws)
+{
+	char buf[4];
+
+	proto_put_u16(buf, ws->ws_row);
+	proto_put_u16(buf + 2, ws->ws_col);
+	return proto_send(fd, PROTO_WINCH, buf, sizeof(buf));
+}
+
+int proto_parse_winch(const struct proto_frame *f, struct winsize *ws)
+{
+	if (f->type != PROTO_WINCH || f->len != 4)
+		return -1;
+	memset(ws, 0, sizeof(*ws));
+	ws->ws_row = proto_get_u16(f->payload);
+	ws->ws_col = proto_get_u16(f->payload + 2);
+	return 0;
+}
@@ -0,0 +1,202 @@
+#ifndef PROTO_H
+#define PROTO_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/ioctl.h> /* for struct winsize */
+
+struct strbuf;
+
+/*
+ * Wire protocol between `myscreen` and a window task.
+ *
+ * Every message is a frame: a 1 byte type, a 4 byte payload length in
+ * network byte order, then the payload. The client opens a connection
+ * with a HELLO frame carrying its protocol version, and the window task
+ * answers with its own HELLO before anything else is sent.
+ */
+#define PROTO_VERSION	  1
+#define PROTO_HDR_LEN	  5
+#define PROTO_MAX_PAYLOAD (1 << 20)
+#define PROTO_MAX_FDS	  4 /* passed with a single frame */
+
+enum proto_type {
+	PROTO_HELLO = 'h', /* u16 version, u16 flags, u16 rows, u16 cols */
+	PROTO_DATA = 'd', /* raw terminal bytes, in either direction */
+	PROTO_WINCH = 'w', /* u16 rows, u16 cols */
+	/*
+	 * No payload, the pty master comes along with SCM_RIGHTS. The
+	 * client owns the pty until it closes the connection.
+	 */
+	PROTO_MASTER = 'm',
+	/* No payload, the fds of a struct shm_channel come along */
+	PROTO_SHM = 'M',
+	/*
+	 * With PROTO_HELLO_SYNC the window task sends SYNC instead of DATA:
+	 * u32 state number, then the terminal bytes which bring the screen
+	 * of the previous state to this one. The client answers with ACK,
+	 * u32 state number, once it has shown it.
+	 */
+	PROTO_SYNC = 'y',
+	PROTO_ACK = 'a',
+	/*
+	 * A client which said PROTO_HELLO_CONTROL gets no output. It may
+	 * send DATA and ask for text:
+	 *   SCREEN: u32 lines, 0 for the screen or that many last lines of
+	 *           output, and optionally u32 PROTO_SCREEN_* flags,
+	 *           answered with SCREEN carrying the text
+	 *   WAIT: u32 timeout in ms, 0 for none, then a POSIX extended
+	 *         regex. Answered with WAIT, 'm' and the match once the
+	 *         plain text of the output since the last match, or the
+	 *         handshake, matches; 't' on timeout; 'e' and a message.
+	 *   STATS: no payload, answered with STATS carrying text about
+	 *          the window
+	 *   GREP: u32 lines of context, then a fixed string, looked for in
+	 *         the plain text of the output kept. Answered with GREP
+	 *         frames, 'l' and lines "N:text", "N-text" or "--" as in
+	 *         grep.h, then 'd' once done, 'c' if the results were cut,
+	 *         or 'e' and a message.
+	 */
+	PROTO_SCREEN = 'c',
+	PROTO_WAIT = 'W',
+	PROTO_GREP = 'g',
+	/*
+	 * Any client may page through the output kept, for copy mode:
+	 *   PAGE: u64 line, u32 count, answered with PAGE: u64 first and
+	 *         u64 last line kept, u64 line the text starts at, then
+	 *         the plain text of up to count lines. A page past either
+	 *         end is moved back in. Lines count from the first output.
+	 *   REDRAW: no payload, the screen is repainted, or updated from
+	 *           scratch with PROTO_HELLO_SYNC
+	 */
+	PROTO_PAGE = 'p',
+	PROTO_REDRAW = 'r',
+	/*
+	 * Between `myscreen` and a myscreen server:
+	 *   SPAWN: u16 rows, u16 cols, u16 termios size, struct termios,
+	 *          then argv as NUL terminated strings
+	 *   SPAWNED: u32 pid, socket path and pty device, NUL terminated
+	 *   STATS: no payload, answered with STATS carrying text
+	 */
+	PROTO_SPAWN = 's',
+	PROTO_SPAWNED = 'S',
+	PROTO_STATS = 't',
+	PROTO_ERROR = 'e', /* a message for the user */
+};
+
+struct proto_frame {
+	int type;
+	uint32_t len;
+	const char *payload; /* points into the reader, valid until refill */
+};
+
+/* Buffers a byte stream and splits it into frames */
+struct proto_reader {
+	char *buf;
+	size_t start; /* first unconsumed byte */
+	size_t len; /* end of valid data */
+	size_t alloc;
+	int fds[PROTO_MAX_FDS]; /* fds received with SCM_RIGHTS */
+	int nr_fds;
+};
+
+void proto_reader_init(struct proto_reader *r);
+void proto_reader_release(struct proto_reader *r);
+/*
+ * Do a single recvmsg() from the socket fd, return what it returned.
+ * File descriptors passed along are kept until proto_reader_take_fds().
+ */
+ssize_t proto_reader_fill(struct proto_reader *r, int fd);
+/*
+ * Move the nr passed file descriptors to fds. Return -1 if a different
+ * number of them was passed.
+ */
+int proto_reader_take_fds(struct proto_reader *r, int *fds, int nr);
+/* Return 1 and fill f if a whole frame is buffered, 0 if more data is
+ * needed, -1 if the stream is malformed */
+int proto_reader_next(struct proto_reader *r, struct proto_frame *f);
+/* Block until a whole frame arrives, return -1 on error or EOF */
+int proto_recv(int fd, struct proto_reader *r, struct proto_frame *f);
+
+int proto_send(int fd, int type, const void *payload, size_t len);
+/* Append the frame to sb instead, for sending along with others */
+void proto_add_frame(struct strbuf *sb, int type, const void *payload,
+		     size_t len);
+/* Same, and pass nr fds to the other end of the socket fd */
+int proto_send_fds(int fd, int type, const void *payload, size_t len,
+		   const int *fds, int nr);
+
+/* HELLO flags */
+#define PROTO_HELLO_WINSIZE	 0x1 /* rows and cols carry the client's size */
+#define PROTO_HELLO_DIRECT	 0x2 /* the client asks for the pty master */
+#define PROTO_HELLO_SHM		 0x4 /* offer or accept the transport in shm.h */
+#define PROTO_HELLO_READONLY	 0x8 /* the client only watches */
+#define PROTO_HELLO_DISCONNECT	0x10 /* drop, don't resync, if we lag behind */
+#define PROTO_HELLO_SYNC		0x20 /* screen updates rather than output */
+#define PROTO_HELLO_CONTROL	0x40 /* a script, see PROTO_SCREEN */
+
+/* SCREEN flags */
+#define PROTO_SCREEN_ATTRS 0x1 /* keep colors and attributes as SGR */
+
+struct proto_hello {
+	int version;
+	unsigned flags;
+	struct winsize ws;
+};
+
+int proto_send_hello(int fd, const struct proto_hello *hello);
+void proto_add_hello(struct strbuf *sb, const struct proto_hello *hello);
+/*
+ * Parse a HELLO frame, return -1 if malformed. Only the version is
+ * guaranteed to be understood, so check it before anything else.
+ */
+int proto_parse_hello(const struct proto_frame *f, struct proto_hello *hello);
+int proto_send_winch(int fd, const struct winsize *ws);
+int proto_parse_winch(const struct proto_frame *f, struct winsize *ws);
+
+static inline void proto_put_u16(char *p, uint16_t v)
+{
+	p[0] = (char)(v >> 8);
+	p[1] = (char)v;
+}
+
+static inline uint16_t proto_get_u16(const char *p)
+{
+	return (uint16_t)((unsigned char)p[0] << 8 | (unsigned char)p[1]);
+}
+
+static inline void proto_put_u32(char *p, uint32_t v)
+{
+	p[0] = (char)(v >> 24);
+	p[1] = (char)(v >> 16);
+	p[2] = (char)(v >> 8);
+	p[3] = (char)v;
+}
+
+static inline uint32_t proto_get_u32(const char *p)
+{
+	return (uint32_t)(unsigned char)p[0] << 24 |
+	       (uint32_t)(unsigned char)p[1] << 16 |
+	       (uint32_t)(unsigned char)p[2] << 8 | (unsigned char)p[3];
+}
+
+static inline void proto_put_u64(char *p, uint64_t v)
+{
+	proto_put_u32(p, (uint32_t)(v >> 32));
+	proto_put_u32(p + 4, (uint32_t)v);
+}
+
+static inline uint64_t proto_get_u64(const char *p)
+{
+	return (uint64_t)proto_get_u32(p) << 32 | proto_get_u32(p + 4);
+}
+
+/* Fill in the PROTO_HDR_LEN bytes which start a frame */
+static inline void proto_put_hdr(char *hdr, int type, uint32_t len)
+{
+	hdr[0] = (char)type;
+	proto_put_u32(hdr + 1, len);
+}
+
+#endif
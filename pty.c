@@ -5,12 +5,26 @@
 #include <stdarg.h>
 #include <assert.h>
 #include <fcntl.h>
+#include <signal.h>
 #include <sys/errno.h>
+#include <string.h>
+#include <stdint.h>
 #include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
 #include "compat_util.h"
+#include "error_raw.h"
+#include "strbuf.h"
+#include "wrapper.h"
 #include "pty.h"
 
-struct pty_info *pty_info_xalloc()
+#define PTY_MAX_FDS 65536 /* closed one by one without close_range() */
+#define PTY_MAX_CMD (16 << 20)
+
+struct pty_info *pty_info_alloc()
 {
 	struct pty_info *info;
 	int master_fd;
@@ -19,69 +33,77 @@ struct pty_info *pty_info_xalloc()
 	master_fd = posix_openpt(O_RDWR | O_NOCTTY);
 	if (master_fd == -1) {
 		perror("Error opening master PTY");
-		exit(EXIT_FAILURE);
+		return NULL;
 	}
+	/* Don't leak the master into programs of other windows */
+	fcntl(master_fd, F_SETFD, FD_CLOEXEC);
 
 	if (grantpt(master_fd) == -1) {
 		perror("Error granting PTY access");
-		exit(EXIT_FAILURE);
+		goto fail;
 	}
 
 	if (unlockpt(master_fd) == -1) {
 		perror("Error unlocking PTY");
-		exit(EXIT_FAILURE);
+		goto fail;
 	}
 
 	slave_name = ptsname(master_fd);
 	if (slave_name == NULL) {
 		perror("Error getting slave PTY name");
-		exit(EXIT_FAILURE);
+		goto fail;
 	}
 
 	FLEX_ALLOC_STR(info, slave_name, slave_name);
 	if (info == NULL) {
 		perror("Error allocating memory for PTY info");
-		exit(EXIT_FAILURE);
+		goto fail;
 	}
 	info->master_fd = master_fd;
 	return info;
+
+fail:
+	close(master_fd);
+	return NULL;
+}
+
+struct pty_info *pty_info_xalloc()
+{
+	struct pty_info *info = pty_info_alloc();
+
+	if (info == NULL)
+		exit(EXIT_FAILURE);
+	return info;
 }
 
 void pty_info_free(struct pty_info *info)
 {
 	if (info == NULL)
 		return;
-	close(info->master_fd);
+	if (info->master_fd >= 0)
+		close(info->master_fd);
 	free(info);
 }
 
 pid_t pty_xexec(struct pty_info *info, struct termios *termios,
 		struct winsize *ws, char **argv)
 {
-	pid_t pid;
-	int slave_fd;
-
-	pid = fork();
-	if (pid == -1) {
-		perror("Error forking process");
-		exit(EXIT_FAILURE);
-	}
+	pid_t pid = pty_exec(info, termios, ws, argv);
 
-	if (pid > 0)
-		return pid; /* Parent process returns child's PID */
-
-	/* Child process */
-	if (setsid() == -1) {
-		perror("Error creating new session");
+	if (pid == -1)
 		exit(EXIT_FAILURE);
-	}
+	return pid;
+}
 
-	slave_fd = open(info->slave_name, O_RDWR);
-	if (slave_fd == -1) {
-		fprintf(stderr, "Error opening slave PTY '%s': %s\n",
-			info->slave_name, strerror(errno));
-		exit(EXIT_FAILURE);
-	}
+/*
+ * Set up the slave we opened as the controlling terminal and run argv.
+ * If exec fails, its errno goes to status_fd unless that is -1.
+ */
+static NORETURN void child_exec(struct pty_info *info, int slave_fd,
+				struct termios *termios, struct winsize *ws,
+				char **argv, int status_fd)
+{
+	int err;
 
 	assert(termios != NULL);
 	assert(ws != NULL);
@@ -121,18 +143,208 @@ pid_t pty_xexec(struct pty_info *info, struct termios *termios,
 
 	/* Execute the command */
 	if (!argv || !*argv) {
-		execlp("bash", NULL);
+		execlp("bash", "bash", (char *)NULL);
+		err = errno;
+		if (status_fd >= 0)
+			write_in_full(status_fd, &err, sizeof(err));
 		perror("Error executing bash");
 		exit(EXIT_FAILURE);
 	}
 
 	execvp(*argv, argv);
+	err = errno;
+	if (status_fd >= 0)
+		write_in_full(status_fd, &err, sizeof(err));
 
 	fprintf(stderr, "Error executing command '%s", *argv++);
 	while (*argv) {
 		fprintf(stderr, " %s", *argv);
 		argv++;
 	}
-	fprintf(stderr, "': %s\n", strerror(errno));
+	fprintf(stderr, "': %s\n", strerror(err));
 	exit(EXIT_FAILURE);
 }
+
+/* In the child, start a new session with the slave as its terminal */
+static int child_open_slave(struct pty_info *info)
+{
+	int slave_fd;
+
+	/* Undo what the window task ignores */
+	signal(SIGPIPE, SIG_DFL);
+	signal(SIGCHLD, SIG_DFL);
+	if (setsid() == -1) {
+		perror("Error creating new session");
+		exit(EXIT_FAILURE);
+	}
+
+	slave_fd = open(info->slave_name, O_RDWR);
+	if (slave_fd == -1) {
+		fprintf(stderr, "Error opening slave PTY '%s': %s\n",
+			info->slave_name, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	return slave_fd;
+}
+
+pid_t pty_exec(struct pty_info *info, struct termios *termios,
+	       struct winsize *ws, char **argv)
+{
+	int status[2], err;
+	pid_t pid;
+
+	/* Closed on exec, or the child tells why exec failed */
+	if (pipe(status) == -1) {
+		perror("Error creating exec status pipe");
+		return -1;
+	}
+	fcntl(status[0], F_SETFD, FD_CLOEXEC);
+	fcntl(status[1], F_SETFD, FD_CLOEXEC);
+
+	pid = fork();
+	if (pid == -1) {
+		perror("Error forking process");
+		close(status[0]);
+		close(status[1]);
+		return -1;
+	}
+
+	if (pid == 0) {
+		close(status[0]);
+		child_exec(info, child_open_slave(info), termios, ws, argv,
+			   status[1]);
+	}
+	close(status[1]);
+	if (read_in_full(status[0], &err, sizeof(err)) != sizeof(err)) {
+		close(status[0]);
+		return pid; /* Parent process returns child's PID */
+	}
+	close(status[0]);
+	waitpid(pid, NULL, 0);
+	fprintf(stderr, "Error executing command '%s': %s\n",
+		argv && *argv ? *argv : "bash", strerror(err));
+	errno = err;
+	return -1;
+}
+
+/*
+ * A waiting child holds on to nothing of its parent but the two fds, or
+ * a child waiting for another window's command would keep that
+ * window's pipe open.
+ */
+#if defined(__linux__) && defined(SYS_close_range)
+/* close_range() takes an empty range for EINVAL, so skip those */
+static int close_fd_range(unsigned first, unsigned last)
+{
+	return first > last ? 0 : syscall(SYS_close_range, first, last, 0);
+}
+#endif
+
+static void close_fds_but(int a, int b)
+{
+	int lo = a < b ? a : b, hi = a < b ? b : a;
+	long max;
+
+#if defined(__linux__) && defined(SYS_close_range)
+	if (close_fd_range(3, lo - 1) == 0 &&
+	    close_fd_range(lo + 1, hi - 1) == 0 &&
+	    close_fd_range(hi + 1, ~0U) == 0)
+		return;
+#endif
+	max = sysconf(_SC_OPEN_MAX);
+	if (max < 0 || max > PTY_MAX_FDS)
+		max = PTY_MAX_FDS;
+	for (int fd = 3; fd < max; fd++)
+		if (fd != a && fd != b)
+			close(fd);
+}
+
+/* Read what a prepared child runs, which ends with the pipe */
+static NORETURN void prepared_child(struct pty_info *info, int slave_fd,
+				    int cmd_fd)
+{
+	struct termios termios;
+	struct winsize ws;
+	char hdr[4], *buf, *p, *end, **argv;
+	uint32_t len;
+	size_t nr = 0;
+
+	close_fds_but(slave_fd, cmd_fd);
+	if (read_in_full(cmd_fd, hdr, sizeof(hdr)) != sizeof(hdr))
+		_exit(EXIT_FAILURE); /* the pool went away */
+	memcpy(&len, hdr, sizeof(len));
+	if (len < sizeof(termios) + sizeof(ws) || len > PTY_MAX_CMD)
+		_exit(EXIT_FAILURE);
+	/*
+	 * mmap() rather than malloc(), we may be forked from threads. At
+	 * most one string per byte, the array goes after them.
+	 */
+	buf = mmap(NULL, len + (len + 2) * sizeof(char *),
+		   PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (buf == MAP_FAILED || read_in_full(cmd_fd, buf, len) != len)
+		_exit(EXIT_FAILURE);
+	close(cmd_fd);
+
+	memcpy(&termios, buf, sizeof(termios));
+	memcpy(&ws, buf + sizeof(termios), sizeof(ws));
+	p = buf + sizeof(termios) + sizeof(ws);
+	end = buf + len;
+	if (p < end && end[-1] != '\0')
+		_exit(EXIT_FAILURE);
+	argv = (char **)(buf + len + (sizeof(char *) - len % sizeof(char *)));
+	for (; p < end; p += strlen(p) + 1)
+		argv[nr++] = p;
+	argv[nr] = NULL;
+	child_exec(info, slave_fd, &termios, &ws, argv, -1);
+}
+
+pid_t pty_prefork(struct pty_info *info, int *cmd_fd)
+{
+	int fds[2];
+	pid_t pid;
+
+	if (pipe(fds) == -1) {
+		perror("Error creating command pipe");
+		return -1;
+	}
+	fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+	fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+
+	pid = fork();
+	if (pid == -1) {
+		perror("Error forking process");
+		close(fds[0]);
+		close(fds[1]);
+		return -1;
+	}
+	if (pid == 0) {
+		int slave_fd = child_open_slave(info);
+
+		prepared_child(info, slave_fd, fds[0]);
+	}
+	close(fds[0]);
+	*cmd_fd = fds[1];
+	return pid;
+}
+
+int pty_exec_prepared(int cmd_fd, struct termios *termios,
+		      struct winsize *ws, char **argv)
+{
+	struct strbuf req = STRBUF_INIT;
+	uint32_t len;
+	int ret;
+
+	strbuf_add(&req, "\0\0\0\0", 4);
+	strbuf_add(&req, termios, sizeof(*termios));
+	strbuf_add(&req, ws, sizeof(*ws));
+	for (; argv && *argv; argv++)
+		strbuf_add(&req, *argv, strlen(*argv) + 1);
+	len = req.len - 4;
+	memcpy(req.buf, &len, sizeof(len));
+	ret = 0;
+	if (len > PTY_MAX_CMD || write_in_full(cmd_fd, req.buf, req.len) < 0)
+		ret = -1;
+	close(cmd_fd);
+	strbuf_release(&req);
+	return ret;
+}
@@ -12,9 +12,25 @@ struct pty_info {
 	char slave_name[FLEX_ARRAY];
 };
 
+/* The x-variants exit on failure, the others return NULL or -1 */
+struct pty_info *pty_info_alloc();
 struct pty_info *pty_info_xalloc();
+/* Also closes master_fd, set it to -1 to keep it open */
 void pty_info_free(struct pty_info *info);
+/* Run argv on the slave, returns once it was exec'd or failed to be */
+pid_t pty_exec(struct pty_info *info, struct termios *termios,
+	       struct winsize *ws, char **argv);
 pid_t pty_xexec(struct pty_info *info, struct termios *termios,
 		struct winsize *ws, char **argv);
 
+/*
+ * Fork a child which takes the slave as its terminal and then waits
+ * for what to run, sent by pty_exec_prepared() to *cmd_fd. Return the
+ * pid, which is the program's once it runs.
+ */
+pid_t pty_prefork(struct pty_info *info, int *cmd_fd);
+/* Tell a child of pty_prefork() what to run. Closes cmd_fd. */
+int pty_exec_prepared(int cmd_fd, struct termios *termios,
+		      struct winsize *ws, char **argv);
+
 #endif
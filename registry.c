@@ -0,0 +1,891 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "compat_util.h"
+#include "error_raw.h"
+#include "strbuf.h"
+#include "wrapper.h"
+#include "window.h"
+#include "registry.h"
+
+#define REGISTRY_MAGIC	 "MYSCRREG"
+#define REGISTRY_VERSION 1
+#define MIN_BUCKETS	 16
+
+#define JOURNAL_MAGIC  0x6d736a31 /* "msj1" */
+#define JOURNAL_SUFFIX ".journal"
+/* Fold the journal into the base once it is this long */
+#define JOURNAL_MAX (64 * 1024)
+
+#define FNV_OFFSET 2166136261u
+
+/*
+ * On disk, in host byte order as the registry never leaves the machine:
+ * the header, nr slots, nr_buckets bucket heads, then the strings.
+ */
+struct registry_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t nr;
+	uint32_t nr_buckets; /* a power of 2 */
+	uint32_t strings_len;
+};
+
+struct registry_slot {
+	uint32_t name; /* offsets into the strings */
+	uint32_t device;
+	uint32_t socket;
+	uint32_t hash; /* of the name */
+	int32_t pid;
+	uint32_t next; /* next slot + 1 in the same bucket, 0 ends */
+};
+
+/*
+ * A journal record, followed by the name, device and socket for an add
+ * or just the name for a remove, each NUL terminated. Records are not
+ * aligned, a torn one leaves the next at any offset.
+ */
+struct journal_record {
+	uint32_t magic;
+	uint32_t len; /* of the whole record */
+	uint32_t sum; /* FNV-1a of the rest of the record */
+	uint32_t op;
+	int32_t pid;
+};
+
+#define JOURNAL_SUM_FROM offsetof(struct journal_record, op)
+
+enum { JOURNAL_ADD = 'a', JOURNAL_REMOVE = 'r' };
+
+/* A record replayed from the journal, the strings point into it */
+struct registry_op {
+	struct registry_entry e;
+	uint32_t hash;
+	int add;
+	uint32_t live; /* index in reg->live, if it is there */
+};
+
+/* What a compaction builds before it replaces the base */
+struct registry_builder {
+	struct strbuf slots;
+	struct strbuf strings;
+	uint32_t nr;
+};
+
+/* 32 bit FNV-1a */
+static uint32_t fnv1a(uint32_t h, const void *buf, size_t len)
+{
+	const unsigned char *p = buf;
+
+	while (len--)
+		h = (h ^ *p++) * 16777619u;
+	return h;
+}
+
+static uint32_t name_hash(const char *name)
+{
+	return fnv1a(FNV_OFFSET, name, strlen(name));
+}
+
+static void registry_unmap(struct registry *reg)
+{
+	if (reg->map)
+		munmap(reg->map, reg->map_len);
+	reg->map = NULL;
+	reg->map_len = 0;
+	reg->hdr = NULL;
+	reg->slots = NULL;
+	reg->buckets = NULL;
+	reg->strings = NULL;
+	reg->nr_slots = 0;
+}
+
+static void registry_unload(struct registry *reg)
+{
+	registry_unmap(reg);
+	strbuf_release(&reg->journal);
+	free(reg->ops);
+	free(reg->op_index);
+	free(reg->hidden);
+	free(reg->live);
+	reg->ops = NULL;
+	reg->nr_ops = reg->alloc_ops = 0;
+	reg->op_index = NULL;
+	reg->op_index_size = 0;
+	reg->hidden = NULL;
+	reg->nr_hidden = 0;
+	reg->live = NULL;
+	reg->nr_live = 0;
+	reg->nr = 0;
+}
+
+/*
+ * Map the base, return -1 if it isn't a registry. Only the layout is
+ * checked here, slots are checked as they are used, so opening costs
+ * the same for any number of windows.
+ */
+static int registry_map(struct registry *reg)
+{
+	const struct registry_header *hdr;
+	struct stat st;
+	uint64_t len;
+	int fd;
+
+	registry_unmap(reg);
+	fd = open(reg->path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return errno == ENOENT ? 0 : -1;
+	if (fstat(fd, &st) < 0) {
+		close(fd);
+		return -1;
+	}
+	if (st.st_size == 0) {
+		close(fd);
+		return 0;
+	}
+	reg->map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (reg->map == MAP_FAILED) {
+		reg->map = NULL;
+		return -1;
+	}
+	reg->map_len = st.st_size;
+
+	hdr = reg->map;
+	if (reg->map_len < sizeof(*hdr) ||
+	    memcmp(hdr->magic, REGISTRY_MAGIC, sizeof(hdr->magic)) ||
+	    hdr->version != REGISTRY_VERSION)
+		goto corrupt;
+	len = sizeof(*hdr) + (uint64_t)hdr->nr * sizeof(struct registry_slot) +
+	      (uint64_t)hdr->nr_buckets * sizeof(uint32_t) + hdr->strings_len;
+	if (len != reg->map_len || hdr->nr_buckets == 0 ||
+	    (hdr->nr_buckets & (hdr->nr_buckets - 1)) ||
+	    hdr->strings_len == 0)
+		goto corrupt;
+	reg->hdr = hdr;
+	reg->slots = (const struct registry_slot *)(hdr + 1);
+	reg->buckets = (const uint32_t *)(reg->slots + hdr->nr);
+	reg->strings = (const char *)(reg->buckets + hdr->nr_buckets);
+	/* Any offset into the strings is then a terminated string */
+	if (reg->strings[hdr->strings_len - 1] != '\0')
+		goto corrupt;
+	reg->nr_slots = hdr->nr;
+	return 0;
+
+corrupt:
+	registry_unmap(reg);
+	errno = EINVAL;
+	return -1;
+}
+
+/* Return -1 if the slot points outside the mapping */
+static int slot_entry(const struct registry *reg,
+		      const struct registry_slot *slot,
+		      struct registry_entry *e)
+{
+	uint32_t len = reg->hdr->strings_len;
+
+	if (slot->name >= len || slot->device >= len || slot->socket >= len ||
+	    slot->next > reg->nr_slots) {
+		ferror_raw("Registry %s is corrupt", reg->path);
+		return -1;
+	}
+	e->name = reg->strings + slot->name;
+	e->device = reg->strings + slot->device;
+	e->socket = reg->strings + slot->socket;
+	e->pid = slot->pid;
+	return 0;
+}
+
+/* Find the slot called name, return it, -1 if none or -2 if corrupt */
+static int slot_find(const struct registry *reg, const char *name,
+		     uint32_t hash, struct registry_entry *e)
+{
+	uint32_t i;
+
+	if (reg->nr_slots == 0)
+		return -1;
+	i = reg->buckets[hash & (reg->hdr->nr_buckets - 1)];
+	/* A corrupt chain can't make us loop for ever */
+	for (uint32_t n = 0; i > 0 && i <= reg->nr_slots && n < reg->nr_slots;
+	     n++) {
+		const struct registry_slot *slot = &reg->slots[i - 1];
+
+		if (slot_entry(reg, slot, e) < 0)
+			return -2;
+		if (slot->hash == hash && !strcmp(e->name, name))
+			return i - 1;
+		i = slot->next;
+	}
+	return -1;
+}
+
+/*
+ * Parse the record at p, return its length or 0 if there is none. The
+ * strings of op point into p.
+ */
+static size_t journal_parse(const char *p, size_t avail,
+			    struct registry_op *op)
+{
+	struct journal_record rec;
+	const char *s, *end;
+	int nr_strings = 0;
+
+	if (avail < sizeof(rec))
+		return 0;
+	memcpy(&rec, p, sizeof(rec));
+	if (rec.magic != JOURNAL_MAGIC || rec.len <= sizeof(rec) ||
+	    rec.len > avail ||
+	    rec.sum != fnv1a(FNV_OFFSET, p + JOURNAL_SUM_FROM,
+			     rec.len - JOURNAL_SUM_FROM))
+		return 0;
+	s = p + sizeof(rec);
+	end = p + rec.len;
+	if (end[-1] != '\0')
+		return 0;
+	for (const char *q = s; q < end; q++)
+		nr_strings += *q == '\0';
+
+	memset(op, 0, sizeof(*op));
+	op->e.name = s;
+	op->e.pid = rec.pid;
+	if (rec.op == JOURNAL_ADD && nr_strings == 3) {
+		op->add = 1;
+		op->e.device = s + strlen(s) + 1;
+		op->e.socket = op->e.device + strlen(op->e.device) + 1;
+	} else if (rec.op != JOURNAL_REMOVE || nr_strings != 1) {
+		return 0;
+	}
+	op->hash = name_hash(op->e.name);
+	return rec.len;
+}
+
+/* Return the bucket of op_index for name, which may be empty */
+static uint32_t *op_bucket(const struct registry *reg, const char *name,
+			   uint32_t hash)
+{
+	size_t mask = reg->op_index_size - 1;
+	uint32_t *b;
+
+	for (size_t i = hash & mask;; i = (i + 1) & mask) {
+		b = &reg->op_index[i];
+		if (*b == 0 || (reg->ops[*b - 1].hash == hash &&
+				!strcmp(reg->ops[*b - 1].e.name, name)))
+			return b;
+	}
+}
+
+static int cmp_slot(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/*
+ * Replay the journal over the base: the latest record for a name wins
+ * and hides the slot of that name.
+ */
+static int journal_replay(struct registry *reg)
+{
+	struct registry_entry e;
+	size_t pos = 0, len;
+
+	while (pos < reg->journal.len) {
+		ALLOC_GROW(reg->ops, reg->nr_ops + 1, reg->alloc_ops);
+		if (reg->ops == NULL)
+			ferror_raw_die("Error allocating memory for registry");
+		len = journal_parse(reg->journal.buf + pos,
+				    reg->journal.len - pos,
+				    &reg->ops[reg->nr_ops]);
+		if (len == 0) {
+			/* Torn by a crash, look for the next record */
+			pos++;
+			continue;
+		}
+		reg->nr_ops++;
+		pos += len;
+	}
+	if (reg->nr_ops == 0)
+		return 0;
+
+	reg->op_index_size = 16;
+	while (reg->op_index_size < 2 * reg->nr_ops)
+		reg->op_index_size *= 2;
+	CALLOC_ARRAY(reg->op_index, reg->op_index_size);
+	ALLOC_ARRAY(reg->hidden, reg->nr_ops);
+	ALLOC_ARRAY(reg->live, reg->nr_ops);
+	if (reg->op_index == NULL || reg->hidden == NULL || reg->live == NULL)
+		ferror_raw_die("Error allocating memory for registry");
+	for (size_t i = 0; i < reg->nr_ops; i++) {
+		struct registry_op *op = &reg->ops[i];
+		uint32_t *b = op_bucket(reg, op->e.name, op->hash);
+		int slot;
+
+		if (*b == 0) {
+			slot = slot_find(reg, op->e.name, op->hash, &e);
+			if (slot < -1)
+				return -1;
+			if (slot >= 0)
+				reg->hidden[reg->nr_hidden++] = slot;
+		}
+		*b = i + 1;
+	}
+	for (size_t i = 0; i < reg->nr_ops; i++) {
+		struct registry_op *op = &reg->ops[i];
+
+		if (op->add && *op_bucket(reg, op->e.name, op->hash) == i + 1) {
+			op->live = reg->nr_live;
+			reg->live[reg->nr_live++] = i;
+		}
+	}
+	qsort(reg->hidden, reg->nr_hidden, sizeof(*reg->hidden), cmp_slot);
+	return 0;
+}
+
+/*
+ * Read the base and replay the journal, which we hold locked as fd if
+ * it exists. Return -1 if either is unreadable.
+ */
+static int registry_load(struct registry *reg, int fd)
+{
+	struct stat st;
+	ssize_t n;
+
+	registry_unload(reg);
+	if (registry_map(reg) < 0)
+		return -1;
+	if (fd >= 0) {
+		if (fstat(fd, &st) < 0)
+			return -1;
+		strbuf_grow(&reg->journal, st.st_size);
+		n = pread(fd, reg->journal.buf, st.st_size, 0);
+		if (n != st.st_size) {
+			if (n >= 0)
+				errno = EIO;
+			return -1;
+		}
+		reg->journal.len = st.st_size;
+		reg->journal.buf[st.st_size] = '\0';
+		if (journal_replay(reg) < 0) {
+			errno = EINVAL;
+			return -1;
+		}
+	}
+	reg->nr = reg->nr_slots - reg->nr_hidden + reg->nr_live;
+	return 0;
+}
+
+static int xflock(int fd, int op)
+{
+	int ret;
+
+	while ((ret = flock(fd, op)) < 0 && errno == EINTR)
+		;
+	return ret;
+}
+
+struct registry *registry_xopen(const char *path)
+{
+	struct registry *reg;
+	struct strbuf journal = STRBUF_INIT;
+	int fd;
+
+	reg = calloc(1, sizeof(*reg));
+	if (reg == NULL)
+		ferror_raw_die("Error allocating memory for registry");
+	reg->path = strdup(path);
+	if (reg->path == NULL)
+		ferror_raw_die("Error allocating memory for registry");
+	strbuf_addf(&journal, "%s%s", path, JOURNAL_SUFFIX);
+	reg->journal_path = journal.buf;
+
+	/* No journal yet means nobody has updated the registry */
+	fd = open(reg->journal_path, O_RDONLY | O_CLOEXEC);
+	if ((fd < 0 && errno != ENOENT) ||
+	    (fd >= 0 && xflock(fd, LOCK_SH) < 0) || registry_load(reg, fd) < 0)
+		ferror_raw_die("Error reading registry %s: %s", path,
+			       strerror(errno));
+	if (fd >= 0)
+		close(fd);
+	else
+		reg->is_new = reg->map == NULL;
+	return reg;
+}
+
+void registry_close(struct registry *reg)
+{
+	if (reg == NULL)
+		return;
+	registry_unload(reg);
+	free(reg->path);
+	free(reg->journal_path);
+	free(reg);
+}
+
+/* The number of hidden slots before the idx'th visible one */
+static size_t hidden_before(const struct registry *reg, size_t idx)
+{
+	size_t lo = 0, hi = reg->nr_hidden;
+
+	/* hidden[j] - j visible slots come before hidden[j] */
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+
+		if (reg->hidden[mid] - mid <= idx)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/* The number of hidden slots before the slot */
+static size_t hidden_below(const struct registry *reg, uint32_t slot)
+{
+	size_t lo = 0, hi = reg->nr_hidden;
+
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+
+		if (reg->hidden[mid] < slot)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+int registry_get(const struct registry *reg, size_t idx,
+		 struct registry_entry *e)
+{
+	size_t visible = reg->nr_slots - reg->nr_hidden;
+
+	if (idx < visible)
+		return slot_entry(reg,
+				  &reg->slots[idx + hidden_before(reg, idx)], e);
+	idx -= visible;
+	if (idx >= reg->nr_live)
+		return -1;
+	*e = reg->ops[reg->live[idx]].e;
+	return 0;
+}
+
+int registry_find(const struct registry *reg, const char *name,
+		  struct registry_entry *e)
+{
+	uint32_t hash = name_hash(name);
+	int slot;
+
+	if (reg->nr_ops) {
+		uint32_t i = *op_bucket(reg, name, hash);
+
+		if (i > 0) {
+			const struct registry_op *op = &reg->ops[i - 1];
+
+			if (!op->add)
+				return -1;
+			*e = op->e;
+			return reg->nr_slots - reg->nr_hidden + op->live;
+		}
+	}
+	slot = slot_find(reg, name, hash, e);
+	if (slot < 0)
+		return -1;
+	return slot - hidden_below(reg, slot);
+}
+
+/* Open and lock the journal for an update, then read the registry */
+static int registry_lock(struct registry *reg)
+{
+	int fd;
+
+	fd = open(reg->journal_path, O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC,
+		  0644);
+	if (fd < 0) {
+		perror_raw("Error opening registry journal");
+		return -1;
+	}
+	if (xflock(fd, LOCK_EX) < 0) {
+		perror_raw("Error locking registry journal");
+		close(fd);
+		return -1;
+	}
+	if (registry_load(reg, fd) < 0) {
+		ferror_raw("Error reading registry %s: %s", reg->path,
+			   strerror(errno));
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+static uint32_t builder_string(struct registry_builder *b, const char *s)
+{
+	uint32_t off = b->strings.len;
+
+	strbuf_add(&b->strings, s, strlen(s) + 1);
+	return off;
+}
+
+static void builder_add(struct registry_builder *b,
+			const struct registry_entry *e)
+{
+	struct registry_slot slot = { 0 };
+
+	slot.name = builder_string(b, e->name);
+	slot.device = builder_string(b, e->device);
+	slot.socket = builder_string(b, e->socket);
+	slot.hash = name_hash(e->name);
+	slot.pid = e->pid;
+	strbuf_add(&b->slots, &slot, sizeof(slot));
+	b->nr++;
+}
+
+/* Start from the current windows */
+static int builder_init(struct registry_builder *b,
+			const struct registry *reg)
+{
+	struct registry_entry e;
+
+	memset(b, 0, sizeof(*b));
+	for (size_t i = 0; i < reg->nr; i++) {
+		if (registry_get(reg, i, &e) < 0)
+			return -1;
+		builder_add(b, &e);
+	}
+	return 0;
+}
+
+static void builder_release(struct registry_builder *b)
+{
+	strbuf_release(&b->slots);
+	strbuf_release(&b->strings);
+}
+
+/*
+ * Write the new base next to the old one, rename it over it and empty
+ * the journal, which we hold locked as fd.
+ */
+static int registry_commit(struct registry *reg, struct registry_builder *b,
+			   int fd)
+{
+	struct registry_header hdr = { 0 };
+	struct registry_slot *slots = (struct registry_slot *)b->slots.buf;
+	uint32_t *buckets;
+	struct strbuf tmp = STRBUF_INIT;
+	struct iovec iov[4];
+	int tmp_fd, ret = -1;
+
+	memcpy(hdr.magic, REGISTRY_MAGIC, sizeof(hdr.magic));
+	hdr.version = REGISTRY_VERSION;
+	hdr.nr = b->nr;
+	hdr.nr_buckets = MIN_BUCKETS;
+	while (hdr.nr_buckets < 2 * b->nr)
+		hdr.nr_buckets *= 2;
+	/* Keep the string table non-empty, see registry_map() */
+	if (b->strings.len == 0)
+		strbuf_addch(&b->strings, '\0');
+	hdr.strings_len = b->strings.len;
+
+	buckets = calloc(hdr.nr_buckets, sizeof(*buckets));
+	if (buckets == NULL) {
+		ferror_raw("Error allocating memory for registry index");
+		return -1;
+	}
+	/* Backwards, so a chain lists its slots in registry order */
+	for (uint32_t i = b->nr; i-- > 0;) {
+		uint32_t *head = &buckets[slots[i].hash & (hdr.nr_buckets - 1)];
+
+		slots[i].next = *head;
+		*head = i + 1;
+	}
+
+	strbuf_addf(&tmp, "%s.tmp.%d", reg->path, (int)getpid());
+	tmp_fd = open(tmp.buf, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (tmp_fd < 0) {
+		perror_raw("Error creating registry");
+		goto cleanup;
+	}
+	iov[0].iov_base = &hdr;
+	iov[0].iov_len = sizeof(hdr);
+	iov[1].iov_base = slots;
+	iov[1].iov_len = b->slots.len;
+	iov[2].iov_base = buckets;
+	iov[2].iov_len = hdr.nr_buckets * sizeof(*buckets);
+	iov[3].iov_base = b->strings.buf;
+	iov[3].iov_len = b->strings.len;
+	if (writev_in_full(tmp_fd, iov, 4) < 0 || fsync(tmp_fd) < 0) {
+		perror_raw("Error writing registry");
+		close(tmp_fd);
+		unlink(tmp.buf);
+		goto cleanup;
+	}
+	close(tmp_fd);
+	if (rename(tmp.buf, reg->path) < 0) {
+		perror_raw("Error replacing registry");
+		unlink(tmp.buf);
+		goto cleanup;
+	}
+	/* Should this fail, the journal is merely replayed once more */
+	if (ftruncate(fd, 0) < 0 || fsync(fd) < 0)
+		perror_raw("Error truncating registry journal");
+	ret = registry_load(reg, fd);
+	if (ret < 0)
+		perror_raw("Error reading registry back");
+
+cleanup:
+	strbuf_release(&tmp);
+	free(buckets);
+	return ret;
+}
+
+/* Add a record to what goes into the journal */
+static void journal_add_record(struct strbuf *sb, int op,
+			       const struct registry_entry *e)
+{
+	struct journal_record rec = { 0 };
+	size_t start = sb->len;
+
+	strbuf_add(sb, &rec, sizeof(rec));
+	strbuf_add(sb, e->name, strlen(e->name) + 1);
+	if (op == JOURNAL_ADD) {
+		strbuf_add(sb, e->device, strlen(e->device) + 1);
+		strbuf_add(sb, e->socket, strlen(e->socket) + 1);
+		rec.pid = e->pid;
+	}
+	rec.magic = JOURNAL_MAGIC;
+	rec.len = sb->len - start;
+	rec.op = op;
+	memcpy(sb->buf + start, &rec, sizeof(rec));
+	rec.sum = fnv1a(FNV_OFFSET, sb->buf + start + JOURNAL_SUM_FROM,
+			rec.len - JOURNAL_SUM_FROM);
+	memcpy(sb->buf + start, &rec, sizeof(rec));
+}
+
+/*
+ * Append the records to the journal, which we hold locked as fd, and
+ * read the registry back, folding the journal into the base if it got
+ * long. They go out in a single write, so a crash tears only the last.
+ */
+static int journal_write(struct registry *reg, int fd, struct strbuf *sb)
+{
+	struct registry_builder b;
+	struct stat st;
+
+	if (write_in_full(fd, sb->buf, sb->len) < 0 || fsync(fd) < 0) {
+		perror_raw("Error writing registry journal");
+		return -1;
+	}
+	if (registry_load(reg, fd) < 0) {
+		perror_raw("Error reading registry back");
+		return -1;
+	}
+	/* The update is done, compacting is only housekeeping */
+	if (fstat(fd, &st) == 0 && st.st_size > JOURNAL_MAX) {
+		if (builder_init(&b, reg) == 0)
+			registry_commit(reg, &b, fd);
+		builder_release(&b);
+	}
+	return 0;
+}
+
+static int journal_append(struct registry *reg, int fd, int op,
+			  const struct registry_entry *e)
+{
+	struct strbuf sb = STRBUF_INIT;
+	int ret;
+
+	journal_add_record(&sb, op, e);
+	ret = journal_write(reg, fd, &sb);
+	strbuf_release(&sb);
+	return ret;
+}
+
+int registry_add(struct registry *reg, const struct window *win)
+{
+	struct registry_entry e = { win->name, win->device, win->socket,
+				    win->pid };
+	int fd, ret;
+
+	fd = registry_lock(reg);
+	if (fd < 0)
+		return -1;
+	ret = journal_append(reg, fd, JOURNAL_ADD, &e);
+	close(fd);
+	return ret;
+}
+
+int registry_add_many(struct registry *reg, struct window *const *wins,
+		      size_t nr)
+{
+	struct registry_entry e;
+	struct strbuf sb = STRBUF_INIT;
+	int fd, ret;
+
+	fd = registry_lock(reg);
+	if (fd < 0)
+		return -1;
+	for (size_t i = 0; i < nr; i++) {
+		e.name = wins[i]->name;
+		e.device = wins[i]->device;
+		e.socket = wins[i]->socket;
+		e.pid = wins[i]->pid;
+		journal_add_record(&sb, JOURNAL_ADD, &e);
+	}
+	ret = journal_write(reg, fd, &sb);
+	strbuf_release(&sb);
+	close(fd);
+	return ret;
+}
+
+int registry_add_numbered(struct registry *reg, struct window *win,
+			  const char *prefix)
+{
+	struct registry_entry e;
+	struct strbuf name = STRBUF_INIT;
+	int fd, ret;
+
+	fd = registry_lock(reg);
+	if (fd < 0)
+		return -1;
+	/* The lowest free number, lookups are by hash so this is cheap */
+	for (size_t n = 0;; n++) {
+		strbuf_reset(&name);
+		strbuf_addf(&name, "%s.%zu", prefix, n);
+		if (registry_find(reg, name.buf, &e) < 0)
+			break;
+	}
+	free(win->name);
+	win->name = name.buf;
+	e.name = win->name;
+	e.device = win->device;
+	e.socket = win->socket;
+	e.pid = win->pid;
+	ret = journal_append(reg, fd, JOURNAL_ADD, &e);
+	close(fd);
+	return ret;
+}
+
+int registry_remove(struct registry *reg, const char *name)
+{
+	struct registry_entry e = { name, NULL, NULL, 0 };
+	int fd, ret;
+
+	fd = registry_lock(reg);
+	if (fd < 0)
+		return -1;
+	ret = journal_append(reg, fd, JOURNAL_REMOVE, &e);
+	close(fd);
+	return ret;
+}
+
+int registry_prune(struct registry *reg, const struct registry_entry *dead,
+		   size_t nr)
+{
+	struct registry_entry e;
+	struct strbuf sb = STRBUF_INIT;
+	int fd, ret = 0;
+
+	fd = registry_lock(reg);
+	if (fd < 0)
+		return -1;
+	/* A window started again under the name meanwhile stays */
+	for (size_t i = 0; i < nr; i++) {
+		if (registry_find(reg, dead[i].name, &e) < 0 ||
+		    e.pid != dead[i].pid)
+			continue;
+		journal_add_record(&sb, JOURNAL_REMOVE, &dead[i]);
+		ret++;
+	}
+	if (ret > 0 && journal_write(reg, fd, &sb) < 0)
+		ret = -1;
+	strbuf_release(&sb);
+	close(fd);
+	return ret;
+}
+
+/* Split a "name device socket pid" line, return -1 if malformed */
+static int parse_line(char *line, struct registry_entry *e)
+{
+	char *field[4], *end;
+	long pid;
+
+	for (int i = 0; i < 4; i++) {
+		field[i] = strsep(&line, " \n");
+		if (field[i] == NULL || *field[i] == '\0')
+			return -1;
+	}
+	pid = strtol(field[3], &end, 10);
+	if (*end || pid <= 0)
+		return -1;
+	e->name = field[0];
+	e->device = field[1];
+	e->socket = field[2];
+	e->pid = pid;
+	return 0;
+}
+
+int registry_import(struct registry *reg, const char *file)
+{
+	struct registry_builder b;
+	struct registry_entry e, old;
+	char *line = NULL;
+	size_t alloc = 0;
+	FILE *fp;
+	int fd, ret = -1, lineno = 0;
+
+	fp = fopen(file, "r");
+	if (fp == NULL) {
+		perror_raw("Error opening windows to import");
+		return -1;
+	}
+	fd = registry_lock(reg);
+	if (fd < 0) {
+		fclose(fp);
+		return -1;
+	}
+	/* Written as a new base, which takes the journal along */
+	if (builder_init(&b, reg) < 0)
+		goto cleanup;
+	while (getline(&line, &alloc, fp) > 0) {
+		lineno++;
+		if (*line == '\n')
+			continue;
+		if (parse_line(line, &e) < 0) {
+			ferror_raw("Error parsing %s line %d", file, lineno);
+			goto cleanup;
+		}
+		/* Windows we know already stay as they are */
+		if (registry_find(reg, e.name, &old) < 0)
+			builder_add(&b, &e);
+	}
+	ret = registry_commit(reg, &b, fd);
+
+cleanup:
+	builder_release(&b);
+	close(fd);
+	free(line);
+	fclose(fp);
+	return ret;
+}
+
+int registry_export(const struct registry *reg, FILE *out)
+{
+	struct registry_entry e;
+
+	for (size_t i = 0; i < reg->nr; i++) {
+		if (registry_get(reg, i, &e) < 0)
+			return -1;
+		fprintf(out, "%s %s %s %d\n", e.name, e.device, e.socket,
+			(int)e.pid);
+	}
+	return ferror(out) ? -1 : 0;
+}
@@ -0,0 +1,119 @@
+#ifndef REGISTRY_H
+#define REGISTRY_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+#include "strbuf.h"
+
+struct window;
+
+/*
+ * The registry of windows, ~/.myscreen.db and ~/.myscreen.db.journal.
+ *
+ * The base is a binary file which is mapped read-only: fixed size
+ * entries, a hash index by window name and a table of NUL terminated
+ * strings. It is never written in place, a new image is renamed over
+ * it, so a mapping stays valid.
+ *
+ * Adding or removing a window appends one checksummed record to the
+ * journal, under an exclusive flock() of it. Readers hold a shared lock
+ * while they map the base and replay the journal over it. Once the
+ * journal grows past a fixed size the writer holding the lock folds it
+ * into a new base and truncates it. Replaying is idempotent, so a crash
+ * between the rename and the truncation loses nothing, and a record
+ * torn by a crash is skipped.
+ *
+ * The text format of older versions, one "name device socket pid" line
+ * per window, is still understood by registry_import() and written by
+ * registry_export().
+ */
+
+/* A window in the registry, the strings point into the registry */
+struct registry_entry {
+	const char *name;
+	const char *device;
+	const char *socket;
+	pid_t pid;
+};
+
+struct registry_header;
+struct registry_slot;
+struct registry_op;
+
+struct registry {
+	char *path;
+	char *journal_path;
+	void *map;
+	size_t map_len;
+	const struct registry_header *hdr;
+	const struct registry_slot *slots; /* the entries */
+	const uint32_t *buckets; /* hash index, slot + 1 or 0 */
+	const char *strings;
+	uint32_t nr_slots;
+
+	/* The journal, replayed over the base */
+	struct strbuf journal;
+	struct registry_op *ops;
+	size_t nr_ops, alloc_ops;
+	uint32_t *op_index; /* by name, latest op + 1 or 0 */
+	size_t op_index_size;
+	uint32_t *hidden; /* sorted slots a journal record overrides */
+	size_t nr_hidden;
+	uint32_t *live; /* ops adding a window still there, in order */
+	size_t nr_live;
+
+	size_t nr; /* windows, the visible slots then the live ops */
+	int is_new; /* neither the base nor the journal existed */
+};
+
+/* Read the registry at path, which may not exist yet. Dies if corrupt. */
+struct registry *registry_xopen(const char *path);
+void registry_close(struct registry *reg);
+
+static inline size_t registry_nr(const struct registry *reg)
+{
+	return reg->nr;
+}
+
+/* Fill e with the idx'th window, return -1 if there is none */
+int registry_get(const struct registry *reg, size_t idx,
+		 struct registry_entry *e);
+/* Fill e with the window called name, return its index or -1 */
+int registry_find(const struct registry *reg, const char *name,
+		  struct registry_entry *e);
+
+/*
+ * Updates take the lock, so they see every earlier update, and reload
+ * reg afterwards. Entries got from reg before are gone by then.
+ */
+
+/* Add win, replacing a window of the same name. Return -1 on failure. */
+int registry_add(struct registry *reg, const struct window *win);
+/* Add the nr windows in wins with a single update */
+int registry_add_many(struct registry *reg, struct window *const *wins,
+		      size_t nr);
+/*
+ * Add win under the first free name "prefix.N", counting from the
+ * number of windows, and rename win to it. Return -1 on failure.
+ */
+int registry_add_numbered(struct registry *reg, struct window *win,
+			  const char *prefix);
+/* Remove the window called name, return -1 on failure */
+int registry_remove(struct registry *reg, const char *name);
+
+/*
+ * Remove the windows in dead, which must not point into reg, unless one
+ * was registered again with another pid. Return the number removed or
+ * -1 on failure.
+ */
+int registry_prune(struct registry *reg, const struct registry_entry *dead,
+		   size_t nr);
+
+/* Add the windows listed in the text file */
+int registry_import(struct registry *reg, const char *file);
+/* Write the windows in the text format */
+int registry_export(const struct registry *reg, FILE *out);
+
+#endif
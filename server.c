@@ -0,0 +1,621 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include "compat_util.h"
+#include "error_raw.h"
+#include "wrapper.h"
+#include "event.h"
+#include "proto.h"
+#include "pty.h"
+#include "socket.h"
+#include "strbuf.h"
+#include "task.h"
+#include "server.h"
+
+#define SPAWN_HDR_LEN 6 /* rows, cols and termios size */
+#define SPAWN_PIPELINE 64 /* SPAWN requests in flight on a connection */
+
+struct server_worker {
+	pthread_t thread;
+	struct event_loop *loop;
+	int pipe_fds[2]; /* new window tasks are handed over here */
+};
+
+/* A `myscreen` asking for a window */
+struct server_conn {
+	int fd;
+	int hello_done;
+	struct proto_reader reader;
+};
+
+/*
+ * A window made ready before anyone asks for it: a pty, a socket which
+ * listens already and a child holding the pty, waiting for its argv.
+ */
+struct pool_slot {
+	struct pty_info *pty_info;
+	char *socket_path;
+	int socket_fd;
+	pid_t pid;
+	int cmd_fd;
+};
+
+/* How long starting windows took, from the SPAWN to the SPAWNED */
+struct spawn_stats {
+	unsigned long nr;
+	uint64_t total_ns;
+	uint64_t max_ns;
+};
+
+static struct event_loop *main_loop;
+static struct server_worker *workers;
+static int nr_workers;
+static int next_worker;
+static unsigned long nr_sockets;
+
+static struct pool_slot *pool;
+static int pool_size, pool_nr;
+/* Don't retry filling the pool until a window is taken from it */
+static int pool_stuck;
+static struct spawn_stats cold_stats, pooled_stats;
+
+static void on_handoff(struct event_loop *loop, int fd, unsigned events,
+		       void *data)
+{
+	struct window_task *tasks[64];
+	ssize_t n;
+
+	(void)events;
+	(void)data;
+	/* pointers are smaller than PIPE_BUF, so they are never split */
+	n = read(fd, tasks, sizeof(tasks));
+	if (n < 0) {
+		if (errno != EINTR && errno != EAGAIN)
+			perror_raw("Error reading from worker pipe");
+		return;
+	}
+	for (size_t i = 0; i < (size_t)n / sizeof(tasks[0]); i++)
+		window_task_register(tasks[i], loop);
+}
+
+static void *worker_main(void *arg)
+{
+	struct server_worker *w = arg;
+
+	for (;;)
+		if (event_loop_run_once(w->loop, -1) < 0)
+			perror_raw_die("Error waiting for events");
+	return NULL;
+}
+
+static void start_workers(void)
+{
+	CALLOC_ARRAY(workers, nr_workers);
+	if (workers == NULL)
+		ferror_raw_die("Error allocating memory for workers");
+	for (int i = 0; i < nr_workers; i++) {
+		struct server_worker *w = &workers[i];
+
+		w->loop = event_loop_alloc();
+		if (w->loop == NULL || pipe(w->pipe_fds) < 0)
+			perror_raw_die("Error creating worker");
+		for (int j = 0; j < 2; j++)
+			fcntl(w->pipe_fds[j], F_SETFD, FD_CLOEXEC);
+		if (event_add(w->loop, w->pipe_fds[0], EVENT_READ, on_handoff,
+			      w) < 0)
+			perror_raw_die("Error watching worker pipe");
+		errno = pthread_create(&w->thread, NULL, worker_main, w);
+		if (errno)
+			perror_raw_die("Error creating worker thread");
+	}
+}
+
+/* Give a new window to a worker, round robin */
+static void place_task(struct window_task *task)
+{
+	struct server_worker *w;
+
+	if (nr_workers <= 1) {
+		window_task_register(task, main_loop);
+		return;
+	}
+	w = &workers[next_worker];
+	next_worker = (next_worker + 1) % nr_workers;
+	if (write(w->pipe_fds[1], &task, sizeof(task)) != sizeof(task))
+		perror_raw("Error handing window to worker");
+}
+
+static char **parse_argv(const char *p, const char *end)
+{
+	char **argv;
+	size_t nr = 0;
+
+	for (const char *s = p; s < end; s += strlen(s) + 1)
+		nr++;
+	CALLOC_ARRAY(argv, nr + 1);
+	if (argv == NULL)
+		return NULL;
+	for (size_t i = 0; i < nr; i++) {
+		argv[i] = (char *)p;
+		p += strlen(p) + 1;
+	}
+	return argv;
+}
+
+static void slot_release(struct pool_slot *slot)
+{
+	/* The child sees the pipe close and exits */
+	if (slot->cmd_fd >= 0)
+		close(slot->cmd_fd);
+	if (slot->socket_fd >= 0) {
+		close(slot->socket_fd);
+		unlink(slot->socket_path);
+	}
+	free(slot->socket_path);
+	pty_info_free(slot->pty_info);
+	memset(slot, 0, sizeof(*slot));
+	slot->socket_fd = slot->cmd_fd = -1;
+}
+
+static int slot_prepare(struct pool_slot *slot)
+{
+	memset(slot, 0, sizeof(*slot));
+	slot->socket_fd = slot->cmd_fd = -1;
+	slot->pty_info = pty_info_alloc();
+	if (slot->pty_info == NULL)
+		goto fail;
+	slot->socket_path = socket_path_xcreate_seq(nr_sockets++);
+	slot->socket_fd = socket_server_start(slot->socket_path);
+	if (slot->socket_fd < 0)
+		goto fail;
+	slot->pid = pty_prefork(slot->pty_info, &slot->cmd_fd);
+	if (slot->pid < 0)
+		goto fail;
+	return 0;
+
+fail:
+	slot_release(slot);
+	return -1;
+}
+
+/* Add a window to the pool, done while nothing else is going on */
+static void pool_fill_one(void)
+{
+	if (slot_prepare(&pool[pool_nr]) < 0)
+		pool_stuck = 1;
+	else
+		pool_nr++;
+}
+
+/* Start a window from the pool, NULL if it's empty or that failed */
+static struct window_task *pool_take(struct termios *termios,
+				     struct winsize *ws, char **argv,
+				     struct strbuf *reply)
+{
+	struct pool_slot *slot;
+	struct window_task *task;
+
+	if (pool_nr == 0)
+		return NULL;
+	slot = &pool[--pool_nr];
+	pool_stuck = 0;
+	if (pty_exec_prepared(slot->cmd_fd, termios, ws, argv) < 0) {
+		slot->cmd_fd = -1;
+		slot_release(slot);
+		return NULL;
+	}
+	slot->cmd_fd = -1;
+	task = window_task_adopt(slot->pty_info, slot->socket_path,
+				 slot->socket_fd, slot->pid, ws);
+	if (task == NULL) {
+		slot_release(slot);
+		return NULL;
+	}
+	strbuf_add(reply, slot->socket_path, strlen(slot->socket_path) + 1);
+	strbuf_add(reply, slot->pty_info->slave_name,
+		   strlen(slot->pty_info->slave_name) + 1);
+	slot->socket_fd = -1;
+	slot_release(slot);
+	return task;
+}
+
+static void stats_add(struct spawn_stats *st, uint64_t ns)
+{
+	st->nr++;
+	st->total_ns += ns;
+	if (ns > st->max_ns)
+		st->max_ns = ns;
+}
+
+static void stats_format(struct strbuf *sb, const char *what,
+			 const struct spawn_stats *st)
+{
+	strbuf_addf(sb, "%s: %lu windows", what, st->nr);
+	if (st->nr)
+		strbuf_addf(sb, ", average %.3f ms, max %.3f ms",
+			    st->total_ns / 1e6 / st->nr, st->max_ns / 1e6);
+	strbuf_addch(sb, '\n');
+}
+
+static int send_stats(int fd)
+{
+	struct strbuf sb = STRBUF_INIT;
+	int ret;
+
+	strbuf_addf(&sb, "pool: %d of %d ready\n", pool_nr, pool_size);
+	stats_format(&sb, "from the pool", &pooled_stats);
+	stats_format(&sb, "started cold", &cold_stats);
+	ret = proto_send(fd, PROTO_STATS, sb.buf, sb.len);
+	strbuf_release(&sb);
+	return ret;
+}
+
+/* Start the window asked for by a SPAWN frame, and say how it went */
+static int spawn_window(int fd, const struct proto_frame *frame)
+{
+	struct termios termios;
+	struct winsize ws = { 0 };
+	struct pty_info *pty_info = NULL;
+	struct window_task *task = NULL;
+	struct strbuf reply = STRBUF_INIT;
+	struct spawn_stats *stats;
+	char *socket_path = NULL;
+	char **argv;
+	char pid_buf[4] = { 0 };
+	uint64_t start = getnanotime();
+	size_t tlen;
+	int ret;
+
+	if (frame->len < SPAWN_HDR_LEN)
+		return -1;
+	ws.ws_row = proto_get_u16(frame->payload);
+	ws.ws_col = proto_get_u16(frame->payload + 2);
+	tlen = proto_get_u16(frame->payload + 4);
+	if (tlen != sizeof(termios) || frame->len < SPAWN_HDR_LEN + tlen ||
+	    (frame->len > SPAWN_HDR_LEN + tlen &&
+	     frame->payload[frame->len - 1] != '\0')) {
+		const char *msg = "malformed SPAWN request";
+		return proto_send(fd, PROTO_ERROR, msg, strlen(msg));
+	}
+	memcpy(&termios, frame->payload + SPAWN_HDR_LEN, tlen);
+	argv = parse_argv(frame->payload + SPAWN_HDR_LEN + tlen,
+			  frame->payload + frame->len);
+
+	/* the pid goes in front once we know it */
+	strbuf_add(&reply, pid_buf, sizeof(pid_buf));
+	task = argv ? pool_take(&termios, &ws, argv, &reply) : NULL;
+	stats = &pooled_stats;
+	if (task == NULL && argv) {
+		pty_info = pty_info_alloc();
+		socket_path = socket_path_xcreate_seq(nr_sockets++);
+		if (pty_info)
+			task = window_task_create(pty_info, socket_path,
+						  &termios, &ws, argv);
+		if (task) {
+			strbuf_add(&reply, socket_path,
+				   strlen(socket_path) + 1);
+			strbuf_add(&reply, pty_info->slave_name,
+				   strlen(pty_info->slave_name) + 1);
+		}
+		stats = &cold_stats;
+	}
+	if (task == NULL) {
+		const char *msg = "cannot create pty, socket or process";
+		ret = proto_send(fd, PROTO_ERROR, msg, strlen(msg));
+		goto cleanup;
+	}
+
+	proto_put_u32(reply.buf, (uint32_t)window_task_pid(task));
+	ret = proto_send(fd, PROTO_SPAWNED, reply.buf, reply.len);
+	/* the socket is listening already, so clients can connect */
+	place_task(task);
+	stats_add(stats, getnanotime() - start);
+
+cleanup:
+	strbuf_release(&reply);
+	free(socket_path);
+	pty_info_free(pty_info);
+	free(argv);
+	return ret;
+}
+
+static void close_conn(struct event_loop *loop, struct server_conn *conn)
+{
+	event_del(loop, conn->fd);
+	close(conn->fd);
+	proto_reader_release(&conn->reader);
+	free(conn);
+}
+
+static void on_conn(struct event_loop *loop, int fd, unsigned events,
+		    void *data)
+{
+	struct server_conn *conn = data;
+	struct proto_frame frame;
+	struct proto_hello hello, reply = { 0 };
+	ssize_t n;
+	int ret;
+
+	(void)events;
+	n = proto_reader_fill(&conn->reader, fd);
+	if (n <= 0) {
+		close_conn(loop, conn);
+		return;
+	}
+	while ((ret = proto_reader_next(&conn->reader, &frame)) > 0) {
+		if (!conn->hello_done) {
+			if (proto_parse_hello(&frame, &hello) < 0 ||
+			    proto_send_hello(fd, &reply) < 0 ||
+			    hello.version != PROTO_VERSION)
+				break;
+			conn->hello_done = 1;
+			continue;
+		}
+		if (frame.type == PROTO_STATS) {
+			if (send_stats(fd) < 0)
+				break;
+			continue;
+		}
+		if (frame.type != PROTO_SPAWN || spawn_window(fd, &frame) < 0)
+			break;
+	}
+	if (ret != 0)
+		close_conn(loop, conn);
+}
+
+static void on_server_listen(struct event_loop *loop, int fd,
+			     unsigned events, void *data)
+{
+	struct server_conn *conn;
+	int cfd;
+
+	(void)events;
+	(void)data;
+	cfd = socket_server_accept(fd);
+	if (cfd < 0) {
+		perror_raw("Error accept() failed");
+		return;
+	}
+	conn = calloc(1, sizeof(*conn));
+	if (conn == NULL) {
+		close(cfd);
+		return;
+	}
+	conn->fd = cfd;
+	proto_reader_init(&conn->reader);
+	if (event_add(loop, cfd, EVENT_READ, on_conn, conn) < 0) {
+		perror_raw("Error watching server connection");
+		close(cfd);
+		free(conn);
+	}
+}
+
+void server_xrun(int nr, int nr_pool)
+{
+	char *path;
+	int fd;
+	pid_t pid;
+
+	path = socket_path_xcreate_server();
+	fd = socket_client_try(path);
+	if (fd >= 0)
+		ferror_raw_die("A myscreen server is already running on %s",
+			       path);
+	fd = socket_server_xstart(path);
+
+	pid = fork();
+	if (pid < 0)
+		perror_raw_die("Error forking myscreen server");
+	if (pid > 0) {
+		printf("myscreen server %d listening on %s\n", (int)pid, path);
+		fflush(stdout);
+		exit(EXIT_SUCCESS);
+	}
+
+	if (setsid() <= 0)
+		perror_raw_die("Error creating new session in server");
+	stdio_to_devnull();
+	/* Clients going away must not kill us, and exited programs are
+	 * reaped by the kernel */
+	signal(SIGPIPE, SIG_IGN);
+	signal(SIGCHLD, SIG_IGN);
+	signal(SIGINT, SIG_DFL);
+	signal(SIGTERM, SIG_DFL);
+	signal(SIGABRT, SIG_DFL);
+
+	nr_workers = nr;
+	pool_size = nr_pool;
+	CALLOC_ARRAY(pool, pool_size + 1);
+	if (pool == NULL)
+		ferror_raw_die("Error allocating memory for window pool");
+	main_loop = event_loop_alloc();
+	if (main_loop == NULL)
+		perror_raw_die("Error creating event loop");
+	if (event_add(main_loop, fd, EVENT_READ, on_server_listen, NULL) < 0)
+		perror_raw_die("Error watching server socket");
+	if (nr_workers > 1)
+		start_workers();
+
+	/* The pool is topped up whenever there is nothing else to do */
+	for (;;) {
+		int refill = pool_nr < pool_size && !pool_stuck;
+		int n = event_loop_run_once(main_loop, refill ? 0 : -1);
+
+		if (n < 0)
+			perror_raw_die("Error waiting for events");
+		if (n == 0 && refill)
+			pool_fill_one();
+	}
+}
+
+/*
+ * Connect to the server and agree on the protocol, return -1 if none
+ * is running.
+ */
+static int server_connect(struct proto_reader *reader)
+{
+	struct proto_frame frame;
+	struct proto_hello hello = { 0 };
+	char *path;
+	int fd;
+
+	path = socket_path_xcreate_server();
+	fd = socket_client_try(path);
+	free(path);
+	if (fd < 0)
+		return -1;
+	if (proto_send_hello(fd, &hello) < 0 ||
+	    proto_recv(fd, reader, &frame) < 0 ||
+	    proto_parse_hello(&frame, &hello) < 0 ||
+	    hello.version != PROTO_VERSION) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+static void spawn_request(struct strbuf *req, struct termios *termios,
+			  struct winsize *ws, char **argv)
+{
+	char hdr[SPAWN_HDR_LEN];
+
+	proto_put_u16(hdr, ws->ws_row);
+	proto_put_u16(hdr + 2, ws->ws_col);
+	proto_put_u16(hdr + 4, sizeof(*termios));
+	strbuf_add(req, hdr, sizeof(hdr));
+	strbuf_add(req, termios, sizeof(*termios));
+	for (; argv && *argv; argv++)
+		strbuf_add(req, *argv, strlen(*argv) + 1);
+}
+
+/* The window called name a SPAWNED frame is about, NULL if malformed */
+static struct window *spawned_window(const char *name,
+				     const struct proto_frame *frame)
+{
+	const char *socket, *device, *end;
+
+	end = frame->payload + frame->len;
+	socket = frame->payload + 4;
+	device = NULL;
+	if (frame->type == PROTO_SPAWNED && frame->len > 4)
+		device = memchr(socket, '\0', end - socket);
+	if (device != NULL)
+		device++;
+	if (device == NULL || !memchr(device, '\0', end - device))
+		return NULL;
+	return window_xnew(name, device, socket,
+			   (pid_t)proto_get_u32(frame->payload));
+}
+
+struct window *server_xspawn(char *name, struct termios *termios,
+			     struct winsize *ws, char **argv)
+{
+	struct proto_reader reader;
+	struct proto_frame frame;
+	struct strbuf req = STRBUF_INIT;
+	struct window *win = NULL;
+	int fd;
+
+	proto_reader_init(&reader);
+	fd = server_connect(&reader);
+	if (fd < 0) {
+		proto_reader_release(&reader);
+		return NULL;
+	}
+
+	spawn_request(&req, termios, ws, argv);
+	if (proto_send(fd, PROTO_SPAWN, req.buf, req.len) < 0 ||
+	    proto_recv(fd, &reader, &frame) < 0)
+		perror_raw_die("Error talking to myscreen server");
+	if (frame.type == PROTO_ERROR)
+		ferror_raw_die("myscreen server failed to start window: %.*s",
+			       (int)frame.len, frame.payload);
+	win = spawned_window(name, &frame);
+	if (win == NULL)
+		ferror_raw_die("Malformed reply from myscreen server");
+
+	proto_reader_release(&reader);
+	strbuf_release(&req);
+	close(fd);
+	return win;
+}
+
+int server_spawn_many(struct window_request *reqs, size_t nr,
+		      struct termios *termios, struct winsize *ws)
+{
+	struct proto_reader reader;
+	struct proto_frame frame;
+	struct strbuf req = STRBUF_INIT;
+	size_t sent = 0;
+	int started = 0;
+	int fd;
+
+	proto_reader_init(&reader);
+	fd = server_connect(&reader);
+	if (fd < 0) {
+		proto_reader_release(&reader);
+		return -1;
+	}
+
+	for (size_t done = 0; done < nr; done++) {
+		/*
+		 * The server answers in order. Only so many requests go
+		 * ahead of the answers we read, or both of us could block
+		 * writing to the other.
+		 */
+		for (; sent < nr && sent - done < SPAWN_PIPELINE; sent++) {
+			strbuf_reset(&req);
+			spawn_request(&req, termios, ws, reqs[sent].argv);
+			reqs[sent].win = NULL;
+			reqs[sent].ns = getnanotime();
+			if (proto_send(fd, PROTO_SPAWN, req.buf, req.len) < 0)
+				perror_raw_die("Error talking to myscreen server");
+		}
+		if (proto_recv(fd, &reader, &frame) < 0)
+			perror_raw_die("Error talking to myscreen server");
+		reqs[done].ns = getnanotime() - reqs[done].ns;
+		if (frame.type == PROTO_ERROR) {
+			ferror_raw("myscreen server failed to start window %s: %.*s",
+				   reqs[done].name, (int)frame.len,
+				   frame.payload);
+			continue;
+		}
+		reqs[done].win = spawned_window(reqs[done].name, &frame);
+		if (reqs[done].win == NULL)
+			ferror_raw_die("Malformed reply from myscreen server");
+		started++;
+	}
+
+	proto_reader_release(&reader);
+	strbuf_release(&req);
+	close(fd);
+	return started;
+}
+
+int server_stats(struct strbuf *out)
+{
+	struct proto_reader reader;
+	struct proto_frame frame;
+	int fd, ret = -1;
+
+	proto_reader_init(&reader);
+	fd = server_connect(&reader);
+	if (fd < 0) {
+		proto_reader_release(&reader);
+		return -1;
+	}
+	if (proto_send(fd, PROTO_STATS, NULL, 0) == 0 &&
+	    proto_recv(fd, &reader, &frame) == 0 &&
+	    frame.type == PROTO_STATS) {
+		strbuf_add(out, frame.payload, frame.len);
+		ret = 0;
+	}
+	proto_reader_release(&reader);
+	close(fd);
+	return ret;
+}
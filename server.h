@@ -0,0 +1,43 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+#include <termios.h>
+#include <sys/ioctl.h> /* for struct winsize */
+#include "error_raw.h"
+#include "window.h"
+
+#define SERVER_MAX_WORKERS 64
+#define SERVER_MAX_POOL	   256
+
+struct strbuf;
+
+/*
+ * Become the myscreen server of this user: a single background process
+ * hosting the pty and socket of every window started while it runs.
+ * With nr_workers > 1 the windows are spread over that many threads,
+ * each running its own event loop.
+ *
+ * Up to nr_pool windows are kept ready, with their pty, socket and
+ * process, so starting one only hands its process the command line.
+ */
+NORETURN void server_xrun(int nr_workers, int nr_pool);
+
+/*
+ * Ask the server to start a window. Return NULL if no server is
+ * running, exit if the server fails to start the window.
+ */
+struct window *server_xspawn(char *name, struct termios *termios,
+			     struct winsize *ws, char **argv);
+/*
+ * Ask the server to start the windows, all over one connection. Return
+ * the number started, or -1 if no server is running.
+ */
+int server_spawn_many(struct window_request *reqs, size_t nr,
+		      struct termios *termios, struct winsize *ws);
+/*
+ * Put how long the server took to start windows in out. Return -1 if
+ * no server is running.
+ */
+int server_stats(struct strbuf *out);
+
+#endif
@@ -0,0 +1,266 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
+#include "error_raw.h"
+#include "shm.h"
+
+#define SHM_MAGIC    0x6d736d31 /* "msm1" */
+#define SHM_HDR_SIZE 256
+
+/*
+ * Lives at the start of each ring in the shared mapping. The producer
+ * and consumer indexes are free running and sit on their own cache
+ * lines so the two sides don't fight over them.
+ */
+struct shm_ring_hdr {
+	uint32_t magic;
+	uint32_t size;
+	_Alignas(64) _Atomic uint32_t head; /* written by the producer */
+	_Atomic uint32_t writer_waiting;
+	_Alignas(64) _Atomic uint32_t tail; /* written by the consumer */
+	_Atomic uint32_t reader_sleeping;
+};
+
+_Static_assert(sizeof(struct shm_ring_hdr) <= SHM_HDR_SIZE,
+	       "shm ring header too large");
+
+static size_t map_len(void)
+{
+	return 2 * SHM_HDR_SIZE + SHM_OUT_SIZE + SHM_IN_SIZE;
+}
+
+/* Point the rings into the mapping */
+static void channel_layout(struct shm_channel *ch)
+{
+	char *p = ch->map;
+
+	ch->out.hdr = (struct shm_ring_hdr *)p;
+	ch->out.data = p + SHM_HDR_SIZE;
+	ch->out.size = SHM_OUT_SIZE;
+	p += SHM_HDR_SIZE + SHM_OUT_SIZE;
+	ch->in.hdr = (struct shm_ring_hdr *)p;
+	ch->in.data = p + SHM_HDR_SIZE;
+	ch->in.size = SHM_IN_SIZE;
+}
+
+static void channel_init(struct shm_channel *ch)
+{
+	ch->map = MAP_FAILED;
+	ch->map_len = 0;
+	ch->memfd = -1;
+	ch->client_efd = -1;
+	ch->task_efd = -1;
+}
+
+#ifdef __linux__
+int shm_channel_create(struct shm_channel *ch)
+{
+	channel_init(ch);
+	ch->map_len = map_len();
+	ch->memfd = memfd_create("myscreen", MFD_CLOEXEC);
+	if (ch->memfd < 0 || ftruncate(ch->memfd, ch->map_len) < 0)
+		goto fail;
+	ch->map = mmap(NULL, ch->map_len, PROT_READ | PROT_WRITE, MAP_SHARED,
+		       ch->memfd, 0);
+	if (ch->map == MAP_FAILED)
+		goto fail;
+	ch->client_efd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	ch->task_efd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (ch->client_efd < 0 || ch->task_efd < 0)
+		goto fail;
+
+	/* The memfd comes zeroed, so only the constants need setting */
+	channel_layout(ch);
+	ch->out.hdr->magic = SHM_MAGIC;
+	ch->out.hdr->size = SHM_OUT_SIZE;
+	ch->in.hdr->magic = SHM_MAGIC;
+	ch->in.hdr->size = SHM_IN_SIZE;
+	return 0;
+
+fail:
+	perror_raw("Error creating shared memory channel");
+	shm_channel_release(ch);
+	return -1;
+}
+#else
+int shm_channel_create(struct shm_channel *ch)
+{
+	channel_init(ch);
+	errno = ENOSYS;
+	return -1;
+}
+#endif
+
+int shm_channel_attach(struct shm_channel *ch, const int *fds)
+{
+	struct stat st;
+
+	channel_init(ch);
+	ch->memfd = fds[0];
+	ch->client_efd = fds[1];
+	ch->task_efd = fds[2];
+	ch->map_len = map_len();
+	if (fstat(ch->memfd, &st) < 0 || (size_t)st.st_size != ch->map_len) {
+		ferror_raw("Shared memory channel has the wrong size");
+		goto fail;
+	}
+	ch->map = mmap(NULL, ch->map_len, PROT_READ | PROT_WRITE, MAP_SHARED,
+		       ch->memfd, 0);
+	if (ch->map == MAP_FAILED) {
+		perror_raw("Error mapping shared memory channel");
+		goto fail;
+	}
+	channel_layout(ch);
+	if (ch->out.hdr->magic != SHM_MAGIC ||
+	    ch->out.hdr->size != SHM_OUT_SIZE ||
+	    ch->in.hdr->magic != SHM_MAGIC || ch->in.hdr->size != SHM_IN_SIZE) {
+		ferror_raw("Shared memory channel has an unknown layout");
+		goto fail;
+	}
+	return 0;
+
+fail:
+	shm_channel_release(ch);
+	return -1;
+}
+
+void shm_channel_fds(const struct shm_channel *ch, int *fds)
+{
+	fds[0] = ch->memfd;
+	fds[1] = ch->client_efd;
+	fds[2] = ch->task_efd;
+}
+
+void shm_channel_release(struct shm_channel *ch)
+{
+	if (ch->map != MAP_FAILED)
+		munmap(ch->map, ch->map_len);
+	if (ch->memfd >= 0)
+		close(ch->memfd);
+	if (ch->client_efd >= 0)
+		close(ch->client_efd);
+	if (ch->task_efd >= 0)
+		close(ch->task_efd);
+	channel_init(ch);
+}
+
+size_t shm_ring_len(const struct shm_ring *r)
+{
+	uint32_t head = atomic_load_explicit(&r->hdr->head,
+					     memory_order_acquire);
+	uint32_t tail = atomic_load_explicit(&r->hdr->tail,
+					     memory_order_acquire);
+	uint32_t len = head - tail;
+
+	/* Don't trust the other side further than the ring size */
+	return len > r->size ? r->size : len;
+}
+
+size_t shm_ring_space(const struct shm_ring *r)
+{
+	return r->size - shm_ring_len(r);
+}
+
+size_t shm_ring_write(struct shm_ring *r, const char *buf, size_t len)
+{
+	uint32_t head = atomic_load_explicit(&r->hdr->head,
+					     memory_order_relaxed);
+	size_t space = shm_ring_space(r);
+	size_t off = head & (r->size - 1);
+	size_t first;
+
+	if (len > space)
+		len = space;
+	first = r->size - off < len ? r->size - off : len;
+	memcpy(r->data + off, buf, first);
+	memcpy(r->data, buf + first, len - first);
+	atomic_store_explicit(&r->hdr->head, head + (uint32_t)len,
+			      memory_order_release);
+	return len;
+}
+
+void shm_ring_peek(const struct shm_ring *r, const char **p1, size_t *len1,
+		   const char **p2, size_t *len2)
+{
+	uint32_t tail = atomic_load_explicit(&r->hdr->tail,
+					     memory_order_relaxed);
+	size_t len = shm_ring_len(r);
+	size_t off = tail & (r->size - 1);
+
+	*p1 = r->data + off;
+	*len1 = r->size - off < len ? r->size - off : len;
+	*p2 = r->data;
+	*len2 = len - *len1;
+}
+
+void shm_ring_consume(struct shm_ring *r, size_t len)
+{
+	uint32_t tail = atomic_load_explicit(&r->hdr->tail,
+					     memory_order_relaxed);
+
+	atomic_store_explicit(&r->hdr->tail, tail + (uint32_t)len,
+			      memory_order_release);
+}
+
+/*
+ * The flag store and the following load of the indexes must not be
+ * reordered, nor the index store and the following load of the flag, or
+ * both sides could decide the other one is awake. Hence the fences.
+ */
+int shm_ring_sleep(struct shm_ring *r)
+{
+	atomic_store(&r->hdr->reader_sleeping, 1);
+	atomic_thread_fence(memory_order_seq_cst);
+	if (shm_ring_len(r) == 0)
+		return 0;
+	atomic_store(&r->hdr->reader_sleeping, 0);
+	return 1;
+}
+
+int shm_ring_wait_space(struct shm_ring *r, size_t len)
+{
+	atomic_store(&r->hdr->writer_waiting, 1);
+	atomic_thread_fence(memory_order_seq_cst);
+	if (shm_ring_space(r) < len)
+		return 0;
+	atomic_store(&r->hdr->writer_waiting, 0);
+	return 1;
+}
+
+static void wakeup(int efd)
+{
+	uint64_t one = 1;
+
+	/* EAGAIN means the counter is already huge, which wakes it too */
+	while (write(efd, &one, sizeof(one)) < 0 && errno == EINTR)
+		;
+}
+
+void shm_ring_notify_data(struct shm_ring *r, int efd)
+{
+	atomic_thread_fence(memory_order_seq_cst);
+	if (atomic_exchange(&r->hdr->reader_sleeping, 0))
+		wakeup(efd);
+}
+
+void shm_ring_notify_space(struct shm_ring *r, int efd)
+{
+	atomic_thread_fence(memory_order_seq_cst);
+	if (atomic_exchange(&r->hdr->writer_waiting, 0))
+		wakeup(efd);
+}
+
+void shm_wakeup_clear(int efd)
+{
+	uint64_t count;
+
+	while (read(efd, &count, sizeof(count)) < 0 && errno == EINTR)
+		;
+}
@@ -0,0 +1,83 @@
+#ifndef SHM_H
+#define SHM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Shared memory transport between `myscreen` and a window task.
+ *
+ * The window task creates a memfd holding two single producer, single
+ * consumer byte rings, one for output and one for input, and passes it
+ * to the client together with two eventfds, one each side sleeps on.
+ * Moving data costs no syscalls: a side only writes the other's eventfd
+ * when the other said it is going to sleep, either because its ring was
+ * empty or because it was waiting for space.
+ *
+ * Only available on Linux, elsewhere shm_channel_create() fails and the
+ * stream socket is used.
+ */
+#define SHM_OUT_SIZE (1024 * 1024) /* window output, a power of 2 */
+#define SHM_IN_SIZE  (16 * 1024) /* keyboard input, a power of 2 */
+#define SHM_NR_FDS   3 /* memfd, client eventfd, window task eventfd */
+
+struct shm_ring_hdr;
+
+struct shm_ring {
+	struct shm_ring_hdr *hdr;
+	char *data;
+	uint32_t size;
+};
+
+struct shm_channel {
+	void *map;
+	size_t map_len;
+	int memfd;
+	int client_efd; /* written to wake the client */
+	int task_efd; /* written to wake the window task */
+	struct shm_ring out; /* written by the window task */
+	struct shm_ring in; /* written by the client */
+};
+
+/* Set up a new channel in the window task, return -1 on failure */
+int shm_channel_create(struct shm_channel *ch);
+/*
+ * Map the channel passed as fds[SHM_NR_FDS] in the client. The channel
+ * owns the fds from now on, even if it fails.
+ */
+int shm_channel_attach(struct shm_channel *ch, const int *fds);
+/* Put the fds to pass to the client in fds[SHM_NR_FDS] */
+void shm_channel_fds(const struct shm_channel *ch, int *fds);
+void shm_channel_release(struct shm_channel *ch);
+
+/* Bytes ready to read, and free space to write */
+size_t shm_ring_len(const struct shm_ring *r);
+size_t shm_ring_space(const struct shm_ring *r);
+/* Copy as much of buf as fits, return the number of bytes copied */
+size_t shm_ring_write(struct shm_ring *r, const char *buf, size_t len);
+/*
+ * Return the readable bytes as at most two contiguous pieces, which stay
+ * valid until shm_ring_consume().
+ */
+void shm_ring_peek(const struct shm_ring *r, const char **p1, size_t *len1,
+		   const char **p2, size_t *len2);
+void shm_ring_consume(struct shm_ring *r, size_t len);
+
+/*
+ * The consumer calls this with an empty ring before waiting on its
+ * eventfd. Return 0 if it may sleep, or 1 if data arrived meanwhile.
+ */
+int shm_ring_sleep(struct shm_ring *r);
+/*
+ * The producer calls this before waiting for len bytes of free space.
+ * Return 0 if it may wait, or 1 if there is that much room already.
+ */
+int shm_ring_wait_space(struct shm_ring *r, size_t len);
+/* After writing, wake the consumer through efd if it sleeps */
+void shm_ring_notify_data(struct shm_ring *r, int efd);
+/* After consuming, wake the producer through efd if it waits */
+void shm_ring_notify_space(struct shm_ring *r, int efd);
+/* Reset an eventfd we were woken through */
+void shm_wakeup_clear(int efd);
+
+#endif
@@ -5,33 +5,68 @@
 #include <sys/un.h>
 #include <sys/socket.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
 #include "socket.h"
 #include "error_raw.h"
 
-#define SOCKET_BASE	"/tmp/myscreen"
+#define SOCKET_DIR	"/tmp"
+#define SOCKET_NAME	"myscreen"
+#define SOCKET_BASE	SOCKET_DIR "/" SOCKET_NAME
 #define SOCKET_BASE_LEN 12
+#define SOCKET_BACKLOG	128
+/* room for a "-server" tag, a 64 bit id and a sequence number */
+#define SOCKET_PATH_LEN (SOCKET_BASE_LEN + 64)
 
 /* we believe all function here will be called in *raw* mode */
 
-char *socket_path_xcreate()
+static char *socket_path_xcreate_suffix(const char *fmt, long id)
 {
-	/* pid_t is uint32_t, and log_10(2^32) < 10 */
-	char *path = (char *)calloc(1, SOCKET_BASE_LEN + 11);
+	char *path = (char *)calloc(1, SOCKET_PATH_LEN);
 	if (path == NULL)
 		perror_raw_die("Error allocating memory for socket path");
 
-	snprintf(path, SOCKET_BASE_LEN + 11, "%s.%d", SOCKET_BASE, getpid());
+	snprintf(path, SOCKET_PATH_LEN, fmt, SOCKET_BASE, id);
 	return path;
 }
 
-int socket_server_xstart(const char *path)
+char *socket_path_xcreate()
+{
+	return socket_path_xcreate_suffix("%s.%ld", (long)getpid());
+}
+
+char *socket_path_xcreate_seq(unsigned long seq)
+{
+	char *path = socket_path_xcreate_suffix("%s.%ld", (long)getpid());
+	size_t len = strlen(path);
+
+	snprintf(path + len, SOCKET_PATH_LEN - len, ".%lu", seq);
+	return path;
+}
+
+char *socket_path_xcreate_server()
+{
+	/* One server per user */
+	return socket_path_xcreate_suffix("%s-server.%ld", (long)getuid());
+}
+
+static void set_cloexec(int fd)
+{
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+}
+
+int socket_server_start(const char *path)
 {
 	int sockfd;
 	struct sockaddr_un addr;
 
 	sockfd = socket(AF_UNIX, SOCK_STREAM, 0);
-	if (sockfd < 0)
-		perror_raw_die("Error socket() failed");
+	if (sockfd < 0) {
+		perror_raw("Error socket() failed");
+		return -1;
+	}
+	set_cloexec(sockfd);
 
 	memset(&addr, 0, sizeof(addr));
 	addr.sun_family = AF_UNIX;
@@ -39,26 +74,73 @@ int socket_server_xstart(const char *path)
 
 	unlink(path); /* Remove any exist socket file */
 
-	if (bind(sockfd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
-		perror_raw_die("Error bind() failed");
+	if (bind(sockfd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		perror_raw("Error bind() failed");
+		close(sockfd);
+		return -1;
+	}
+
+	if (listen(sockfd, SOCKET_BACKLOG) < 0) {
+		perror_raw("Error listen() failed");
+		close(sockfd);
+		return -1;
+	}
+
+	return sockfd;
+}
 
-	if (listen(sockfd, 5) < 0)
-		perror_raw_die("Error listen() failed");
+int socket_server_xstart(const char *path)
+{
+	int sockfd = socket_server_start(path);
 
+	if (sockfd < 0)
+		exit(EXIT_FAILURE);
 	return sockfd;
 }
 
+int socket_server_accept(int sockfd)
+{
+	int fd;
+
+	do {
+		fd = accept(sockfd, NULL, NULL);
+	} while (fd < 0 && errno == EINTR);
+	if (fd >= 0)
+		set_cloexec(fd);
+	return fd;
+}
+
 int socket_server_xaccept(int sockfd)
 {
 	int fd;
 
-	fd = accept(sockfd, NULL, NULL);
+	fd = socket_server_accept(sockfd);
 	if (fd < 0)
 		perror_raw_die("Error accept() failed");
 
 	return fd;
 }
 
+int socket_client_try(const char *path)
+{
+	int sockfd;
+	struct sockaddr_un addr;
+
+	sockfd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (sockfd < 0)
+		return -1;
+	set_cloexec(sockfd);
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+	if (connect(sockfd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		close(sockfd);
+		return -1;
+	}
+	return sockfd;
+}
+
 int socket_client_start(const char *path)
 {
 	int sockfd;
@@ -75,8 +157,6 @@ int socket_client_start(const char *path)
 	addr.sun_family = AF_UNIX;
 	strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
 
-	if (access(path, F_OK) == -1)
-		sleep(1);
 	while (connect(sockfd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
 		if (errno != EINPROGRESS) {
 			perror_raw("Error connect() failed");
@@ -94,3 +174,44 @@ int socket_client_start(const char *path)
 
 	return sockfd;
 }
+
+int socket_for_each(int (*fn)(const char *path, void *data), void *data)
+{
+	char path[SOCKET_PATH_LEN];
+	size_t name_len = strlen(SOCKET_NAME);
+	struct dirent *de;
+	struct stat st;
+	DIR *dir;
+	int ret = 0;
+
+	dir = opendir(SOCKET_DIR);
+	if (dir == NULL)
+		return -1;
+	while (ret == 0 && (de = readdir(dir)) != NULL) {
+		/* Window sockets only, not the server's */
+		if (strncmp(de->d_name, SOCKET_NAME, name_len) ||
+		    de->d_name[name_len] != '.')
+			continue;
+		if (snprintf(path, sizeof(path), SOCKET_DIR "/%s",
+			     de->d_name) >= (int)sizeof(path))
+			continue;
+		if (lstat(path, &st) < 0 || !S_ISSOCK(st.st_mode) ||
+		    st.st_uid != getuid())
+			continue;
+		ret = fn(path, data);
+	}
+	closedir(dir);
+	return ret;
+}
+
+int socket_is_stale(const char *path)
+{
+	int fd = socket_client_try(path);
+
+	if (fd >= 0) {
+		close(fd);
+		return 0;
+	}
+	/* A listener with a full backlog says EAGAIN */
+	return errno == ECONNREFUSED ? 1 : 0;
+}
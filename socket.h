@@ -1,12 +1,31 @@
 #ifndef SOCKET_H
 #define SOCKET_H
 
+#include <sys/types.h>
+
 char *socket_path_xcreate();
+/* One of many window sockets created by this process */
+char *socket_path_xcreate_seq(unsigned long seq);
+/* Control socket of the myscreen server of this user */
+char *socket_path_xcreate_server();
 
+/* The x-variants exit on failure, the others return -1 */
+int socket_server_start(const char *path);
 int socket_server_xstart(const char *path);
 
+int socket_server_accept(int sockfd);
 int socket_server_xaccept(int sockfd);
 
 int socket_client_start(const char *path);
+/* Connect once without waiting for the socket to show up */
+int socket_client_try(const char *path);
+
+/*
+ * Call fn with the path of every window socket of this user, until it
+ * returns non-zero, which is then returned.
+ */
+int socket_for_each(int (*fn)(const char *path, void *data), void *data);
+/* Return 1 if nobody listens on the socket any more */
+int socket_is_stale(const char *path);
 
-#endif
\ No newline at end of file
+#endif
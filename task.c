@@ -0,0 +1,1554 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <regex.h>
+#ifdef __linux__
+#include <sys/timerfd.h>
+#endif
+#include "compat_util.h"
+#include "error_raw.h"
+#include "socket.h"
+#include "proto.h"
+#include "wrapper.h"
+#include "history.h"
+#include "strbuf.h"
+#include "vt.h"
+#include "shm.h"
+#include "trigger.h"
+#include "log.h"
+#include "grep.h"
+#include "task.h"
+
+/*
+ * Memory a window's scrollback may take, compressed, see history.h.
+ * ~/.myscreen.scrollback may give another size, like 16M, for the
+ * windows started after it is written; none is below a block.
+ */
+#define DEFAULT_SCROLLBACK (1024 * 1024)
+#define SCROLLBACK_FILE	   ".myscreen.scrollback"
+
+/*
+ * The pty relay buffer starts small, doubles whenever a read fills it
+ * and halves after RELAY_SHRINK_READS reads in a row used less than a
+ * quarter of it, so idle windows stay cheap and bulk output moves in
+ * few large frames.
+ */
+#define RELAY_MIN	   4096
+#define RELAY_MAX	   (256 * 1024)
+#define RELAY_SHRINK_READS 16
+
+/*
+ * Output a client may fall behind by before its overflow policy kicks
+ * in: either the queue is dropped and the client is resynced with a
+ * repaint once it caught up, or it is disconnected. The shared memory
+ * ring (SHM_OUT_SIZE) plays the part of the queue for shm clients.
+ */
+#define CLIENT_QUEUE_MAX (1024 * 1024)
+
+/*
+ * Plain output a control client's WAIT is matched against. Past this
+ * much without a match the older half is dropped.
+ */
+#define CONTROL_TEXT_MAX (64 * 1024)
+
+/*
+ * Blocks of scrollback a GREP searches before the window gets back to
+ * its pty and other clients, a few ms worth
+ */
+#define GREP_STEP_BLOCKS 16
+
+/* A `myscreen` attached to a window */
+struct window_client {
+	struct window_task *task;
+	int fd;
+	int hello_done; /* fd finished the HELLO exchange */
+	int read_only; /* input and size are ignored */
+	int direct; /* holds the pty master, see window_hand_over() */
+	int has_size; /* ws is the size of the client's terminal */
+	struct winsize ws;
+	uint64_t last_active; /* see window_pick_size() */
+	struct proto_reader reader; /* frames from fd */
+	struct shm_channel *shm; /* shared memory transport, if any */
+	struct strbuf out; /* frames the non-blocking fd did not take yet */
+	int lagging; /* output is dropped until a repaint, see window_resync() */
+	int disconnect_slow; /* overflow policy, disconnect rather than resync */
+	int want_direct; /* hand over the pty master once out is drained */
+	int closing; /* drop the client once out is drained */
+	int sync; /* gets screen updates, see window_sync() */
+	struct vt_snapshot snap; /* the screen as of sync_sent */
+	uint32_t sync_sent;
+	uint32_t sync_acked;
+	int control; /* a script, see window_control() */
+	struct vt_strip strip;
+	struct strbuf unmatched; /* plain output since the last match */
+	int waiting; /* for wait_re to match unmatched */
+	regex_t wait_re;
+	int timer_fd; /* ends the wait, -1 if there is none */
+	struct grep *grep; /* the search under way, see window_grep() */
+	struct strbuf grep_out;
+};
+
+/* State of a running window task */
+struct window_task {
+	struct event_loop *loop;
+	int master_fd;
+	int socket_fd; /* listening socket */
+	char *socket_path;
+	pid_t pid; /* program running in the window */
+	struct window_client **clients;
+	size_t nr_clients;
+	size_t alloc_clients;
+	struct window_client *direct; /* client holding the pty master */
+	struct window_client *size_owner; /* client whose size we have */
+	uint64_t activity; /* bumped on every client activity */
+	struct history scrollback; /* recent pty output */
+	struct vt *vt; /* what the screen looks like */
+	char *relay_buf; /* pty output on its way to the clients */
+	size_t relay_alloc;
+	int relay_short; /* reads in a row which used little of relay_buf */
+	struct strbuf input; /* client input the pty did not take yet */
+	struct triggers *triggers; /* watching the output, if any */
+	int tick_fd; /* a timer for the silence triggers, or -1 */
+	struct window_log *log; /* the session log, if any */
+};
+
+static void on_master(struct event_loop *loop, int fd, unsigned events,
+		      void *data);
+
+static int pty_set_winsize(int fd, struct winsize *ws)
+{
+	/* We don't care about pixels in Linux and MacOs */
+	ws->ws_xpixel = 0;
+	ws->ws_ypixel = 0;
+
+	if (ioctl(fd, TIOCSWINSZ, ws) < 0) {
+		perror_raw("Error setting window size on pty master");
+		return -1;
+	}
+	return 0;
+}
+
+static int window_sync(struct window_client *c);
+
+static void window_resize(struct window_task *task, struct winsize *ws)
+{
+	if (ws->ws_row == task->vt->rows && ws->ws_col == task->vt->cols)
+		return;
+	if (pty_set_winsize(task->master_fd, ws) < 0)
+		return;
+	vt_resize(task->vt, ws->ws_row, ws->ws_col);
+	/* A client we fail to write to is dropped when it reads EOF */
+	for (size_t i = 0; i < task->nr_clients; i++)
+		if (task->clients[i]->sync)
+			window_sync(task->clients[i]);
+}
+
+/*
+ * Size policy: the window has the size of the read-write client which
+ * was active last, i.e. attached, resized its terminal or typed. View
+ * only clients never resize the window. When the client whose size we
+ * have goes away, the next most recently active one takes over.
+ */
+static void window_pick_size(struct window_task *task)
+{
+	struct window_client *best = NULL;
+
+	for (size_t i = 0; i < task->nr_clients; i++) {
+		struct window_client *c = task->clients[i];
+
+		if (c->read_only || !c->has_size || !c->hello_done)
+			continue;
+		if (best == NULL || c->last_active > best->last_active)
+			best = c;
+	}
+	task->size_owner = best;
+	if (best)
+		window_resize(task, &best->ws);
+}
+
+static void window_client_active(struct window_client *c)
+{
+	struct window_task *task = c->task;
+
+	if (c->read_only)
+		return;
+	c->last_active = ++task->activity;
+	if (task->size_owner != c && c->has_size)
+		window_pick_size(task);
+}
+
+static void window_client_watch(struct window_client *c)
+{
+	if (event_mod(c->task->loop, c->fd,
+		      (c->task->input.len ? 0 : EVENT_READ) |
+			      (c->out.len || c->want_direct || c->grep ?
+				       EVENT_WRITE :
+				       0)) < 0)
+		perror_raw("Error watching client socket");
+}
+
+/*
+ * Always read the pty, however slow the clients are, but take input
+ * from them only as far as the pty keeps up with it.
+ */
+static void window_watch(struct window_task *task)
+{
+	if (!task->direct &&
+	    event_mod(task->loop, task->master_fd,
+		      EVENT_READ | (task->input.len ? EVENT_WRITE : 0)) < 0)
+		perror_raw("Error watching pty master");
+	for (size_t i = 0; i < task->nr_clients; i++)
+		window_client_watch(task->clients[i]);
+}
+
+/*
+ * Write client input to the non-blocking pty master. What the program
+ * isn't ready for waits in task->input, and no more input is taken
+ * from any client until it is gone.
+ */
+static int window_write_input(struct window_task *task, const char *buf,
+			      size_t len)
+{
+	ssize_t n = 0;
+
+	/* A direct client made the master blocking */
+	if (task->direct)
+		return write_in_full(task->master_fd, buf, len) < 0 ? -1 : 0;
+	if (task->input.len == 0) {
+		n = write(task->master_fd, buf, len);
+		if (n < 0 && errno != EAGAIN && errno != EINTR)
+			return -1;
+		if (n < 0)
+			n = 0;
+	}
+	if ((size_t)n < len) {
+		strbuf_add(&task->input, buf + n, len - n);
+		window_watch(task);
+	}
+	return 0;
+}
+
+static void window_drain_shm(struct window_client *c);
+static void window_detach(struct window_client *c);
+
+static void window_flush_input(struct window_task *task)
+{
+	ssize_t n = write(task->master_fd, task->input.buf, task->input.len);
+
+	if (n < 0 && (errno == EAGAIN || errno == EINTR))
+		return;
+	if (n < 0) {
+		perror_raw("Error writing to pty master");
+		n = task->input.len;
+	}
+	strbuf_remove(&task->input, 0, n);
+	if (task->input.len)
+		return;
+	window_watch(task);
+	for (size_t i = 0; i < task->nr_clients && !task->input.len; i++)
+		if (task->clients[i]->shm)
+			window_drain_shm(task->clients[i]);
+}
+
+/* Move client input from the shared memory ring to the pty */
+static void window_drain_shm(struct window_client *c)
+{
+	struct window_task *task = c->task;
+	struct shm_ring *in = &c->shm->in;
+	const char *p1, *p2;
+	size_t len1, len2;
+
+	do {
+		/* Picked up again once the pty took the pending input */
+		if (task->input.len)
+			return;
+		shm_ring_peek(in, &p1, &len1, &p2, &len2);
+		if (len1 && !c->read_only) {
+			window_client_active(c);
+			if (window_write_input(task, p1, len1) < 0 ||
+			    window_write_input(task, p2, len2) < 0)
+				perror_raw("Error writing to pty master");
+		}
+		shm_ring_consume(in, len1 + len2);
+		shm_ring_notify_space(in, c->shm->client_efd);
+	} while (shm_ring_sleep(in));
+}
+
+/*
+ * Queue a frame for the client, of any size and however far behind it
+ * is, and write as much of it as the socket takes right away.
+ */
+static int window_client_send(struct window_client *c, int type,
+			      const char *buf, size_t len)
+{
+	char hdr[PROTO_HDR_LEN];
+	struct iovec iov[2];
+	ssize_t n = 0;
+
+	proto_put_hdr(hdr, type, len);
+	if (c->out.len == 0) {
+		iov[0].iov_base = hdr;
+		iov[0].iov_len = PROTO_HDR_LEN;
+		iov[1].iov_base = (void *)buf;
+		iov[1].iov_len = len;
+		n = writev(c->fd, iov, 2);
+		if (n < 0 && errno != EAGAIN && errno != EINTR)
+			return -1;
+		if (n < 0)
+			n = 0;
+	}
+	if (n < PROTO_HDR_LEN) {
+		strbuf_add(&c->out, hdr + n, PROTO_HDR_LEN - n);
+		n = 0;
+	} else {
+		n -= PROTO_HDR_LEN;
+	}
+	if ((size_t)n < len)
+		strbuf_add(&c->out, buf + n, len - n);
+	if (c->out.len)
+		window_client_watch(c);
+	return 0;
+}
+
+/* Send a buffer of any size as DATA frames */
+static int window_send_data(struct window_client *c, const char *buf,
+			    size_t len)
+{
+	while (len > 0) {
+		size_t n = len < PROTO_MAX_PAYLOAD ? len : PROTO_MAX_PAYLOAD;
+
+		if (window_client_send(c, PROTO_DATA, buf, n) < 0)
+			return -1;
+		buf += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/*
+ * Bring a client which is lagging, or just attached, up to date with
+ * one repaint of the screen, however much output it missed. Over shared
+ * memory that waits until the client emptied its ring; the client wakes
+ * us through on_shm() once it did.
+ */
+static int window_resync(struct window_client *c)
+{
+	struct strbuf sb = STRBUF_INIT;
+	int ret = 0;
+
+	if (c->shm && !shm_ring_wait_space(&c->shm->out, c->shm->out.size))
+		return 0;
+	vt_repaint(c->task->vt, &sb);
+	if (c->shm) {
+		shm_ring_write(&c->shm->out, sb.buf, sb.len);
+		shm_ring_notify_data(&c->shm->out, c->shm->client_efd);
+	} else {
+		ret = window_send_data(c, sb.buf, sb.len);
+	}
+	c->lagging = 0;
+	strbuf_release(&sb);
+	return ret;
+}
+
+/*
+ * Tell a client it is being disconnected. It is dropped after it read
+ * what was queued for it before, return -1 if that is right away.
+ */
+static int window_kick(struct window_client *c, const char *msg)
+{
+	ferror_raw("Disconnecting client: %s", msg);
+	c->closing = 1;
+	if (window_client_send(c, PROTO_ERROR, msg, strlen(msg)) < 0)
+		return -1;
+	return c->out.len ? 0 : -1;
+}
+
+/*
+ * State synchronization, in the style of mosh's SSP, for clients which
+ * asked for it with PROTO_HELLO_SYNC. Instead of every byte of output
+ * such a client gets the difference between the screen it acknowledged
+ * last and the screen now. Only one update is in flight at a time, so a
+ * client which can't keep up skips whatever the screen went through in
+ * the meantime, rather than replaying it.
+ */
+static int window_sync(struct window_client *c)
+{
+	struct strbuf sb = STRBUF_INIT;
+	int ret = 0;
+
+	if (c->sync_sent != c->sync_acked || c->closing)
+		return 0;
+	/* Room for the state number */
+	strbuf_add(&sb, "\0\0\0\0", 4);
+	vt_diff(c->task->vt, &c->snap, &sb);
+	if (sb.len > 4 && sb.len - 4 <= PROTO_MAX_PAYLOAD) {
+		proto_put_u32(sb.buf, ++c->sync_sent);
+		ret = window_client_send(c, PROTO_SYNC, sb.buf, sb.len);
+	} else if (sb.len > 4) {
+		ferror_raw("Screen update too large for a frame");
+		ret = -1;
+	}
+	strbuf_release(&sb);
+	return ret;
+}
+
+/*
+ * Control mode, for scripts driving the window. A control client gets
+ * no output. It asks for the text on the screen or at the end of the
+ * output, or waits for the output to match a pattern, which we check
+ * as it comes, so waiting costs the script nothing.
+ */
+
+/* Answer with a frame of the given type carrying status and text */
+static int window_reply(struct window_client *c, int type, int status,
+			const char *text, size_t len)
+{
+	struct strbuf sb = STRBUF_INIT;
+	int ret;
+
+	strbuf_addch(&sb, status);
+	strbuf_add(&sb, text, len);
+	ret = window_client_send(c, type, sb.buf, sb.len);
+	strbuf_release(&sb);
+	return ret;
+}
+
+static void window_wait_stop(struct window_client *c)
+{
+	if (c->waiting)
+		regfree(&c->wait_re);
+	c->waiting = 0;
+	if (c->timer_fd >= 0) {
+		event_del(c->task->loop, c->timer_fd);
+		close(c->timer_fd);
+		c->timer_fd = -1;
+	}
+}
+
+/* Answer the WAIT if the output matches by now */
+static int window_wait_match(struct window_client *c)
+{
+	regmatch_t m;
+	int ret;
+
+	if (!c->waiting || regexec(&c->wait_re, c->unmatched.len ?
+				   c->unmatched.buf : "", 1, &m, 0))
+		return 0;
+	window_wait_stop(c);
+	ret = window_reply(c, PROTO_WAIT, 'm', c->unmatched.buf + m.rm_so,
+				m.rm_eo - m.rm_so);
+	/* The next WAIT looks at what comes after the match */
+	strbuf_remove(&c->unmatched, 0, m.rm_eo);
+	return ret;
+}
+
+static void on_wait_timeout(struct event_loop *loop, int fd,
+			    unsigned events, void *data)
+{
+	struct window_client *c = data;
+
+	(void)loop;
+	(void)fd;
+	(void)events;
+	window_wait_stop(c);
+	if (window_reply(c, PROTO_WAIT, 't', NULL, 0) < 0)
+		window_detach(c);
+}
+
+#ifdef __linux__
+static int window_wait_timer(struct window_client *c, uint32_t ms)
+{
+	struct itimerspec its = { 0 };
+
+	c->timer_fd = timerfd_create(CLOCK_MONOTONIC,
+				     TFD_CLOEXEC | TFD_NONBLOCK);
+	if (c->timer_fd < 0)
+		return -1;
+	its.it_value.tv_sec = ms / 1000;
+	its.it_value.tv_nsec = (long)(ms % 1000) * 1000000;
+	if (timerfd_settime(c->timer_fd, 0, &its, NULL) < 0 ||
+	    event_add(c->task->loop, c->timer_fd, EVENT_READ, on_wait_timeout,
+		      c) < 0) {
+		close(c->timer_fd);
+		c->timer_fd = -1;
+		return -1;
+	}
+	return 0;
+}
+#else
+/* The client gives up by itself */
+static int window_wait_timer(struct window_client *c, uint32_t ms)
+{
+	(void)c;
+	(void)ms;
+	return 0;
+}
+#endif
+
+/* Handle a WAIT, return -1 if the client has to go */
+static int window_wait(struct window_client *c,
+		       const struct proto_frame *frame)
+{
+	struct strbuf pattern = STRBUF_INIT;
+	char msg[128];
+	int err;
+
+	if (frame->len < 4) {
+		ferror_raw("Malformed WAIT from socket");
+		return -1;
+	}
+	if (c->waiting) {
+		const char *busy = "already waiting";
+		return window_reply(c, PROTO_WAIT, 'e', busy, strlen(busy));
+	}
+	strbuf_add(&pattern, frame->payload + 4, frame->len - 4);
+	err = regcomp(&c->wait_re, pattern.buf, REG_EXTENDED | REG_NEWLINE);
+	strbuf_release(&pattern);
+	if (err) {
+		regerror(err, &c->wait_re, msg, sizeof(msg));
+		return window_reply(c, PROTO_WAIT, 'e', msg, strlen(msg));
+	}
+	c->waiting = 1;
+	if (proto_get_u32(frame->payload) &&
+	    window_wait_timer(c, proto_get_u32(frame->payload)) < 0) {
+		window_wait_stop(c);
+		snprintf(msg, sizeof(msg), "no timer: %s", strerror(errno));
+		return window_reply(c, PROTO_WAIT, 'e', msg, strlen(msg));
+	}
+	return window_wait_match(c);
+}
+
+/* Answer a SCREEN with the screen, or the last lines of output */
+static int window_screen(struct window_client *c,
+			 const struct proto_frame *frame)
+{
+	struct window_task *task = c->task;
+	struct strbuf sb = STRBUF_INIT, raw = STRBUF_INIT;
+	struct vt_strip strip = { 0 };
+	uint64_t from;
+	size_t i;
+	uint32_t nr, flags = 0;
+	int ret;
+
+	if (frame->len != 4 && frame->len != 8) {
+		ferror_raw("Malformed SCREEN from socket");
+		return -1;
+	}
+	nr = proto_get_u32(frame->payload);
+	if (frame->len == 8)
+		flags = proto_get_u32(frame->payload + 4);
+	strip.keep_sgr = !!(flags & PROTO_SCREEN_ATTRS);
+	strbuf_grow(&sb, 0);
+	if (nr == 0) {
+		if (strip.keep_sgr)
+			vt_text_attrs(task->vt, &sb);
+		else
+			vt_text(task->vt, &sb);
+		i = 0;
+	} else {
+		/* Only the blocks holding those lines are decompressed */
+		from = history_last_lines(&task->scrollback, nr);
+		history_read(&task->scrollback, from,
+			     history_end(&task->scrollback), &raw);
+		vt_strip(&strip, raw.buf, raw.len, &sb);
+		strbuf_release(&raw);
+		/* Don't leave the pen of the last line to the reader */
+		if (strip.keep_sgr && sb.len > 0) {
+			int nl = sb.buf[sb.len - 1] == '\n';
+
+			if (nl)
+				strbuf_remove(&sb, sb.len - 1, 1);
+			strbuf_addstr(&sb, "\033[0m");
+			if (nl)
+				strbuf_addch(&sb, '\n');
+		}
+		/* A newline at the end ends the last line */
+		i = sb.len && sb.buf[sb.len - 1] == '\n' ? sb.len - 1 : sb.len;
+		while (i > 0 && (sb.buf[i - 1] != '\n' || --nr > 0))
+			i--;
+		/* As many whole lines as fit in a frame */
+		if (sb.len - i > PROTO_MAX_PAYLOAD) {
+			i = sb.len - PROTO_MAX_PAYLOAD;
+			while (i < sb.len && sb.buf[i - 1] != '\n')
+				i++;
+		}
+	}
+	ret = window_client_send(c, PROTO_SCREEN, sb.buf + i, sb.len - i);
+	strbuf_release(&sb);
+	return ret;
+}
+
+/*
+ * Answer a PAGE with the plain text of count lines from line nr on. The
+ * line index finds where they start, so only the blocks holding them
+ * are read, however much output there is before or after.
+ */
+static int window_page(struct window_client *c,
+		       const struct proto_frame *frame)
+{
+	struct history *h = &c->task->scrollback;
+	struct strbuf sb = STRBUF_INIT, raw = STRBUF_INIT;
+	struct vt_strip strip = { 0 };
+	uint64_t nr, first, last, from, to;
+	uint32_t count;
+	char hdr[24];
+	int ret;
+
+	if (frame->len != 12) {
+		ferror_raw("Malformed PAGE from socket");
+		return -1;
+	}
+	nr = proto_get_u64(frame->payload);
+	count = proto_get_u32(frame->payload + 8);
+	first = history_first_line(h);
+	last = history_last_line(h);
+	if (count > 0 && (nr > last || last - nr < count - 1))
+		nr = last - first >= count - 1 ? last - (count - 1) : first;
+	if (nr < first)
+		nr = first;
+
+	from = history_line_pos(h, nr);
+	if (count == 0)
+		to = from;
+	else if (last - nr < count)
+		to = history_end(h);
+	else
+		to = history_line_pos(h, nr + count);
+	/* The text is no longer than the output it comes from */
+	if (to - from > PROTO_MAX_PAYLOAD - sizeof(hdr))
+		to = from + PROTO_MAX_PAYLOAD - sizeof(hdr);
+	history_read(h, from, to, &raw);
+
+	proto_put_u64(hdr, first);
+	proto_put_u64(hdr + 8, last);
+	proto_put_u64(hdr + 16, nr);
+	strbuf_add(&sb, hdr, sizeof(hdr));
+	vt_strip(&strip, raw.buf, raw.len, &sb);
+	strbuf_release(&raw);
+	ret = window_client_send(c, PROTO_PAGE, sb.buf, sb.len);
+	strbuf_release(&sb);
+	return ret;
+}
+
+static int window_client_flush(struct window_client *c);
+
+/* Repaint the screen of a client which drew over it */
+static int window_redraw(struct window_client *c)
+{
+	if (c->sync) {
+		vt_snapshot_release(&c->snap);
+		return window_sync(c);
+	}
+	/* Whatever output is still queued goes out before the repaint */
+	c->lagging = 1;
+	if (c->shm)
+		return window_resync(c);
+	return window_client_flush(c);
+}
+
+static int window_grep_flush(struct strbuf *out, void *data)
+{
+	return window_reply(data, PROTO_GREP, 'l', out->buf, out->len);
+}
+
+/* Search on, and answer with how it ended once it did */
+static int window_grep_step(struct window_client *c)
+{
+	int ret = grep_step(c->grep, &c->task->scrollback, GREP_STEP_BLOCKS);
+
+	if (ret > 0)
+		ret = window_reply(c, PROTO_GREP, grep_cut(c->grep) ? 'c' : 'd',
+				   NULL, 0);
+	if (ret != 0) {
+		grep_free(c->grep);
+		c->grep = NULL;
+		strbuf_release(&c->grep_out);
+	}
+	/* Back here once the socket can take more */
+	window_client_watch(c);
+	return ret;
+}
+
+/*
+ * Answer a GREP with the lines found, a piece at a time as the search
+ * goes, then with how it ended. The search goes GREP_STEP_BLOCKS at a
+ * time, carried on by window_client_flush() whenever the client has
+ * taken what was found so far, so in the server the other windows on
+ * the same worker aren't held up for long.
+ */
+static int window_grep(struct window_client *c,
+		       const struct proto_frame *frame)
+{
+	static const char bad_text[] = "the text is empty or more than a line";
+	static const char bad_context[] = "too many lines of context";
+	static const char busy[] = "already searching";
+	const char *text;
+	uint32_t context;
+	size_t len;
+
+	if (frame->len < 4) {
+		ferror_raw("Malformed GREP from socket");
+		return -1;
+	}
+	context = proto_get_u32(frame->payload);
+	text = frame->payload + 4;
+	len = frame->len - 4;
+	if (c->grep)
+		return window_reply(c, PROTO_GREP, 'e', busy, strlen(busy));
+	if (len == 0 || memchr(text, '\n', len))
+		return window_reply(c, PROTO_GREP, 'e', bad_text,
+				    strlen(bad_text));
+	if (context > GREP_MAX_CONTEXT)
+		return window_reply(c, PROTO_GREP, 'e', bad_context,
+				    strlen(bad_context));
+	c->grep = grep_start(&c->task->scrollback, text, len, context,
+			     &c->grep_out, window_grep_flush, c);
+	return window_grep_step(c);
+}
+
+/* Answer a STATS with what the window keeps and what it costs */
+static int window_stats(struct window_client *c)
+{
+	struct strbuf sb = STRBUF_INIT;
+	int ret;
+
+	history_stats(&c->task->scrollback, &sb);
+	ret = window_client_send(c, PROTO_STATS, sb.buf, sb.len);
+	strbuf_release(&sb);
+	return ret;
+}
+
+static int window_control_output(struct window_client *c, const char *buf,
+				 size_t len)
+{
+	vt_strip(&c->strip, buf, len, &c->unmatched);
+	if (c->unmatched.len > CONTROL_TEXT_MAX)
+		strbuf_remove(&c->unmatched, 0,
+			      c->unmatched.len - CONTROL_TEXT_MAX / 2);
+	return window_wait_match(c);
+}
+
+/*
+ * Pass pty output to the client without ever waiting for it. Return -1
+ * if the client has to go.
+ */
+static int window_client_output(struct window_client *c, const char *buf,
+				size_t len)
+{
+	size_t queued;
+
+	if (!c->hello_done || c->lagging || c->closing)
+		return 0;
+	if (c->control)
+		return window_control_output(c, buf, len);
+	if (c->sync)
+		return window_sync(c);
+	queued = c->shm ? c->shm->out.size - shm_ring_space(&c->shm->out) :
+			  c->out.len + PROTO_HDR_LEN;
+	if (queued + len > (c->shm ? c->shm->out.size : CLIENT_QUEUE_MAX)) {
+		if (c->disconnect_slow)
+			return window_kick(c, "client too slow");
+		c->lagging = 1;
+		/* shm clients wake us up once they caught up */
+		return c->shm ? window_resync(c) : 0;
+	}
+	if (!c->shm)
+		return window_client_send(c, PROTO_DATA, buf, len);
+	shm_ring_write(&c->shm->out, buf, len);
+	shm_ring_notify_data(&c->shm->out, c->shm->client_efd);
+	return 0;
+}
+
+static void on_shm(struct event_loop *loop, int fd, unsigned events,
+		   void *data)
+{
+	struct window_client *c = data;
+
+	(void)loop;
+	(void)events;
+	shm_wakeup_clear(fd);
+	if (c->lagging && window_resync(c) < 0) {
+		window_detach(c);
+		return;
+	}
+	window_drain_shm(c);
+}
+
+/*
+ * Create a shared memory channel for the client which asked for one.
+ * Return -1 if we can't, and the client stays on the socket.
+ */
+static int window_setup_shm(struct window_client *c)
+{
+	c->shm = malloc(sizeof(*c->shm));
+	if (c->shm == NULL || shm_channel_create(c->shm) < 0) {
+		free(c->shm);
+		c->shm = NULL;
+		return -1;
+	}
+	return 0;
+}
+
+/* Pass the channel to the client, all output goes through it from now */
+static int window_start_shm(struct window_client *c)
+{
+	int fds[SHM_NR_FDS];
+
+	shm_channel_fds(c->shm, fds);
+	if (proto_send_fds(c->fd, PROTO_SHM, NULL, 0, fds, SHM_NR_FDS) < 0) {
+		perror_raw("Error passing shared memory to socket");
+		return -1;
+	}
+	if (event_add(c->task->loop, c->shm->task_efd, EVENT_READ, on_shm,
+		      c) < 0) {
+		perror_raw("Error watching shared memory channel");
+		return -1;
+	}
+	if (window_resync(c) < 0)
+		return -1;
+	/* The client wakes us once it wrote input */
+	if (shm_ring_sleep(&c->shm->in))
+		window_drain_shm(c);
+	return 0;
+}
+
+static void window_release_shm(struct window_client *c)
+{
+	if (c->shm == NULL)
+		return;
+	event_del(c->task->loop, c->shm->task_efd);
+	shm_channel_release(c->shm);
+	free(c->shm);
+	c->shm = NULL;
+}
+
+static void set_nonblock(int fd)
+{
+	if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) < 0)
+		perror_raw("Error setting O_NONBLOCK");
+}
+
+/*
+ * Give the client the pty master, so it talks to the program without
+ * going through us. We stop reading the pty until the client is gone,
+ * so the screen model and scrollback miss what is printed meanwhile.
+ */
+static int window_hand_over(struct window_client *c)
+{
+	struct window_task *task = c->task;
+
+	if (proto_send_fds(c->fd, PROTO_MASTER, NULL, 0, &task->master_fd,
+			   1) < 0) {
+		/* Tried again once the socket has room */
+		if (errno == EAGAIN)
+			return 0;
+		perror_raw("Error passing pty master to socket");
+		return -1;
+	}
+	event_del(task->loop, task->master_fd);
+	task->direct = c;
+	c->direct = 1;
+	c->want_direct = 0;
+	return 0;
+}
+
+/*
+ * Write what the socket takes of the client's queue, and once it is
+ * empty do what waited for that. Return -1 if the client has to go.
+ */
+static int window_client_flush(struct window_client *c)
+{
+	ssize_t n;
+
+	if (c->out.len) {
+		n = write(c->fd, c->out.buf, c->out.len);
+		if (n < 0 && errno != EAGAIN && errno != EINTR) {
+			perror_raw("Error writing to socket");
+			return -1;
+		}
+		if (n > 0)
+			strbuf_remove(&c->out, 0, n);
+	}
+	if (c->out.len == 0 && c->closing)
+		return -1;
+	if (c->out.len == 0 && c->lagging && window_resync(c) < 0)
+		return -1;
+	if (c->out.len == 0 && c->want_direct && window_hand_over(c) < 0)
+		return -1;
+	if (c->out.len == 0 && c->grep && window_grep_step(c) < 0)
+		return -1;
+	window_client_watch(c);
+	return 0;
+}
+
+/*
+ * Take the pty master back from a direct client. Programs which redraw
+ * on SIGWINCH (editors, pagers, top...) bring the screen model up to
+ * date again.
+ */
+static void window_take_back(struct window_task *task)
+{
+	pid_t pgrp;
+
+	task->direct = NULL;
+	/* The client may have made the shared file description blocking */
+	set_nonblock(task->master_fd);
+	if (event_add(task->loop, task->master_fd, EVENT_READ, on_master,
+		      task) < 0)
+		perror_raw("Error watching pty master");
+	window_watch(task);
+	pgrp = tcgetpgrp(task->master_fd);
+	if (pgrp > 0)
+		kill(-pgrp, SIGWINCH);
+}
+
+/* Tell the client why it is turned away */
+static int window_refuse(struct window_client *c, const char *msg)
+{
+	ferror_raw("Refusing client: %s", msg);
+	window_client_send(c, PROTO_ERROR, msg, strlen(msg));
+	return -1;
+}
+
+/*
+ * Answer the HELLO of a new connection. Return -1 if the client speaks
+ * a protocol version we don't understand, or can't be served.
+ */
+static int window_handshake(struct window_client *c,
+			    const struct proto_frame *frame)
+{
+	struct window_task *task = c->task;
+	struct proto_hello hello, reply = { 0 };
+	int ok;
+
+	ok = proto_parse_hello(frame, &hello) == 0 &&
+	     hello.version == PROTO_VERSION;
+	if (ok && (hello.flags & PROTO_HELLO_CONTROL)) {
+		reply.flags |= PROTO_HELLO_CONTROL;
+		c->control = 1;
+	} else if (ok && (hello.flags & PROTO_HELLO_SYNC) &&
+		   !(hello.flags & PROTO_HELLO_DIRECT)) {
+		/* Screen updates are small, they go over the socket */
+		reply.flags |= PROTO_HELLO_SYNC;
+		c->sync = 1;
+	} else if (ok && (hello.flags & PROTO_HELLO_SHM) &&
+		   !(hello.flags & PROTO_HELLO_DIRECT) &&
+		   window_setup_shm(c) == 0) {
+		reply.flags |= PROTO_HELLO_SHM;
+	}
+	/* Always tell the client our version, so it can report a mismatch */
+	if (proto_send_hello(c->fd, &reply) < 0) {
+		perror_raw("Error sending HELLO to socket");
+		return -1;
+	}
+	if (!ok) {
+		ferror_raw("Unsupported protocol version %d from client",
+			   hello.version);
+		return -1;
+	}
+	/* The pty can't be shared with a direct client */
+	for (size_t i = 0; i < task->nr_clients; i++)
+		if (task->clients[i]->want_direct)
+			return window_refuse(c, "window is attached directly");
+	if (task->direct)
+		return window_refuse(c, "window is attached directly");
+	if ((hello.flags & PROTO_HELLO_DIRECT) && task->nr_clients > 1)
+		return window_refuse(c, "window has other clients attached");
+	/* A direct client's output would never reach the log */
+	if ((hello.flags & PROTO_HELLO_DIRECT) && task->log)
+		return window_refuse(c, "window is logged, attach without -D");
+	/* Nor would the triggers see it, and silence would be reported */
+	if ((hello.flags & PROTO_HELLO_DIRECT) && task->triggers)
+		return window_refuse(c,
+				     "window has triggers, attach without -D");
+
+	c->hello_done = 1;
+	/* Scripts get no output, so no repaint either, and have no size */
+	if (c->control)
+		return 0;
+	/* Somebody is looking now */
+	if (task->triggers)
+		triggers_clear_flag(task->triggers);
+	c->read_only = !!(hello.flags & PROTO_HELLO_READONLY);
+	c->disconnect_slow = !!(hello.flags & PROTO_HELLO_DISCONNECT);
+	if (hello.flags & PROTO_HELLO_WINSIZE) {
+		c->ws = hello.ws;
+		c->has_size = 1;
+	}
+	window_client_active(c);
+	/* The first update is the whole screen */
+	if (c->sync)
+		return window_sync(c);
+	/* Brought up to date by window_resync() */
+	c->lagging = 1;
+	if (c->shm)
+		return window_start_shm(c);
+	/* The pty master follows the repaint */
+	c->want_direct = !!(hello.flags & PROTO_HELLO_DIRECT);
+	return window_client_flush(c);
+}
+
+/*
+ * Handle every whole frame buffered in the reader. Return -1 if the
+ * client sent something we can't handle and should be dropped.
+ */
+static int window_dispatch(struct window_client *c)
+{
+	struct proto_frame frame;
+	struct winsize ws;
+	int ret;
+
+	while ((ret = proto_reader_next(&c->reader, &frame)) > 0) {
+		if (!c->hello_done) {
+			if (frame.type != PROTO_HELLO) {
+				ferror_raw("Expected HELLO from socket");
+				return -1;
+			}
+			if (window_handshake(c, &frame) < 0)
+				return -1;
+			continue;
+		}
+
+		switch (frame.type) {
+		case PROTO_DATA:
+			if (c->read_only)
+				break;
+			window_client_active(c);
+			if (window_write_input(c->task, frame.payload,
+					       frame.len) < 0) {
+				perror_raw("Error writing to pty master");
+				return -1;
+			}
+			break;
+		case PROTO_WINCH:
+			if (proto_parse_winch(&frame, &ws) < 0) {
+				ferror_raw("Malformed window size from socket");
+				return -1;
+			}
+			c->ws = ws;
+			c->has_size = 1;
+			window_client_active(c);
+			if (c->task->size_owner == c)
+				window_resize(c->task, &ws);
+			break;
+		case PROTO_SCREEN:
+			if (!c->control) {
+				ferror_raw("Unexpected SCREEN from socket");
+				return -1;
+			}
+			if (window_screen(c, &frame) < 0)
+				return -1;
+			break;
+		case PROTO_WAIT:
+			if (!c->control) {
+				ferror_raw("Unexpected WAIT from socket");
+				return -1;
+			}
+			if (window_wait(c, &frame) < 0)
+				return -1;
+			break;
+		case PROTO_GREP:
+			if (!c->control) {
+				ferror_raw("Unexpected GREP from socket");
+				return -1;
+			}
+			if (window_grep(c, &frame) < 0)
+				return -1;
+			break;
+		case PROTO_STATS:
+			if (!c->control || frame.len != 0) {
+				ferror_raw("Unexpected STATS from socket");
+				return -1;
+			}
+			if (window_stats(c) < 0)
+				return -1;
+			break;
+		case PROTO_PAGE:
+			if (window_page(c, &frame) < 0)
+				return -1;
+			break;
+		case PROTO_REDRAW:
+			if (c->control || frame.len != 0) {
+				ferror_raw("Unexpected REDRAW from socket");
+				return -1;
+			}
+			if (window_redraw(c) < 0)
+				return -1;
+			break;
+		case PROTO_ACK:
+			if (!c->sync || frame.len != 4) {
+				ferror_raw("Unexpected ACK from socket");
+				return -1;
+			}
+			/* The client is ready for the next update */
+			c->sync_acked = proto_get_u32(frame.payload);
+			if (window_sync(c) < 0)
+				return -1;
+			break;
+		default:
+			ferror_raw("Unknown frame from socket: %c", frame.type);
+			return -1;
+		}
+	}
+	if (ret < 0) {
+		ferror_raw("Malformed frame from socket");
+		return -1;
+	}
+	return 0;
+}
+
+static void window_detach(struct window_client *c)
+{
+	struct window_task *task = c->task;
+
+	for (size_t i = 0; i < task->nr_clients; i++) {
+		if (task->clients[i] != c)
+			continue;
+		memmove(task->clients + i, task->clients + i + 1,
+			(task->nr_clients - i - 1) * sizeof(*task->clients));
+		task->nr_clients--;
+		break;
+	}
+	event_del(task->loop, c->fd);
+	proto_reader_release(&c->reader);
+	strbuf_release(&c->out);
+	vt_snapshot_release(&c->snap);
+	window_wait_stop(c);
+	strbuf_release(&c->unmatched);
+	grep_free(c->grep);
+	strbuf_release(&c->grep_out);
+	close(c->fd);
+	window_release_shm(c);
+	if (c->direct)
+		window_take_back(task);
+	if (task->size_owner == c)
+		window_pick_size(task);
+	free(c);
+}
+
+static void window_task_free(struct window_task *task)
+{
+	while (task->nr_clients)
+		window_detach(task->clients[task->nr_clients - 1]);
+	event_del(task->loop, task->socket_fd);
+	event_del(task->loop, task->master_fd);
+	if (task->tick_fd >= 0) {
+		event_del(task->loop, task->tick_fd);
+		close(task->tick_fd);
+	}
+	triggers_free(task->triggers);
+	window_log_close(task->log);
+	close(task->socket_fd);
+	close(task->master_fd);
+	unlink(task->socket_path);
+	free(task->socket_path);
+	free(task->clients);
+	history_release(&task->scrollback);
+	vt_free(task->vt);
+	free(task->relay_buf);
+	strbuf_release(&task->input);
+	free(task);
+}
+
+static void on_client(struct event_loop *loop, int fd, unsigned events,
+		      void *data)
+{
+	struct window_client *c = data;
+	ssize_t n;
+
+	(void)loop;
+	if ((events & EVENT_WRITE) && window_client_flush(c) < 0) {
+		window_detach(c);
+		return;
+	}
+	if (!(events & EVENT_READ))
+		return;
+	/* Read a batch of frames from socket */
+	n = proto_reader_fill(&c->reader, fd);
+	if (n < 0 && (errno == EAGAIN || errno == EINTR))
+		return;
+	if (n < 0)
+		perror_raw("Error reading from socket");
+	/* n == 0 means this `myscreen` detached from the window */
+	if (n <= 0 || (!c->closing && window_dispatch(c) < 0))
+		window_detach(c);
+}
+
+static void on_listen(struct event_loop *loop, int fd, unsigned events,
+		      void *data)
+{
+	struct window_task *task = data;
+	struct window_client *c;
+	int cfd;
+
+	(void)events;
+	cfd = socket_server_accept(fd);
+	if (cfd < 0) {
+		perror_raw("Error accept() failed");
+		return;
+	}
+	c = calloc(1, sizeof(*c));
+	if (c == NULL) {
+		ferror_raw("Error allocating memory for client");
+		close(cfd);
+		return;
+	}
+	c->task = task;
+	c->fd = cfd;
+	c->timer_fd = -1;
+	/* A slow client must never hold up the window */
+	set_nonblock(cfd);
+	proto_reader_init(&c->reader);
+	ALLOC_GROW(task->clients, task->nr_clients + 1, task->alloc_clients);
+	if (task->clients == NULL)
+		ferror_raw_die("Error allocating memory for clients");
+	task->clients[task->nr_clients++] = c;
+	if (event_add(loop, cfd, task->input.len ? 0 : EVENT_READ, on_client,
+		      c) < 0) {
+		perror_raw("Error watching client socket");
+		window_detach(c);
+	}
+}
+
+/* Size relay_buf for the next read after one which returned n bytes */
+static void relay_adapt(struct window_task *task, size_t n)
+{
+	size_t alloc = task->relay_alloc;
+	char *buf;
+
+	if (n == alloc && alloc < RELAY_MAX) {
+		alloc *= 2;
+		task->relay_short = 0;
+	} else if (n < alloc / 4 && alloc > RELAY_MIN) {
+		if (++task->relay_short < RELAY_SHRINK_READS)
+			return;
+		alloc /= 2;
+		task->relay_short = 0;
+	} else {
+		task->relay_short = 0;
+		return;
+	}
+	/* keep the old buffer if realloc() fails, it is still usable */
+	buf = realloc(task->relay_buf, alloc);
+	if (buf != NULL) {
+		task->relay_buf = buf;
+		task->relay_alloc = alloc;
+	}
+}
+
+/*
+ * A pty hands out at most a few KiB per read(), so keep reading the
+ * non-blocking master until buf is full or it runs dry. Return the bytes
+ * read, 0 if there were none after all, -1 if the pty is closed.
+ */
+static ssize_t read_pty(int fd, char *buf, size_t size)
+{
+	size_t len = 0;
+	ssize_t n;
+
+	while (len < size) {
+		n = read(fd, buf + len, size - len);
+		if (n > 0) {
+			len += n;
+			continue;
+		}
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0 && errno == EAGAIN)
+			break;
+		/* Linux reports EIO once the last slave fd is closed */
+		if (n < 0 && errno != EIO)
+			perror_raw("Error reading from pty master");
+		/* Hand out what we have, the next call reports the close */
+		return len > 0 ? (ssize_t)len : -1;
+	}
+	return len;
+}
+
+/*
+ * The pty master is drained even when nobody is attached, so programs
+ * in a detached window never block on a full pty.
+ */
+static void on_master(struct event_loop *loop, int fd, unsigned events,
+		      void *data)
+{
+	struct window_task *task = data;
+	ssize_t n;
+
+	(void)loop;
+	if (events & EVENT_WRITE)
+		window_flush_input(task);
+	if (!(events & EVENT_READ))
+		return;
+	n = read_pty(fd, task->relay_buf, task->relay_alloc);
+	if (n == 0)
+		return;
+	if (n < 0) {
+		ferror_raw("PTY closed");
+		window_task_free(task);
+		return;
+	}
+	history_write(&task->scrollback, task->relay_buf, n);
+	vt_write(task->vt, task->relay_buf, n);
+	if (task->triggers)
+		triggers_scan(task->triggers, task->relay_buf, n);
+	if (task->log)
+		window_log_write(task->log, task->relay_buf, n);
+	/* Backwards, as a client which fails is removed from the array */
+	for (size_t i = task->nr_clients; i-- > 0;) {
+		struct window_client *c = task->clients[i];
+
+		if (window_client_output(c, task->relay_buf, n) < 0)
+			window_detach(c);
+	}
+	relay_adapt(task, n);
+}
+
+/* Read ~/.myscreen.triggers, if there is one */
+static struct triggers *window_load_triggers(const char *socket_path)
+{
+	struct strbuf file = STRBUF_INIT;
+	struct triggers *t;
+	const char *home = getenv("HOME");
+
+	if (home == NULL || *home == '\0')
+		return NULL;
+	strbuf_addf(&file, "%s/%s", home, TRIGGERS_FILE);
+	t = triggers_load(file.buf, socket_path);
+	strbuf_release(&file);
+	return t;
+}
+
+/* The scrollback size ~/.myscreen.scrollback asks for, or the default */
+static size_t window_scrollback_limit(void)
+{
+	static const uint64_t sizes[] = { 1024, 1024 * 1024,
+					  1024 * 1024 * 1024 };
+	struct strbuf file = STRBUF_INIT;
+	const char *home = getenv("HOME");
+	char *line = NULL, *val;
+	size_t alloc = 0, limit = DEFAULT_SCROLLBACK;
+	uint64_t v;
+	FILE *fp;
+
+	if (home == NULL || *home == '\0')
+		return limit;
+	strbuf_addf(&file, "%s/%s", home, SCROLLBACK_FILE);
+	fp = fopen(file.buf, "r");
+	if (fp == NULL) {
+		if (errno != ENOENT)
+			perror_raw("Error reading scrollback size");
+		strbuf_release(&file);
+		return limit;
+	}
+	if (getline(&line, &alloc, fp) > 0) {
+		val = line + strspn(line, " \t");
+		val[strcspn(val, " \t\n")] = '\0';
+		if (parse_scaled(val, "KMG", sizes, &v) < 0 ||
+		    v < HISTORY_BLOCK || v > SIZE_MAX)
+			ferror_raw("%s: bad scrollback size, using %zu bytes",
+				   file.buf, limit);
+		else
+			limit = v;
+	}
+	free(line);
+	fclose(fp);
+	strbuf_release(&file);
+	return limit;
+}
+
+/* Start the session log ~/.myscreen.logging asks for, if any */
+static struct window_log *window_open_log(const char *socket_path)
+{
+	struct strbuf file = STRBUF_INIT;
+	struct window_log *log;
+	const char *home = getenv("HOME");
+
+	if (home == NULL || *home == '\0')
+		return NULL;
+	strbuf_addf(&file, "%s/%s", home, LOGGING_FILE);
+	log = window_log_open(file.buf, socket_path);
+	strbuf_release(&file);
+	return log;
+}
+
+static void on_tick(struct event_loop *loop, int fd, unsigned events,
+		    void *data)
+{
+	struct window_task *task = data;
+	uint64_t expired;
+
+	(void)loop;
+	(void)events;
+	if (read(fd, &expired, sizeof(expired)) < 0)
+		return;
+	triggers_tick(task->triggers);
+}
+
+#ifdef __linux__
+/* Tick every second, for the silence triggers */
+static int window_start_ticks(struct window_task *task)
+{
+	struct itimerspec its = { 0 };
+
+	task->tick_fd = timerfd_create(CLOCK_MONOTONIC,
+				       TFD_CLOEXEC | TFD_NONBLOCK);
+	if (task->tick_fd < 0)
+		return -1;
+	its.it_value.tv_sec = 1;
+	its.it_interval.tv_sec = 1;
+	if (timerfd_settime(task->tick_fd, 0, &its, NULL) < 0 ||
+	    event_add(task->loop, task->tick_fd, EVENT_READ, on_tick,
+		      task) < 0) {
+		close(task->tick_fd);
+		task->tick_fd = -1;
+		return -1;
+	}
+	return 0;
+}
+#else
+static int window_start_ticks(struct window_task *task)
+{
+	(void)task;
+	(void)on_tick;
+	errno = ENOSYS;
+	return -1;
+}
+#endif
+
+struct window_task *window_task_adopt(struct pty_info *pty_info,
+				      const char *socket_path, int socket_fd,
+				      pid_t pid, struct winsize *ws)
+{
+	struct window_task *task;
+
+	task = calloc(1, sizeof(*task));
+	if (task == NULL) {
+		ferror_raw("Error allocating memory for window task");
+		return NULL;
+	}
+	task->relay_alloc = RELAY_MIN;
+	task->relay_buf = malloc(task->relay_alloc);
+	task->socket_path = strdup(socket_path);
+	if (task->relay_buf == NULL || task->socket_path == NULL) {
+		ferror_raw("Error allocating memory for window task");
+		free(task->socket_path);
+		free(task->relay_buf);
+		free(task);
+		return NULL;
+	}
+	task->master_fd = pty_info->master_fd;
+	pty_info->master_fd = -1;
+	task->socket_fd = socket_fd;
+	task->pid = pid;
+	set_nonblock(task->master_fd);
+	history_init(&task->scrollback, window_scrollback_limit());
+	task->vt = vt_xalloc(ws->ws_row, ws->ws_col);
+	task->triggers = window_load_triggers(socket_path);
+	task->log = window_open_log(socket_path);
+	task->tick_fd = -1;
+	return task;
+}
+
+struct window_task *window_task_create(struct pty_info *pty_info,
+				       const char *socket_path,
+				       struct termios *termios,
+				       struct winsize *ws, char **argv)
+{
+	struct window_task *task;
+	int socket_fd;
+	pid_t pid;
+
+	/* Start a socket daemon listen on socket_path */
+	socket_fd = socket_server_start(socket_path);
+	if (socket_fd < 0)
+		return NULL;
+	/* Start a child process runs on pty */
+	pid = pty_exec(pty_info, termios, ws, argv);
+	if (pid >= 0) {
+		task = window_task_adopt(pty_info, socket_path, socket_fd, pid,
+					 ws);
+		if (task)
+			return task;
+		/* Closing the master hangs the program up */
+	}
+	close(socket_fd);
+	unlink(socket_path);
+	return NULL;
+}
+
+pid_t window_task_pid(struct window_task *task)
+{
+	return task->pid;
+}
+
+int window_task_register(struct window_task *task, struct event_loop *loop)
+{
+	task->loop = loop;
+	if (event_add(loop, task->master_fd, EVENT_READ, on_master, task) <
+		    0 ||
+	    event_add(loop, task->socket_fd, EVENT_READ, on_listen, task) <
+		    0) {
+		perror_raw("Error watching window task");
+		window_task_free(task);
+		return -1;
+	}
+	if (task->triggers && triggers_want_ticks(task->triggers) &&
+	    window_start_ticks(task) < 0)
+		perror_raw("Error starting timer, silence triggers are off");
+	return 0;
+}
+
+/*
+ * a window task does two things
+ *   - reads from a pty master, keeps the output in its scrollback and
+ *     screen model and writes it to every attached client.
+ *   - reads from its clients and writes to the pty master.
+ */
+void window_task_xrun(struct pty_info *pty_info, const char *socket_path,
+		      struct termios *termios, struct winsize *ws, char **argv,
+		      int ready_fd)
+{
+	struct window_task *task;
+	struct event_loop *loop;
+
+	if (setsid() <= 0)
+		perror_raw_die("Error creating new session in window task");
+	/* A client going away must not kill the window */
+	signal(SIGPIPE, SIG_IGN);
+	/* The client's handlers for restoring its tty are inherited */
+	signal(SIGINT, SIG_DFL);
+	signal(SIGTERM, SIG_DFL);
+	signal(SIGABRT, SIG_DFL);
+
+	loop = event_loop_alloc();
+	if (loop == NULL)
+		perror_raw_die("Error creating event loop");
+	task = window_task_create(pty_info, socket_path, termios, ws, argv);
+	if (task == NULL || window_task_register(task, loop) < 0)
+		exit(EXIT_FAILURE);
+	/* The socket listens, our parent may connect */
+	if (write_in_full(ready_fd, "", 1) < 0)
+		perror_raw("Error telling the window is ready");
+	close(ready_fd);
+	/* Our clients come and go, the terminal we started from with them */
+	stdio_to_devnull();
+
+	/*
+	 * This daemon only exit when receive a SIGKILL signal or the pty
+	 * is closed, which removes the task from the loop.
+	 */
+	while (event_loop_nr(loop) > 0)
+		if (event_loop_run_once(loop, -1) < 0)
+			perror_raw_die("Error waiting for events");
+	event_loop_free(loop);
+	/* The last output may still be on its way to the log */
+	window_log_sync();
+	exit(EXIT_SUCCESS);
+}
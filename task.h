@@ -0,0 +1,51 @@
+#ifndef TASK_H
+#define TASK_H
+
+#include <sys/types.h>
+#include <termios.h>
+#include "error_raw.h"
+#include "event.h"
+#include "pty.h"
+
+/*
+ * A window task owns the pty master of a window and the socket clients
+ * attach to. It is driven by an event loop, so one process can host a
+ * single window (the classic forked window task) or many of them (the
+ * myscreen server).
+ */
+struct window_task;
+
+/*
+ * Start argv on the pty and listen on socket_path. The task takes over
+ * pty_info->master_fd and leaves -1 there. Return NULL on failure.
+ */
+struct window_task *window_task_create(struct pty_info *pty_info,
+				       const char *socket_path,
+				       struct termios *termios,
+				       struct winsize *ws, char **argv);
+/*
+ * The same for a socket_fd listening on socket_path and a program pid
+ * started on the pty already. Only takes them over if it succeeds.
+ */
+struct window_task *window_task_adopt(struct pty_info *pty_info,
+				      const char *socket_path, int socket_fd,
+				      pid_t pid, struct winsize *ws);
+/* pid of the program running in the window */
+pid_t window_task_pid(struct window_task *task);
+/*
+ * Hand the task to a loop. The task removes itself from the loop and
+ * frees itself once the program in the window is gone.
+ */
+int window_task_register(struct window_task *task, struct event_loop *loop);
+
+/*
+ * Run a single window task in this process until its pty is closed.
+ * A byte is written to ready_fd, which is then closed, once clients can
+ * connect. If the task fails before, the fd is closed with nothing.
+ */
+NORETURN void window_task_xrun(struct pty_info *pty_info,
+			       const char *socket_path,
+			       struct termios *termios, struct winsize *ws,
+			       char **argv, int ready_fd);
+
+#endif
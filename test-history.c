@@ -0,0 +1,203 @@
+/*
+ * Checks of the scrollback: lz round trips over random, incompressible
+ * and repetitive input, the decompressor on corrupt input, and a
+ * history kept under its memory limit against a copy of all output.
+ * Run by `make test`, exits non-zero on the first failure.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "strbuf.h"
+#include "lz.h"
+#include "history.h"
+
+#define LIMIT (256 * 1024)
+
+static uint64_t seed = 88172645463325252ULL;
+static int failures;
+
+static uint32_t rnd(void)
+{
+	seed ^= seed << 13;
+	seed ^= seed >> 7;
+	seed ^= seed << 17;
+	return seed >> 32;
+}
+
+static void fail(const char *what, size_t a, size_t b)
+{
+	fprintf(stderr, "FAIL: %s (%zu, %zu)\n", what, a, b);
+	failures++;
+}
+
+/* Fill buf with one of the kinds of input, by kind */
+static void fill(char *buf, size_t len, int kind)
+{
+	static const char *words[] = { "\033[31m", "error ", "make[2]: ",
+				       "\r\n", "ok ", "\033[0m", "$ ls -l\n" };
+	size_t i = 0, period = 1 + rnd() % 7;
+
+	switch (kind) {
+	case 0: /* random, incompressible */
+		for (; i < len; i++)
+			buf[i] = rnd();
+		break;
+	case 1: /* one byte, or a short period, overlapping matches */
+		for (; i < len; i++)
+			buf[i] = "abcdefg"[i % period];
+		break;
+	default: /* terminal output like, with some noise */
+		while (i < len) {
+			const char *w = words[rnd() % 7];
+			size_t n = strlen(w);
+
+			if (rnd() % 5 == 0) {
+				buf[i++] = '0' + rnd() % 10;
+				continue;
+			}
+			if (n > len - i)
+				n = len - i;
+			memcpy(buf + i, w, n);
+			i += n;
+		}
+		break;
+	}
+}
+
+static void check_lz_round_trip(const char *buf, size_t len)
+{
+	/* Incompressible data grows by a length byte per 255 literals */
+	size_t cap = len + len / 255 + 16;
+	char *packed = malloc(cap), *out = malloc(len + 1);
+	size_t n;
+	ssize_t got;
+
+	n = lz_compress(buf, len, packed, cap);
+	if (n == 0) {
+		fail("lz_compress didn't fit", len, cap);
+		goto out;
+	}
+	got = lz_decompress(packed, n, out, len);
+	if (got != (ssize_t)len || memcmp(out, buf, len))
+		fail("lz round trip", len, (size_t)got);
+	/* Too small an output is refused, never overrun */
+	if (len > 0 && lz_decompress(packed, n, out, len - 1) >= 0)
+		fail("lz_decompress overran its output", len, n);
+	/* A cap which doesn't fit gives 0, or data which still decodes */
+	n = lz_compress(buf, len, packed, len / 2);
+	if (n && (lz_decompress(packed, n, out, len) != (ssize_t)len ||
+		  memcmp(out, buf, len)))
+		fail("lz round trip with a small cap", len, n);
+out:
+	free(packed);
+	free(out);
+}
+
+static void test_lz(void)
+{
+	char *buf = malloc(HISTORY_BLOCK), *junk = malloc(256);
+	char out[1024];
+
+	for (int kind = 0; kind < 3; kind++) {
+		for (size_t len = 0; len < 300; len++) {
+			fill(buf, len, kind);
+			check_lz_round_trip(buf, len);
+		}
+		for (int i = 0; i < 20; i++) {
+			size_t len = rnd() % HISTORY_BLOCK + 1;
+
+			fill(buf, len, kind);
+			check_lz_round_trip(buf, len);
+		}
+	}
+	/* Garbage must be refused or decode in bounds, ASan checks that */
+	for (int i = 0; i < 100000; i++) {
+		size_t len = rnd() % 256;
+
+		for (size_t j = 0; j < len; j++)
+			junk[j] = rnd();
+		if (lz_decompress(junk, len, out, rnd() % sizeof(out)) >
+		    (ssize_t)sizeof(out))
+			fail("lz_decompress past its cap", len, 0);
+	}
+	free(buf);
+	free(junk);
+}
+
+/* Compare what h keeps with all the output, in all */
+static void check_history(struct history *h, const struct strbuf *all)
+{
+	struct strbuf sb = STRBUF_INIT;
+	uint64_t start = history_start(h), nr, first, pos;
+	const char *p;
+
+	if (history_end(h) != all->len)
+		fail("history end", history_end(h), all->len);
+	if (h->mem > h->limit && h->nr > 0)
+		fail("history over its limit", h->mem, h->limit);
+	history_read(h, start, history_end(h), &sb);
+	if (sb.len != all->len - start ||
+	    memcmp(sb.buf, all->buf + start, sb.len))
+		fail("history read", sb.len, all->len - start);
+
+	/* The line index, against newlines counted in the copy */
+	first = 0;
+	for (p = all->buf; (p = memchr(p, '\n', all->buf + start - p)); p++)
+		first++;
+	if (history_first_line(h) != first)
+		fail("first line", history_first_line(h), first);
+	nr = first;
+	pos = start;
+	for (p = all->buf + start;
+	     (p = memchr(p, '\n', all->buf + all->len - p)); p++) {
+		nr++;
+		pos = p - all->buf + 1;
+		if (rnd() % 64 == 0 && history_line_pos(h, nr) != pos)
+			fail("line position", history_line_pos(h, nr), pos);
+	}
+	if (history_line_pos(h, nr + 1) != (nr > first ? pos : start))
+		fail("position past the last line", nr, pos);
+	if (history_line_pos(h, first) != start)
+		fail("position of the first line", first, start);
+	strbuf_release(&sb);
+}
+
+static void test_history(void)
+{
+	struct strbuf all = STRBUF_INIT;
+	struct history h;
+	char *buf = malloc(3 * HISTORY_BLOCK);
+
+	history_init(&h, LIMIT);
+	check_history(&h, &all);
+	for (int i = 0; i < 400; i++) {
+		/* Mostly small writes, now and then more than a block */
+		size_t len = rnd() % 8 ? rnd() % 4096 :
+					 rnd() % (3 * HISTORY_BLOCK);
+
+		fill(buf, len, i % 7 == 0 ? 0 : i % 7 == 1 ? 1 : 2);
+		history_write(&h, buf, len);
+		strbuf_add(&all, buf, len);
+		if (i % 10 == 0)
+			check_history(&h, &all);
+	}
+	check_history(&h, &all);
+	if (history_start(&h) == 0)
+		fail("nothing was dropped at the limit", all.len, LIMIT);
+	history_release(&h);
+	strbuf_release(&all);
+	free(buf);
+}
+
+int main(void)
+{
+	test_lz();
+	test_history();
+	if (failures) {
+		fprintf(stderr, "%d checks failed\n", failures);
+		return EXIT_FAILURE;
+	}
+	printf("ok\n");
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,490 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <spawn.h>
+#include <sys/wait.h>
+#include "compat_util.h"
+#include "error_raw.h"
+#include "strbuf.h"
+#include "wrapper.h"
+#include "trigger.h"
+
+enum { TRIGGER_TEXT, TRIGGER_SILENT };
+enum { ACTION_FLAG, ACTION_FIFO, ACTION_HOOK };
+
+struct trigger {
+	int event;
+	char *text; /* TRIGGER_TEXT */
+	unsigned seconds; /* TRIGGER_SILENT */
+	int action;
+	char *arg; /* the FIFO or the hook command */
+	uint64_t fired; /* getnanotime() it last fired at, 0 if never */
+	unsigned long fired_silence; /* the silence it last fired in */
+	int next; /* next trigger on the same text, -1 at the end */
+};
+
+/* A state of the automaton, the node of a prefix of some texts */
+struct ac_state {
+	uint32_t fail; /* the longest proper suffix which is a state too */
+	int32_t out; /* this or the nearest fail state ending a text, or -1 */
+	int first; /* first trigger on the text ending here, or -1 */
+};
+
+struct triggers {
+	char *socket_path;
+	char *flag_path;
+	struct trigger *list;
+	size_t nr, alloc;
+
+	/*
+	 * Bytes are mapped to classes first, the bytes in no text all to
+	 * class 0, which keeps the transition table small.
+	 */
+	unsigned char classes[256];
+	size_t nr_classes;
+	uint32_t *delta; /* next state, by state and class */
+	size_t alloc_delta;
+	struct ac_state *states;
+	size_t nr_states, alloc_states;
+	uint32_t state; /* where the output so far left us */
+
+	/* Silence is counted in ticks */
+	int want_ticks;
+	unsigned long output; /* bumped by every scan */
+	unsigned long output_seen; /* output at the last tick */
+	unsigned long silence; /* number of the current silence */
+	unsigned silent_ticks; /* ticks since the output last changed */
+
+	/* Hooks started and maybe not reaped yet */
+	pid_t *hooks;
+	size_t nr_hooks, alloc_hooks;
+};
+
+extern char **environ;
+
+static void write_flag(struct triggers *t, const char *alert)
+{
+	int fd;
+
+	fd = open(t->flag_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+		  0600);
+	if (fd < 0 || write_in_full(fd, alert, strlen(alert)) < 0 ||
+	    write_in_full(fd, "\n", 1) < 0)
+		perror_raw("Error flagging window");
+	if (fd >= 0)
+		close(fd);
+}
+
+static void write_fifo(struct triggers *t, const char *fifo,
+		       const char *alert)
+{
+	struct strbuf line = STRBUF_INIT;
+	int fd;
+
+	/* Nobody reading is no error, and a full FIFO drops the line */
+	fd = open(fifo, O_WRONLY | O_NONBLOCK | O_CLOEXEC);
+	if (fd < 0)
+		return;
+	strbuf_addf(&line, "%s %s\n", t->socket_path, alert);
+	/* Short enough to go in whole, or not at all */
+	if (write(fd, line.buf, line.len) < 0 && errno != EAGAIN)
+		perror_raw("Error writing to trigger FIFO");
+	close(fd);
+	strbuf_release(&line);
+}
+
+/* Reap the hooks which are done, without waiting for the others */
+static void reap_hooks(struct triggers *t)
+{
+	for (size_t i = 0; i < t->nr_hooks;) {
+		pid_t pid = waitpid(t->hooks[i], NULL, WNOHANG);
+
+		/* Where SIGCHLD is ignored the kernel reaped it */
+		if (pid == 0 || (pid < 0 && errno == EINTR))
+			i++;
+		else
+			t->hooks[i] = t->hooks[--t->nr_hooks];
+	}
+}
+
+/*
+ * Run cmd with posix_spawn(), which doesn't copy the address space and
+ * runs nothing of ours in the child. In the server we are one of many
+ * threads, so the environment and arguments are all made up before.
+ */
+static void run_hook(struct triggers *t, const char *cmd, const char *alert)
+{
+	struct strbuf sock = STRBUF_INIT, msg = STRBUF_INIT;
+	char *argv[] = { "sh", "-c", (char *)cmd, NULL };
+	char **envp;
+	size_t nr = 0, n = 0;
+	posix_spawnattr_t attr;
+	sigset_t none, dfl;
+	short flags = POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETSIGMASK;
+	pid_t pid;
+
+	reap_hooks(t);
+	while (environ[nr])
+		nr++;
+	ALLOC_ARRAY(envp, nr + 3);
+	if (envp == NULL)
+		ferror_raw_die("Error allocating memory for trigger hook");
+	strbuf_addf(&sock, "MYSCREEN_SOCKET=%s", t->socket_path);
+	strbuf_addf(&msg, "MYSCREEN_ALERT=%s", alert);
+	for (size_t i = 0; i < nr; i++)
+		if (strncmp(environ[i], "MYSCREEN_SOCKET=", 16) &&
+		    strncmp(environ[i], "MYSCREEN_ALERT=", 15))
+			envp[n++] = environ[i];
+	envp[n++] = sock.buf;
+	envp[n++] = msg.buf;
+	envp[n] = NULL;
+
+	/* Undo what the window ignores, and detach the hook from it */
+	sigemptyset(&none);
+	sigemptyset(&dfl);
+	sigaddset(&dfl, SIGPIPE);
+	sigaddset(&dfl, SIGCHLD);
+#ifdef POSIX_SPAWN_SETSID
+	flags |= POSIX_SPAWN_SETSID;
+#endif
+	posix_spawnattr_init(&attr);
+	posix_spawnattr_setflags(&attr, flags);
+	posix_spawnattr_setsigmask(&attr, &none);
+	posix_spawnattr_setsigdefault(&attr, &dfl);
+	errno = posix_spawn(&pid, "/bin/sh", NULL, &attr, argv, envp);
+	posix_spawnattr_destroy(&attr);
+	if (errno) {
+		perror_raw("Error running trigger hook");
+	} else {
+		ALLOC_GROW(t->hooks, t->nr_hooks + 1, t->alloc_hooks);
+		if (t->hooks == NULL)
+			ferror_raw_die("Error allocating memory for trigger hook");
+		t->hooks[t->nr_hooks++] = pid;
+	}
+	free(envp);
+	strbuf_release(&sock);
+	strbuf_release(&msg);
+}
+
+static void trigger_fire(struct triggers *t, const struct trigger *tr)
+{
+	struct strbuf alert = STRBUF_INIT;
+
+	if (tr->event == TRIGGER_TEXT)
+		strbuf_addf(&alert, "on %s", tr->text);
+	else
+		strbuf_addf(&alert, "silent %u", tr->seconds);
+	switch (tr->action) {
+	case ACTION_FLAG:
+		write_flag(t, alert.buf);
+		break;
+	case ACTION_FIFO:
+		write_fifo(t, tr->arg, alert.buf);
+		break;
+	case ACTION_HOOK:
+		run_hook(t, tr->arg, alert.buf);
+		break;
+	}
+	strbuf_release(&alert);
+}
+
+/* Cut the next word, or "quoted text", off *p. NULL at the end. */
+static char *next_token(char **p)
+{
+	char *s = *p, *end;
+
+	s += strspn(s, " \t");
+	if (*s == '\0')
+		return NULL;
+	if (*s == '"') {
+		end = strchr(++s, '"');
+		if (end == NULL)
+			return NULL;
+	} else {
+		end = s + strcspn(s, " \t");
+	}
+	*p = *end ? end + 1 : end;
+	*end = '\0';
+	return s;
+}
+
+/* Add the trigger on line, return -1 if it makes no sense */
+static int parse_trigger(struct triggers *t, char *line)
+{
+	struct trigger tr = { .next = -1 };
+	char *p = line, *word, *end;
+	unsigned long n;
+
+	word = next_token(&p);
+	if (word == NULL || *word == '#')
+		return 0;
+	if (!strcmp(word, "on")) {
+		tr.event = TRIGGER_TEXT;
+		tr.text = next_token(&p);
+		if (tr.text == NULL || *tr.text == '\0')
+			return -1;
+	} else if (!strcmp(word, "silent")) {
+		tr.event = TRIGGER_SILENT;
+		word = next_token(&p);
+		if (word == NULL)
+			return -1;
+		n = strtoul(word, &end, 10);
+		if (*end || end == word || n == 0 || n > UINT_MAX)
+			return -1;
+		tr.seconds = n;
+	} else {
+		return -1;
+	}
+
+	word = next_token(&p);
+	if (word == NULL)
+		return -1;
+	if (!strcmp(word, "flag")) {
+		tr.action = ACTION_FLAG;
+	} else if (!strcmp(word, "fifo")) {
+		tr.action = ACTION_FIFO;
+		tr.arg = next_token(&p);
+		if (tr.arg == NULL)
+			return -1;
+	} else if (!strcmp(word, "hook")) {
+		tr.action = ACTION_HOOK;
+		tr.arg = p + strspn(p, " \t");
+		if (*tr.arg == '\0')
+			return -1;
+		/* The rest of the line, the shell splits it */
+		p += strlen(p);
+	} else {
+		return -1;
+	}
+	if (next_token(&p))
+		return -1;
+
+	if (tr.text)
+		tr.text = strdup(tr.text);
+	if (tr.arg)
+		tr.arg = strdup(tr.arg);
+	ALLOC_GROW(t->list, t->nr + 1, t->alloc);
+	if (t->list == NULL)
+		ferror_raw_die("Error allocating memory for triggers");
+	t->list[t->nr++] = tr;
+	if (tr.event == TRIGGER_SILENT)
+		t->want_ticks = 1;
+	return 0;
+}
+
+static uint32_t new_state(struct triggers *t)
+{
+	uint32_t s = t->nr_states++;
+
+	ALLOC_GROW(t->states, t->nr_states, t->alloc_states);
+	ALLOC_GROW(t->delta, t->nr_states * t->nr_classes, t->alloc_delta);
+	if (t->states == NULL || t->delta == NULL)
+		ferror_raw_die("Error allocating memory for triggers");
+	memset(t->delta + s * t->nr_classes, 0,
+	       t->nr_classes * sizeof(*t->delta));
+	t->states[s].fail = 0;
+	t->states[s].out = -1;
+	t->states[s].first = -1;
+	return s;
+}
+
+/*
+ * Build the trie of the texts, then turn it into a DFA breadth first:
+ * a missing transition of a state is the one of its fail state, which
+ * is shallower and so done already. Scanning is then one table lookup
+ * per byte, whatever the number of texts.
+ */
+static void build_automaton(struct triggers *t)
+{
+	uint32_t *queue, u, v, s;
+	size_t k, head = 0, tail = 0;
+
+	t->nr_classes = 1;
+	for (size_t i = 0; i < t->nr; i++)
+		for (const char *p = t->list[i].text; p && *p; p++)
+			if (!t->classes[(unsigned char)*p])
+				t->classes[(unsigned char)*p] = t->nr_classes++;
+	if (t->nr_classes == 1)
+		return;
+	k = t->nr_classes;
+
+	new_state(t);
+	for (size_t i = 0; i < t->nr; i++) {
+		s = 0;
+		for (const char *p = t->list[i].text; p && *p; p++) {
+			uint32_t c = t->classes[(unsigned char)*p];
+
+			if (t->delta[s * k + c] == 0) {
+				v = new_state(t);
+				t->delta[s * k + c] = v;
+			}
+			s = t->delta[s * k + c];
+		}
+		if (t->list[i].text == NULL)
+			continue;
+		t->list[i].next = t->states[s].first;
+		t->states[s].first = i;
+		t->states[s].out = s;
+	}
+
+	ALLOC_ARRAY(queue, t->nr_states);
+	if (queue == NULL)
+		ferror_raw_die("Error allocating memory for triggers");
+	queue[tail++] = 0;
+	while (head < tail) {
+		u = queue[head++];
+		for (size_t c = 0; c < k; c++) {
+			v = t->delta[u * k + c];
+			if (v) {
+				s = u ? t->delta[t->states[u].fail * k + c] : 0;
+				t->states[v].fail = s;
+				if (t->states[v].out < 0)
+					t->states[v].out = t->states[s].out;
+				queue[tail++] = v;
+			} else if (u) {
+				t->delta[u * k + c] =
+					t->delta[t->states[u].fail * k + c];
+			}
+		}
+	}
+	free(queue);
+}
+
+struct triggers *triggers_load(const char *file, const char *socket_path)
+{
+	struct triggers *t;
+	struct strbuf flag = STRBUF_INIT;
+	char *line = NULL;
+	size_t alloc = 0;
+	ssize_t len;
+	int lineno = 0;
+	FILE *fp;
+
+	fp = fopen(file, "r");
+	if (fp == NULL) {
+		if (errno != ENOENT)
+			perror_raw("Error reading triggers");
+		return NULL;
+	}
+	t = calloc(1, sizeof(*t));
+	if (t == NULL)
+		ferror_raw_die("Error allocating memory for triggers");
+	while ((len = getline(&line, &alloc, fp)) > 0) {
+		lineno++;
+		if (line[len - 1] == '\n')
+			line[len - 1] = '\0';
+		if (parse_trigger(t, line) < 0)
+			ferror_raw("%s:%d: bad trigger, skipped", file, lineno);
+	}
+	free(line);
+	fclose(fp);
+	if (t->nr == 0) {
+		triggers_free(t);
+		return NULL;
+	}
+
+	strbuf_addf(&flag, "%s%s", socket_path, TRIGGER_FLAG_SUFFIX);
+	t->flag_path = flag.buf;
+	t->socket_path = strdup(socket_path);
+	if (t->socket_path == NULL)
+		ferror_raw_die("Error allocating memory for triggers");
+	build_automaton(t);
+	t->silence = 1;
+	return t;
+}
+
+void triggers_free(struct triggers *t)
+{
+	if (t == NULL)
+		return;
+	if (t->flag_path)
+		unlink(t->flag_path);
+	for (size_t i = 0; i < t->nr; i++) {
+		free(t->list[i].text);
+		free(t->list[i].arg);
+	}
+	/* Hooks still running are reaped by init once we are gone */
+	reap_hooks(t);
+	free(t->hooks);
+	free(t->list);
+	free(t->delta);
+	free(t->states);
+	free(t->flag_path);
+	free(t->socket_path);
+	free(t);
+}
+
+/* State s ends some texts, fire their triggers */
+static void triggers_hit(struct triggers *t, uint32_t s)
+{
+	uint64_t now = getnanotime();
+
+	for (int32_t x = t->states[s].out; x >= 0;
+	     x = t->states[t->states[x].fail].out) {
+		for (int i = t->states[x].first; i >= 0; i = t->list[i].next) {
+			struct trigger *tr = &t->list[i];
+
+			if (tr->fired &&
+			    now - tr->fired < TRIGGER_HOLDOFF * 1000000000ULL)
+				continue;
+			tr->fired = now;
+			trigger_fire(t, tr);
+		}
+	}
+}
+
+void triggers_scan(struct triggers *t, const char *buf, size_t len)
+{
+	const unsigned char *p = (const unsigned char *)buf;
+	const uint32_t *delta = t->delta;
+	const unsigned char *classes = t->classes;
+	size_t k = t->nr_classes;
+	uint32_t s = t->state;
+
+	t->output++;
+	if (t->nr_states == 0)
+		return;
+	for (size_t i = 0; i < len; i++) {
+		s = delta[s * k + classes[p[i]]];
+		if (t->states[s].out >= 0)
+			triggers_hit(t, s);
+	}
+	t->state = s;
+}
+
+int triggers_want_ticks(const struct triggers *t)
+{
+	return t->want_ticks;
+}
+
+void triggers_tick(struct triggers *t)
+{
+	if (t->output != t->output_seen) {
+		t->output_seen = t->output;
+		t->silent_ticks = 0;
+		t->silence++;
+		return;
+	}
+	t->silent_ticks++;
+	for (size_t i = 0; i < t->nr; i++) {
+		struct trigger *tr = &t->list[i];
+
+		if (tr->event != TRIGGER_SILENT ||
+		    t->silent_ticks < tr->seconds ||
+		    tr->fired_silence == t->silence)
+			continue;
+		tr->fired_silence = t->silence;
+		trigger_fire(t, tr);
+	}
+}
+
+void triggers_clear_flag(struct triggers *t)
+{
+	unlink(t->flag_path);
+}
@@ -0,0 +1,52 @@
+#ifndef TRIGGER_H
+#define TRIGGER_H
+
+#include <stddef.h>
+
+/*
+ * Triggers watch the output of a window for text, or for the lack of
+ * it, and act on it. They are read from ~/.myscreen.triggers when the
+ * window starts, one per line:
+ *
+ *   on TEXT ACTION           TEXT shows up in the output
+ *   silent SECONDS ACTION    nothing was printed for that long
+ *
+ * where TEXT is a word or "text in double quotes", and ACTION is
+ *
+ *   flag                     mark the window in `myscreen --list`
+ *   fifo PATH                write a line to the FIFO at PATH
+ *   hook COMMAND...          run COMMAND with /bin/sh
+ *
+ * Blank lines and lines starting with '#' are skipped.
+ *
+ * All the texts are looked for in one pass over the raw output, by an
+ * Aho-Corasick automaton, so the cost per byte doesn't depend on how
+ * many there are. A trigger fires at most once in TRIGGER_HOLDOFF
+ * seconds, and a silence trigger once per silence. A window with
+ * triggers refuses -D clients, whose output it would never see.
+ */
+#define TRIGGERS_FILE	".myscreen.triggers"
+#define TRIGGER_HOLDOFF 5
+/* Where the flag action leaves the last alert, next to the socket */
+#define TRIGGER_FLAG_SUFFIX ".alert"
+
+struct triggers;
+
+/*
+ * Read the triggers of the window listening on socket_path from file.
+ * Return NULL if there are none. Bad lines are reported and skipped.
+ */
+struct triggers *triggers_load(const char *file, const char *socket_path);
+/* Remove the flag too, the window is gone */
+void triggers_free(struct triggers *t);
+
+/* Look for the texts in the next piece of output */
+void triggers_scan(struct triggers *t, const char *buf, size_t len);
+/* Whether triggers_tick() has to be called every second */
+int triggers_want_ticks(const struct triggers *t);
+/* A second passed, fire the silence triggers due */
+void triggers_tick(struct triggers *t);
+/* Somebody looked at the window, remove the flag */
+void triggers_clear_flag(struct triggers *t);
+
+#endif
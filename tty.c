@@ -2,6 +2,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <assert.h>
 #include <termios.h>
 #include <unistd.h>
@@ -60,3 +61,53 @@ void tty_get_winsize(int fd, struct winsize *ws)
 	if (ioctl(fd, TIOCGWINSZ, ws) < 0)
 		perror_raw_die("Error getting window size: %s");
 }
+
+/* What `stty sane` sets, in a UTF-8 locale */
+void tty_default_termios(struct termios *t)
+{
+	memset(t, 0, sizeof(*t));
+	t->c_iflag = BRKINT | ICRNL | IXON | IMAXBEL;
+#ifdef IUTF8
+	t->c_iflag |= IUTF8;
+#endif
+	t->c_oflag = OPOST | ONLCR;
+	t->c_cflag = CS8 | CREAD | HUPCL;
+	t->c_lflag = ISIG | ICANON | IEXTEN | ECHO | ECHOE | ECHOK | ECHOCTL |
+		     ECHOKE;
+	t->c_cc[VINTR] = CINTR;
+	t->c_cc[VQUIT] = CQUIT;
+	t->c_cc[VERASE] = CERASE;
+	t->c_cc[VKILL] = CKILL;
+	t->c_cc[VEOF] = CEOF;
+	t->c_cc[VSTART] = CSTART;
+	t->c_cc[VSTOP] = CSTOP;
+	t->c_cc[VSUSP] = CSUSP;
+	t->c_cc[VREPRINT] = CREPRINT;
+	t->c_cc[VWERASE] = CWERASE;
+	t->c_cc[VLNEXT] = CLNEXT;
+	t->c_cc[VDISCARD] = CDISCARD;
+	t->c_cc[VMIN] = 1;
+	t->c_cc[VTIME] = 0;
+	cfsetispeed(t, B38400);
+	cfsetospeed(t, B38400);
+}
+
+int tty_parse_winsize(const char *s, struct winsize *ws)
+{
+	unsigned long cols, rows;
+	char *end;
+
+	cols = strtoul(s, &end, 10);
+	if (end == s || *end != 'x')
+		return -1;
+	s = end + 1;
+	rows = strtoul(s, &end, 10);
+	if (end == s || *end)
+		return -1;
+	if (cols == 0 || rows == 0 || cols > 0xffff || rows > 0xffff)
+		return -1;
+	memset(ws, 0, sizeof(*ws));
+	ws->ws_col = cols;
+	ws->ws_row = rows;
+	return 0;
+}
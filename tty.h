@@ -10,4 +10,9 @@ int tty_set_raw(int fd, struct termios *prev);
 /* Only called in *raw* mode */
 void tty_get_winsize(int fd, struct winsize *ws);
 
+/* The settings of a fresh terminal, for windows started without one */
+void tty_default_termios(struct termios *t);
+/* Parse "COLSxROWS" into ws, return -1 if it is no such size */
+int tty_parse_winsize(const char *s, struct winsize *ws);
+
 #endif
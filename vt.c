@@ -0,0 +1,1555 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include "compat_util.h"
+#include "error_raw.h"
+#include "vt.h"
+
+enum {
+	VT_GROUND,
+	VT_ESC,
+	VT_ESC_INTER, /* ESC followed by an intermediate byte */
+	VT_CSI,
+	VT_OSC,
+	VT_OSC_ESC, /* ESC inside an OSC, maybe the start of ST */
+	VT_STR, /* DCS, SOS, PM and APC, which we ignore */
+	VT_STR_ESC,
+};
+
+#define ESC "\033"
+
+/* DEC special graphics, for 0x60..0x7e when G0/G1 selects it */
+static const uint32_t dec_graphics[31] = {
+	0x25c6, 0x2592, 0x2409, 0x240c, 0x240d, 0x240a, 0x00b0, 0x00b1,
+	0x2424, 0x240b, 0x2518, 0x2510, 0x250c, 0x2514, 0x253c, 0x23ba,
+	0x23bb, 0x2500, 0x23bc, 0x23bd, 0x251c, 0x2524, 0x2534, 0x252c,
+	0x2502, 0x2264, 0x2265, 0x03c0, 0x2260, 0x00a3, 0x00b7,
+};
+
+/*
+ * Column width of a code point. The window task runs in whatever locale
+ * it inherited, so we don't trust wcwidth() and use the common ranges
+ * of combining and East Asian wide characters instead.
+ */
+static int vt_wcwidth(uint32_t cp)
+{
+	if ((cp >= 0x0300 && cp <= 0x036f) || (cp >= 0x1ab0 && cp <= 0x1aff) ||
+	    (cp >= 0x1dc0 && cp <= 0x1dff) || (cp >= 0x200b && cp <= 0x200f) ||
+	    (cp >= 0x20d0 && cp <= 0x20ff) || (cp >= 0xfe00 && cp <= 0xfe0f) ||
+	    (cp >= 0xfe20 && cp <= 0xfe2f))
+		return 0;
+	if ((cp >= 0x1100 && cp <= 0x115f) || (cp >= 0x2e80 && cp <= 0x303e) ||
+	    (cp >= 0x3041 && cp <= 0x33ff) || (cp >= 0x3400 && cp <= 0x4dbf) ||
+	    (cp >= 0x4e00 && cp <= 0x9fff) || (cp >= 0xa000 && cp <= 0xa4cf) ||
+	    (cp >= 0xac00 && cp <= 0xd7a3) || (cp >= 0xf900 && cp <= 0xfaff) ||
+	    (cp >= 0xfe30 && cp <= 0xfe4f) || (cp >= 0xff00 && cp <= 0xff60) ||
+	    (cp >= 0xffe0 && cp <= 0xffe6) ||
+	    (cp >= 0x1f300 && cp <= 0x1f64f) ||
+	    (cp >= 0x1f900 && cp <= 0x1f9ff) ||
+	    (cp >= 0x20000 && cp <= 0x2fffd) ||
+	    (cp >= 0x30000 && cp <= 0x3fffd))
+		return 2;
+	return 1;
+}
+
+static struct vt_cell blank_cell(struct vt *vt)
+{
+	struct vt_cell c = { ' ', VT_COLOR_DEFAULT, vt->cur.bg, 0 };
+	return c;
+}
+
+static void clear_cells(struct vt *vt, struct vt_cell *line, int from, int to)
+{
+	struct vt_cell c = blank_cell(vt);
+
+	for (int i = from; i < to; i++)
+		line[i] = c;
+}
+
+static struct vt_cell **alloc_lines(int rows, int cols)
+{
+	struct vt_cell **lines;
+
+	CALLOC_ARRAY(lines, rows);
+	if (lines == NULL)
+		ferror_raw_die("Error allocating memory for screen");
+	for (int r = 0; r < rows; r++) {
+		ALLOC_ARRAY(lines[r], cols);
+		if (lines[r] == NULL)
+			ferror_raw_die("Error allocating memory for screen");
+		for (int c = 0; c < cols; c++) {
+			lines[r][c].ch = ' ';
+			lines[r][c].fg = VT_COLOR_DEFAULT;
+			lines[r][c].bg = VT_COLOR_DEFAULT;
+			lines[r][c].attr = 0;
+		}
+	}
+	return lines;
+}
+
+static void free_lines(struct vt_cell **lines, int rows)
+{
+	if (lines == NULL)
+		return;
+	for (int r = 0; r < rows; r++)
+		free(lines[r]);
+	free(lines);
+}
+
+static void reset_tabs(struct vt *vt)
+{
+	for (int c = 0; c < vt->cols; c++)
+		vt->tabs[c] = c > 0 && c % 8 == 0;
+}
+
+static void reset_cursor(struct vt_cursor *cur)
+{
+	memset(cur, 0, sizeof(*cur));
+	cur->fg = VT_COLOR_DEFAULT;
+	cur->bg = VT_COLOR_DEFAULT;
+}
+
+/* RIS, also used to set up a new terminal */
+static void vt_reset(struct vt *vt)
+{
+	vt->lines = vt->main_lines;
+	vt->alt = 0;
+	reset_cursor(&vt->cur);
+	reset_cursor(&vt->saved);
+	reset_cursor(&vt->saved_main);
+	vt->top = 0;
+	vt->bottom = vt->rows - 1;
+	vt->modes = VT_MODE_WRAP;
+	vt->title[0] = '\0';
+	vt->shift_out = 0;
+	vt->last_ch = ' ';
+	reset_tabs(vt);
+	for (int r = 0; r < vt->rows; r++)
+		clear_cells(vt, vt->lines[r], 0, vt->cols);
+}
+
+struct vt *vt_xalloc(int rows, int cols)
+{
+	struct vt *vt;
+
+	if (rows < 1)
+		rows = 24;
+	if (cols < 1)
+		cols = 80;
+	vt = calloc(1, sizeof(*vt));
+	if (vt == NULL)
+		ferror_raw_die("Error allocating memory for vt");
+	vt->rows = rows;
+	vt->cols = cols;
+	vt->main_lines = alloc_lines(rows, cols);
+	vt->tabs = calloc(cols, 1);
+	if (vt->tabs == NULL)
+		ferror_raw_die("Error allocating memory for vt");
+	strbuf_init(&vt->osc, 0);
+	vt->state = VT_GROUND;
+	vt_reset(vt);
+	return vt;
+}
+
+void vt_free(struct vt *vt)
+{
+	if (vt == NULL)
+		return;
+	free_lines(vt->main_lines, vt->rows);
+	free_lines(vt->alt_lines, vt->rows);
+	free(vt->tabs);
+	strbuf_release(&vt->osc);
+	free(vt);
+}
+
+/* scroll lines top..bottom up by n, the vacated lines are cleared */
+static void scroll_up(struct vt *vt, int top, int bottom, int n)
+{
+	int height = bottom - top + 1;
+
+	if (n > height)
+		n = height;
+	for (int i = 0; i < n; i++) {
+		struct vt_cell *line = vt->lines[top];
+
+		memmove(&vt->lines[top], &vt->lines[top + 1],
+			sizeof(*vt->lines) * (height - 1));
+		vt->lines[bottom] = line;
+		clear_cells(vt, line, 0, vt->cols);
+	}
+}
+
+static void scroll_down(struct vt *vt, int top, int bottom, int n)
+{
+	int height = bottom - top + 1;
+
+	if (n > height)
+		n = height;
+	for (int i = 0; i < n; i++) {
+		struct vt_cell *line = vt->lines[bottom];
+
+		memmove(&vt->lines[top + 1], &vt->lines[top],
+			sizeof(*vt->lines) * (height - 1));
+		vt->lines[top] = line;
+		clear_cells(vt, line, 0, vt->cols);
+	}
+}
+
+static void linefeed(struct vt *vt)
+{
+	vt->cur.wrap_pending = 0;
+	if (vt->cur.row == vt->bottom)
+		scroll_up(vt, vt->top, vt->bottom, 1);
+	else if (vt->cur.row < vt->rows - 1)
+		vt->cur.row++;
+}
+
+static void reverse_index(struct vt *vt)
+{
+	vt->cur.wrap_pending = 0;
+	if (vt->cur.row == vt->top)
+		scroll_down(vt, vt->top, vt->bottom, 1);
+	else if (vt->cur.row > 0)
+		vt->cur.row--;
+}
+
+static void move_to(struct vt *vt, int row, int col)
+{
+	int min_row = 0, max_row = vt->rows - 1;
+
+	if (vt->cur.origin) {
+		row += vt->top;
+		min_row = vt->top;
+		max_row = vt->bottom;
+	}
+	if (row < min_row)
+		row = min_row;
+	if (row > max_row)
+		row = max_row;
+	if (col < 0)
+		col = 0;
+	if (col >= vt->cols)
+		col = vt->cols - 1;
+	vt->cur.row = row;
+	vt->cur.col = col;
+	vt->cur.wrap_pending = 0;
+}
+
+/* relative moves stop at the scroll region if they start inside it */
+static void move_rel(struct vt *vt, int drow, int dcol)
+{
+	int row = vt->cur.row + drow;
+	int col = vt->cur.col + dcol;
+	int min_row = vt->cur.row >= vt->top ? vt->top : 0;
+	int max_row = vt->cur.row <= vt->bottom ? vt->bottom : vt->rows - 1;
+
+	if (row < min_row)
+		row = min_row;
+	if (row > max_row)
+		row = max_row;
+	if (col < 0)
+		col = 0;
+	if (col >= vt->cols)
+		col = vt->cols - 1;
+	vt->cur.row = row;
+	vt->cur.col = col;
+	vt->cur.wrap_pending = 0;
+}
+
+static void put_char(struct vt *vt, uint32_t cp)
+{
+	struct vt_cell *line;
+	int width;
+
+	if (cp >= 0x60 && cp <= 0x7e &&
+	    (vt->shift_out ? vt->cur.g1_graphics : vt->cur.g0_graphics))
+		cp = dec_graphics[cp - 0x60];
+	width = vt_wcwidth(cp);
+	if (width == 0)
+		return; /* combining characters are not kept */
+	if (width > vt->cols)
+		return;
+
+	if (vt->cur.wrap_pending && (vt->modes & VT_MODE_WRAP)) {
+		linefeed(vt);
+		vt->cur.col = 0;
+	}
+	vt->cur.wrap_pending = 0;
+	if (vt->cur.col + width > vt->cols) {
+		if (vt->modes & VT_MODE_WRAP) {
+			linefeed(vt);
+			vt->cur.col = 0;
+		} else {
+			vt->cur.col = vt->cols - width;
+		}
+	}
+
+	line = vt->lines[vt->cur.row];
+	if (vt->modes & VT_MODE_INSERT) {
+		memmove(&line[vt->cur.col + width], &line[vt->cur.col],
+			sizeof(*line) * (vt->cols - vt->cur.col - width));
+	}
+	/* overwriting half of a wide character blanks the other half */
+	if (line[vt->cur.col].ch == 0 && vt->cur.col > 0)
+		line[vt->cur.col - 1].ch = ' ';
+	if (vt->cur.col + width < vt->cols &&
+	    line[vt->cur.col + width].ch == 0)
+		line[vt->cur.col + width].ch = ' ';
+
+	for (int i = 0; i < width; i++) {
+		struct vt_cell *c = &line[vt->cur.col + i];
+
+		c->ch = i == 0 ? cp : 0;
+		c->fg = vt->cur.fg;
+		c->bg = vt->cur.bg;
+		c->attr = vt->cur.attr;
+	}
+	vt->last_ch = cp;
+	vt->cur.col += width;
+	if (vt->cur.col >= vt->cols) {
+		vt->cur.col = vt->cols - 1;
+		vt->cur.wrap_pending = 1;
+	}
+}
+
+static void erase_display(struct vt *vt, int mode)
+{
+	int row = vt->cur.row, col = vt->cur.col;
+
+	switch (mode) {
+	case 0:
+		clear_cells(vt, vt->lines[row], col, vt->cols);
+		for (int r = row + 1; r < vt->rows; r++)
+			clear_cells(vt, vt->lines[r], 0, vt->cols);
+		break;
+	case 1:
+		for (int r = 0; r < row; r++)
+			clear_cells(vt, vt->lines[r], 0, vt->cols);
+		clear_cells(vt, vt->lines[row], 0, col + 1);
+		break;
+	case 2:
+	case 3:
+		for (int r = 0; r < vt->rows; r++)
+			clear_cells(vt, vt->lines[r], 0, vt->cols);
+		break;
+	}
+	vt->cur.wrap_pending = 0;
+}
+
+static void erase_line(struct vt *vt, int mode)
+{
+	struct vt_cell *line = vt->lines[vt->cur.row];
+
+	switch (mode) {
+	case 0:
+		clear_cells(vt, line, vt->cur.col, vt->cols);
+		break;
+	case 1:
+		clear_cells(vt, line, 0, vt->cur.col + 1);
+		break;
+	case 2:
+		clear_cells(vt, line, 0, vt->cols);
+		break;
+	}
+	vt->cur.wrap_pending = 0;
+}
+
+static void insert_chars(struct vt *vt, int n)
+{
+	struct vt_cell *line = vt->lines[vt->cur.row];
+	int col = vt->cur.col;
+
+	if (n > vt->cols - col)
+		n = vt->cols - col;
+	memmove(&line[col + n], &line[col],
+		sizeof(*line) * (vt->cols - col - n));
+	clear_cells(vt, line, col, col + n);
+	vt->cur.wrap_pending = 0;
+}
+
+static void delete_chars(struct vt *vt, int n)
+{
+	struct vt_cell *line = vt->lines[vt->cur.row];
+	int col = vt->cur.col;
+
+	if (n > vt->cols - col)
+		n = vt->cols - col;
+	memmove(&line[col], &line[col + n],
+		sizeof(*line) * (vt->cols - col - n));
+	clear_cells(vt, line, vt->cols - n, vt->cols);
+	vt->cur.wrap_pending = 0;
+}
+
+static void erase_chars(struct vt *vt, int n)
+{
+	int col = vt->cur.col;
+
+	if (n > vt->cols - col)
+		n = vt->cols - col;
+	clear_cells(vt, vt->lines[vt->cur.row], col, col + n);
+	vt->cur.wrap_pending = 0;
+}
+
+static void insert_lines(struct vt *vt, int n)
+{
+	if (vt->cur.row < vt->top || vt->cur.row > vt->bottom)
+		return;
+	scroll_down(vt, vt->cur.row, vt->bottom, n);
+	vt->cur.col = 0;
+	vt->cur.wrap_pending = 0;
+}
+
+static void delete_lines(struct vt *vt, int n)
+{
+	if (vt->cur.row < vt->top || vt->cur.row > vt->bottom)
+		return;
+	scroll_up(vt, vt->cur.row, vt->bottom, n);
+	vt->cur.col = 0;
+	vt->cur.wrap_pending = 0;
+}
+
+static void save_cursor(struct vt *vt, struct vt_cursor *to)
+{
+	*to = vt->cur;
+}
+
+static void restore_cursor(struct vt *vt, const struct vt_cursor *from)
+{
+	vt->cur = *from;
+	if (vt->cur.row >= vt->rows)
+		vt->cur.row = vt->rows - 1;
+	if (vt->cur.col >= vt->cols)
+		vt->cur.col = vt->cols - 1;
+}
+
+static void switch_screen(struct vt *vt, int alt, int clear)
+{
+	if (alt && !vt->alt_lines)
+		vt->alt_lines = alloc_lines(vt->rows, vt->cols);
+	vt->alt = alt;
+	vt->lines = alt ? vt->alt_lines : vt->main_lines;
+	if (alt && clear)
+		for (int r = 0; r < vt->rows; r++)
+			clear_cells(vt, vt->lines[r], 0, vt->cols);
+}
+
+static unsigned private_mode_bit(int mode)
+{
+	switch (mode) {
+	case 1:
+		return VT_MODE_CURSOR_KEYS;
+	case 7:
+		return VT_MODE_WRAP;
+	case 9:
+		return VT_MODE_MOUSE_X10;
+	case 25:
+		return VT_MODE_CURSOR_HIDDEN;
+	case 1000:
+		return VT_MODE_MOUSE_NORMAL;
+	case 1002:
+		return VT_MODE_MOUSE_BUTTON;
+	case 1003:
+		return VT_MODE_MOUSE_ANY;
+	case 1004:
+		return VT_MODE_FOCUS;
+	case 1006:
+		return VT_MODE_MOUSE_SGR;
+	case 2004:
+		return VT_MODE_BRACKETED_PASTE;
+	}
+	return 0;
+}
+
+static void set_private_mode(struct vt *vt, int mode, int set)
+{
+	unsigned bit;
+
+	switch (mode) {
+	case 6:
+		vt->cur.origin = set;
+		move_to(vt, 0, 0);
+		return;
+	case 47:
+	case 1047:
+		if (!set && vt->alt && mode == 1047)
+			switch_screen(vt, 1, 1);
+		switch_screen(vt, set, 0);
+		return;
+	case 1049:
+		if (set == vt->alt)
+			return;
+		if (set) {
+			save_cursor(vt, &vt->saved_main);
+			switch_screen(vt, 1, 1);
+		} else {
+			switch_screen(vt, 0, 0);
+			restore_cursor(vt, &vt->saved_main);
+		}
+		return;
+	}
+
+	bit = private_mode_bit(mode);
+	/* DECTCEM set means the cursor is visible */
+	if (bit == VT_MODE_CURSOR_HIDDEN)
+		set = !set;
+	if (set)
+		vt->modes |= bit;
+	else
+		vt->modes &= ~bit;
+}
+
+static int param(struct vt *vt, int i, int def)
+{
+	if (i >= vt->nparams || vt->params[i] <= 0)
+		return def;
+	return vt->params[i];
+}
+
+static void set_color(uint32_t *color, int *i, struct vt *vt)
+{
+	int kind = param(vt, *i + 1, 0);
+
+	if (kind == 5 && *i + 2 < vt->nparams) {
+		*color = VT_COLOR_INDEX | (vt->params[*i + 2] & 0xff);
+		*i += 2;
+	} else if (kind == 2 && *i + 4 < vt->nparams) {
+		*color = VT_COLOR_RGB | (vt->params[*i + 2] & 0xff) << 16 |
+			 (vt->params[*i + 3] & 0xff) << 8 |
+			 (vt->params[*i + 4] & 0xff);
+		*i += 4;
+	} else {
+		*i = vt->nparams;
+	}
+}
+
+static void select_graphic_rendition(struct vt *vt)
+{
+	struct vt_cursor *cur = &vt->cur;
+
+	if (vt->nparams == 0)
+		vt->params[vt->nparams++] = 0;
+	for (int i = 0; i < vt->nparams; i++) {
+		int p = vt->params[i] < 0 ? 0 : vt->params[i];
+
+		if (p >= 30 && p <= 37)
+			cur->fg = VT_COLOR_INDEX | (p - 30);
+		else if (p >= 40 && p <= 47)
+			cur->bg = VT_COLOR_INDEX | (p - 40);
+		else if (p >= 90 && p <= 97)
+			cur->fg = VT_COLOR_INDEX | (p - 90 + 8);
+		else if (p >= 100 && p <= 107)
+			cur->bg = VT_COLOR_INDEX | (p - 100 + 8);
+		else
+			switch (p) {
+			case 0:
+				cur->attr = 0;
+				cur->fg = VT_COLOR_DEFAULT;
+				cur->bg = VT_COLOR_DEFAULT;
+				break;
+			case 1:
+				cur->attr |= VT_ATTR_BOLD;
+				break;
+			case 2:
+				cur->attr |= VT_ATTR_DIM;
+				break;
+			case 3:
+				cur->attr |= VT_ATTR_ITALIC;
+				break;
+			case 4:
+				cur->attr |= VT_ATTR_UNDERLINE;
+				break;
+			case 5:
+				cur->attr |= VT_ATTR_BLINK;
+				break;
+			case 7:
+				cur->attr |= VT_ATTR_REVERSE;
+				break;
+			case 8:
+				cur->attr |= VT_ATTR_INVISIBLE;
+				break;
+			case 9:
+				cur->attr |= VT_ATTR_STRIKE;
+				break;
+			case 22:
+				cur->attr &= ~(VT_ATTR_BOLD | VT_ATTR_DIM);
+				break;
+			case 23:
+				cur->attr &= ~VT_ATTR_ITALIC;
+				break;
+			case 24:
+				cur->attr &= ~VT_ATTR_UNDERLINE;
+				break;
+			case 25:
+				cur->attr &= ~VT_ATTR_BLINK;
+				break;
+			case 27:
+				cur->attr &= ~VT_ATTR_REVERSE;
+				break;
+			case 28:
+				cur->attr &= ~VT_ATTR_INVISIBLE;
+				break;
+			case 29:
+				cur->attr &= ~VT_ATTR_STRIKE;
+				break;
+			case 38:
+				set_color(&cur->fg, &i, vt);
+				break;
+			case 39:
+				cur->fg = VT_COLOR_DEFAULT;
+				break;
+			case 48:
+				set_color(&cur->bg, &i, vt);
+				break;
+			case 49:
+				cur->bg = VT_COLOR_DEFAULT;
+				break;
+			default:
+				/* ignore what we don't know */
+				break;
+			}
+	}
+}
+
+static void csi_dispatch(struct vt *vt, unsigned char final)
+{
+	int n = param(vt, 0, 1);
+
+	if (vt->priv == '?') {
+		if (final == 'h' || final == 'l')
+			for (int i = 0; i < vt->nparams; i++)
+				set_private_mode(vt, vt->params[i],
+						 final == 'h');
+		return;
+	}
+	if (vt->priv || vt->inter)
+		return; /* DA2, DECSCUSR and friends don't change the screen */
+
+	switch (final) {
+	case '@':
+		insert_chars(vt, n);
+		break;
+	case 'A':
+		move_rel(vt, -n, 0);
+		break;
+	case 'B':
+	case 'e':
+		move_rel(vt, n, 0);
+		break;
+	case 'C':
+	case 'a':
+		move_rel(vt, 0, n);
+		break;
+	case 'D':
+		move_rel(vt, 0, -n);
+		break;
+	case 'E':
+		move_rel(vt, n, -vt->cur.col);
+		break;
+	case 'F':
+		move_rel(vt, -n, -vt->cur.col);
+		break;
+	case 'G':
+	case '`':
+		vt->cur.col = n > vt->cols ? vt->cols - 1 : n - 1;
+		vt->cur.wrap_pending = 0;
+		break;
+	case 'H':
+	case 'f':
+		move_to(vt, param(vt, 0, 1) - 1, param(vt, 1, 1) - 1);
+		break;
+	case 'I':
+		for (int i = 0; i < n; i++) {
+			int c = vt->cur.col + 1;
+
+			while (c < vt->cols - 1 && !vt->tabs[c])
+				c++;
+			vt->cur.col = c < vt->cols ? c : vt->cols - 1;
+		}
+		break;
+	case 'J':
+		erase_display(vt, param(vt, 0, 0));
+		break;
+	case 'K':
+		erase_line(vt, param(vt, 0, 0));
+		break;
+	case 'L':
+		insert_lines(vt, n);
+		break;
+	case 'M':
+		delete_lines(vt, n);
+		break;
+	case 'P':
+		delete_chars(vt, n);
+		break;
+	case 'S':
+		scroll_up(vt, vt->top, vt->bottom, n);
+		break;
+	case 'T':
+		scroll_down(vt, vt->top, vt->bottom, n);
+		break;
+	case 'X':
+		erase_chars(vt, n);
+		break;
+	case 'Z':
+		for (int i = 0; i < n; i++) {
+			int c = vt->cur.col - 1;
+
+			while (c > 0 && !vt->tabs[c])
+				c--;
+			vt->cur.col = c > 0 ? c : 0;
+		}
+		break;
+	case 'b':
+		for (int i = 0; i < n && i < vt->cols * vt->rows; i++)
+			put_char(vt, vt->last_ch);
+		break;
+	case 'd':
+		move_to(vt, n - 1, vt->cur.col);
+		break;
+	case 'g':
+		if (param(vt, 0, 0) == 0)
+			vt->tabs[vt->cur.col] = 0;
+		else if (param(vt, 0, 0) == 3)
+			memset(vt->tabs, 0, vt->cols);
+		break;
+	case 'h':
+	case 'l':
+		for (int i = 0; i < vt->nparams; i++)
+			if (vt->params[i] == 4) {
+				if (final == 'h')
+					vt->modes |= VT_MODE_INSERT;
+				else
+					vt->modes &= ~VT_MODE_INSERT;
+			}
+		break;
+	case 'm':
+		select_graphic_rendition(vt);
+		break;
+	case 'r': {
+		int top = param(vt, 0, 1) - 1;
+		int bottom = param(vt, 1, vt->rows) - 1;
+
+		if (bottom >= vt->rows)
+			bottom = vt->rows - 1;
+		if (top < bottom) {
+			vt->top = top;
+			vt->bottom = bottom;
+			move_to(vt, 0, 0);
+		}
+		break;
+	}
+	case 's':
+		save_cursor(vt, &vt->saved);
+		break;
+	case 'u':
+		restore_cursor(vt, &vt->saved);
+		break;
+	default:
+		break;
+	}
+}
+
+static void esc_dispatch(struct vt *vt, unsigned char final)
+{
+	if (vt->inter == '(' || vt->inter == ')') {
+		int graphics = final == '0';
+
+		if (vt->inter == '(')
+			vt->cur.g0_graphics = graphics;
+		else
+			vt->cur.g1_graphics = graphics;
+		return;
+	}
+	if (vt->inter == '#' && final == '8') {
+		/* DECALN fills the screen with E */
+		for (int r = 0; r < vt->rows; r++)
+			for (int c = 0; c < vt->cols; c++) {
+				vt->lines[r][c] = blank_cell(vt);
+				vt->lines[r][c].ch = 'E';
+			}
+		return;
+	}
+	if (vt->inter)
+		return;
+
+	switch (final) {
+	case '7':
+		save_cursor(vt, &vt->saved);
+		break;
+	case '8':
+		restore_cursor(vt, &vt->saved);
+		break;
+	case 'D':
+		linefeed(vt);
+		break;
+	case 'E':
+		linefeed(vt);
+		vt->cur.col = 0;
+		break;
+	case 'H':
+		vt->tabs[vt->cur.col] = 1;
+		break;
+	case 'M':
+		reverse_index(vt);
+		break;
+	case 'c':
+		if (vt->alt_lines) {
+			free_lines(vt->alt_lines, vt->rows);
+			vt->alt_lines = NULL;
+		}
+		vt_reset(vt);
+		break;
+	case '=':
+		vt->modes |= VT_MODE_KEYPAD;
+		break;
+	case '>':
+		vt->modes &= ~VT_MODE_KEYPAD;
+		break;
+	default:
+		break;
+	}
+}
+
+static void osc_dispatch(struct vt *vt)
+{
+	char *text = vt->osc.buf;
+	char *semi;
+
+	if (text == NULL)
+		return;
+	semi = strchr(text, ';');
+	if (!semi)
+		return;
+	/* OSC 0 and 2 set the window title */
+	if ((semi - text == 1) && (text[0] == '0' || text[0] == '2')) {
+		snprintf(vt->title, sizeof(vt->title), "%s", semi + 1);
+	}
+}
+
+static void execute(struct vt *vt, unsigned char c)
+{
+	switch (c) {
+	case '\b':
+		if (vt->cur.col > 0)
+			vt->cur.col--;
+		vt->cur.wrap_pending = 0;
+		break;
+	case '\t': {
+		int col = vt->cur.col + 1;
+
+		while (col < vt->cols - 1 && !vt->tabs[col])
+			col++;
+		vt->cur.col = col < vt->cols ? col : vt->cols - 1;
+		break;
+	}
+	case '\n':
+	case '\v':
+	case '\f':
+		linefeed(vt);
+		break;
+	case '\r':
+		vt->cur.col = 0;
+		vt->cur.wrap_pending = 0;
+		break;
+	case 0x0e: /* SO */
+		vt->shift_out = 1;
+		break;
+	case 0x0f: /* SI */
+		vt->shift_out = 0;
+		break;
+	default:
+		/* BEL and the rest */
+		break;
+	}
+}
+
+static void clear_params(struct vt *vt)
+{
+	vt->nparams = 0;
+	vt->priv = 0;
+	vt->inter = 0;
+	memset(vt->params, 0, sizeof(vt->params));
+}
+
+static void feed_byte(struct vt *vt, unsigned char c)
+{
+	switch (vt->state) {
+	case VT_GROUND:
+		if (c == 0x1b) {
+			clear_params(vt);
+			vt->state = VT_ESC;
+		} else if (c < 0x20 || c == 0x7f) {
+			execute(vt, c);
+		} else {
+			put_char(vt, c);
+		}
+		break;
+	case VT_ESC:
+		if (c >= 0x20 && c <= 0x2f) {
+			vt->inter = c;
+			vt->state = VT_ESC_INTER;
+		} else if (c == '[') {
+			vt->state = VT_CSI;
+		} else if (c == ']') {
+			strbuf_reset(&vt->osc);
+			vt->state = VT_OSC;
+		} else if (c == 'P' || c == 'X' || c == '^' || c == '_') {
+			vt->state = VT_STR;
+		} else if (c < 0x20) {
+			execute(vt, c);
+		} else {
+			esc_dispatch(vt, c);
+			vt->state = VT_GROUND;
+		}
+		break;
+	case VT_ESC_INTER:
+		if (c >= 0x30 && c <= 0x7e) {
+			esc_dispatch(vt, c);
+			vt->state = VT_GROUND;
+		} else if (c < 0x20) {
+			execute(vt, c);
+		}
+		break;
+	case VT_CSI:
+		if (c >= '0' && c <= '9') {
+			if (vt->nparams == 0)
+				vt->nparams = 1;
+			if (vt->params[vt->nparams - 1] < 100000)
+				vt->params[vt->nparams - 1] =
+					vt->params[vt->nparams - 1] * 10 +
+					(c - '0');
+		} else if (c == ';' || c == ':') {
+			if (vt->nparams == 0)
+				vt->nparams = 1;
+			if (vt->nparams < VT_MAX_PARAMS)
+				vt->params[vt->nparams++] = 0;
+		} else if (c >= '<' && c <= '?') {
+			vt->priv = c;
+		} else if (c >= 0x20 && c <= 0x2f) {
+			vt->inter = c;
+		} else if (c >= 0x40 && c <= 0x7e) {
+			csi_dispatch(vt, c);
+			vt->state = VT_GROUND;
+		} else if (c == 0x1b) {
+			clear_params(vt);
+			vt->state = VT_ESC;
+		} else if (c < 0x20) {
+			execute(vt, c);
+		}
+		break;
+	case VT_OSC:
+		if (c == 0x07) {
+			osc_dispatch(vt);
+			vt->state = VT_GROUND;
+		} else if (c == 0x1b) {
+			vt->state = VT_OSC_ESC;
+		} else if (vt->osc.len < VT_MAX_TITLE) {
+			strbuf_addch(&vt->osc, c);
+		}
+		break;
+	case VT_OSC_ESC:
+		osc_dispatch(vt);
+		if (c == '\\') {
+			vt->state = VT_GROUND;
+		} else {
+			clear_params(vt);
+			vt->state = VT_ESC;
+			feed_byte(vt, c);
+		}
+		break;
+	case VT_STR:
+		if (c == 0x1b)
+			vt->state = VT_STR_ESC;
+		else if (c == 0x07)
+			vt->state = VT_GROUND;
+		break;
+	case VT_STR_ESC:
+		vt->state = c == '\\' ? VT_GROUND : VT_STR;
+		break;
+	}
+}
+
+void vt_write(struct vt *vt, const char *buf, size_t len)
+{
+	const unsigned char *p = (const unsigned char *)buf;
+	const unsigned char *end = p + len;
+
+	for (; p < end; p++) {
+		unsigned char c = *p;
+
+		if (vt->utf8_left > 0) {
+			if ((c & 0xc0) == 0x80) {
+				vt->utf8_cp = vt->utf8_cp << 6 | (c & 0x3f);
+				if (--vt->utf8_left == 0 &&
+				    vt->state == VT_GROUND)
+					put_char(vt, vt->utf8_cp);
+				continue;
+			}
+			/* truncated sequence */
+			vt->utf8_left = 0;
+			if (vt->state == VT_GROUND)
+				put_char(vt, 0xfffd);
+		}
+		if (c < 0x80) {
+			feed_byte(vt, c);
+		} else if ((c & 0xe0) == 0xc0) {
+			vt->utf8_cp = c & 0x1f;
+			vt->utf8_left = 1;
+		} else if ((c & 0xf0) == 0xe0) {
+			vt->utf8_cp = c & 0x0f;
+			vt->utf8_left = 2;
+		} else if ((c & 0xf8) == 0xf0) {
+			vt->utf8_cp = c & 0x07;
+			vt->utf8_left = 3;
+		} else if (vt->state == VT_GROUND) {
+			put_char(vt, 0xfffd);
+		}
+	}
+}
+
+static struct vt_cell **resize_lines(struct vt_cell **old, int old_rows,
+				     int old_cols, int rows, int cols,
+				     int drop)
+{
+	struct vt_cell **lines = alloc_lines(rows, cols);
+	int ncols = cols < old_cols ? cols : old_cols;
+
+	for (int r = 0; r < rows && r + drop < old_rows; r++) {
+		memcpy(lines[r], old[r + drop], sizeof(**lines) * ncols);
+		/* don't leave the left half of a wide char at the edge */
+		if (ncols > 0 && ncols < old_cols && old[r + drop][ncols].ch == 0)
+			lines[r][ncols - 1].ch = ' ';
+	}
+	free_lines(old, old_rows);
+	return lines;
+}
+
+void vt_resize(struct vt *vt, int rows, int cols)
+{
+	int drop = 0;
+	char *tabs;
+
+	if (rows < 1 || cols < 1 || (rows == vt->rows && cols == vt->cols))
+		return;
+	/* keep the cursor on screen by dropping lines from the top */
+	if (vt->cur.row >= rows)
+		drop = vt->cur.row - rows + 1;
+
+	vt->main_lines = resize_lines(vt->main_lines, vt->rows, vt->cols, rows,
+				      cols, vt->alt ? 0 : drop);
+	if (vt->alt_lines)
+		vt->alt_lines = resize_lines(vt->alt_lines, vt->rows, vt->cols,
+					     rows, cols, vt->alt ? drop : 0);
+	vt->lines = vt->alt ? vt->alt_lines : vt->main_lines;
+
+	tabs = realloc(vt->tabs, cols);
+	if (tabs == NULL)
+		ferror_raw_die("Error allocating memory for vt");
+	vt->tabs = tabs;
+	vt->rows = rows;
+	vt->cols = cols;
+	reset_tabs(vt);
+
+	vt->cur.row -= drop;
+	restore_cursor(vt, &vt->cur);
+	vt->cur.wrap_pending = 0;
+	vt->top = 0;
+	vt->bottom = rows - 1;
+}
+
+static void add_utf8(struct strbuf *out, uint32_t cp)
+{
+	char buf[4];
+	int n;
+
+	if (cp < 0x80) {
+		strbuf_addch(out, cp);
+		return;
+	}
+	if (cp < 0x800) {
+		buf[0] = 0xc0 | (cp >> 6);
+		buf[1] = 0x80 | (cp & 0x3f);
+		n = 2;
+	} else if (cp < 0x10000) {
+		buf[0] = 0xe0 | (cp >> 12);
+		buf[1] = 0x80 | ((cp >> 6) & 0x3f);
+		buf[2] = 0x80 | (cp & 0x3f);
+		n = 3;
+	} else {
+		buf[0] = 0xf0 | (cp >> 18);
+		buf[1] = 0x80 | ((cp >> 12) & 0x3f);
+		buf[2] = 0x80 | ((cp >> 6) & 0x3f);
+		buf[3] = 0x80 | (cp & 0x3f);
+		n = 4;
+	}
+	strbuf_add(out, buf, n);
+}
+
+static void add_color(struct strbuf *out, uint32_t color, int base)
+{
+	uint32_t v = color & 0xffffff;
+
+	if (color == VT_COLOR_DEFAULT)
+		return;
+	if ((color & ~0xffffffu) == VT_COLOR_RGB)
+		strbuf_addf(out, ";%d8;2;%u;%u;%u", base / 10, v >> 16,
+			    (v >> 8) & 0xff, v & 0xff);
+	else if (v < 8)
+		strbuf_addf(out, ";%u", base + v);
+	else if (v < 16)
+		strbuf_addf(out, ";%u", base + 60 + v - 8);
+	else
+		strbuf_addf(out, ";%d8;5;%u", base / 10, v);
+}
+
+static void add_sgr(struct strbuf *out, uint32_t fg, uint32_t bg, uint8_t attr)
+{
+	static const int codes[8] = { 1, 2, 3, 4, 5, 7, 8, 9 };
+
+	strbuf_addstr(out, ESC "[0");
+	for (int i = 0; i < 8; i++)
+		if (attr & (1 << i))
+			strbuf_addf(out, ";%d", codes[i]);
+	add_color(out, fg, 30);
+	add_color(out, bg, 40);
+	strbuf_addch(out, 'm');
+}
+
+static int cell_is_blank(const struct vt_cell *c)
+{
+	return c->ch == ' ' && c->bg == VT_COLOR_DEFAULT &&
+	       !(c->attr & (VT_ATTR_REVERSE | VT_ATTR_UNDERLINE |
+			    VT_ATTR_STRIKE));
+}
+
+/* draw every line of a screen, the terminal has just been cleared */
+static void repaint_lines(struct vt *vt, struct vt_cell **lines,
+			  struct strbuf *out)
+{
+	for (int r = 0; r < vt->rows; r++) {
+		struct vt_cell *line = lines[r];
+		struct vt_cell pen = { ' ', VT_COLOR_DEFAULT, VT_COLOR_DEFAULT,
+				       0 };
+		int end = vt->cols;
+
+		while (end > 0 && cell_is_blank(&line[end - 1]))
+			end--;
+		if (end == 0)
+			continue;
+		strbuf_addf(out, ESC "[%d;1H", r + 1);
+		for (int c = 0; c < end; c++) {
+			const struct vt_cell *cell = &line[c];
+
+			if (cell->ch == 0)
+				continue;
+			if (cell->fg != pen.fg || cell->bg != pen.bg ||
+			    cell->attr != pen.attr) {
+				add_sgr(out, cell->fg, cell->bg, cell->attr);
+				pen = *cell;
+			}
+			add_utf8(out, cell->ch);
+		}
+		strbuf_addstr(out, ESC "[0m");
+	}
+}
+
+/* modes which are off on a freshly cleared terminal */
+static const struct {
+	unsigned bit;
+	const char *set;
+	const char *reset;
+} modes[] = {
+	{ VT_MODE_CURSOR_KEYS, ESC "[?1h", ESC "[?1l" },
+	{ VT_MODE_KEYPAD, ESC "=", ESC ">" },
+	{ VT_MODE_INSERT, ESC "[4h", ESC "[4l" },
+	{ VT_MODE_BRACKETED_PASTE, ESC "[?2004h", ESC "[?2004l" },
+	{ VT_MODE_MOUSE_X10, ESC "[?9h", ESC "[?9l" },
+	{ VT_MODE_MOUSE_NORMAL, ESC "[?1000h", ESC "[?1000l" },
+	{ VT_MODE_MOUSE_BUTTON, ESC "[?1002h", ESC "[?1002l" },
+	{ VT_MODE_MOUSE_ANY, ESC "[?1003h", ESC "[?1003l" },
+	{ VT_MODE_MOUSE_SGR, ESC "[?1006h", ESC "[?1006l" },
+	{ VT_MODE_FOCUS, ESC "[?1004h", ESC "[?1004l" },
+};
+
+void vt_repaint(struct vt *vt, struct strbuf *out)
+{
+	const struct vt_cursor *cur = &vt->cur;
+
+	/* start from a known state: main screen, no margins, cleared */
+	strbuf_addstr(out, ESC "[?1049l" ESC "[r" ESC "[0m" ESC "[H" ESC "[2J");
+	if (vt->title[0])
+		strbuf_addf(out, ESC "]2;%s\007", vt->title);
+
+	repaint_lines(vt, vt->main_lines, out);
+	if (vt->alt) {
+		/* ?1049h saves the cursor the program will get back */
+		strbuf_addf(out, ESC "[%d;%dH", vt->saved_main.row + 1,
+			    vt->saved_main.col + 1);
+		strbuf_addstr(out, ESC "[?1049h");
+		repaint_lines(vt, vt->alt_lines, out);
+	}
+
+	if (vt->top != 0 || vt->bottom != vt->rows - 1)
+		strbuf_addf(out, ESC "[%d;%dr", vt->top + 1, vt->bottom + 1);
+	for (size_t i = 0; i < sizeof(modes) / sizeof(modes[0]); i++)
+		if (vt->modes & modes[i].bit)
+			strbuf_addstr(out, modes[i].set);
+	if (!(vt->modes & VT_MODE_WRAP))
+		strbuf_addstr(out, ESC "[?7l");
+	if (cur->g0_graphics)
+		strbuf_addstr(out, ESC "(0");
+	if (cur->g1_graphics)
+		strbuf_addstr(out, ESC ")0");
+	if (vt->shift_out)
+		strbuf_addch(out, 0x0e);
+
+	add_sgr(out, cur->fg, cur->bg, cur->attr);
+	/* the cursor position is absolute, so set DECOM afterwards */
+	strbuf_addf(out, ESC "[%d;%dH", cur->row + 1, cur->col + 1);
+	if (cur->origin)
+		strbuf_addf(out, ESC "[?6h" ESC "[%d;%dH",
+			    cur->row - vt->top + 1, cur->col + 1);
+	strbuf_addstr(out, (vt->modes & VT_MODE_CURSOR_HIDDEN) ? ESC "[?25l" :
+								 ESC "[?25h");
+}
+
+void vt_text(struct vt *vt, struct strbuf *out)
+{
+	for (int r = 0; r < vt->rows; r++) {
+		struct vt_cell *line = vt->lines[r];
+		int end = vt->cols;
+
+		while (end > 0 && line[end - 1].ch == ' ')
+			end--;
+		for (int c = 0; c < end; c++)
+			if (line[c].ch != 0)
+				add_utf8(out, line[c].ch);
+		strbuf_addch(out, '\n');
+	}
+}
+
+void vt_text_attrs(struct vt *vt, struct strbuf *out)
+{
+	for (int r = 0; r < vt->rows; r++) {
+		struct vt_cell *line = vt->lines[r];
+		struct vt_cell pen = { ' ', VT_COLOR_DEFAULT, VT_COLOR_DEFAULT,
+				       0 };
+		int end = vt->cols;
+
+		while (end > 0 && cell_is_blank(&line[end - 1]))
+			end--;
+		for (int c = 0; c < end; c++) {
+			const struct vt_cell *cell = &line[c];
+
+			if (cell->ch == 0)
+				continue;
+			if (cell->fg != pen.fg || cell->bg != pen.bg ||
+			    cell->attr != pen.attr) {
+				add_sgr(out, cell->fg, cell->bg, cell->attr);
+				pen = *cell;
+			}
+			add_utf8(out, cell->ch);
+		}
+		if (pen.fg != VT_COLOR_DEFAULT || pen.bg != VT_COLOR_DEFAULT ||
+		    pen.attr)
+			strbuf_addstr(out, ESC "[0m");
+		strbuf_addch(out, '\n');
+	}
+}
+
+static int is_text(unsigned char c)
+{
+	return (c >= 0x20 && c != 0x7f) || c == '\n' || c == '\t';
+}
+
+#define BYTES_01 ((uint64_t)-1 / 255)
+#define BYTES_80 (BYTES_01 * 0x80)
+
+/*
+ * Whether one of the 8 bytes at p is below 0x20 or is DEL, with the
+ * bit tricks for finding a zero byte, so plain text is skipped a word
+ * at a time.
+ */
+static int word_has_control(const unsigned char *p)
+{
+	uint64_t w, del;
+
+	memcpy(&w, p, sizeof(w));
+	del = w ^ (BYTES_01 * 0x7f);
+	return !!((((w - BYTES_01 * 0x20) & ~w) | ((del - BYTES_01) & ~del)) &
+		  BYTES_80);
+}
+
+/* Keep the CSI sequence ending in final if it only sets the pen */
+static void strip_csi_end(struct vt_strip *st, unsigned char final,
+			  struct strbuf *out)
+{
+	if (!st->keep_sgr || final != 'm' || st->sgr_len > sizeof(st->sgr))
+		return;
+	for (size_t i = 0; i < st->sgr_len; i++)
+		if ((st->sgr[i] < '0' || st->sgr[i] > '9') &&
+		    st->sgr[i] != ';' && st->sgr[i] != ':')
+			return;
+	strbuf_addstr(out, ESC "[");
+	strbuf_add(out, st->sgr, st->sgr_len);
+	strbuf_addch(out, 'm');
+}
+
+/* The parser of feed_byte(), minus everything but finding the text */
+void vt_strip(struct vt_strip *st, const char *buf, size_t len,
+	      struct strbuf *out)
+{
+	const unsigned char *p = (const unsigned char *)buf;
+	const unsigned char *end = p + len;
+
+	while (p < end) {
+		unsigned char c = *p;
+
+		if (st->state == VT_GROUND) {
+			const unsigned char *run = p;
+
+			while (p < end) {
+				if (end - p >= 8 && !word_has_control(p))
+					p += 8;
+				else if (is_text(*p))
+					p++;
+				else
+					break;
+			}
+			strbuf_add(out, run, p - run);
+			if (p < end && *p++ == 0x1b)
+				st->state = VT_ESC;
+			continue;
+		}
+		p++;
+		switch (st->state) {
+		case VT_ESC:
+			if (c >= 0x20 && c <= 0x2f)
+				st->state = VT_ESC_INTER;
+			else if (c == '[') {
+				st->state = VT_CSI;
+				st->sgr_len = 0;
+			} else if (c == ']' || c == 'P' || c == 'X' || c == '^' ||
+				 c == '_')
+				st->state = VT_STR;
+			else if (c >= 0x20)
+				st->state = VT_GROUND;
+			break;
+		case VT_ESC_INTER:
+			if (c >= 0x30 && c <= 0x7e)
+				st->state = VT_GROUND;
+			break;
+		case VT_CSI:
+			if (c >= 0x40 && c <= 0x7e) {
+				strip_csi_end(st, c, out);
+				st->state = VT_GROUND;
+			} else if (c == 0x1b) {
+				st->state = VT_ESC;
+			} else if (c >= 0x20 && st->sgr_len <= sizeof(st->sgr)) {
+				if (st->sgr_len < sizeof(st->sgr))
+					st->sgr[st->sgr_len] = c;
+				st->sgr_len++;
+			}
+			break;
+		case VT_STR:
+			if (c == 0x1b)
+				st->state = VT_STR_ESC;
+			else if (c == 0x07)
+				st->state = VT_GROUND;
+			break;
+		default: /* VT_STR_ESC */
+			st->state = c == '\\' ? VT_GROUND : VT_STR;
+			break;
+		}
+	}
+}
+
+void vt_snapshot_release(struct vt_snapshot *snap)
+{
+	free(snap->cells);
+	memset(snap, 0, sizeof(*snap));
+}
+
+static void take_snapshot(struct vt *vt, struct vt_snapshot *snap)
+{
+	if (snap->cells == NULL || snap->rows != vt->rows ||
+	    snap->cols != vt->cols) {
+		free(snap->cells);
+		ALLOC_ARRAY(snap->cells, (size_t)vt->rows * vt->cols);
+		if (snap->cells == NULL)
+			ferror_raw_die("Error allocating memory for snapshot");
+	}
+	for (int r = 0; r < vt->rows; r++)
+		memcpy(snap->cells + (size_t)r * vt->cols, vt->lines[r],
+		       sizeof(*snap->cells) * vt->cols);
+	snap->rows = vt->rows;
+	snap->cols = vt->cols;
+	snap->alt = vt->alt;
+	snap->cur = vt->cur;
+	snap->top = vt->top;
+	snap->bottom = vt->bottom;
+	snap->modes = vt->modes;
+	snap->shift_out = vt->shift_out;
+	memcpy(snap->title, vt->title, sizeof(snap->title));
+}
+
+static int cell_eq(const struct vt_cell *a, const struct vt_cell *b)
+{
+	return a->ch == b->ch && a->fg == b->fg && a->bg == b->bg &&
+	       a->attr == b->attr;
+}
+
+/* The screen looks like snap, which has the size and screen of vt */
+static int snapshot_matches(struct vt *vt, const struct vt_snapshot *snap)
+{
+	const struct vt_cursor *a = &vt->cur, *b = &snap->cur;
+
+	if (a->row != b->row || a->col != b->col || a->fg != b->fg ||
+	    a->bg != b->bg || a->attr != b->attr || a->origin != b->origin ||
+	    a->g0_graphics != b->g0_graphics ||
+	    a->g1_graphics != b->g1_graphics || vt->top != snap->top ||
+	    vt->bottom != snap->bottom || vt->modes != snap->modes ||
+	    vt->shift_out != snap->shift_out || strcmp(vt->title, snap->title))
+		return 0;
+	for (int r = 0; r < vt->rows; r++) {
+		const struct vt_cell *old = snap->cells + (size_t)r * vt->cols;
+
+		for (int c = 0; c < vt->cols; c++)
+			if (!cell_eq(&vt->lines[r][c], &old[c]))
+				return 0;
+	}
+	return 1;
+}
+
+/* what EL leaves behind with the default pen */
+static int cell_is_erased(const struct vt_cell *c)
+{
+	return c->ch == ' ' && c->bg == VT_COLOR_DEFAULT && c->attr == 0;
+}
+
+/*
+ * Unchanged cells between two changed ones are redrawn rather than
+ * jumped over when there are at most this many of them.
+ */
+#define DIFF_MAX_GAP 4
+
+/* redraw the cells of a row which differ from old */
+static void diff_line(int row, const struct vt_cell *line,
+		      const struct vt_cell *old, int cols,
+		      struct vt_cell *pen, int *pen_valid, struct strbuf *out)
+{
+	int c = 0;
+
+	while (c < cols) {
+		int start, end, tail;
+
+		if (cell_eq(&line[c], &old[c])) {
+			c++;
+			continue;
+		}
+		start = c;
+		end = c + 1;
+		for (int i = c + 1; i < cols && i - end <= DIFF_MAX_GAP; i++)
+			if (!cell_eq(&line[i], &old[i]))
+				end = i + 1;
+		/* draw wide chars, old or new, as a whole */
+		if (start > 0 && (line[start].ch == 0 || old[start].ch == 0))
+			start--;
+		if (end < cols && (line[end].ch == 0 || old[end].ch == 0))
+			end++;
+		tail = cols;
+		while (tail > start && cell_is_erased(&line[tail - 1]))
+			tail--;
+
+		strbuf_addf(out, ESC "[%d;%dH", row + 1, start + 1);
+		for (int i = start; i < end && i < tail; i++) {
+			const struct vt_cell *cell = &line[i];
+
+			if (cell->ch == 0)
+				continue;
+			if (!*pen_valid || cell->fg != pen->fg ||
+			    cell->bg != pen->bg || cell->attr != pen->attr) {
+				add_sgr(out, cell->fg, cell->bg, cell->attr);
+				*pen = *cell;
+				*pen_valid = 1;
+			}
+			add_utf8(out, cell->ch);
+		}
+		if (tail < end) {
+			/* the rest of the line is empty */
+			if (!*pen_valid || pen->bg != VT_COLOR_DEFAULT ||
+			    pen->attr != 0) {
+				strbuf_addstr(out, ESC "[0m");
+				pen->fg = pen->bg = VT_COLOR_DEFAULT;
+				pen->attr = 0;
+				*pen_valid = 1;
+			}
+			strbuf_addstr(out, ESC "[K");
+			return;
+		}
+		c = end;
+	}
+}
+
+void vt_diff(struct vt *vt, struct vt_snapshot *snap, struct strbuf *out)
+{
+	const struct vt_cursor *cur = &vt->cur;
+	struct vt_cell pen = { 0 };
+	int pen_valid = 0;
+	unsigned old_modes = snap->modes;
+
+	if (snap->cells == NULL || snap->rows != vt->rows ||
+	    snap->cols != vt->cols || snap->alt != vt->alt) {
+		vt_repaint(vt, out);
+		take_snapshot(vt, snap);
+		return;
+	}
+	if (snapshot_matches(vt, snap))
+		return;
+
+	/* draw in absolute positions, with plain characters */
+	if (snap->cur.origin)
+		strbuf_addstr(out, ESC "[?6l");
+	if (old_modes & VT_MODE_INSERT) {
+		strbuf_addstr(out, ESC "[4l");
+		old_modes &= ~VT_MODE_INSERT;
+	}
+	if (snap->shift_out)
+		strbuf_addch(out, 0x0f);
+	if (snap->cur.g0_graphics)
+		strbuf_addstr(out, ESC "(B");
+	for (int r = 0; r < vt->rows; r++)
+		diff_line(r, vt->lines[r], snap->cells + (size_t)r * vt->cols,
+			  vt->cols, &pen, &pen_valid, out);
+
+	if (strcmp(vt->title, snap->title))
+		strbuf_addf(out, ESC "]2;%s\007", vt->title);
+	if (vt->top != snap->top || vt->bottom != snap->bottom)
+		strbuf_addf(out, ESC "[%d;%dr", vt->top + 1, vt->bottom + 1);
+	for (size_t i = 0; i < sizeof(modes) / sizeof(modes[0]); i++)
+		if ((vt->modes ^ old_modes) & modes[i].bit)
+			strbuf_addstr(out, (vt->modes & modes[i].bit) ?
+						   modes[i].set :
+						   modes[i].reset);
+	if ((vt->modes ^ old_modes) & VT_MODE_WRAP)
+		strbuf_addstr(out, (vt->modes & VT_MODE_WRAP) ? ESC "[?7h" :
+								ESC "[?7l");
+	if (cur->g0_graphics)
+		strbuf_addstr(out, ESC "(0");
+	if (cur->g1_graphics != snap->cur.g1_graphics)
+		strbuf_addstr(out, cur->g1_graphics ? ESC ")0" : ESC ")B");
+	if (vt->shift_out)
+		strbuf_addch(out, 0x0e);
+
+	add_sgr(out, cur->fg, cur->bg, cur->attr);
+	strbuf_addf(out, ESC "[%d;%dH", cur->row + 1, cur->col + 1);
+	if (cur->origin)
+		strbuf_addf(out, ESC "[?6h" ESC "[%d;%dH",
+			    cur->row - vt->top + 1, cur->col + 1);
+	if ((vt->modes ^ snap->modes) & VT_MODE_CURSOR_HIDDEN)
+		strbuf_addstr(out, (vt->modes & VT_MODE_CURSOR_HIDDEN) ?
+					   ESC "[?25l" :
+					   ESC "[?25h");
+	take_snapshot(vt, snap);
+}
@@ -0,0 +1,153 @@
+#ifndef VT_H
+#define VT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "strbuf.h"
+
+/*
+ * A small virtual terminal, enough of xterm/VT220 to keep a model of
+ * what a window's screen looks like. The window task feeds it everything
+ * the program prints, and renders it back to a client that attaches.
+ */
+
+/* cell attributes */
+#define VT_ATTR_BOLD	  0x01
+#define VT_ATTR_DIM	  0x02
+#define VT_ATTR_ITALIC	  0x04
+#define VT_ATTR_UNDERLINE 0x08
+#define VT_ATTR_BLINK	  0x10
+#define VT_ATTR_REVERSE	  0x20
+#define VT_ATTR_INVISIBLE 0x40
+#define VT_ATTR_STRIKE	  0x80
+
+/* colors are VT_COLOR_DEFAULT, VT_COLOR_INDEX | n or VT_COLOR_RGB | rgb */
+#define VT_COLOR_DEFAULT 0
+#define VT_COLOR_INDEX	 (1u << 24)
+#define VT_COLOR_RGB	 (2u << 24)
+
+/* terminal modes which must be restored on a client when it attaches */
+#define VT_MODE_WRAP		(1u << 0) /* DECAWM */
+#define VT_MODE_ORIGIN		(1u << 1) /* DECOM */
+#define VT_MODE_INSERT		(1u << 2) /* IRM */
+#define VT_MODE_CURSOR_HIDDEN	(1u << 3) /* !DECTCEM */
+#define VT_MODE_CURSOR_KEYS	(1u << 4) /* DECCKM */
+#define VT_MODE_KEYPAD		(1u << 5) /* DECKPAM */
+#define VT_MODE_BRACKETED_PASTE (1u << 6)
+#define VT_MODE_MOUSE_X10	(1u << 7)
+#define VT_MODE_MOUSE_NORMAL	(1u << 8)
+#define VT_MODE_MOUSE_BUTTON	(1u << 9)
+#define VT_MODE_MOUSE_ANY	(1u << 10)
+#define VT_MODE_MOUSE_SGR	(1u << 11)
+#define VT_MODE_FOCUS		(1u << 12)
+
+#define VT_MAX_PARAMS 16
+#define VT_MAX_TITLE  256
+
+struct vt_cell {
+	uint32_t ch; /* code point, 0 for the right half of a wide char */
+	uint32_t fg;
+	uint32_t bg;
+	uint8_t attr;
+};
+
+/* cursor position together with the pen used for new characters */
+struct vt_cursor {
+	int row;
+	int col;
+	uint32_t fg;
+	uint32_t bg;
+	uint8_t attr;
+	int wrap_pending; /* a character was put in the last column */
+	int origin; /* DECOM, saved and restored with the cursor */
+	int g0_graphics; /* G0 is the DEC special graphics set */
+	int g1_graphics;
+};
+
+struct vt {
+	int rows;
+	int cols;
+	struct vt_cell **lines; /* the active screen, main or alt */
+	struct vt_cell **main_lines;
+	struct vt_cell **alt_lines; /* allocated on first use */
+	int alt; /* alternate screen is active */
+	struct vt_cursor cur;
+	struct vt_cursor saved; /* DECSC */
+	struct vt_cursor saved_main; /* cursor saved by ?1049h */
+	int top; /* scroll region, inclusive */
+	int bottom;
+	unsigned modes;
+	char *tabs; /* tabs[col] is set for every tab stop */
+	char title[VT_MAX_TITLE];
+
+	/* parser state */
+	int state;
+	int params[VT_MAX_PARAMS];
+	int nparams;
+	char priv; /* '?', '>' or '=' after CSI */
+	char inter; /* intermediate byte */
+	int shift_out; /* SO selected G1 */
+	uint32_t utf8_cp;
+	int utf8_left;
+	uint32_t last_ch; /* for REP */
+	struct strbuf osc;
+};
+
+/*
+ * What a client's terminal was last brought to by vt_diff(). Starts out
+ * zeroed, which means nothing was sent yet.
+ */
+struct vt_snapshot {
+	int rows;
+	int cols;
+	int alt;
+	struct vt_cell *cells; /* rows * cols of the active screen */
+	struct vt_cursor cur;
+	int top;
+	int bottom;
+	unsigned modes;
+	int shift_out;
+	char title[VT_MAX_TITLE];
+};
+
+struct vt *vt_xalloc(int rows, int cols);
+void vt_free(struct vt *vt);
+/* Feed output of the program running in the window */
+void vt_write(struct vt *vt, const char *buf, size_t len);
+void vt_resize(struct vt *vt, int rows, int cols);
+/*
+ * Append the escape sequences which redraw the whole screen, cursor
+ * and modes on a terminal of the same size to out.
+ */
+void vt_repaint(struct vt *vt, struct strbuf *out);
+/*
+ * Append what brings a terminal showing snap to the screen now, which is
+ * nothing if it is the same, and update snap. A size change, a switch
+ * between main and alternate screen or an empty snap take a repaint.
+ */
+void vt_diff(struct vt *vt, struct vt_snapshot *snap, struct strbuf *out);
+void vt_snapshot_release(struct vt_snapshot *snap);
+
+/* Append the text on the screen to out, a line per row, right trimmed */
+void vt_text(struct vt *vt, struct strbuf *out);
+/* Same, with SGR sequences for colors and attributes, reset by each row */
+void vt_text_attrs(struct vt *vt, struct strbuf *out);
+
+/*
+ * Turns program output into plain text, without escape sequences or
+ * control characters other than newline and tab. The output may be
+ * fed a piece at a time, starting from a zeroed struct vt_strip.
+ * With keep_sgr set, the SGR sequences setting colors and attributes
+ * are kept too.
+ */
+struct vt_strip {
+	int state;
+	int keep_sgr;
+	char sgr[32]; /* parameters of the CSI sequence being parsed */
+	size_t sgr_len; /* past the end of sgr if they don't fit */
+};
+
+void vt_strip(struct vt_strip *st, const char *buf, size_t len,
+	      struct strbuf *out);
+
+#endif
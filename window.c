@@ -1,5 +1,6 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdarg.h>
 #include <stddef.h>
 #include <string.h>
 #include <assert.h>
@@ -7,521 +8,755 @@
 #include <termios.h>
 #include <unistd.h>
 #include <fcntl.h>
-#include <sys/time.h>
-#include <sys/select.h>
+#include <signal.h>
+#include <poll.h>
+#include <sys/socket.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
 #include "compat_util.h"
 #include "error_raw.h"
+#include "proto.h"
+#include "strbuf.h"
 #include "pty.h"
 #include "window.h"
 #include "socket.h"
-
-enum { CHAR_MODE = 'c', WINCH_MODE = 'w' };
-
-static void pty_xset_winsize(int fd, char buf[4])
-{
-	struct winsize ws;
-	uint16_t *p = (uint16_t *)buf;
-
-	ws.ws_row = p[0];
-	ws.ws_col = p[1];
-	/* We don't care about pixels in Linux and MacOs */
-
-	if (ioctl(fd, TIOCSWINSZ, &ws) < 0)
-		perror_raw_die("Error setting window size on pty master");
-}
+#include "task.h"
+#include "server.h"
+#include "wrapper.h"
 
 /*
- * a window task does two things
- *   - reads from a pty master and writes to its socket.
- *   - reads from its socket and writes to the pty master.
+ * Fork the window task of a new window on socket_path, which is freed.
+ * Put the window in *winp and return the read end of the pipe its task
+ * says it is ready on, or -1 on failure. The task closes the nr_busy
+ * fds in busy which are open, the pipes of windows started before.
  */
-static void do_window_task(struct pty_info *pty_info, char *socket_path,
-			   struct termios *termios, struct winsize *ws,
-			   char **argv)
+static int window_fork(const char *name, char *socket_path,
+		       struct termios *termios, struct winsize *ws,
+		       char **argv, struct window **winp,
+		       const struct pollfd *busy, size_t nr_busy)
 {
-	int master_fd, socket_fd;
-
-	if (setsid() <= 0)
-		perror_raw_die("Error creating new session in window task");
-
-	master_fd = pty_info->master_fd;
-	/* Start a socket daemon listen on socket_path */
-	socket_fd = socket_server_xstart(socket_path);
-	/* Start a child process runs on pty */
-	pty_xexec(pty_info, termios, ws, argv);
-
-	/*
-	 * This for loop never breaks, this daemon only exit when receive
-	 * a SIGKILL signal.
-	 */
-	for (;;) {
-		int cfd, nfds;
-		char socket_buf[4];
-		char pty_buf[257];
-		fd_set read_fds;
-
-		/* Start a connection */
-		cfd = socket_server_xaccept(socket_fd);
-		nfds = cfd > master_fd ? cfd + 1 : master_fd + 1;
-
-		for (;;) {
-			int n;
-
-			FD_ZERO(&read_fds);
-			FD_SET(cfd, &read_fds);
-			FD_SET(master_fd, &read_fds);
-			if (select(nfds, &read_fds, NULL, NULL, NULL) < 0) {
-				if (errno == EINTR)
-					continue; /* Interrupted by signal,
-						     retry select */
-				perror_raw(
-					"Error in select on socket and pty master");
-			}
-
-			if (FD_ISSET(cfd, &read_fds)) {
-				/* Read from socket */
-				n = read(cfd, socket_buf, 1);
-				if (n < 0)
-					perror_raw_die(
-						"Error reading from socket");
-				else if (n == 0) {
-					/*
-					 * This means `myscreen` detach from
-					 * this window, so break and wait for
-					 * the next connection
-					 */
-					close(cfd);
-					break;
-				}
+	struct pty_info *pty_info;
+	int ready[2];
+	pid_t pid;
 
-				switch (socket_buf[0]) {
-				case CHAR_MODE:
-					if (read(cfd, socket_buf, 1) != 1)
-						perror_raw_die(
-							"Error reading char from socket");
-					if (write(master_fd, socket_buf, 1) !=
-					    1)
-						perror_raw_die(
-							"Error writing char to pty master");
-					break;
-				case WINCH_MODE:
-					if (read(cfd, socket_buf, 4) != 4)
-						perror_raw_die(
-							"Error reading window size from socket");
-					pty_xset_winsize(master_fd, socket_buf);
-					break;
-				default:
-					ferror_raw_die(
-						"Unknown command from socket: %c",
-						socket_buf[0]);
-				}
-			}
+	pty_info = pty_info_alloc();
+	if (pty_info == NULL)
+		goto fail;
+	if (pipe(ready) < 0) {
+		perror_raw("Error creating pipe for window task");
+		goto fail;
+	}
+	fcntl(ready[0], F_SETFD, FD_CLOEXEC);
+	fcntl(ready[1], F_SETFD, FD_CLOEXEC);
 
-			if (FD_ISSET(master_fd, &read_fds)) {
-				/* Read from pty master */
-				n = read(master_fd, pty_buf,
-					 sizeof(pty_buf) - 1);
-				if (n < 0)
-					perror_raw_die(
-						"Error reading from pty master");
-				else if (n == 0) {
-					ferror_raw("PTY closed");
-					exit(EXIT_SUCCESS);
-				}
-				if (write(cfd, pty_buf, n) != n)
-					perror_raw_die(
-						"Error writing to socket from pty master");
-			}
-		}
+	pid = fork();
+	if (pid < 0) {
+		perror_raw("Error forking process for window task");
+		close(ready[0]);
+		close(ready[1]);
+		goto fail;
+	}
+	if (pid == 0) {
+		/* Window task start here */
+		close(ready[0]);
+		for (size_t i = 0; i < nr_busy; i++)
+			if (busy[i].fd >= 0)
+				close(busy[i].fd);
+		window_task_xrun(pty_info, socket_path, termios, ws, argv,
+				 ready[1]);
 	}
+	close(ready[1]);
+	*winp = window_xnew(name, pty_info->slave_name, socket_path, pid);
+	pty_info_free(pty_info);
+	free(socket_path);
+	return ready[0];
+
+fail:
+	pty_info_free(pty_info);
+	free(socket_path);
+	return -1;
 }
 
 /*
  * start a new window task
  *
  * start a new window task in a new process, return task info to parent
- * process by return a struct window *.
+ * process by return a struct window *. If a myscreen server is running,
+ * the window is hosted by the server instead.
  */
 struct window *window_xstart(char *name, struct termios *termios,
 			     struct winsize *ws, char **argv)
 {
 	struct window *win;
-	struct pty_info *pty_info = NULL;
-	char *socket_path = NULL;
-	pid_t pid;
+	int ready_fd;
+	char c;
 
-	/* Create socket for communication */
-	socket_path = socket_path_xcreate();
-	/* Open pty device */
-	pty_info = pty_info_xalloc();
-
-	pid = fork();
-	if ((pid) < 0)
-		ferror_raw_die("Error forking process for window task");
-	else if (pid > 0) {
-		win = (struct window *)calloc(1, sizeof(struct window));
-		if (win == NULL)
-			ferror_raw_die(
-				"Error allocating memory for window struct");
-		win->name = strdup(name);
-		win->device = strdup(pty_info->slave_name);
-		win->socket = socket_path;
-		win->pid = pid;
-		if (win->name == NULL || win->device == NULL ||
-		    win->socket == NULL)
-			ferror_raw_die("Error allocating memory for window");
-		pty_info_free(pty_info);
+	win = server_xspawn(name, termios, ws, argv);
+	if (win)
 		return win;
-	}
 
-	/* Window task start here */
-	do_window_task(pty_info, socket_path, termios, ws, argv);
-	/*
-	 * Since do_window_task() never returns, no need to free
-	 * socket_path and pty_info here
-	 */
-	return NULL;
+	ready_fd = window_fork(name, socket_path_xcreate(), termios, ws, argv,
+			       &win, NULL, 0);
+	if (ready_fd < 0)
+		exit(EXIT_FAILURE);
+	/* The window task says when its socket listens */
+	if (read_in_full(ready_fd, &c, 1) != 1)
+		ferror_raw_die("Window task failed to start");
+	close(ready_fd);
+	return win;
 }
 
-void window_free(struct window *win)
+size_t window_start_many(struct window_request *reqs, size_t nr,
+			 struct termios *termios, struct winsize *ws)
 {
-	if (win == NULL)
-		return;
-	if (win->name != NULL)
-		free(win->name);
-	if (win->device != NULL)
-		free(win->device);
-	if (win->socket != NULL)
-		free(win->socket);
-	free(win);
+	struct pollfd *pfd;
+	size_t started = 0, pending = 0;
+	int ret;
+	char c;
+
+	ret = server_spawn_many(reqs, nr, termios, ws);
+	if (ret >= 0)
+		return ret;
+
+	CALLOC_ARRAY(pfd, nr + 1);
+	if (pfd == NULL)
+		ferror_raw_die("Error allocating memory for window tasks");
+	/* Every window task gets going before we wait for the first */
+	for (size_t i = 0; i < nr; i++) {
+		reqs[i].win = NULL;
+		reqs[i].ns = getnanotime();
+		pfd[i].fd = window_fork(reqs[i].name,
+					socket_path_xcreate_seq(i), termios,
+					ws, reqs[i].argv, &reqs[i].win, pfd,
+					i);
+		pfd[i].events = POLLIN;
+		if (pfd[i].fd < 0)
+			reqs[i].ns = 0;
+		else
+			pending++;
+	}
+	while (pending > 0) {
+		if (poll(pfd, nr, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			perror_raw_die("Error waiting for window tasks");
+		}
+		for (size_t i = 0; i < nr; i++) {
+			if (pfd[i].fd < 0 || !pfd[i].revents)
+				continue;
+			reqs[i].ns = getnanotime() - reqs[i].ns;
+			/* Closed with nothing written, it failed */
+			if (read_in_full(pfd[i].fd, &c, 1) == 1) {
+				started++;
+			} else {
+				window_free(reqs[i].win);
+				reqs[i].win = NULL;
+			}
+			close(pfd[i].fd);
+			pfd[i].fd = -1;
+			pending--;
+		}
+	}
+	free(pfd);
+	return started;
 }
 
-struct window_vec *window_vec_xalloc()
-{
-	struct window_vec *vec;
+#define SEND_BATCH 256 /* windows connected to at once */
+
+/* Where window_send_many() is with a window */
+struct send_conn {
+	struct window_send *send;
+	size_t off; /* of the request written so far */
+	int hello_done;
+	struct proto_reader reader;
+};
 
-	vec = (struct window_vec *)malloc(sizeof(struct window_vec));
-	if (vec == NULL)
-		ferror_raw_die("Error allocating memory for window vector");
-	vec->windows = NULL;
-	vec->nr = 0;
-	vec->alloc = 0;
+static void send_fail(struct window_send *send, const char *fmt, ...)
+	__attribute__((format(printf, 2, 3)));
 
-	return vec;
+static void send_fail(struct window_send *send, const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	vsnprintf(send->error, sizeof(send->error), fmt, ap);
+	va_end(ap);
 }
 
-void window_vec_free(struct window_vec *vec)
+/*
+ * Read what the window task sent. Return 1 once it closed the
+ * connection, having read all of ours, 0 to wait for more, or -1 on
+ * failure.
+ */
+static int send_read(struct send_conn *conn, int fd)
 {
-	if (vec == NULL)
-		return;
-	for (size_t i = 0; i < vec->nr; i++) {
-		struct window *win = vec->windows[i];
-		window_free(win);
+	struct proto_frame frame;
+	struct proto_hello hello;
+	ssize_t n;
+	int ret;
+
+	n = proto_reader_fill(&conn->reader, fd);
+	if (n < 0 && (errno == EAGAIN || errno == EINTR))
+		return 0;
+	if (n < 0) {
+		send_fail(conn->send, "%s", strerror(errno));
+		return -1;
+	}
+	while ((ret = proto_reader_next(&conn->reader, &frame)) > 0) {
+		if (frame.type == PROTO_ERROR) {
+			send_fail(conn->send, "refused: %.*s", (int)frame.len,
+				  frame.payload);
+			return -1;
+		}
+		if (conn->hello_done) {
+			send_fail(conn->send, "unexpected answer");
+			return -1;
+		}
+		if (proto_parse_hello(&frame, &hello) < 0 ||
+		    hello.version != PROTO_VERSION ||
+		    !(hello.flags & PROTO_HELLO_CONTROL)) {
+			send_fail(conn->send, "does not support control mode");
+			return -1;
+		}
+		conn->hello_done = 1;
+	}
+	if (ret < 0) {
+		send_fail(conn->send, "malformed frame");
+		return -1;
+	}
+	if (n > 0)
+		return 0;
+	if (!conn->hello_done) {
+		send_fail(conn->send, "closed before the handshake");
+		return -1;
 	}
+	return 1;
 }
 
-void window_vec_remove(struct window_vec *vec, struct window *win)
+/* Move the request on, return like send_read() */
+static int send_step(struct send_conn *conn, struct pollfd *pfd,
+		     const struct strbuf *req)
 {
-	assert(win);
-	assert(vec);
-	for (size_t i = 0; i < vec->nr; i++) {
-		if (vec->windows[i] == win) {
-			/* Found the window, remove it */
-			window_free(win);
-			vec->nr--;
-			if (i < vec->nr)
-				vec->windows[i] = vec->windows[vec->nr];
-			vec->windows[vec->nr] = NULL;
-			return;
+	ssize_t n;
+	int ret = 0;
+
+	if (conn->off < req->len && (pfd->revents & (POLLOUT | POLLERR))) {
+		n = write(pfd->fd, req->buf + conn->off, req->len - conn->off);
+		if (n < 0 && errno != EAGAIN && errno != EINTR) {
+			send_fail(conn->send, "%s", strerror(errno));
+			return -1;
 		}
+		if (n > 0)
+			conn->off += n;
+		/* All sent, the window task sees us hang up */
+		if (conn->off == req->len) {
+			shutdown(pfd->fd, SHUT_WR);
+			pfd->events = POLLIN;
+		}
+	}
+	if (pfd->revents & (POLLIN | POLLHUP))
+		ret = send_read(conn, pfd->fd);
+	if (ret > 0 && conn->off < req->len) {
+		send_fail(conn->send, "closed by the window");
+		return -1;
 	}
+	return ret;
+}
 
-	/* Should never reach here */
-	ferror_raw_die("Error removing window: window not found in vector");
+/*
+ * The request is written to every window of the batch as their sockets
+ * take it, then we wait for the window tasks to hang up. A window task
+ * only reads a client while its pty keeps up with input, and handles
+ * the frames it read before the end of the stream, so hanging up says
+ * the input went to the window.
+ */
+static size_t send_batch(struct window_send *sends, size_t nr,
+			 const struct strbuf *req, uint64_t deadline)
+{
+	struct send_conn conns[SEND_BATCH];
+	struct pollfd pfd[SEND_BATCH];
+	size_t pending = 0, delivered = 0;
+	uint64_t now;
+	int ret;
+
+	for (size_t i = 0; i < nr; i++) {
+		conns[i].send = &sends[i];
+		conns[i].off = 0;
+		conns[i].hello_done = 0;
+		proto_reader_init(&conns[i].reader);
+		sends[i].delivered = 0;
+		sends[i].error[0] = '\0';
+		sends[i].ns = getnanotime();
+		pfd[i].fd = socket_client_try(sends[i].socket);
+		pfd[i].events = POLLIN | POLLOUT;
+		if (pfd[i].fd < 0) {
+			send_fail(&sends[i], "%s", strerror(errno));
+			continue;
+		}
+		fcntl(pfd[i].fd, F_SETFL,
+		      fcntl(pfd[i].fd, F_GETFL) | O_NONBLOCK);
+		pending++;
+	}
+	while (pending > 0 && (now = getnanotime()) < deadline) {
+		if (poll(pfd, nr, (deadline - now) / 1000000 + 1) < 0) {
+			if (errno == EINTR)
+				continue;
+			perror_raw_die("Error waiting for windows");
+		}
+		for (size_t i = 0; i < nr; i++) {
+			if (pfd[i].fd < 0 || !pfd[i].revents)
+				continue;
+			ret = send_step(&conns[i], &pfd[i], req);
+			if (ret == 0)
+				continue;
+			sends[i].ns = getnanotime() - sends[i].ns;
+			sends[i].delivered = ret > 0;
+			delivered += ret > 0;
+			close(pfd[i].fd);
+			pfd[i].fd = -1;
+			pending--;
+		}
+	}
+	for (size_t i = 0; i < nr; i++) {
+		if (pfd[i].fd >= 0) {
+			send_fail(&sends[i], "timed out");
+			close(pfd[i].fd);
+		}
+		proto_reader_release(&conns[i].reader);
+	}
+	return delivered;
 }
 
-void window_vec_add(struct window_vec *vec, struct window *win)
+size_t window_send_many(struct window_send *sends, size_t nr,
+			const char *buf, size_t len, int timeout_ms)
 {
-	assert(win);
-	assert(vec);
-	ALLOC_GROW(vec->windows, vec->nr + 1, vec->alloc);
-	if (vec->windows == NULL)
-		ferror_raw_die("Error reallocating memory for window vector");
-	vec->windows[vec->nr++] = win;
+	struct strbuf req = STRBUF_INIT;
+	struct proto_hello hello = { .flags = PROTO_HELLO_CONTROL };
+	uint64_t deadline = getnanotime() + (uint64_t)timeout_ms * 1000000;
+	size_t delivered = 0;
+
+	/*
+	 * As a script: no size, so we never resize the window, no screen
+	 * to render for us, and nobody looking, so alerts stay raised
+	 */
+	proto_add_hello(&req, &hello);
+	while (len > 0) {
+		size_t n = len < PROTO_MAX_PAYLOAD ? len : PROTO_MAX_PAYLOAD;
+
+		proto_add_frame(&req, PROTO_DATA, buf, n);
+		buf += n;
+		len -= n;
+	}
+	for (size_t i = 0; i < nr; i += SEND_BATCH)
+		delivered += send_batch(sends + i,
+					nr - i < SEND_BATCH ? nr - i :
+							      SEND_BATCH,
+					&req, deadline);
+	strbuf_release(&req);
+	return delivered;
 }
 
-struct window *window_vec_get(struct window_vec *vec, size_t idx)
+/*
+ * Where window_grep_many() or window_dump_many() is with a window. All
+ * of them get the same request, and answer() takes each frame which
+ * comes back after the HELLO: it returns 1 once that was the last one,
+ * 0 for more, or -1 after control_fail().
+ */
+struct control_conn {
+	const char *socket;
+	void *item; /* the struct window_grep or window_dump */
+	int (*answer)(struct control_conn *conn,
+		      const struct proto_frame *frame);
+	size_t off; /* of the request written so far */
+	int hello_done;
+	struct proto_reader reader;
+	char error[96];
+};
+
+static void control_fail(struct control_conn *conn, const char *fmt, ...)
+	__attribute__((format(printf, 2, 3)));
+
+static void control_fail(struct control_conn *conn, const char *fmt, ...)
 {
-	assert(vec);
-	if (idx < vec->nr)
-		return vec->windows[idx];
-	return NULL;
+	va_list ap;
+
+	va_start(ap, fmt);
+	vsnprintf(conn->error, sizeof(conn->error), fmt, ap);
+	va_end(ap);
 }
 
-struct window *window_vec_find(struct window_vec *vec, const char *name)
+/*
+ * Read what the window task sent. Return 1 once it answered, 0 to wait
+ * for more, or -1 on failure.
+ */
+static int control_read(struct control_conn *conn, int fd)
 {
-	assert(vec);
-	for (size_t i = 0; i < vec->nr; i++) {
-		assert(vec->windows[i]);
-		if (strcmp(vec->windows[i]->name, name) == 0)
-			return vec->windows[i];
+	struct proto_frame frame;
+	struct proto_hello hello;
+	ssize_t n;
+	int ret;
+
+	n = proto_reader_fill(&conn->reader, fd);
+	if (n < 0 && (errno == EAGAIN || errno == EINTR))
+		return 0;
+	if (n < 0) {
+		control_fail(conn, "%s", strerror(errno));
+		return -1;
+	}
+	while ((ret = proto_reader_next(&conn->reader, &frame)) > 0) {
+		if (frame.type == PROTO_ERROR) {
+			control_fail(conn, "refused: %.*s", (int)frame.len,
+				     frame.payload);
+			return -1;
+		}
+		if (!conn->hello_done) {
+			if (proto_parse_hello(&frame, &hello) < 0 ||
+			    hello.version != PROTO_VERSION ||
+			    !(hello.flags & PROTO_HELLO_CONTROL)) {
+				control_fail(conn,
+					     "does not support control mode");
+				return -1;
+			}
+			conn->hello_done = 1;
+			continue;
+		}
+		ret = conn->answer(conn, &frame);
+		if (ret != 0)
+			return ret;
+	}
+	if (ret < 0) {
+		control_fail(conn, "malformed frame");
+		return -1;
 	}
-	return NULL;
+	if (n == 0) {
+		control_fail(conn, "closed by the window");
+		return -1;
+	}
+	return 0;
 }
 
-static char *read_line(int fd)
+/*
+ * The request goes to every window of the batch as their sockets take
+ * it, and the answers are read as they come from any of them. Return
+ * the number of windows which answered.
+ */
+static size_t control_batch(struct control_conn *conns, size_t nr,
+			    const struct strbuf *req, uint64_t deadline)
 {
-	char **line_vec = NULL;
-	int nr = 0, alloc = 0;
-	char *line = NULL, *line_end;
-	size_t line_len;
-#define BUFSZ 256
-	static char buf[BUFSZ];
-	static int buf_len = 0;
-
-	/* See if we can get a line from buf first */
-	if (buf_len > 0) {
-		line_end = memchr(buf, '\n', buf_len);
-		if (line_end) {
-			/* Found a line */
-			size_t len = line_end - buf + 1; /* include '\n' */
-			line = (char *)calloc(1, len + 1);
-			memcpy(line, buf, len);
-
-			/* remove line from buffer */
-			buf_len -= len;
-			memmove(buf, line_end + 1, buf_len);
-			return line;
+	struct pollfd pfd[SEND_BATCH];
+	size_t pending = 0, done = 0;
+	uint64_t now;
+	ssize_t n;
+	int ret;
+
+	for (size_t i = 0; i < nr; i++) {
+		pfd[i].fd = socket_client_try(conns[i].socket);
+		pfd[i].events = POLLIN | POLLOUT;
+		if (pfd[i].fd < 0) {
+			control_fail(&conns[i], "%s", strerror(errno));
+			continue;
 		}
+		fcntl(pfd[i].fd, F_SETFL,
+		      fcntl(pfd[i].fd, F_GETFL) | O_NONBLOCK);
+		pending++;
 	}
-
-	/*
-	 * Read a line from fd, the line is split into multiple
-	 * BUFSZ sized chunks, and stored in line_vec.
-	 */
-	for (;;) {
-		int n;
-
-		if ((n = read(fd, buf + buf_len, BUFSZ - buf_len)) < 0) {
-			fprintf(stderr, "Error reading from file descriptor\n");
-			goto cleanup;
+	while (pending > 0 && (now = getnanotime()) < deadline) {
+		if (poll(pfd, nr, (deadline - now) / 1000000 + 1) < 0) {
+			if (errno == EINTR)
+				continue;
+			perror_raw_die("Error waiting for windows");
 		}
-
-		buf_len += n;
-		line_end = memchr(buf, '\n', buf_len);
-		if (!line_end) {
-			if (buf_len != BUFSZ) {
-				line = (char *)calloc(1, buf_len + 2);
-				if (line == NULL) {
-					fprintf(stderr,
-						"Error allocating memory for line\n");
-					goto cleanup;
-				}
-				memcpy(line, buf, buf_len);
-				line[buf_len] = '\n';
-				line[buf_len + 1] = '\0';
-				ALLOC_GROW(line_vec, nr + 1, alloc);
-				line_vec[nr++] = line;
-				buf_len = 0; /* reset buffer */
-				break; /* no more data to read */
-			} else {
-				line = (char *)calloc(1, BUFSZ);
-				if (line == NULL) {
-					fprintf(stderr,
-						"Error allocating memory for line\n");
-					goto cleanup;
+		for (size_t i = 0; i < nr; i++) {
+			struct control_conn *conn = &conns[i];
+
+			if (pfd[i].fd < 0 || !pfd[i].revents)
+				continue;
+			ret = 0;
+			if (conn->off < req->len &&
+			    (pfd[i].revents & (POLLOUT | POLLERR))) {
+				n = write(pfd[i].fd, req->buf + conn->off,
+					  req->len - conn->off);
+				if (n < 0 && errno != EAGAIN && errno != EINTR) {
+					control_fail(conn, "%s",
+						     strerror(errno));
+					ret = -1;
 				}
-				memcpy(line, buf, BUFSZ);
-				ALLOC_GROW(line_vec, nr + 1, alloc);
-				line_vec[nr++] = line;
-				buf_len = 0; /* reset buffer */
-			}
-		} else {
-			/* Found a line */
-			size_t len = line_end - buf + 1; /* include '\n' */
-			line = (char *)calloc(1, len + 1);
-			if (line == NULL) {
-				fprintf(stderr,
-					"Error allocating memory for line\n");
-				goto cleanup;
+				if (n > 0)
+					conn->off += n;
+				if (conn->off == req->len)
+					pfd[i].events = POLLIN;
 			}
+			if (ret == 0 &&
+			    (pfd[i].revents & (POLLIN | POLLHUP)))
+				ret = control_read(conn, pfd[i].fd);
+			if (ret == 0)
+				continue;
+			done += ret > 0;
+			close(pfd[i].fd);
+			pfd[i].fd = -1;
+			pending--;
+		}
+	}
+	for (size_t i = 0; i < nr; i++) {
+		if (pfd[i].fd >= 0) {
+			control_fail(&conns[i], "timed out");
+			close(pfd[i].fd);
+		}
+	}
+	return done;
+}
 
-			memcpy(line, buf, len);
+/*
+ * Send HELLO and the frame to the windows of conns, SEND_BATCH of them
+ * at a time, and wait up to timeout_ms in all. Return the number of
+ * windows which answered.
+ */
+static size_t control_many(struct control_conn *conns, size_t nr, int type,
+			   const struct strbuf *payload, int timeout_ms)
+{
+	struct strbuf req = STRBUF_INIT;
+	struct proto_hello hello = { .flags = PROTO_HELLO_CONTROL };
+	uint64_t deadline = getnanotime() + (uint64_t)timeout_ms * 1000000;
+	size_t done = 0;
+
+	proto_add_hello(&req, &hello);
+	proto_add_frame(&req, type, payload->buf, payload->len);
+	for (size_t i = 0; i < nr; i++)
+		proto_reader_init(&conns[i].reader);
+	for (size_t i = 0; i < nr; i += SEND_BATCH)
+		done += control_batch(conns + i,
+				      nr - i < SEND_BATCH ? nr - i : SEND_BATCH,
+				      &req, deadline);
+	for (size_t i = 0; i < nr; i++)
+		proto_reader_release(&conns[i].reader);
+	strbuf_release(&req);
+	return done;
+}
 
-			/* remove line from buffer */
-			buf_len -= len;
-			memmove(buf, line_end + 1, buf_len);
-			ALLOC_GROW(line_vec, nr + 1, alloc);
-			line_vec[nr++] = line;
-			break;
+/* Print the lines of a piece of results, after the window name */
+static void grep_print(struct window_grep *grep, const char *p, size_t len)
+{
+	struct strbuf sb = STRBUF_INIT;
+	const char *end = p + len, *nl, *sep;
+
+	for (; p < end; p = nl + 1) {
+		nl = memchr(p, '\n', end - p);
+		if (nl == NULL)
+			nl = end;
+		if (nl - p == 2 && !memcmp(p, "--", 2)) {
+			strbuf_addstr(&sb, "--\n");
+			continue;
 		}
+		/* "N:text" for a match, "N-text" for context */
+		for (sep = p; sep < nl && *sep >= '0' && *sep <= '9'; sep++)
+			;
+		strbuf_addstr(&sb, grep->name);
+		strbuf_addch(&sb, sep < nl ? *sep : ':');
+		strbuf_add(&sb, p, nl - p);
+		strbuf_addch(&sb, '\n');
+		grep->matches += sep < nl && *sep == ':';
 	}
+	fwrite(sb.buf, 1, sb.len, stdout);
+	fflush(stdout);
+	strbuf_release(&sb);
+}
 
-	/*
-	 * Now we finished reading a line, concatenate the lines in
-	 * line_vec into a single line.
-	 */
-	line_len = 0;
-	for (int i = 0; i < nr; i++) {
-		assert(line_vec[i]);
-		if (i != nr - 1)
-			line_len += BUFSZ;
-		else
-			/* 1 for trailing "\0" */
-			line_len += strlen(line_vec[i]) + 1;
-	}
-	line = (char *)calloc(1, line_len);
-	if (line == NULL) {
-		fprintf(stderr, "Error allocating memory for line\n");
-		goto cleanup;
-	}
-	for (int i = 0; i < nr; i++) {
-		char *start = line;
-		start += i * BUFSZ;
-		if (i != nr - 1)
-			memcpy(start, line_vec[i], BUFSZ);
-		else {
-			size_t len = line_len;
-			len -= (size_t)i * BUFSZ;
-			memcpy(start, line_vec[i], len - 1);
-			start[len - 1] = '\0';
-		}
+static int grep_answer(struct control_conn *conn,
+		       const struct proto_frame *frame)
+{
+	struct window_grep *grep = conn->item;
+
+	if (frame->type != PROTO_GREP || frame->len == 0) {
+		control_fail(conn, "unexpected answer");
+		return -1;
 	}
-cleanup:
-	for (int i = 0; i < nr; i++)
-		free(line_vec[i]);
-	free(line_vec);
-	if (line && *line == '\n') {
-		free(line);
-		return NULL;
+	switch (frame->payload[0]) {
+	case 'l':
+		grep_print(grep, frame->payload + 1, frame->len - 1);
+		return 0;
+	case 'c':
+		grep->cut = 1;
+		/* fall through */
+	case 'd':
+		grep->done = 1;
+		return 1;
+	default:
+		control_fail(conn, "%.*s", (int)frame->len - 1,
+			     frame->payload + 1);
+		return -1;
 	}
-	return line;
 }
 
-void window_vec_load(struct window_vec *vec, const char *file)
+size_t window_grep_many(struct window_grep *greps, size_t nr,
+			const char *text, unsigned context, int timeout_ms)
 {
-	char *line = NULL;
-	int fd;
-	/*
-	 * when loading window_vec, we still in the normal mode. So no need
-	 * to use ferror_raw() or perror_raw() here.
-	 */
-
-	assert(vec);
-	fd = open(file, O_RDONLY | O_CREAT, 0644);
-	if (fd < 0)
-		fprintf(stderr, "Error opening myscreen file: %s\n", file);
-	while ((line = read_line(fd))) {
-		char *name, *device, *socket, *start, *end;
-		pid_t pid;
-		int n;
-		struct window *win;
-
-		start = line;
-		end = strchr(start, ' ');
-		if (end == NULL) {
-			fprintf(stderr, "Error parsing myscreen file: %s\n",
-				file);
-			goto cleanup;
-		}
-		*end = '\0';
-		name = start;
-
-		start = end + 1;
-		end = strchr(start, ' ');
-		if (end == NULL) {
-			fprintf(stderr, "Error parsing myscreen file: %s\n",
-				file);
-			goto cleanup;
-		}
-		*end = '\0';
-		device = start;
-
-		start = end + 1;
-		end = strchr(start, ' ');
-		if (end == NULL) {
-			fprintf(stderr, "Error parsing myscreen file: %s\n",
-				file);
-			goto cleanup;
-		}
-		*end = '\0';
-		socket = start;
-
-		start = end + 1;
-		n = sscanf(start, "%d\n", &pid);
-		if (n != 1) {
-			fprintf(stderr, "Error parsing myscreen file: %s\n",
-				file);
-			goto cleanup;
-		}
+	struct strbuf grep = STRBUF_INIT;
+	struct control_conn *conns;
+	size_t done;
+
+	CALLOC_ARRAY(conns, nr + 1);
+	if (conns == NULL)
+		ferror_raw_die("Error allocating memory for windows");
+	for (size_t i = 0; i < nr; i++) {
+		conns[i].socket = greps[i].socket;
+		conns[i].item = &greps[i];
+		conns[i].answer = grep_answer;
+		greps[i].done = greps[i].cut = 0;
+		greps[i].matches = 0;
+	}
+	strbuf_add(&grep, "\0\0\0\0", 4);
+	proto_put_u32(grep.buf, context);
+	strbuf_addstr(&grep, text);
+	done = control_many(conns, nr, PROTO_GREP, &grep, timeout_ms);
+	for (size_t i = 0; i < nr; i++)
+		memcpy(greps[i].error, conns[i].error, sizeof(greps[i].error));
+	strbuf_release(&grep);
+	free(conns);
+	return done;
+}
 
-		win = (struct window *)malloc(sizeof(struct window));
-		if (win == NULL) {
-			fprintf(stderr,
-				"Error allocating memory for window struct\n");
-			goto cleanup;
-		}
-		win->name = strdup(name);
-		win->device = strdup(device);
-		win->socket = strdup(socket);
-		win->pid = pid;
-		if (win->name == NULL || win->device == NULL ||
-		    win->socket == NULL) {
-			fprintf(stderr, "Error allocating memory for window\n");
-			window_free(win);
-			goto cleanup;
-		}
-		window_vec_add(vec, win);
+static int dump_answer(struct control_conn *conn,
+		       const struct proto_frame *frame)
+{
+	struct window_dump *dump = conn->item;
 
-		free(line);
-		line = NULL;
+	if (frame->type != PROTO_SCREEN) {
+		control_fail(conn, "unexpected answer");
+		return -1;
 	}
+	dump->text = malloc(frame->len + 1);
+	if (dump->text == NULL)
+		ferror_raw_die("Error allocating memory for screen");
+	memcpy(dump->text, frame->payload, frame->len);
+	dump->text[frame->len] = '\0';
+	dump->len = frame->len;
+	return 1;
+}
 
-cleanup:
-	free(line);
-	close(fd);
+size_t window_dump_many(struct window_dump *dumps, size_t nr, uint32_t lines,
+			unsigned flags, int timeout_ms)
+{
+	struct strbuf screen = STRBUF_INIT;
+	struct control_conn *conns;
+	size_t done;
+
+	CALLOC_ARRAY(conns, nr + 1);
+	if (conns == NULL)
+		ferror_raw_die("Error allocating memory for windows");
+	for (size_t i = 0; i < nr; i++) {
+		conns[i].socket = dumps[i].socket;
+		conns[i].item = &dumps[i];
+		conns[i].answer = dump_answer;
+		dumps[i].text = NULL;
+		dumps[i].len = 0;
+	}
+	strbuf_add(&screen, "\0\0\0\0\0\0\0\0", 8);
+	proto_put_u32(screen.buf, lines);
+	proto_put_u32(screen.buf + 4, flags);
+	done = control_many(conns, nr, PROTO_SCREEN, &screen, timeout_ms);
+	for (size_t i = 0; i < nr; i++)
+		memcpy(dumps[i].error, conns[i].error, sizeof(dumps[i].error));
+	strbuf_release(&screen);
+	free(conns);
+	return done;
 }
 
-void window_vec_save(struct window_vec *vec, const char *file)
+struct window *window_xnew(const char *name, const char *device,
+			   const char *socket, pid_t pid)
 {
-	/* we are definitely in raw mode here */
-	int fd;
+	struct window *win;
+
+	win = calloc(1, sizeof(*win));
+	if (win == NULL)
+		ferror_raw_die("Error allocating memory for window struct");
+	win->name = strdup(name);
+	win->device = strdup(device);
+	win->socket = strdup(socket);
+	win->pid = pid;
+	if (win->name == NULL || win->device == NULL || win->socket == NULL)
+		ferror_raw_die("Error allocating memory for window");
+	return win;
+}
 
-	assert(vec);
-	fd = open(file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
-	if (fd < 0) {
-		ferror_raw("Error opening myscreen file for writing: %s", file);
+void window_free(struct window *win)
+{
+	if (win == NULL)
 		return;
+	if (win->name != NULL)
+		free(win->name);
+	if (win->device != NULL)
+		free(win->device);
+	if (win->socket != NULL)
+		free(win->socket);
+	free(win);
+}
+
+/* Return a pidfd for pid, -1 if it's gone or -2 if we can't tell */
+static int pidfd_open_pid(pid_t pid)
+{
+#if defined(__linux__) && defined(SYS_pidfd_open)
+	int fd = syscall(SYS_pidfd_open, pid, 0);
+
+	if (fd >= 0)
+		return fd;
+	if (errno == ESRCH)
+		return -1;
+#else
+	(void)pid;
+#endif
+	return -2;
+}
+
+#define PROBE_BATCH 256
+
+/* A pidfd is readable once its process has exited */
+static void probe_batch(struct pollfd *pfd, const size_t *idx, size_t n,
+			unsigned char *alive)
+{
+	int ret;
+
+	while ((ret = poll(pfd, n, 0)) < 0 && errno == EINTR)
+		;
+	for (size_t j = 0; j < n; j++) {
+		/* When in doubt, a window is alive */
+		alive[idx[j]] = ret < 0 || !(pfd[j].revents & POLLIN);
+		close(pfd[j].fd);
 	}
+}
+
+/*
+ * A pidfd tells an exited but unreaped process from a running one,
+ * which kill(pid, 0) can't. The pidfds are polled in batches, so that
+ * takes one syscall per process plus one per batch.
+ */
+void window_pids_alive(const pid_t *pids, size_t nr, unsigned char *alive)
+{
+	struct pollfd pfd[PROBE_BATCH];
+	size_t idx[PROBE_BATCH];
+	size_t n = 0;
+	int fd;
 
-	for (size_t i = 0; i < vec->nr; i++) {
-		struct window *win = vec->windows[i];
-		char *buf;
-		size_t len;
-		int n;
-
-		assert(win);
-		assert(win->name && win->device && win->socket);
-		len = strlen(win->name) + 1 + strlen(win->device) + 1 +
-		      strlen(win->socket) + 1 + 10 +
-		      2; /* 10 for pid, 1 for \n, 1 for trailing '\0' */
-		buf = (char *)calloc(1, len);
-		if (!buf) {
-			ferror_raw("Error allocating memory for window string");
-			goto cleanup;
+	for (size_t i = 0; i < nr; i++) {
+		alive[i] = 0;
+		if (pids[i] <= 0)
+			continue;
+		fd = pidfd_open_pid(pids[i]);
+		if (fd == -1)
+			continue;
+		if (fd == -2) {
+			/* EPERM means someone else's, but there */
+			alive[i] = kill(pids[i], 0) == 0 || errno == EPERM;
+			continue;
 		}
-		n = snprintf(buf, len, "%s %s %s %d\n", win->name, win->device,
-			     win->socket, win->pid);
-		/* snprintf must succeed */
-		assert(n > 0 && (size_t)n < len);
-		if (write(fd, buf, n) != n) {
-			ferror_raw("Error writing window to myscreen file: %s",
-				   file);
-			free(buf);
-			goto cleanup;
+		pfd[n].fd = fd;
+		pfd[n].events = POLLIN;
+		idx[n++] = i;
+		if (n == PROBE_BATCH) {
+			probe_batch(pfd, idx, n, alive);
+			n = 0;
 		}
 	}
-
-cleanup:
-	close(fd);
+	if (n > 0)
+		probe_batch(pfd, idx, n, alive);
 }
@@ -1,8 +1,13 @@
 #ifndef WINDOW_H
 #define WINDOW_H
 
+#include <stddef.h>
+#include <stdint.h>
 #include <sys/types.h>
 
+struct termios;
+struct winsize;
+
 struct window {
 	char *name; /* Name of the window */
 	char *device; /* Device associated with the window
@@ -11,24 +16,80 @@ struct window {
 	pid_t pid; /* Process ID of the window task */
 };
 
-struct window_vec {
-	struct window **windows;
-	size_t nr;
-	size_t alloc;
-};
-
 /* start a new window task */
 struct window *window_xstart(char *name, struct termios *termios,
 			     struct winsize *ws, char **argv);
+/* A window to start with window_start_many() */
+struct window_request {
+	const char *name;
+	char **argv;
+	struct window *win; /* the window, or NULL if it failed to start */
+	uint64_t ns; /* how long it took to start */
+};
+
+/*
+ * Start the windows side by side and wait until each is ready or has
+ * failed. Return the number started.
+ */
+size_t window_start_many(struct window_request *reqs, size_t nr,
+			 struct termios *termios, struct winsize *ws);
+/* A window to send input to with window_send_many(), and how it went */
+struct window_send {
+	const char *socket;
+	int delivered; /* the window task took the input */
+	char error[96]; /* why not, if it wasn't */
+	uint64_t ns; /* how long it took */
+};
+
+/*
+ * Send buf as input to the windows side by side and wait up to
+ * timeout_ms for their window tasks to take it. Return the number of
+ * windows it was delivered to.
+ */
+size_t window_send_many(struct window_send *sends, size_t nr,
+			const char *buf, size_t len, int timeout_ms);
+/* A window to search with window_grep_many(), and how it went */
+struct window_grep {
+	const char *name;
+	const char *socket;
+	int done; /* all the output the window keeps was searched */
+	int cut; /* but the window found too much to send it all */
+	size_t matches; /* lines which matched */
+	char error[96]; /* why it wasn't searched */
+};
+
+/*
+ * Look for text in the output the windows keep, every window task
+ * searching its own side by side, and print the lines found to stdout
+ * as they come, after the window name as `grep -n -C context` does
+ * with file names. Wait up to timeout_ms. Return the number of windows
+ * which searched everything.
+ */
+size_t window_grep_many(struct window_grep *greps, size_t nr,
+			const char *text, unsigned context, int timeout_ms);
+/* A window to take a copy of with window_dump_many(), and what it was */
+struct window_dump {
+	const char *name;
+	const char *socket;
+	char *text; /* NUL terminated, to be freed, NULL if it failed */
+	size_t len;
+	char error[96]; /* why it failed */
+};
+
+/*
+ * Fetch the text on the screens of the windows, or with lines set their
+ * last lines of output, side by side over control connections, which
+ * leave the windows and their size alone. flags are PROTO_SCREEN_*.
+ * Wait up to timeout_ms. Return the number of windows which answered.
+ */
+size_t window_dump_many(struct window_dump *dumps, size_t nr, uint32_t lines,
+			unsigned flags, int timeout_ms);
+/* a window with copies of the strings */
+struct window *window_xnew(const char *name, const char *device,
+			   const char *socket, pid_t pid);
 void window_free(struct window *win);
 
-struct window_vec *window_vec_xalloc();
-void window_vec_free(struct window_vec *vec);
-void window_vec_add(struct window_vec *vec, struct window *win);
-void window_vec_remove(struct window_vec *vec, struct window *win);
-struct window *window_vec_get(struct window_vec *vec, size_t idx);
-struct window *window_vec_find(struct window_vec *vec, const char *name);
-void window_vec_load(struct window_vec *vec, const char *file);
-void window_vec_save(struct window_vec *vec, const char *file);
+/* Set alive[i] to whether process pids[i] is still running */
+void window_pids_alive(const pid_t *pids, size_t nr, unsigned char *alive);
 
 #endif
@@ -0,0 +1,114 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include "wrapper.h"
+
+ssize_t read_in_full(int fd, void *buf, size_t count)
+{
+	char *p = buf;
+	ssize_t total = 0;
+
+	while (count > 0) {
+		ssize_t n = read(fd, p, count);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		if (n == 0)
+			break;
+		count -= n;
+		p += n;
+		total += n;
+	}
+	return total;
+}
+
+ssize_t write_in_full(int fd, const void *buf, size_t count)
+{
+	const char *p = buf;
+	ssize_t total = 0;
+
+	while (count > 0) {
+		ssize_t n = write(fd, p, count);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		if (n == 0) {
+			errno = ENOSPC;
+			return -1;
+		}
+		count -= n;
+		p += n;
+		total += n;
+	}
+	return total;
+}
+
+int writev_in_full(int fd, struct iovec *iov, int iovcnt)
+{
+	while (iovcnt > 0) {
+		ssize_t n = writev(fd, iov, iovcnt);
+
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		while (iovcnt > 0 && (size_t)n >= iov->iov_len) {
+			n -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if (iovcnt > 0) {
+			iov->iov_base = (char *)iov->iov_base + n;
+			iov->iov_len -= n;
+		}
+	}
+	return 0;
+}
+
+void stdio_to_devnull(void)
+{
+	int devnull = open("/dev/null", O_RDWR);
+
+	if (devnull < 0)
+		return;
+	for (int i = 0; i < 3; i++)
+		dup2(devnull, i);
+	if (devnull > 2)
+		close(devnull);
+}
+
+uint64_t getnanotime(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+int parse_scaled(const char *s, const char *units, const uint64_t *scale,
+		 uint64_t *v)
+{
+	const char *unit;
+	char *end;
+
+	errno = 0;
+	*v = strtoull(s, &end, 10);
+	if (end == s || *s == '-' || errno)
+		return -1;
+	if (*end == '\0')
+		return 0;
+	unit = strchr(units, *end);
+	if (unit == NULL || end[1] != '\0' ||
+	    *v > UINT64_MAX / scale[unit - units])
+		return -1;
+	*v *= scale[unit - units];
+	return 0;
+}
@@ -0,0 +1,33 @@
+#ifndef WRAPPER_H
+#define WRAPPER_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+/*
+ * read()/write() wrappers modelled after the ones in git: retry on EINTR
+ * and keep going until the whole buffer is transferred.
+ */
+ssize_t read_in_full(int fd, void *buf, size_t count);
+ssize_t write_in_full(int fd, const void *buf, size_t count);
+/* Same for writev(), iov is used as scratch space */
+int writev_in_full(int fd, struct iovec *iov, int iovcnt);
+
+/*
+ * Point stdin, stdout and stderr at /dev/null, so a daemon never writes
+ * over, or blocks on, the terminal it was started from.
+ */
+void stdio_to_devnull(void);
+
+/* Nanoseconds from some fixed point, for measuring how long things take */
+uint64_t getnanotime(void);
+
+/*
+ * Parse a number with an optional unit, one of units worth scale[i],
+ * like "64M" for units "KMG". Return -1 if s is no such number.
+ */
+int parse_scaled(const char *s, const char *units, const uint64_t *scale,
+		 uint64_t *v);
+
+#endif